@@ -0,0 +1,111 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "AllocCounter.h"
+
+#ifdef SOFTFM_COUNT_ALLOCS
+
+static std::atomic<std::uint64_t> total_allocs(0);
+static thread_local std::uint64_t thread_allocs = 0;
+
+static void * counted_alloc_nothrow(std::size_t size) noexcept
+{
+    total_allocs.fetch_add(1, std::memory_order_relaxed);
+    ++thread_allocs;
+    return std::malloc(size ? size : 1);
+}
+
+static void * counted_alloc(std::size_t size)
+{
+    void *p = counted_alloc_nothrow(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void * operator new(std::size_t size)
+{
+    return counted_alloc(size);
+}
+
+void * operator new[](std::size_t size)
+{
+    return counted_alloc(size);
+}
+
+void * operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size);
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_alloc_nothrow(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept
+{
+    std::free(p);
+}
+
+bool alloc_counter_enabled()
+{
+    return true;
+}
+
+std::uint64_t alloc_count_total()
+{
+    return total_allocs.load(std::memory_order_relaxed);
+}
+
+std::uint64_t alloc_count_thread()
+{
+    return thread_allocs;
+}
+
+#else
+
+bool alloc_counter_enabled()
+{
+    return false;
+}
+
+std::uint64_t alloc_count_total()
+{
+    return 0;
+}
+
+std::uint64_t alloc_count_thread()
+{
+    return 0;
+}
+
+#endif
+
+/* end */
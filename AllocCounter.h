@@ -0,0 +1,26 @@
+#ifndef SOFTFM_ALLOCCOUNTER_H
+#define SOFTFM_ALLOCCOUNTER_H
+
+#include <cstdint>
+
+/**
+ *  Heap allocation counter.
+ *
+ *  When built with SOFTFM_COUNT_ALLOCS defined, AllocCounter.cpp replaces
+ *  the global operator new, including the std::nothrow forms, and counts
+ *  every allocation, in total and per thread. The decoder threads use it
+ *  to check that steady-state block processing does not touch the heap;
+ *  work they do on the source thread is counted there. Without
+ *  SOFTFM_COUNT_ALLOCS all counts are zero.
+ */
+
+/** Return true if allocation counting is compiled in. */
+bool alloc_counter_enabled();
+
+/** Return the number of heap allocations made by all threads. */
+std::uint64_t alloc_count_total();
+
+/** Return the number of heap allocations made by the calling thread. */
+std::uint64_t alloc_count_thread();
+
+#endif
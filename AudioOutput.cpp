@@ -28,9 +28,12 @@
 #include <cstring>
 #include <cerrno>
 #include <algorithm>
+#include <chrono>
+#include <limits>
 
 #include "SoftFM.h"
 #include "AudioOutput.h"
+#include "Filter.h"
 
 /********** DEBUG SETUP **********/
 #define ENABLE_SDEBUG
@@ -45,38 +48,36 @@ using namespace std;
 
 /* ****************  class AudioOutput  **************** */
 
+// Write audio data and measure the capture-to-playout latency.
+bool AudioOutput::write_stamped(const SampleVector& samples, const CaptureTime& capture)
+{
+    bool ret = write(samples);
+    if (capture.valid()) {
+        double latency = (CaptureTime::now().monotonic_ns - capture.monotonic_ns) * 1.0e-9
+                         + output_delay();
+        m_latency.blocks++;
+        m_latency_total += latency;
+        m_latency.mean = m_latency_total / m_latency.blocks;
+        m_latency.max  = max(m_latency.max, latency);
+        m_latency.last = latency;
+    }
+    return ret;
+}
+
 // Encode a list of samples as signed 16-bit little-endian integers.
 void AudioOutput::samplesToInt16(const SampleVector& samples, vector<uint8_t>& bytes)
 {
     bytes.resize(2 * samples.size());
-
-    SampleVector::const_iterator i = samples.begin();
-    SampleVector::const_iterator n = samples.end();
-    vector<uint8_t>::iterator k = bytes.begin();
-
-    while (i != n) {
-        Sample s = *(i++);
-        s = max(Sample(-1.0), min(Sample(1.0), s));
-        long v = lrint(s * 32767);
-        unsigned long u = v;
-        *(k++) = u & 0xff;
-        *(k++) = (u >> 8) & 0xff;
-    }
+    m_convert(samples.data(), samples.size(),
+              m_dither ? &m_dither_state : NULL, bytes.data());
 }
 
+
+// Encode a list of samples and push them to the player in one call.
 void AudioOutput::samplesToInt16(const SampleVector& samples, LF::audio::AudioBuffer& bytes)
 {
-    uint32_t size = samples.size() * 2;
-    for (auto ss : samples)
-    {
-        Sample s = max(Sample(-1.0), min(Sample(1.0), ss));
-        long v = lrint(s * 32767);
-        unsigned long u = v;
-        uint8_t temp[2];
-        temp[0] = u & 0xff;
-        temp [1] = (u >> 8) & 0xff;
-        bytes.PushFramesBytes(temp, 2);
-    }
+    samplesToInt16(samples, m_pushbuf);
+    bytes.PushFramesBytes(m_pushbuf.data(), m_pushbuf.size());
 }
 
 
@@ -285,10 +286,16 @@ void WavAudioOutput::set_value(uint8_t * ptr, T value)
 
 /* ****************  class RtAudioOutput  **************** */
 
-RtAudioOutput::RtAudioOutput(unsigned int samplerate, bool stereo) :
+const double RtAudioOutput::max_drift = 0.001;
+
+RtAudioOutput::RtAudioOutput(unsigned int samplerate, bool stereo,
+                             double buffer_secs, bool adaptive) :
+    mSampleRate(samplerate),
+    mFrameBytes(stereo ? 4 : 2),
     mAudioBuffer(LF::audio::AudioFormat_t::Sint16, static_cast<uint16_t>(samplerate), (stereo ? 2 : 1)),
     mParameters(LF::audio::AudioFormat_t::Sint16, static_cast<uint16_t>(samplerate), (stereo ? 2 : 1)),
-    mPlayer(mParameters)
+    mPlayer(mParameters),
+    mLowBytes(numeric_limits<size_t>::max())
 {
     mPlayer.SetEndOfEmptyBuffer(false);
     mPlayer.SetBuffer(&mAudioBuffer);
@@ -300,17 +307,164 @@ RtAudioOutput::RtAudioOutput(unsigned int samplerate, bool stereo) :
      mPlayer.SetOutputDevice(api, id);
 #endif
     mPlayer.Start();
+
+    if (buffer_secs > 0)
+    {
+        // Feed the player every 5 ms, or 4 times per FIFO length if shorter.
+        size_t frames = max(size_t(64), size_t(buffer_secs * samplerate));
+        mPeriodFrames = max(size_t(16), min(size_t(samplerate / 200), frames / 4));
+        mTargetFrames = frames / 2;
+        mFillAverage = mTargetFrames;
+        mFifo = new SpscFifo<uint8_t>(frames * mFrameBytes);
+        if (adaptive)
+        {
+            mResampler = new DriftResampler(stereo ? 2 : 1);
+        }
+        SDEB("low-latency output: %.1f ms buffer, %.1f ms chunks%s",
+             frames * 1.0e3 / samplerate, mPeriodFrames * 1.0e3 / samplerate,
+             adaptive ? ", adaptive resampling" : "");
+        mFeeder = new thread(&RtAudioOutput::FeederThread, this);
+    }
 }
 
 RtAudioOutput::~RtAudioOutput()
 {
+    if (mFeeder)
+    {
+        mStop = true;
+        mFeeder->join();
+        delete mFeeder;
+    }
     mPlayer.Stop();
+    delete mFifo;
+    delete mResampler;
 }
 
 bool RtAudioOutput::write(const SampleVector& samples)
 {
-    samplesToInt16(samples, mAudioBuffer);
+    if (mFifo == nullptr)
+    {
+        samplesToInt16(samples, mAudioBuffer);
+        return true;
+    }
+
+    const SampleVector* out = &samples;
+    if (mResampler)
+    {
+        // Steer the FIFO towards half full with a PI controller: produce
+        // fewer samples while it is fuller, more while it is emptier.
+        // The level half way through this block is the mean of the
+        // sawtooth of block-wise writes; the average smooths the jitter.
+        double frames = samples.size() / (mFrameBytes / 2);
+        double fill = double(mFifo->Size() / mFrameBytes) + 0.5 * frames;
+        mFillAverage += 0.05 * (fill - mFillAverage);
+        double err = (mFillAverage - mTargetFrames) / mTargetFrames;
+        err = max(-1.0, min(1.0, err));
+        // Integral time 20 s, slow enough for a well damped loop.
+        mDriftIntegral += err * frames / (20.0 * mSampleRate);
+        mDriftIntegral = max(-1.0, min(1.0, mDriftIntegral));
+        double corr = max(-1.0, min(1.0, err + mDriftIntegral));
+        mResampler->set_ratio(1.0 - max_drift * corr);
+        mResampler->process(samples, mResampled);
+        out = &mResampled;
+    }
+
+    samplesToInt16(*out, mBytes);
+    size_t written = mFifo->Write(mBytes.data(), mBytes.size());
+    if (written < mBytes.size())
+    {
+        ++mOverruns;
+    }
+    mHighBytes = max(mHighBytes, mFifo->Size());
     return true;
 }
 
+bool RtAudioOutput::get_buffer_stats(BufferStats& stats)
+{
+    if (mFifo == nullptr)
+    {
+        return false;
+    }
+    double bytes_per_sec = double(mFrameBytes) * mSampleRate;
+    size_t fill = mFifo->Size();
+    size_t low = mLowBytes.exchange(numeric_limits<size_t>::max());
+    stats.fill = fill / bytes_per_sec;
+    stats.low = min(low, fill) / bytes_per_sec;
+    stats.high = max(mHighBytes, fill) / bytes_per_sec;
+    stats.underruns = mUnderruns;
+    stats.overruns = mOverruns;
+    stats.drift_ppm = mResampler ? (mResampler->get_ratio() - 1.0) * 1.0e6 : 0;
+    mHighBytes = 0;
+    return true;
+}
+
+double RtAudioOutput::output_delay() const
+{
+    if (mFifo == nullptr)
+    {
+        return 0;
+    }
+    // FIFO plus the two chunks of lead in the player's buffer.
+    return double(mFifo->Size() / mFrameBytes + 2 * mPeriodFrames) / mSampleRate;
+}
+
+// Move audio from the FIFO to the player at the nominal sample rate.
+void RtAudioOutput::FeederThread()
+{
+    typedef chrono::steady_clock Clock;
+    const size_t period_bytes = mPeriodFrames * mFrameBytes;
+    vector<uint8_t> chunk(4 * period_bytes);
+
+    // Keep two chunks in the player so that feeder jitter does not starve it.
+    fill(chunk.begin(), chunk.end(), 0);
+    mAudioBuffer.PushFramesBytes(chunk.data(), 2 * period_bytes);
+
+    const Clock::time_point start = Clock::now();
+    const Clock::duration period = chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>(double(mPeriodFrames) / mSampleRate));
+    uint64_t fed = 0;
+    bool started = false;
+
+    while (!mStop)
+    {
+        this_thread::sleep_until(start + (fed / mPeriodFrames + 1) * period);
+
+        double elapsed = chrono::duration<double>(Clock::now() - start).count();
+        uint64_t due = uint64_t(elapsed * mSampleRate);
+        if (due <= fed)
+        {
+            continue;
+        }
+        if (due - fed > 4 * mPeriodFrames)
+        {
+            // Fell far behind (e.g. the thread was not scheduled);
+            // skip ahead instead of bursting audio into the player.
+            fed = due - mPeriodFrames;
+        }
+        size_t bytes = (due - fed) * mFrameBytes;
+
+        size_t level = mFifo->Size();
+        size_t low = mLowBytes.load();
+        while (level < low && !mLowBytes.compare_exchange_weak(low, level))
+        {
+        }
+
+        size_t got = mFifo->Read(chunk.data(), bytes);
+        if (got > 0)
+        {
+            started = true;
+        }
+        if (got < bytes)
+        {
+            fill_n(chunk.begin() + got, bytes - got, 0);
+            if (started)
+            {
+                ++mUnderruns;
+            }
+        }
+        mAudioBuffer.PushFramesBytes(chunk.data(), bytes);
+        fed += bytes / mFrameBytes;
+    }
+}
+
 /* end */
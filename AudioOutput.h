@@ -1,15 +1,21 @@
 #ifndef SOFTFM_AUDIOOUTPUT_H
 #define SOFTFM_AUDIOOUTPUT_H
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "audio/audiobuffer.h"
 #include "audio/audioplayer.h"
 
 #include "SoftFM.h"
+#include "SimdKernels.h"
+#include "SpscFifo.h"
+
+class DriftResampler;
 
 
 /** Base class for writing audio data to file or playback. */
@@ -17,6 +23,26 @@ class AudioOutput
 {
 public:
 
+    /** Capture-to-playout latency of blocks written with write_stamped(). */
+    struct LatencyStats
+    {
+        std::uint64_t   blocks;
+        double          mean;       // seconds
+        double          max;        // seconds
+        double          last;       // seconds
+    };
+
+    /** Fill level and xruns of an output with a bounded playback buffer. */
+    struct BufferStats
+    {
+        double          fill;       // seconds
+        double          low;        // lowest fill since the last call, seconds
+        double          high;       // highest fill since the last call, seconds
+        std::uint64_t   underruns;  // times the player got silence
+        std::uint64_t   overruns;   // writes that did not fit
+        double          drift_ppm;  // adaptive resampling correction
+    };
+
     /** Destructor. */
     virtual ~AudioOutput() { }
 
@@ -28,6 +54,39 @@ public:
      */
     virtual bool write(const SampleVector& samples) = 0;
 
+    /**
+     * Write audio data made from IQ samples captured at "capture" and
+     * update the capture-to-playout latency. Blocks without a capture
+     * time are written without measuring.
+     */
+    bool write_stamped(const SampleVector& samples, const CaptureTime& capture);
+
+    /** Return capture-to-playout latency; call from the writing thread. */
+    LatencyStats get_latency_stats() const
+    {
+        return m_latency;
+    }
+
+    /**
+     * Return statistics of the playback buffer and restart the
+     * watermarks; call from the writing thread. Return false if the
+     * output has no bounded buffer.
+     */
+    virtual bool get_buffer_stats(BufferStats& stats)
+    {
+        (void)stats;
+        return false;
+    }
+
+    /**
+     * Add triangular (TPDF) dither of +/- 1 LSB before rounding to 16 bits;
+     * call before the first write.
+     */
+    void set_dither(bool enable)
+    {
+        m_dither = enable;
+    }
+
     /** Return the last error, or return an empty string if there is no error. */
     std::string error()
     {
@@ -44,16 +103,40 @@ public:
 
 protected:
     /** Constructor. */
-    AudioOutput() : m_zombie(false) { }
+    AudioOutput()
+      : m_zombie(false)
+      , m_latency { 0, 0, 0, 0 }
+      , m_latency_total(0)
+      , m_convert(select_s16_out_kernel(simd_detect()))
+      , m_dither(false)
+    { }
+
+    /**
+     * Return the time in seconds until audio written now is played.
+     * Outputs without a playback buffer return 0.
+     */
+    virtual double output_delay() const
+    {
+        return 0;
+    }
 
     /** Encode a list of samples as signed 16-bit little-endian integers. */
-    static void samplesToInt16(const SampleVector& samples, std::vector<std::uint8_t>& bytes);
-    static void samplesToInt16(const SampleVector& samples, LF::audio::AudioBuffer& bytes);
+    void samplesToInt16(const SampleVector& samples, std::vector<std::uint8_t>& bytes);
+
+    /** Encode a list of samples and push them to "bytes" at once. */
+    void samplesToInt16(const SampleVector& samples, LF::audio::AudioBuffer& bytes);
 
     std::string m_error;
     bool        m_zombie;
 
 private:
+    LatencyStats m_latency;
+    double      m_latency_total;
+    S16OutKernel m_convert;
+    bool        m_dither;
+    DitherState m_dither_state;
+    std::vector<std::uint8_t> m_pushbuf;
+
     AudioOutput(const AudioOutput&);            // no copy constructor
     AudioOutput& operator=(const AudioOutput&); // no assignment operator
 };
@@ -115,18 +198,70 @@ private:
     std::vector<std::uint8_t> m_bytebuf;
 };
 
+/**
+ *  Play audio through the default audio device.
+ *
+ *  By default every block is pushed into the player's AudioBuffer as it
+ *  is written, without bound. In low-latency mode, blocks go into a
+ *  bounded FIFO instead, and a feeder thread moves audio from the FIFO to
+ *  the player in small chunks paced by the monotonic clock. Only the FIFO
+ *  and two chunks are buffered between the decoder and the device.
+ *  With adaptive resampling, the audio is resampled by up to
+ *  max_drift to hold the FIFO at half full, which absorbs the clock
+ *  difference between the receiver and the sound card.
+ */
 class RtAudioOutput : public AudioOutput
 {
 public:
-    RtAudioOutput(unsigned int samplerate, bool stereo);
+    /** Largest resampling correction of the adaptive mode (0.1 %). */
+    static const double max_drift;
+
+    /**
+     * Construct audio player.
+     *
+     * samplerate   :: audio sample rate in Hz
+     * stereo       :: true if the output stream contains stereo data
+     * buffer_secs  :: size of the low-latency FIFO in seconds,
+     *                 or 0 to push blocks to the player unbounded
+     * adaptive     :: in low-latency mode, resample to track the
+     *                 sound card clock
+     */
+    RtAudioOutput(unsigned int samplerate, bool stereo,
+                  double buffer_secs = 0, bool adaptive = false);
 
     ~RtAudioOutput();
 
     bool write(const SampleVector& samples);
 
+    bool get_buffer_stats(BufferStats& stats) override;
+
+protected:
+    double output_delay() const override;
+
 private:
+    void FeederThread();
+
+    const unsigned int mSampleRate;
+    const unsigned int mFrameBytes;
     LF::audio::AudioBuffer mAudioBuffer;
     LF::audio::AudioParameters mParameters;
     LF::audio::AudioBufferPlayer mPlayer;
+
+    // Low-latency mode.
+    SpscFifo<std::uint8_t>* mFifo { nullptr };
+    std::thread* mFeeder { nullptr };
+    std::atomic<bool> mStop { false };
+    std::size_t mPeriodFrames { 0 };    // frames per feeder chunk
+    std::size_t mTargetFrames { 0 };    // FIFO fill that adaptive mode steers to
+    DriftResampler* mResampler { nullptr };
+    double mFillAverage { 0 };
+    double mDriftIntegral { 0 };
+    SampleVector mResampled;
+    std::vector<std::uint8_t> mBytes;
+
+    std::atomic<std::uint64_t> mUnderruns { 0 };
+    std::atomic<std::uint64_t> mOverruns { 0 };
+    std::atomic<std::size_t> mLowBytes;
+    std::size_t mHighBytes { 0 };
 };
 #endif
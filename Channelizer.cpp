@@ -0,0 +1,302 @@
+#include <cmath>
+#include <algorithm>
+
+#include "Channelizer.h"
+#include "IQSampleSource.h"
+#include "AudioOutput.h"
+#include "AllocCounter.h"
+
+#include "utils/profiler.h"
+
+/********** DEBUG SETUP **********/
+#define ENABLE_SDEBUG
+#define DEBUG_PREFIX "Channelizer: "
+#include "utils/singleton.h"
+#include "utils/screenlogger.h"
+/*********************************/
+
+using namespace std;
+using namespace LF::utils;
+
+const unsigned int Channelizer::tile_size;
+const unsigned int ChannelizerThread::alloc_warmup_blocks;
+
+
+/* ****************  class Channelizer  **************** */
+
+// Construct one channel.
+Channelizer::Channel::Channel(double freq_offset, double sample_rate_if,
+                              unsigned int downsample, double bandwidth)
+    : freq_offset(freq_offset)
+    , tuner(-freq_offset / sample_rate_if)
+    // Same filter as the decimating IF filter of FmDecoder: it must
+    // suppress everything that would alias into the channel.
+    , filter(8 * downsample, bandwidth / sample_rate_if, downsample)
+{ }
+
+
+// Construct channelizer.
+Channelizer::Channelizer(double sample_rate_if,
+                         unsigned int downsample,
+                         double bandwidth)
+    : m_sample_rate_if(sample_rate_if)
+    , m_downsample(max(1u, downsample))
+    , m_bandwidth(bandwidth)
+    , m_buf_tuned(tile_size * m_downsample)
+{ }
+
+
+// Add a channel.
+unsigned int Channelizer::add_channel(double freq_offset)
+{
+    m_channels.emplace_back(new Channel(freq_offset, m_sample_rate_if,
+                                        m_downsample, m_bandwidth));
+    m_count.resize(m_channels.size());
+    return m_channels.size() - 1;
+}
+
+
+// Process samples.
+void Channelizer::process(const IQSample *samples_in, unsigned int n)
+{
+    RTTIProfiler f("Channelizer::process");
+
+    unsigned int tile = m_buf_tuned.size();
+
+    // Each filter call produces at most (k / downsample + 1) samples,
+    // and all calls of one block together at most (n / downsample + 1).
+    fill(m_count.begin(), m_count.end(), 0);
+    for (auto& ch : m_channels)
+        ch->samples.resize(n / m_downsample + 2);
+
+    for (unsigned int p = 0; p < n; p += tile) {
+        unsigned int k = min(tile, n - p);
+
+        for (unsigned int c = 0; c < m_channels.size(); c++) {
+            Channel& ch = *m_channels[c];
+
+            // Shift the station to zero frequency.
+            ch.tuner.process(samples_in + p, k, m_buf_tuned.data());
+
+            // Isolate and decimate.
+            m_count[c] += ch.filter.process(m_buf_tuned.data(), k,
+                                            ch.samples.data() + m_count[c]);
+        }
+    }
+
+    for (unsigned int c = 0; c < m_channels.size(); c++)
+        m_channels[c]->samples.resize(m_count[c]);
+}
+
+
+// Clear the channel filters after a gap.
+void Channelizer::reset(uint64_t skipped)
+{
+    for (auto& ch : m_channels) {
+        ch->tuner.skip(skipped);
+        ch->filter.reset();
+    }
+}
+
+
+/* ****************  class ChannelizerThread  **************** */
+
+ChannelizerThread::ChannelizerThread(IQSampleSource* src,
+                                     double sample_rate_if,
+                                     unsigned int downsample,
+                                     unsigned int num_workers) :
+    mChannelizer(sample_rate_if, downsample),
+    mSource(src)
+{
+    if (num_workers > 0)
+    {
+        mPool.reset(new DecoderPool(num_workers));
+    }
+    mThread.Start();
+    CONNECT(mSource->NEW_DATA, ChannelizerThread, OnNewIQSamples, this);
+}
+
+void ChannelizerThread::AddStation(double tuning_offset,
+                                   AudioOutput* output,
+                                   double sample_rate_pcm,
+                                   bool stereo,
+                                   double deemphasis,
+                                   double bandwidth_pcm,
+                                   const FmDecoderOptions& options)
+{
+    mChannelizer.add_channel(tuning_offset);
+
+    // The channel is already centered, filtered and decimated; the
+    // decoder runs at the channel rate without further downsampling.
+    Station station;
+    station.decoder.reset(new FmDecoder(mChannelizer.get_sample_rate(),
+                                        0,                          // tuning_offset
+                                        sample_rate_pcm,
+                                        stereo,
+                                        deemphasis,
+                                        FmDecoder::default_bandwidth_if,
+                                        FmDecoder::default_freq_dev,
+                                        bandwidth_pcm,
+                                        1,                          // downsample
+                                        options));
+    station.output = output;
+    if (mPool)
+    {
+        mPool->AddDecoder(station.decoder.get(), output);
+    }
+    mStations.push_back(move(station));
+}
+
+ChannelizerThread::~ChannelizerThread()
+{
+    mThread.Stop();
+    mPool.reset();
+}
+
+void ChannelizerThread::WaitIdle()
+{
+    {
+        lock_guard<mutex> lock(mIdleMutex);
+        mIdle = false;
+    }
+    // Tasks run in order, so the marker runs after all queued blocks.
+    SCHEDULE_TASK(&mThread, &ChannelizerThread::MarkIdle, this);
+    {
+        unique_lock<mutex> lock(mIdleMutex);
+        mIdleCond.wait(lock, [this] { return mIdle; });
+    }
+    if (mPool)
+    {
+        mPool->WaitIdle();
+    }
+}
+
+void ChannelizerThread::MarkIdle()
+{
+    {
+        lock_guard<mutex> lock(mIdleMutex);
+        mIdle = true;
+    }
+    mIdleCond.notify_all();
+}
+
+void ChannelizerThread::OnNewIQSamples(IQSampleSource*)
+{
+    // Queueing the task runs on the source thread; count what it allocates.
+    uint64_t allocs = alloc_count_thread();
+    SCHEDULE_TASK(&mThread, &ChannelizerThread::DecodeIQSamples, this);
+    if (mBlocks > alloc_warmup_blocks)
+    {
+        mAllocs += alloc_count_thread() - allocs;
+    }
+}
+
+void ChannelizerThread::DecodeIQSamples()
+{
+    RTTIProfiler f("ChannelizerThread::DecodeIQSamples");
+    SampleBufferBlock* block = mSource->GetBlockToRead();
+    if (block)
+    {
+        ++mBlocks;
+        uint64_t allocs = alloc_count_thread();
+
+        // After a gap, start the channels and the decoders cleanly
+        // instead of splicing the block onto unrelated history.
+        bool gap = block->sample_index != mNextSampleIndex;
+        if (gap)
+        {
+            ++mGaps;
+            SDEB("gap before sample %llu (expected %llu)",
+                 (unsigned long long)block->sample_index,
+                 (unsigned long long)mNextSampleIndex);
+            mChannelizer.reset(block->sample_index - mNextSampleIndex);
+        }
+        mNextSampleIndex = block->sample_index + block->size;
+
+        // The block goes back to the source before the stations are decoded.
+        CaptureTime capture = block->capture_time;
+        mChannelizer.process(block->samples, block->size);
+        mSource->UpdateReadState();
+
+        for (unsigned int i = 0; i < mStations.size(); i++)
+        {
+            if (mPool)
+            {
+                // The pool decodes asynchronously; hand it its own copy
+                // in a recycled block.
+                const IQSampleVector& samples = mChannelizer.get_samples(i);
+                std::shared_ptr<IQSampleVector> copy = mStations[i].blocks.Acquire();
+                copy->assign(samples.begin(), samples.end());
+                mPool->Submit(i, copy, capture, gap);
+            }
+            else
+            {
+                Station& station = mStations[i];
+                if (gap)
+                {
+                    station.decoder->reset_frontend();
+                    station.decoder->reset_backend();
+                }
+                station.decoder->process(mChannelizer.get_samples(i), station.audio);
+                station.output->write_stamped(station.audio, capture);
+            }
+        }
+
+        if (mBlocks > alloc_warmup_blocks)
+        {
+            mAllocs += alloc_count_thread() - allocs;
+        }
+
+        if (mPrintStats)
+        {
+            PrintStats();
+        }
+    }
+}
+
+void ChannelizerThread::PrintStats()
+{
+    PRINT("\rblk=%6u", mBlocks.load());
+    if (alloc_counter_enabled())
+    {
+        PRINT(" alloc=%llu", (unsigned long long)mAllocs.load());
+    }
+    SampleRingStats overruns = mSource->GetOverrunStats();
+    if (overruns.overruns || mGaps)
+    {
+        PRINT(" ovr=%llu gap=%llu", (unsigned long long)overruns.overruns,
+              (unsigned long long)mGaps);
+    }
+    for (unsigned int i = 0; i < mStations.size(); i++)
+    {
+        double freq = mSource->get_frequency() + mChannelizer.get_freq_offset(i);
+        if (mPool)
+        {
+            // Decoder state belongs to the workers; only show pool stats.
+            DecoderPool::Stats stats = mPool->GetStats(i);
+            PRINT("  %8.4fMHz lat=%5.1f/%5.1fms",
+                  freq * 1.0e-6,
+                  stats.mean_latency * 1.0e3,
+                  stats.max_latency * 1.0e3);
+            if (alloc_counter_enabled())
+            {
+                PRINT(" alloc=%llu", (unsigned long long)stats.allocs);
+            }
+        }
+        else
+        {
+            const FmDecoder& decoder = *mStations[i].decoder;
+            PRINT("  %8.4fMHz IF=%+5.1fdB %s",
+                  (freq + decoder.get_tuning_offset()) * 1.0e-6,
+                  20 * log10(decoder.get_if_level()),
+                  decoder.stereo_detected() ? "st" : "  ");
+            AudioOutput::LatencyStats lat = mStations[i].output->get_latency_stats();
+            if (lat.blocks)
+            {
+                PRINT(" cap=%5.1fms", lat.last * 1.0e3);
+            }
+        }
+    }
+}
+
+/* end */
@@ -0,0 +1,192 @@
+#ifndef SOFTFM_CHANNELIZER_H
+#define SOFTFM_CHANNELIZER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "SoftFM.h"
+#include "Filter.h"
+#include "FmDecode.h"
+#include "DecoderPool.h"
+
+
+/**
+ *  Split a wideband IQ stream into decimated IQ streams, one per station.
+ *
+ *  Each channel is a shared-input NCO followed by a decimating low-pass
+ *  filter. The input is processed in tiles; every channel reads the same
+ *  tile while it is still in cache. Only the decimated output samples of
+ *  each channel filter are computed, so the per-channel cost is one
+ *  complex multiply per input sample plus the filter taps per output
+ *  sample.
+ */
+class Channelizer
+{
+public:
+
+    /**
+     * Construct channelizer.
+     *
+     * sample_rate_if :: Input sample rate in Hz.
+     * downsample     :: Decimation factor for every channel.
+     * bandwidth      :: Half bandwidth of every channel in Hz.
+     */
+    Channelizer(double sample_rate_if,
+                unsigned int downsample,
+                double bandwidth=FmDecoder::default_bandwidth_if);
+
+    /**
+     * Add a channel and return its index.
+     *
+     * freq_offset :: Channel center frequency in Hz with respect to
+     *                the center of the input stream.
+     */
+    unsigned int add_channel(double freq_offset);
+
+    /** Return number of channels. */
+    unsigned int num_channels() const
+    {
+        return m_channels.size();
+    }
+
+    /** Return output sample rate of every channel in Hz. */
+    double get_sample_rate() const
+    {
+        return m_sample_rate_if / m_downsample;
+    }
+
+    /** Return center frequency of a channel with respect to the input. */
+    double get_freq_offset(unsigned int channel) const
+    {
+        return m_channels[channel]->freq_offset;
+    }
+
+    /**
+     * Process n input samples.
+     * The output of every channel replaces its previous output and is
+     * available through get_samples() until the next call.
+     */
+    void process(const IQSample *samples_in, unsigned int n);
+
+    /**
+     * Clear the channel filters after a gap of "skipped" samples in the
+     * input. The oscillators advance over the gap, so they stay in phase
+     * with the sample stream.
+     */
+    void reset(std::uint64_t skipped);
+
+    /** Return the output samples of a channel from the most recent block. */
+    const IQSampleVector& get_samples(unsigned int channel) const
+    {
+        return m_channels[channel]->samples;
+    }
+
+private:
+    /** Number of channel output samples per tile. */
+    static const unsigned int tile_size = 1024;
+
+    struct Channel
+    {
+        Channel(double freq_offset, double sample_rate_if,
+                unsigned int downsample, double bandwidth);
+
+        double              freq_offset;
+        NcoTuner            tuner;
+        LowPassFilterFirIQ  filter;
+        IQSampleVector      samples;
+    };
+
+    const double        m_sample_rate_if;
+    const unsigned int  m_downsample;
+    const double        m_bandwidth;
+    std::vector<std::unique_ptr<Channel>> m_channels;
+    std::vector<unsigned int> m_count;
+    IQSampleVector      m_buf_tuned;
+};
+
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "threads/iothread.h"
+
+class IQSampleSource;
+class AudioOutput;
+
+/**
+ *  Decode several stations from one IQ sample stream.
+ *
+ *  Runs a Channelizer over each block from the source and feeds every
+ *  channel into its own FmDecoder and AudioOutput. The decoders run
+ *  either on the channelizer thread or on a DecoderPool. A block that
+ *  does not continue the sample stream (after an overrun) resets the
+ *  channel filters and every decoder.
+ */
+class ChannelizerThread
+{
+public:
+    /**
+     * num_workers :: Decode on a pool of this many worker threads,
+     *                or 0 to decode on the channelizer thread.
+     */
+    ChannelizerThread(IQSampleSource* src,
+                      double sample_rate_if,
+                      unsigned int downsample,
+                      unsigned int num_workers = 0);
+
+    /**
+     * Add a station. Must be called before the source starts streaming.
+     *
+     * tuning_offset :: Station frequency in Hz with respect to receiver LO.
+     * output        :: Audio output for this station (not owned).
+     */
+    void AddStation(double tuning_offset,
+                    AudioOutput* output,
+                    double sample_rate_pcm,
+                    bool   stereo = true,
+                    double deemphasis = FmDecoder::default_deemphasis,
+                    double bandwidth_pcm = FmDecoder::default_bandwidth_pcm,
+                    const FmDecoderOptions& options = FmDecoderOptions());
+
+    ~ChannelizerThread();
+
+    /** Wait until every block taken from the source is decoded and written. */
+    void WaitIdle();
+
+private:
+    void OnNewIQSamples(IQSampleSource*);
+    void DecodeIQSamples();
+    void MarkIdle();
+    void PrintStats();
+
+    struct Station
+    {
+        std::unique_ptr<FmDecoder> decoder;
+        AudioOutput* output;
+        SampleVector audio;
+        BlockPool blocks;
+    };
+
+    /** Number of blocks before allocations are counted. */
+    static const unsigned int alloc_warmup_blocks = 16;
+
+    LF::threads::IOThread mThread;
+    Channelizer mChannelizer;
+    std::vector<Station> mStations;
+    std::unique_ptr<DecoderPool> mPool;
+    IQSampleSource* mSource { nullptr };
+
+    std::mutex mIdleMutex;
+    std::condition_variable mIdleCond;
+    bool mIdle { true };
+
+    bool mPrintStats { true };
+    std::atomic<uint32_t> mBlocks { 0 };        // the source thread reads it too
+    std::atomic<std::uint64_t> mAllocs { 0 };
+    std::uint64_t mNextSampleIndex { 0 };   // expected index of the next block
+    std::uint64_t mGaps { 0 };              // blocks that did not continue the stream
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <atomic>
+
+#include "DecoderPool.h"
+#include "FmDecode.h"
+#include "AudioOutput.h"
+#include "ThreadAffinity.h"
+#include "AllocCounter.h"
+
+#include "utils/profiler.h"
+
+/********** DEBUG SETUP **********/
+#define ENABLE_SDEBUG
+#define DEBUG_PREFIX "DecoderPool: "
+#include "utils/singleton.h"
+#include "utils/screenlogger.h"
+/*********************************/
+
+using namespace std;
+using namespace LF::utils;
+
+const unsigned int DecoderPool::alloc_warmup_blocks;
+
+
+/* ****************  class BlockPool  **************** */
+
+shared_ptr<IQSampleVector> BlockPool::Acquire()
+{
+    for (auto& block : mBlocks)
+    {
+        if (block.use_count() == 1)
+        {
+            // The last user has released the block; make its writes
+            // visible before the block is refilled.
+            atomic_thread_fence(memory_order_acquire);
+            return block;
+        }
+    }
+    mBlocks.push_back(make_shared<IQSampleVector>());
+    return mBlocks.back();
+}
+
+
+/* ****************  class DecoderPool  **************** */
+
+DecoderPool::DecoderPool(unsigned int num_workers,
+                         unsigned int max_pending,
+                         bool pin_workers) :
+    mMaxPending(max(1u, max_pending))
+{
+    if (num_workers == 0)
+    {
+        // One worker per core the workers may be pinned to.
+        unsigned int num_cpus = pinnable_cpus().size();
+        if (num_cpus == 0)
+        {
+            num_cpus = thread::hardware_concurrency();
+        }
+        num_workers = max(1u, num_cpus);
+    }
+
+    for (unsigned int i = 0; i < num_workers; i++)
+    {
+        mWorkers.emplace_back(&DecoderPool::WorkerLoop, this);
+        unsigned int cpu = 0;
+        if (pin_workers && !pin_thread_to_cpu(mWorkers.back().native_handle(), i, &cpu))
+        {
+            SWAR("can not pin worker %u to CPU %u", i, cpu);
+        }
+    }
+}
+
+DecoderPool::~DecoderPool()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStop = true;
+        for (auto& d : mDecoders)
+        {
+            d->room.notify_all();
+        }
+    }
+    mWork.notify_all();
+
+    for (auto& t : mWorkers)
+    {
+        t.join();
+    }
+}
+
+unsigned int DecoderPool::AddDecoder(FmDecoder* decoder, AudioOutput* output)
+{
+    lock_guard<mutex> lock(mMutex);
+    mDecoders.emplace_back(new Decoder);
+    mDecoders.back()->decoder = decoder;
+    mDecoders.back()->output = output;
+    mDecoders.back()->pending.Reserve(mMaxPending);
+    mReady.Reserve(mDecoders.size());
+    return mDecoders.size() - 1;
+}
+
+void DecoderPool::Submit(unsigned int id, Block block, const CaptureTime& capture,
+                         bool gap)
+{
+    unique_lock<mutex> lock(mMutex);
+    Decoder& d = *mDecoders[id];
+
+    // Backpressure: wait until a worker has taken a block of this decoder.
+    if (d.pending.Size() >= mMaxPending)
+    {
+        ++d.stalls;
+        d.room.wait(lock, [&] { return d.pending.Size() < mMaxPending || mStop; });
+    }
+    if (mStop)
+    {
+        return;
+    }
+
+    d.pending.Push(Job { move(block), Clock::now(), capture, gap });
+
+    // A decoder is in the ready queue only while it has pending blocks
+    // and no worker; this keeps its blocks in order.
+    if (!d.busy && d.pending.Size() == 1)
+    {
+        mReady.Push(id);
+        mWork.notify_one();
+    }
+}
+
+void DecoderPool::SubmitAll(Block block, const CaptureTime& capture, bool gap)
+{
+    unsigned int n;
+    {
+        lock_guard<mutex> lock(mMutex);
+        n = mDecoders.size();
+    }
+    for (unsigned int id = 0; id < n; id++)
+    {
+        Submit(id, block, capture, gap);
+    }
+}
+
+void DecoderPool::WaitIdle()
+{
+    unique_lock<mutex> lock(mMutex);
+    mIdle.wait(lock, [this] {
+        for (auto& d : mDecoders)
+        {
+            if (d->busy || !d->pending.Empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+DecoderPool::Stats DecoderPool::GetStats(unsigned int id) const
+{
+    lock_guard<mutex> lock(mMutex);
+    const Decoder& d = *mDecoders[id];
+    Stats stats;
+    stats.blocks = d.blocks;
+    stats.stalls = d.stalls;
+    stats.mean_latency = d.blocks ? d.total_latency / d.blocks : 0;
+    stats.max_latency = d.max_latency;
+    stats.mean_decode = d.blocks ? d.total_decode / d.blocks : 0;
+    stats.allocs = d.allocs;
+    return stats;
+}
+
+void DecoderPool::WorkerLoop()
+{
+    unique_lock<mutex> lock(mMutex);
+    for (;;)
+    {
+        mWork.wait(lock, [this] { return mStop || !mReady.Empty(); });
+        if (mReady.Empty())
+        {
+            // Stopped and all queued blocks are decoded.
+            break;
+        }
+
+        unsigned int id = mReady.Pop();
+        Decoder& d = *mDecoders[id];
+        Job job = d.pending.Pop();
+        d.busy = true;
+        d.room.notify_one();
+        lock.unlock();
+
+        uint64_t allocs = alloc_count_thread();
+        Clock::time_point start = Clock::now();
+        {
+            RTTIProfiler f("DecoderPool::Decode");
+            if (job.gap)
+            {
+                d.decoder->reset_frontend();
+                d.decoder->reset_backend();
+            }
+            d.decoder->process(*job.block, d.audio);
+            d.output->write_stamped(d.audio, job.capture);
+        }
+        Clock::time_point done = Clock::now();
+        job.block.reset();
+        allocs = alloc_count_thread() - allocs;
+
+        lock.lock();
+        d.busy = false;
+        double latency = chrono::duration<double>(done - job.submitted).count();
+        ++d.blocks;
+        d.total_latency += latency;
+        d.max_latency = max(d.max_latency, latency);
+        d.total_decode += chrono::duration<double>(done - start).count();
+        if (d.blocks > alloc_warmup_blocks)
+        {
+            d.allocs += allocs;
+        }
+
+        if (!d.pending.Empty())
+        {
+            mReady.Push(id);
+            mWork.notify_one();
+        }
+        else
+        {
+            mIdle.notify_all();
+        }
+    }
+}
+
+/* end */
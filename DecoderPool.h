@@ -0,0 +1,184 @@
+#ifndef SOFTFM_DECODERPOOL_H
+#define SOFTFM_DECODERPOOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "SoftFM.h"
+
+class FmDecoder;
+class AudioOutput;
+
+/**
+ *  Recycled IQ sample blocks for DecoderPool.
+ *
+ *  Acquire() returns a block that nobody else references any more, and
+ *  only allocates a new block when all existing blocks are in use. In
+ *  steady state blocks and their sample buffers are reused, so submitting
+ *  to the pool does not touch the heap. Use from one thread only.
+ */
+class BlockPool
+{
+public:
+    std::shared_ptr<IQSampleVector> Acquire();
+
+private:
+    std::vector<std::shared_ptr<IQSampleVector>> mBlocks;
+};
+
+/**
+ *  Fixed-size pool of worker threads shared by many FM decoders.
+ *
+ *  Blocks of IQ samples are submitted per decoder. The blocks of one
+ *  decoder are decoded in submission order and never concurrently;
+ *  different decoders run in parallel on all workers. Every decoder has
+ *  a bounded queue, and Submit() blocks while that queue is full.
+ */
+class DecoderPool
+{
+public:
+    typedef std::shared_ptr<const IQSampleVector> Block;
+
+    /** Per-decoder statistics. Times are in seconds. */
+    struct Stats
+    {
+        std::uint64_t   blocks;         // blocks decoded
+        std::uint64_t   stalls;         // Submit() calls that waited for room
+        double          mean_latency;   // Submit() to audio written
+        double          max_latency;
+        double          mean_decode;    // decode and write only
+        std::uint64_t   allocs;         // heap allocations after warm-up
+    };
+
+    /**
+     * Create the pool and start its workers.
+     *
+     * num_workers  :: Number of worker threads (0 = one per core in
+     *                 pinnable_cpus()).
+     * max_pending  :: Maximum number of queued blocks per decoder.
+     * pin_workers  :: Pin worker i to the i-th core of pinnable_cpus().
+     */
+    DecoderPool(unsigned int num_workers = 0,
+                unsigned int max_pending = 4,
+                bool pin_workers = true);
+
+    /** Decode all queued blocks and stop the workers. */
+    ~DecoderPool();
+
+    /**
+     * Add a decoder and return its id. Decoder and output are not owned
+     * and must outlive the pool.
+     */
+    unsigned int AddDecoder(FmDecoder* decoder, AudioOutput* output);
+
+    /**
+     * Queue a block for one decoder; waits while its queue is full.
+     * capture is when the block was received and stamps its audio.
+     * With gap, the block does not continue the previous block of the
+     * decoder, and the decoder is reset before it decodes the block.
+     */
+    void Submit(unsigned int id, Block block, const CaptureTime& capture,
+                bool gap = false);
+
+    /** Queue the same block for every decoder. */
+    void SubmitAll(Block block, const CaptureTime& capture, bool gap = false);
+
+    /** Wait until all queued blocks are decoded. */
+    void WaitIdle();
+
+    /** Return statistics of one decoder. */
+    Stats GetStats(unsigned int id) const;
+
+    unsigned int GetNumWorkers() const
+    {
+        return mWorkers.size();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    /** Number of blocks per decoder before allocations are counted. */
+    static const unsigned int alloc_warmup_blocks = 16;
+
+    struct Job
+    {
+        Block block;
+        Clock::time_point submitted;
+        CaptureTime capture;
+        bool gap;
+    };
+
+    /** FIFO with fixed capacity; does not allocate after Reserve(). */
+    template <class T>
+    class FixedQueue
+    {
+    public:
+        void Reserve(std::size_t capacity)
+        {
+            std::vector<T> items(capacity);
+            for (std::size_t i = 0; i < mCount; i++)
+            {
+                items[i] = std::move(mItems[(mHead + i) % mItems.size()]);
+            }
+            mItems.swap(items);
+            mHead = 0;
+        }
+
+        bool Empty() const { return mCount == 0; }
+        std::size_t Size() const { return mCount; }
+
+        void Push(T item)
+        {
+            mItems[(mHead + mCount) % mItems.size()] = std::move(item);
+            ++mCount;
+        }
+
+        T Pop()
+        {
+            T item = std::move(mItems[mHead]);
+            mHead = (mHead + 1) % mItems.size();
+            --mCount;
+            return item;
+        }
+
+    private:
+        std::vector<T> mItems;
+        std::size_t mHead { 0 };
+        std::size_t mCount { 0 };
+    };
+
+    struct Decoder
+    {
+        FmDecoder* decoder;
+        AudioOutput* output;
+        SampleVector audio;
+        FixedQueue<Job> pending;
+        std::condition_variable room;
+        bool busy { false };
+
+        std::uint64_t blocks { 0 };
+        std::uint64_t stalls { 0 };
+        double total_latency { 0 };
+        double max_latency { 0 };
+        double total_decode { 0 };
+        std::uint64_t allocs { 0 };
+    };
+
+    void WorkerLoop();
+
+    const unsigned int mMaxPending;
+    std::vector<std::unique_ptr<Decoder>> mDecoders;
+    FixedQueue<unsigned int> mReady;    // decoders with work and no worker
+    std::vector<std::thread> mWorkers;
+    mutable std::mutex mMutex;
+    std::condition_variable mWork;
+    std::condition_variable mIdle;      // a decoder finished a block
+    bool mStop { false };
+};
+
+#endif
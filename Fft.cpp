@@ -0,0 +1,161 @@
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+#include "Fft.h"
+
+using namespace std;
+
+
+/**
+ * Complex multiply without the NaN and infinity handling that
+ * std::complex needs without -ffast-math.
+ */
+static inline IQSample cmul(IQSample a, IQSample b)
+{
+    return IQSample(a.real() * b.real() - a.imag() * b.imag(),
+                    a.real() * b.imag() + a.imag() * b.real());
+}
+
+
+/* ****************  class Fft  **************** */
+
+// Construct FFT.
+Fft::Fft(unsigned int size, SimdLevel simd)
+    : m_size(size)
+    , m_twiddle(size)
+    , m_work(size)
+    , m_radix4(select_fft_radix4_kernel(simd))
+{
+    assert(size > 0 && (size & (size - 1)) == 0);
+
+    for (unsigned int k = 0; k < size; k++)
+        m_twiddle[k] = polar(1.0, -2 * M_PI * k / size);
+}
+
+
+// Run the Stockham stages. Stage input has n-point transforms of stride s
+// (n * s = size); a radix-r stage turns them into (n / r)-point transforms
+// of stride (r * s) and writes its output to the other buffer.
+void Fft::transform(IQSample *data, bool inverse)
+{
+    const IQSample *tw = m_twiddle.data();
+    IQSample *x = data;
+    IQSample *y = m_work.data();
+    unsigned int n = m_size;
+    unsigned int s = 1;
+
+    while (n > 1) {
+        if (n % 4 == 0) {
+            m_radix4(x, n / 4, s, tw, inverse, y);
+            n /= 4;
+            s *= 4;
+        } else {
+            // Only the last stage of an odd power of two, n = 2.
+            unsigned int m = n / 2;
+            for (unsigned int p = 0; p < m; p++) {
+                IQSample w = inverse ? conj(tw[p * s]) : tw[p * s];
+                const IQSample *xa = x + s * p;
+                IQSample *ya = y + s * 2 * p;
+                for (unsigned int q = 0; q < s; q++) {
+                    IQSample a = xa[q];
+                    IQSample b = xa[q + s * m];
+                    ya[q]     = a + b;
+                    ya[q + s] = cmul(w, a - b);
+                }
+            }
+            n /= 2;
+            s *= 2;
+        }
+        swap(x, y);
+    }
+
+    if (x != data)
+        copy(x, x + m_size, data);
+}
+
+
+// Forward transform.
+void Fft::forward(IQSample *data)
+{
+    transform(data, false);
+}
+
+
+// Inverse transform.
+void Fft::inverse(IQSample *data)
+{
+    transform(data, true);
+}
+
+
+/* ****************  class RealFft  **************** */
+
+// Construct real FFT.
+RealFft::RealFft(unsigned int size, SimdLevel simd)
+    : m_size(size)
+    , m_fft(size / 2, simd)
+    , m_twiddle(size / 2)
+    , m_buf(size / 2)
+{
+    assert(size >= 2);
+
+    for (unsigned int k = 0; k < size / 2; k++)
+        m_twiddle[k] = polar(1.0, -2 * M_PI * k / size);
+}
+
+
+// Transform real samples into the bins of the non-negative frequencies.
+void RealFft::forward(const Sample *samples_in, IQSample *bins_out)
+{
+    unsigned int m = m_size / 2;
+
+    // z[k] = x[2k] + j x[2k+1]
+    for (unsigned int k = 0; k < m; k++)
+        m_buf[k] = IQSample(samples_in[2*k], samples_in[2*k+1]);
+
+    m_fft.forward(m_buf.data());
+
+    // Split Z into the transforms of the even samples, E = (Z[k] +
+    // conj(Z[m-k])) / 2, and the odd samples, O = (Z[k] - conj(Z[m-k])) / 2j,
+    // then X[k] = E + W^k O.
+    Sample z0r = m_buf[0].real(), z0i = m_buf[0].imag();
+    bins_out[0] = IQSample(z0r + z0i, 0);
+    bins_out[m] = IQSample(z0r - z0i, 0);
+    for (unsigned int k = 1; k < m; k++) {
+        IQSample zk = m_buf[k];
+        IQSample zc = conj(m_buf[m - k]);
+        IQSample e = Sample(0.5) * (zk + zc);
+        IQSample d = Sample(0.5) * (zk - zc);
+        IQSample o(d.imag(), -d.real());
+        bins_out[k] = e + cmul(m_twiddle[k], o);
+    }
+}
+
+
+// Transform the bins of the non-negative frequencies back to real samples.
+void RealFft::inverse(const IQSample *bins_in, Sample *samples_out)
+{
+    unsigned int m = m_size / 2;
+
+    // Undo the split: Z[k] = E + j O with E = X[k] + conj(X[m-k]) and
+    // O = (X[k] - conj(X[m-k])) W^-k, which scales the result by 2 so that
+    // the inverse of a size point transform is scaled by size.
+    for (unsigned int k = 0; k < m; k++) {
+        IQSample xk = bins_in[k];
+        IQSample xc = conj(bins_in[m - k]);
+        IQSample e = xk + xc;
+        IQSample o = cmul(xk - xc, conj(m_twiddle[k]));
+        m_buf[k] = e + IQSample(-o.imag(), o.real());
+    }
+
+    m_fft.inverse(m_buf.data());
+
+    for (unsigned int k = 0; k < m; k++) {
+        samples_out[2*k]   = m_buf[k].real();
+        samples_out[2*k+1] = m_buf[k].imag();
+    }
+}
+
+/* end */
@@ -0,0 +1,88 @@
+#ifndef SOFTFM_FFT_H
+#define SOFTFM_FFT_H
+
+#include "SoftFM.h"
+#include "SimdKernels.h"
+
+/**
+ *  Complex FFT of a power-of-two size.
+ *
+ *  Self-sorting (Stockham) radix-4 stages, with one radix-2 stage for odd
+ *  powers of two, so no bit reversal pass is needed. The radix-4 stages
+ *  run a vectorized kernel (AVX2) when the CPU supports it. The
+ *  transforms are not scaled: inverse(forward(x)) is size * x.
+ */
+class Fft
+{
+public:
+
+    /**
+     * Construct FFT.
+     *
+     * size :: Transform size, a power of two (>= 1).
+     * simd :: Instruction set for the radix-4 kernel
+     *         (default: best level supported by the CPU).
+     */
+    explicit Fft(unsigned int size, SimdLevel simd=simd_detect());
+
+    /** Return the transform size. */
+    unsigned int size() const
+    {
+        return m_size;
+    }
+
+    /** Forward transform of "size" samples in place. */
+    void forward(IQSample *data);
+
+    /** Inverse transform of "size" samples in place. */
+    void inverse(IQSample *data);
+
+private:
+    void transform(IQSample *data, bool inverse);
+
+    unsigned int    m_size;
+    IQSampleVector  m_twiddle;  // exp(-2 pi j k / size), k < size
+    IQSampleVector  m_work;
+    FftRadix4Kernel m_radix4;
+};
+
+
+/**
+ *  FFT of a real-valued signal of a power-of-two size.
+ *
+ *  The even and odd samples are packed as one complex signal of half the
+ *  size; one complex FFT and a split pass give the (size / 2 + 1) bins of
+ *  the non-negative frequencies. Not scaled, as for Fft.
+ */
+class RealFft
+{
+public:
+
+    /**
+     * Construct real FFT.
+     *
+     * size :: Transform size, a power of two (>= 2).
+     * simd :: Instruction set, as for Fft.
+     */
+    explicit RealFft(unsigned int size, SimdLevel simd=simd_detect());
+
+    /** Return the transform size. */
+    unsigned int size() const
+    {
+        return m_size;
+    }
+
+    /** Transform "size" samples into (size / 2 + 1) bins. */
+    void forward(const Sample *samples_in, IQSample *bins_out);
+
+    /** Transform (size / 2 + 1) bins back into "size" samples. */
+    void inverse(const IQSample *bins_in, Sample *samples_out);
+
+private:
+    unsigned int    m_size;
+    Fft             m_fft;
+    IQSampleVector  m_twiddle;  // exp(-2 pi j k / size), k < size / 2
+    IQSampleVector  m_buf;
+};
+
+#endif
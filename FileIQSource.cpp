@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "FileIQSource.h"
+
+/********** DEBUG SETUP **********/
+//#define ENABLE_SDEBUG
+#define DEBUG_PREFIX "FileIQSource: "
+#include "utils/singleton.h"
+#include "utils/screenlogger.h"
+/*********************************/
+
+using namespace std;
+
+// Bytes per IQ sample for each format.
+static unsigned int sample_size(FileIQSource::Format format)
+{
+    switch (format)
+    {
+        case FileIQSource::FORMAT_CS16:
+            return 4;
+        case FileIQSource::FORMAT_CF32:
+            return 8;
+        default:
+            return 2;
+    }
+}
+
+// Map a file read-only; return nullptr and set error if that fails.
+// An empty file gives nullptr, length 0 and no error.
+static const unsigned char* map_file(const string& filename, size_t& length,
+                                     string& error)
+{
+    length = 0;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                              nullptr, OPEN_EXISTING,
+                              FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        error = "can not open '" + filename + "' (error " +
+                to_string(GetLastError()) + ")";
+        return nullptr;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        error = "can not stat '" + filename + "' (error " +
+                to_string(GetLastError()) + ")";
+        CloseHandle(file);
+        return nullptr;
+    }
+    if (size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    // The view keeps the mapping and the file open after the handles
+    // are closed.
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (data == nullptr)
+    {
+        error = "can not map '" + filename + "' (error " +
+                to_string(GetLastError()) + ")";
+        if (mapping)
+        {
+            CloseHandle(mapping);
+        }
+        return nullptr;
+    }
+    CloseHandle(mapping);
+    length = size_t(size.QuadPart);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "can not open '" + filename + "' (" + strerror(errno) + ")";
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error = "can not stat '" + filename + "' (" + strerror(errno) + ")";
+        close(fd);
+        return nullptr;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        error = "can not map '" + filename + "' (" + strerror(errno) + ")";
+        return nullptr;
+    }
+
+    // The file is read once from start to end; let the kernel read ahead.
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    length = st.st_size;
+#endif
+    return static_cast<const unsigned char*>(data);
+}
+
+// Unmap a file mapped with map_file().
+static void unmap_file(const unsigned char* data, size_t length)
+{
+#ifdef _WIN32
+    (void)length;
+    UnmapViewOfFile(data);
+#else
+    munmap(const_cast<unsigned char*>(data), length);
+#endif
+}
+
+// Open and map an IQ file.
+FileIQSource::FileIQSource(const string& filename,
+                           Format format,
+                           uint32_t sample_rate,
+                           uint32_t frequency,
+                           bool realtime,
+                           bool raw) :
+    mFormat(format == FORMAT_AUTO ? format_from_filename(filename) : format),
+    mSampleRate(sample_rate),
+    mFrequency(frequency),
+    mRealtime(realtime),
+    mRaw(raw),
+    mConvertU8(select_u8_to_iq_kernel(simd_detect()))
+{
+    mData = map_file(filename, mMapLength, mError);
+    if (!mError.empty())
+    {
+        return;
+    }
+
+    mNumSamples = uint64_t(mMapLength) / sample_size(mFormat);
+    if (mNumSamples == 0)
+    {
+        mError = "'" + filename + "' contains no samples";
+        return;
+    }
+
+    if (raw && mFormat != FORMAT_U8)
+    {
+        mError = "raw samples need a u8 recording";
+    }
+}
+
+// Stop streaming and unmap the file.
+FileIQSource::~FileIQSource()
+{
+    StopAsync();
+    delete mSampleBuffer;
+    delete mRawBuffer;
+    if (mData)
+    {
+        unmap_file(mData, mMapLength);
+    }
+}
+
+bool FileIQSource::StartAsync()
+{
+    bool ret = false;
+    if (mData && mError.empty() && !mThread)
+    {
+        SampleRingConfig ring = mRingConfig;
+        if (ring.block_length == 0)
+        {
+            ring.block_length = DEFAULT_BUF_LENGTH;
+        }
+        mBlockLength = ring.block_length;
+
+        bool ok;
+        if (mRaw)
+        {
+            if (mRawBuffer == nullptr)
+            {
+                mRawBuffer = new SampleRing<RawSampleBufferBlock>(ring);
+            }
+            ok = bool(*mRawBuffer);
+        }
+        else
+        {
+            if (mSampleBuffer == nullptr)
+            {
+                mSampleBuffer = new SampleRing<SampleBufferBlock>(ring);
+            }
+            ok = bool(*mSampleBuffer);
+        }
+        if (!ok)
+        {
+            mError = "can not allocate sample ring";
+            return false;
+        }
+
+        mThread = new std::thread(&FileIQSource::ReaderThread, this);
+        ret = true;
+    }
+    return ret;
+}
+
+bool FileIQSource::StopAsync()
+{
+    bool ret = false;
+    if (mThread)
+    {
+        {
+            lock_guard<mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCond.notify_all();
+        mThread->join();
+        delete mThread;
+        mThread = nullptr;
+        ret = true;
+    }
+    return ret;
+}
+
+void FileIQSource::WaitFinished()
+{
+    unique_lock<mutex> lock(mMutex);
+    mCond.wait(lock, [this] { return mStop || (mEndOfFile && mBlocksRead == mBlocksWritten); });
+}
+
+bool FileIQSource::parse_format(const string& name, Format& format)
+{
+    if (name == "u8" || name == "cu8")
+    {
+        format = FORMAT_U8;
+    }
+    else if (name == "cs16")
+    {
+        format = FORMAT_CS16;
+    }
+    else if (name == "cf32")
+    {
+        format = FORMAT_CF32;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+FileIQSource::Format FileIQSource::format_from_filename(const string& filename)
+{
+    Format format = FORMAT_U8;
+    size_t dot = filename.find_last_of('.');
+    if (dot != string::npos && parse_format(filename.substr(dot + 1), format))
+    {
+        return format;
+    }
+    // rtl_sdr writes unsigned 8-bit samples, usually named .dat or .bin.
+    return FORMAT_U8;
+}
+
+SampleBufferBlock* FileIQSource::GetBlockToRead()
+{
+    return mSampleBuffer ? mSampleBuffer->GetBlockToRead() : nullptr;
+}
+
+void FileIQSource::UpdateReadState()
+{
+    if (mSampleBuffer)
+    {
+        mSampleBuffer->UpdateReadState();
+        BlockRead();
+    }
+}
+
+RawSampleBufferBlock* FileIQSource::GetRawBlockToRead()
+{
+    return mRawBuffer ? mRawBuffer->GetBlockToRead() : nullptr;
+}
+
+void FileIQSource::UpdateRawReadState()
+{
+    if (mRawBuffer)
+    {
+        mRawBuffer->UpdateReadState();
+        BlockRead();
+    }
+}
+
+// Count a returned block and wake up the reader thread.
+void FileIQSource::BlockRead()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        ++mBlocksRead;
+    }
+    mCond.notify_all();
+}
+
+// Convert n samples starting at sample offset to IQSample.
+void FileIQSource::Convert(uint64_t offset, unsigned int n, IQSample* samples_out) const
+{
+    const unsigned char *p = mData + offset * sample_size(mFormat);
+    const IQCorrection& c = mCorrection;
+
+    switch (mFormat)
+    {
+        case FORMAT_CS16:
+        {
+            for (unsigned int i = 0; i < n; i++)
+            {
+                int16_t re, im;
+                memcpy(&re, p + 4 * i, 2);
+                memcpy(&im, p + 4 * i + 2, 2);
+                Sample x = re / Sample(32768) - c.dc_i;
+                Sample y = (im / Sample(32768) - c.dc_q) * c.gain + x * c.phase;
+                samples_out[i] = IQSample(x, y);
+            }
+            break;
+        }
+        case FORMAT_CF32:
+        {
+            for (unsigned int i = 0; i < n; i++)
+            {
+                float iq[2];
+                memcpy(iq, p + 8 * i, 8);
+                Sample x = iq[0] - c.dc_i;
+                Sample y = (iq[1] - c.dc_q) * c.gain + x * c.phase;
+                samples_out[i] = IQSample(x, y);
+            }
+            break;
+        }
+        default:
+        {
+            mConvertU8(p, n, c, samples_out);
+            break;
+        }
+    }
+}
+
+// Copy n raw u8 samples starting at sample offset.
+void FileIQSource::Convert(uint64_t offset, unsigned int n, uint8_t* samples_out) const
+{
+    memcpy(samples_out, mData + 2 * offset, 2 * n);
+}
+
+template <class Block>
+bool FileIQSource::WriteBlock(SampleRing<Block>* buffer,
+                              uint64_t offset, unsigned int n)
+{
+    Block* block = buffer->GetBlockToWrite();
+    if (block == nullptr)
+    {
+        return false;
+    }
+    Convert(offset, n, block->samples);
+    block->size = n;
+    block->sample_index = offset;
+    block->dropped = 0;
+    block->capture_time = CaptureTime::now();
+    {
+        lock_guard<mutex> lock(mMutex);
+        ++mBlocksWritten;
+    }
+    buffer->UpdateWriteState();
+    return true;
+}
+
+void FileIQSource::ReaderThread()
+{
+    SDEB("Started ReaderThread");
+    typedef chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+
+    uint64_t offset = 0;
+    while (offset < mNumSamples)
+    {
+        if (mRealtime)
+        {
+            this_thread::sleep_until(start + chrono::duration_cast<Clock::duration>(
+                                     chrono::duration<double>(double(offset) / mSampleRate)));
+        }
+
+        {
+            lock_guard<mutex> lock(mMutex);
+            if (mStop)
+            {
+                break;
+            }
+        }
+
+        unsigned int n = min(uint64_t(mBlockLength), mNumSamples - offset);
+        bool written = mRawBuffer ? WriteBlock(mRawBuffer, offset, n)
+                                  : WriteBlock(mSampleBuffer, offset, n);
+        if (!written)
+        {
+            // Never drop recorded samples; wait until the consumer returns a block.
+            unique_lock<mutex> lock(mMutex);
+            uint64_t read = mBlocksRead;
+            mCond.wait_for(lock, chrono::milliseconds(10),
+                           [&] { return mStop || mBlocksRead != read; });
+            if (mStop)
+            {
+                break;
+            }
+            continue;
+        }
+
+        offset += n;
+        NEW_DATA.Emit(this);
+    }
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mEndOfFile = true;
+    }
+    mCond.notify_all();
+    SDEB("Stopped ReaderThread");
+}
+
+/* end */
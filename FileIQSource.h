@@ -0,0 +1,152 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "IQSampleSource.h"
+
+/**
+ *  Replay IQ samples from a recorded file.
+ *
+ *  The file is memory-mapped and converted to IQSample in blocks of
+ *  DEFAULT_BUF_LENGTH samples (or the block length of the ring
+ *  configuration) on the source thread. Blocks are never
+ *  dropped: when the consumer falls behind, the source waits for it,
+ *  whatever the overrun policy of the ring configuration.
+ *  Without real-time pacing the file is decoded as fast as possible,
+ *  which makes runs on the same recording reproducible. Blocks are
+ *  stamped with the time they were read from the file.
+ *
+ *  In raw mode (u8 recordings only) the bytes are copied into
+ *  RawSampleBufferBlocks unchanged, for decoders with an integer front end.
+ */
+class FileIQSource : public IQSampleSource
+{
+public:
+
+    /** Sample formats of IQ recordings. */
+    enum Format {
+        FORMAT_AUTO,    // choose from the file name extension
+        FORMAT_U8,      // unsigned 8-bit I/Q pairs (rtl_sdr .dat / .cu8)
+        FORMAT_CS16,    // signed 16-bit little-endian I/Q pairs
+        FORMAT_CF32     // 32-bit float I/Q pairs
+    };
+
+    /**
+     * Open and map an IQ file.
+     *
+     * filename     :: path of the recording.
+     * format       :: sample format, or FORMAT_AUTO to use the extension.
+     * sample_rate  :: sample rate of the recording in Hz.
+     * frequency    :: center frequency of the recording in Hz.
+     * realtime     :: true to pace blocks at the sample rate,
+     *                 false to deliver them as fast as they are consumed.
+     * raw          :: deliver RawSampleBufferBlocks (u8 format only;
+     *                 no I/Q correction).
+     */
+    FileIQSource(const std::string& filename,
+                 Format format,
+                 std::uint32_t sample_rate,
+                 std::uint32_t frequency,
+                 bool realtime = false,
+                 bool raw = false);
+
+    /** Stop streaming and unmap the file. */
+    ~FileIQSource();
+
+    bool StartAsync() override;
+    bool StopAsync() override;
+
+    std::uint32_t get_sample_rate() override
+    {
+        return mSampleRate;
+    }
+
+    std::uint32_t get_frequency() override
+    {
+        return mFrequency;
+    }
+
+    /** Return the number of IQ samples in the file. */
+    std::uint64_t get_num_samples() const
+    {
+        return mNumSamples;
+    }
+
+    /** Wait until every block of the file was taken and returned by the consumer. */
+    void WaitFinished();
+
+    /** Return the last error, or return an empty string if there is no error. */
+    std::string error()
+    {
+        std::string ret(mError);
+        mError.clear();
+        return ret;
+    }
+
+    /** Return true if the file is mapped, return false if there is an error. */
+    operator bool() const
+    {
+        return mData && mError.empty();
+    }
+
+    /** Parse a format name ("u8", "cu8", "cs16", "cf32"); return false if unknown. */
+    static bool parse_format(const std::string& name, Format& format);
+
+    /** Guess the format from the file name extension (.cs16, .cf32, otherwise u8). */
+    static Format format_from_filename(const std::string& filename);
+
+    SampleBufferBlock* GetBlockToRead() override;
+    void UpdateReadState() override;
+
+    bool realtime() const override
+    {
+        return mRealtime;
+    }
+
+    bool raw_samples() const override
+    {
+        return mRaw;
+    }
+
+    RawSampleBufferBlock* GetRawBlockToRead() override;
+    void UpdateRawReadState() override;
+
+private:
+    void ReaderThread();
+    void Convert(std::uint64_t offset, unsigned int n, IQSample* samples_out) const;
+    void Convert(std::uint64_t offset, unsigned int n, std::uint8_t* samples_out) const;
+    void BlockRead();
+
+    /** Fill and publish the next block; return false if the buffer is full. */
+    template <class Block>
+    bool WriteBlock(SampleRing<Block>* buffer,
+                    std::uint64_t offset, unsigned int n);
+
+    const Format mFormat;
+    const std::uint32_t mSampleRate;
+    const std::uint32_t mFrequency;
+    const bool mRealtime;
+    const bool mRaw;
+    const U8ToIQKernel mConvertU8;
+
+    const unsigned char* mData { nullptr };
+    std::size_t mMapLength { 0 };
+    std::uint64_t mNumSamples { 0 };
+    std::string mError;
+
+    SampleRing<SampleBufferBlock>* mSampleBuffer { nullptr };
+    SampleRing<RawSampleBufferBlock>* mRawBuffer { nullptr };
+    unsigned int mBlockLength { DEFAULT_BUF_LENGTH };
+    std::thread* mThread { nullptr };
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mStop { false };
+    bool mEndOfFile { false };
+    std::uint64_t mBlocksWritten { 0 };
+    std::uint64_t mBlocksRead { 0 };
+};
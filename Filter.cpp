@@ -6,6 +6,7 @@
 #include <complex>
 
 #include "Filter.h"
+#include "FilterDesign.h"
 #include "RtlSdrSource.h"
 
 #include "utils/profiler.h"
@@ -14,45 +15,6 @@ using namespace std;
 using namespace LF::utils;
 
 
-/** Prepare Lanczos FIR filter coefficients. */
-template <class T>
-static void make_lanczos_coeff(unsigned int filter_order, double cutoff,
-                               vector<T>& coeff)
-{
-    coeff.resize(filter_order + 1);
-
-    // Prepare Lanczos FIR filter.
-    //   t[i]     =  (i - order/2)
-    //   coeff[i] =  Sinc(2 * cutoff * t[i]) * Sinc(t[i] / (order/2 + 1))
-    //   coeff    /= sum(coeff)
-
-    double ysum = 0.0;
-
-    // Calculate filter kernel.
-    for (int i = 0; i <= (int)filter_order; i++) {
-        int t2 = 2 * i - filter_order;
-
-        double y;
-        if (t2 == 0) {
-            y = 1.0;
-        } else {
-            double x1 = cutoff * t2;
-            double x2 = t2 / double(filter_order + 2);
-            y = ( sin(M_PI * x1) / M_PI / x1 ) *
-                ( sin(M_PI * x2) / M_PI / x2 );
-        }
-
-        coeff[i] = y;
-        ysum += y;
-    }
-
-    // Apply correction factor to ensure unit gain at DC.
-    for (unsigned i = 0; i <= filter_order; i++) {
-        coeff[i] /= ysum;
-    }
-}
-
-
 /* ****************  class FineTuner  **************** */
 
 // Construct finetuner.
@@ -73,12 +35,24 @@ FineTuner::FineTuner(unsigned int table_size, int freq_shift)
 // Process samples.
 void FineTuner::process(const IQSampleVector& samples_in,
                         IQSampleVector& samples_out)
+{
+    samples_out.resize(samples_in.size());
+    process(samples_in.data(), samples_in.size(), samples_out.data());
+}
+
+void FineTuner::Process(const SampleBufferBlock* samples_in, IQSampleVector& samples_out)
+{
+    RTTIProfiler f("FineTuner::Process");
+    samples_out.resize(samples_in->size);
+    process(samples_in->samples, samples_in->size, samples_out.data());
+}
+
+// Process n samples.
+void FineTuner::process(const IQSample *samples_in, unsigned int n,
+                        IQSample *samples_out)
 {
     unsigned int tblidx = m_index;
     unsigned int tblsiz = m_table.size();
-    unsigned int n = samples_in.size();
-
-    samples_out.resize(n);
 
     for (unsigned int i = 0; i < n; i++) {
         samples_out[i] = samples_in[i] * m_table[tblidx];
@@ -90,33 +64,367 @@ void FineTuner::process(const IQSampleVector& samples_in,
     m_index = tblidx;
 }
 
-void FineTuner::Process(const SampleBufferBlock* samples_in, IQSampleVector& samples_out)
+
+/* ****************  class NcoTuner  **************** */
+
+const unsigned int NcoTuner::renormalize_interval;
+
+// Construct NCO fine tuner.
+NcoTuner::NcoTuner(double freq_shift, SimdLevel simd)
+    : m_phase_step(2.0 * M_PI * freq_shift)
+    , m_phase(0)
+    , m_step(polar(1.0, nco_lanes * m_phase_step))
+    , m_kernel(select_nco_kernel(simd))
+{ }
+
+
+// Process samples.
+void NcoTuner::process(const IQSampleVector& samples_in,
+                       IQSampleVector& samples_out)
 {
-    RTTIProfiler f("FineTuner::Process");
-    unsigned int tblidx = m_index;
-    unsigned int tblsiz = m_table.size();
-    unsigned int n = samples_in->size;
+    samples_out.resize(samples_in.size());
+    process(samples_in.data(), samples_in.size(), samples_out.data());
+}
+
+void NcoTuner::Process(const SampleBufferBlock* samples_in, IQSampleVector& samples_out)
+{
+    RTTIProfiler f("NcoTuner::Process");
+    samples_out.resize(samples_in->size);
+    process(samples_in->samples, samples_in->size, samples_out.data());
+}
+
+// Process n samples.
+void NcoTuner::process(const IQSample *samples_in, unsigned int n,
+                       IQSample *samples_out)
+{
+    unsigned int p = 0;
+    while (p < n) {
+        unsigned int k = min(n - p, renormalize_interval);
+
+        // Seed the rotator phasors from the exact phase.
+        for (unsigned int l = 0; l < nco_lanes; l++) {
+            m_phasors[l] = polar(1.0, m_phase + l * m_phase_step);
+        }
+
+        // Rotate whole groups of samples.
+        unsigned int kv = k - k % nco_lanes;
+        m_kernel(samples_in + p, kv, m_phasors, m_step, samples_out + p);
+
+        // Rotate remaining samples with the next group of phasors.
+        for (unsigned int i = kv; i < k; i++) {
+            samples_out[p+i] = samples_in[p+i] * m_phasors[i-kv];
+        }
+
+        // Advance the phase accumulator.
+        m_phase = remainder(m_phase + k * m_phase_step, 2.0 * M_PI);
+        p += k;
+    }
+}
+
+
+// Advance the oscillator over lost samples.
+void NcoTuner::skip(uint64_t n)
+{
+    m_phase = remainder(m_phase + double(n) * m_phase_step, 2.0 * M_PI);
+}
+
+
+/* ****************  class FineTunerU8  **************** */
+
+// Construct 8-bit fine tuner.
+FineTunerU8::FineTunerU8(unsigned int table_size, int freq_shift,
+                         SimdLevel simd)
+    : m_index(0)
+    , m_table_a(2 * table_size)
+    , m_table_b(2 * table_size)
+    , m_kernel(select_tuner_u8_kernel(simd))
+{
+    double phase_step = 2.0 * M_PI / double(table_size);
+    for (unsigned int i = 0; i < table_size; i++) {
+        double phi = (((int64_t)freq_shift * i) % table_size) * phase_step;
+        int16_t pcos = lrint(cos(phi) * (1 << 14));
+        int16_t psin = lrint(sin(phi) * (1 << 14));
+        m_table_a[2*i]   = pcos;
+        m_table_a[2*i+1] = -psin;
+        m_table_b[2*i]   = psin;
+        m_table_b[2*i+1] = pcos;
+    }
+}
+
+
+// Process n samples.
+void FineTunerU8::process(const uint8_t *samples_in, unsigned int n,
+                          int16_t *samples_out)
+{
+    unsigned int tblsiz = m_table_a.size() / 2;
+
+    // Run the kernel up to the end of the table, then wrap around.
+    unsigned int p = 0;
+    while (p < n) {
+        unsigned int k = min(n - p, tblsiz - m_index);
+        m_kernel(samples_in + 2 * p, k,
+                 m_table_a.data() + 2 * m_index,
+                 m_table_b.data() + 2 * m_index,
+                 samples_out + 2 * p);
+        m_index += k;
+        if (m_index == tblsiz)
+            m_index = 0;
+        p += k;
+    }
+}
+
+
+/* ****************  class FftFilterIQ  **************** */
+
+/**
+ * Return the FFT size for an overlap-save filter: a power of two of
+ * about 4 times the filter length, so that most of each FFT produces
+ * valid output.
+ */
+static unsigned int overlap_save_size(unsigned int ntaps)
+{
+    unsigned int size = 64;
+    while (size < 4 * ntaps)
+        size *= 2;
+    return size;
+}
+
+
+// Construct low-pass filter.
+FftFilterIQ::FftFilterIQ(unsigned int filter_order, double cutoff,
+                         unsigned int downsample, const FirDesign& design,
+                         SimdLevel simd)
+    : m_order(filter_order)
+    , m_block(overlap_save_size(filter_order + 1) - filter_order)
+    , m_downsample(downsample)
+    , m_pos(0)
+    , m_fft(overlap_save_size(filter_order + 1), simd)
+{
+    vector<IQSample::value_type> coeff;
+    make_fir_lowpass(design, filter_order, cutoff, coeff);
+    init(coeff);
+}
+
+
+// Construct filter from its coefficients.
+FftFilterIQ::FftFilterIQ(const vector<IQSample::value_type>& coeff,
+                         unsigned int downsample, SimdLevel simd)
+    : m_order(coeff.size() - 1)
+    , m_block(overlap_save_size(coeff.size()) - m_order)
+    , m_downsample(downsample)
+    , m_pos(0)
+    , m_fft(overlap_save_size(coeff.size()), simd)
+{
+    init(coeff);
+}
+
+
+// Set the filter spectrum from the coefficients.
+void FftFilterIQ::init(const vector<IQSample::value_type>& coeff)
+{
+    assert(m_downsample >= 1);
+
+    unsigned int size = m_fft.size();
+
+    // Fold the scaling of the inverse transform into the spectrum.
+    m_spectrum.assign(size, IQSample(0));
+    for (unsigned int j = 0; j < coeff.size(); j++)
+        m_spectrum[j] = coeff[j] / Sample(size);
+    m_fft.forward(m_spectrum.data());
+
+    m_hist.assign(m_order, IQSample(0));
+    m_work.resize(size);
+}
+
 
+// Process samples.
+void FftFilterIQ::process(const IQSampleVector& samples_in,
+                          IQSampleVector& samples_out)
+{
+    RTTIProfiler f("FftFilterIQ::process");
+    unsigned int n = samples_in.size();
+    samples_out.resize(n / m_downsample + 1);
+    n = process(samples_in.data(), n, samples_out.data());
     samples_out.resize(n);
+}
 
-    for (unsigned int i = 0; i < n; i++) {
-        samples_out[i] = samples_in->samples[i] * m_table[tblidx];
-        tblidx++;
-        if (tblidx == tblsiz)
-            tblidx = 0;
+
+// Process n samples.
+unsigned int FftFilterIQ::process(const IQSample *samples_in, unsigned int n,
+                                  IQSample *samples_out)
+{
+    unsigned int order = m_order;
+    unsigned int size = m_fft.size();
+    IQSample *w = m_work.data();
+
+    // Output position p, relative to the start of this block, is kept
+    // from every downsample-th input position.
+    unsigned int p = m_pos;
+    unsigned int n_out = 0;
+
+    for (unsigned int off = 0; off < n; off += m_block) {
+        unsigned int k = min(m_block, n - off);
+
+        // History followed by the new samples, zero padded.
+        copy(m_hist.begin(), m_hist.end(), w);
+        copy(samples_in + off, samples_in + off + k, w + order);
+        fill(w + order + k, w + size, IQSample(0));
+
+        // Keep the last "order" input samples as history.
+        copy(w + k, w + k + order, m_hist.begin());
+
+        m_fft.forward(w);
+        for (unsigned int i = 0; i < size; i++)
+            w[i] *= m_spectrum[i];
+        m_fft.inverse(w);
+
+        // w[order + i] is the output at input position (off + i).
+        for (; p < off + k; p += m_downsample)
+            samples_out[n_out++] = w[order + p - off];
     }
 
-    m_index = tblidx;
+    m_pos = p - n;
+    return n_out;
+}
+
+
+// Clear the filter history.
+void FftFilterIQ::reset()
+{
+    fill(m_hist.begin(), m_hist.end(), IQSample(0));
+    m_pos = 0;
+}
+
+
+/* ****************  class FftFilter  **************** */
+
+// Construct filter from its coefficients.
+FftFilter::FftFilter(const SampleVector& coeff, unsigned int downsample,
+                     SimdLevel simd)
+    : m_order(coeff.size() - 1)
+    , m_block(overlap_save_size(coeff.size()) - m_order)
+    , m_downsample(downsample)
+    , m_pos(0)
+    , m_fft(overlap_save_size(coeff.size()), simd)
+    , m_spectrum(m_fft.size() / 2 + 1)
+    , m_bins(m_fft.size() / 2 + 1)
+    , m_hist(m_order, 0)
+    , m_work(m_fft.size())
+{
+    assert(downsample >= 1);
+
+    unsigned int size = m_fft.size();
+
+    // Fold the scaling of the inverse transform into the spectrum.
+    fill(m_work.begin(), m_work.end(), 0);
+    for (unsigned int j = 0; j < coeff.size(); j++)
+        m_work[j] = coeff[j] / Sample(size);
+    m_fft.forward(m_work.data(), m_spectrum.data());
+}
+
+
+// Process n samples.
+unsigned int FftFilter::process(const Sample *samples_in, unsigned int n,
+                                Sample *samples_out)
+{
+    unsigned int order = m_order;
+    unsigned int size = m_fft.size();
+    unsigned int nbins = m_bins.size();
+    Sample *w = m_work.data();
+
+    unsigned int p = m_pos;
+    unsigned int n_out = 0;
+
+    for (unsigned int off = 0; off < n; off += m_block) {
+        unsigned int k = min(m_block, n - off);
+
+        copy(m_hist.begin(), m_hist.end(), w);
+        copy(samples_in + off, samples_in + off + k, w + order);
+        fill(w + order + k, w + size, Sample(0));
+        copy(w + k, w + k + order, m_hist.begin());
+
+        m_fft.forward(w, m_bins.data());
+        for (unsigned int i = 0; i < nbins; i++)
+            m_bins[i] *= m_spectrum[i];
+        m_fft.inverse(m_bins.data(), w);
+
+        for (; p < off + k; p += m_downsample)
+            samples_out[n_out++] = w[order + p - off];
+    }
+
+    m_pos = p - n;
+    return n_out;
+}
+
+
+// Clear the filter history.
+void FftFilter::reset()
+{
+    fill(m_hist.begin(), m_hist.end(), 0);
+    m_pos = 0;
+}
+
+
+// Return the number of taps from which FFT convolution is faster.
+unsigned int fft_filter_crossover(SimdLevel simd, unsigned int downsample,
+                                  bool real)
+{
+    // Measured with FFT lengths of 4 times the filter on one x86 machine,
+    // comparing the scalar and AVX2 kernels. The other levels are
+    // estimates: AVX-512 from the wider FIR kernels, and without a
+    // vectorized FFT kernel (scalar, SSE2, NEON) the FFT runs at about
+    // half the speed. Recheck with the FftFilterIQ stage of bench.
+    bool fast_fft = (simd == SimdLevel::AVX2 || simd == SimdLevel::AVX512);
+
+    if (real) {
+        // The integer mode of DownsampleFilter is plain C++; its cost
+        // scales with 1 / downsample.
+        return (fast_fft ? 16 : 40) * downsample;
+    }
+
+    // The decimating kernels gain less than the factor downsample over
+    // the plain kernels.
+    unsigned int taps;
+    switch (simd) {
+        case SimdLevel::Scalar: taps = 48;  break;
+        case SimdLevel::AVX512: taps = 224; break;
+        default:                taps = 160; break;
+    }
+    return taps * (2 * downsample + 1) / 3;
 }
 
 
 /* ****************  class LowPassFilterFirIQ  **************** */
 
 // Construct low-pass filter.
-LowPassFilterFirIQ::LowPassFilterFirIQ(unsigned int filter_order, double cutoff)
+LowPassFilterFirIQ::LowPassFilterFirIQ(unsigned int filter_order, double cutoff,
+                                       unsigned int downsample,
+                                       const FirDesign& design,
+                                       SimdLevel simd)
     : m_state(filter_order)
+    , m_head(2 * filter_order)
+    , m_downsample(downsample)
+    , m_pos(0)
+    , m_kernel(select_fir_iq_kernel(simd))
+    , m_decim_kernel(select_fir_iq_decim_kernel(simd))
 {
-    make_lanczos_coeff(filter_order, cutoff, m_coeff);
+    assert(downsample >= 1);
+
+    make_fir_lowpass(design, filter_order, cutoff, m_coeff);
+
+    if (filter_order + 1 >= fft_filter_crossover(simd, downsample)) {
+        m_fft.reset(new FftFilterIQ(m_coeff, downsample, simd));
+        return;
+    }
+
+    // The decimating kernel wants each coefficient twice (for I and Q).
+    if (m_downsample > 1) {
+        m_coeff2.resize(2 * m_coeff.size());
+        for (unsigned int j = 0; j < m_coeff.size(); j++) {
+            m_coeff2[2*j]   = m_coeff[j];
+            m_coeff2[2*j+1] = m_coeff[j];
+        }
+    }
 }
 
 
@@ -125,45 +433,212 @@ void LowPassFilterFirIQ::process(const IQSampleVector& samples_in,
                                  IQSampleVector& samples_out)
 {
     RTTIProfiler f("LowPassFilterFirIQ::process");
-    unsigned int order = m_state.size();
     unsigned int n = samples_in.size();
-
+    samples_out.resize(n / m_downsample + 1);
+    n = process(samples_in.data(), n, samples_out.data());
     samples_out.resize(n);
+}
+
+
+// Process n samples.
+unsigned int LowPassFilterFirIQ::process(const IQSample *samples_in,
+                                         unsigned int n,
+                                         IQSample *samples_out)
+{
+    unsigned int order = m_state.size();
+
+    if (m_fft)
+        return m_fft->process(samples_in, n, samples_out);
 
     if (n == 0)
-        return;
+        return 0;
 
     // NOTE: We use m_coeff the wrong way around because it is slightly
     // faster to scan forward through the array. The result is still correct
     // because the coefficients are symmetric.
 
     // The first few samples need data from m_state.
-    unsigned int i = 0;
-    for (; i < n && i < order; i++) {
-        IQSample y = 0;
-        for (unsigned int j = 0; j < order - i; j++)
-            y += m_state[i+j] * m_coeff[j];
-        for (unsigned int j = order - i; j <= order; j++)
-            y += samples_in[i-order+j] * m_coeff[j];
-        samples_out[i] = y;
-    }
+    // Run them from a small buffer holding m_state followed by the
+    // first samples of the new block.
+    unsigned int nhead = min(n, order);
+    copy(m_state.begin(), m_state.end(), m_head.begin());
+    copy(samples_in, samples_in + nhead, m_head.begin() + order);
 
-    // Remaining samples only need data from samples_in.
-    for (; i < n; i++) {
-        IQSample y = 0;
-        IQSampleVector::const_iterator inp = samples_in.begin() + i - order;
-        for (unsigned int j = 0; j <= order; j++)
-            y += inp[j] * m_coeff[j];
-        samples_out[i] = y;
+    unsigned int n_out;
+
+    if (m_downsample == 1) {
+
+        m_kernel(m_head.data(), m_coeff.data(), order, nhead, samples_out);
+
+        // Remaining samples only need data from samples_in.
+        if (n > order) {
+            m_kernel(samples_in, m_coeff.data(), order, n - order,
+                     samples_out + order);
+        }
+
+        n_out = n;
+
+    } else {
+
+        // Only compute output samples at positions p, p + downsample, ...
+        // The output sample at position p uses input samples
+        // (p - order) .. p of this block.
+        unsigned int p = m_pos;
+        unsigned int pstep = m_downsample;
+        unsigned int k;
+        n_out = 0;
+
+        // Output samples that need data from m_state.
+        k = (p < nhead) ? (nhead - p + pstep - 1) / pstep : 0;
+        m_decim_kernel(m_head.data() + p, m_coeff2.data(), order, k, pstep,
+                       samples_out);
+        p += k * pstep;
+        n_out += k;
+
+        // Remaining samples only need data from samples_in.
+        if (p < n) {
+            k = (n - p + pstep - 1) / pstep;
+            m_decim_kernel(samples_in + p - order, m_coeff2.data(), order, k,
+                           pstep, samples_out + n_out);
+            p += k * pstep;
+            n_out += k;
+        }
+
+        // Update index of start position in next sample block.
+        m_pos = p - n;
     }
 
     // Update m_state.
     if (n < order) {
         copy(m_state.begin() + n, m_state.end(), m_state.begin());
-        copy(samples_in.begin(), samples_in.end(), m_state.end() - n);
+        copy(samples_in, samples_in + n, m_state.end() - n);
     } else {
-        copy(samples_in.end() - order, samples_in.end(), m_state.begin());
+        copy(samples_in + n - order, samples_in + n, m_state.begin());
     }
+
+    return n_out;
+}
+
+
+// Clear the filter history.
+void LowPassFilterFirIQ::reset()
+{
+    fill(m_state.begin(), m_state.end(), IQSample(0));
+    m_pos = 0;
+    if (m_fft)
+        m_fft->reset();
+}
+
+
+/* ****************  class LowPassFilterFirS16  **************** */
+
+const unsigned int LowPassFilterFirS16::slack;
+
+// Construct 16-bit low-pass filter.
+LowPassFilterFirS16::LowPassFilterFirS16(unsigned int filter_order,
+                                         double cutoff,
+                                         unsigned int downsample,
+                                         const FirDesign& design,
+                                         SimdLevel simd)
+    : m_order(filter_order)
+    , m_downsample(downsample)
+    , m_pos(0)
+    , m_buf(2 * (filter_order + slack))
+    , m_kernel(select_fir_s16_kernel(simd))
+    , m_decim_kernel(select_fir_s16_decim_kernel(simd))
+{
+    assert(downsample >= 1);
+
+    vector<double> coeff;
+    make_fir_lowpass(design, filter_order, cutoff, coeff);
+
+    // Pad with zero taps: to an even count for the plain kernel, to a
+    // multiple of 8 for the decimating kernel.
+    unsigned int ntaps = filter_order + 1;
+    ntaps = (m_downsample == 1) ? (ntaps + 1) & ~1u : (ntaps + 7) & ~7u;
+    coeff.resize(ntaps, 0.0);
+    assert(ntaps <= filter_order + slack);
+
+    if (m_downsample == 1) {
+        m_coeff.resize(ntaps);
+        for (unsigned int j = 0; j < ntaps; j++)
+            m_coeff[j] = lrint(coeff[j] * (1 << 14));
+    } else {
+        // The decimating kernel wants (c0, c1, c0, c1, c2, c3, c2, c3)
+        // for every group of 4 taps.
+        m_coeff.resize(2 * ntaps);
+        for (unsigned int j = 0; j < ntaps; j += 4) {
+            for (unsigned int l = 0; l < 2; l++) {
+                int16_t c0 = lrint(coeff[j+2*l]   * (1 << 14));
+                int16_t c1 = lrint(coeff[j+2*l+1] * (1 << 14));
+                m_coeff[2*j+4*l]   = c0;
+                m_coeff[2*j+4*l+1] = c1;
+                m_coeff[2*j+4*l+2] = c0;
+                m_coeff[2*j+4*l+3] = c1;
+            }
+        }
+    }
+}
+
+
+// Process n samples.
+unsigned int LowPassFilterFirS16::process(const int16_t *samples_in,
+                                          unsigned int n,
+                                          IQSample *samples_out)
+{
+    // Q14 samples times Q14 coefficients.
+    const Sample scale = 1.0 / double(1 << 28);
+
+    if (n == 0)
+        return 0;
+
+    // Run the kernels over one buffer holding the last "order" samples
+    // of the previous block, this block and a few zero samples that
+    // the padded taps may read.
+    unsigned int order = m_order;
+    if (m_buf.size() < 2 * (order + n + slack)) {
+        m_buf.resize(2 * (order + n + slack));
+        if (m_downsample == 1)
+            m_scratch.resize(4 * (n + m_coeff.size()));
+    }
+    copy(samples_in, samples_in + 2 * n, m_buf.begin() + 2 * order);
+    fill(m_buf.begin() + 2 * (order + n),
+         m_buf.begin() + 2 * (order + n + slack), 0);
+
+    unsigned int n_out;
+
+    if (m_downsample == 1) {
+
+        m_kernel(m_buf.data(), m_coeff.data(), m_coeff.size(), n,
+                 scale, m_scratch.data(), samples_out);
+        n_out = n;
+
+    } else {
+
+        // The output sample at position p uses buffer samples p .. p + order.
+        unsigned int p = m_pos;
+        unsigned int pstep = m_downsample;
+        n_out = (p < n) ? (n - p + pstep - 1) / pstep : 0;
+        m_decim_kernel(m_buf.data() + 2 * p, m_coeff.data(),
+                       m_coeff.size() / 2, n_out, pstep, scale, samples_out);
+
+        // Update index of start position in next sample block.
+        m_pos = p + n_out * pstep - n;
+    }
+
+    // Keep the last "order" samples for the next block.
+    copy(m_buf.begin() + 2 * n, m_buf.begin() + 2 * (n + order),
+         m_buf.begin());
+
+    return n_out;
+}
+
+
+// Clear the filter history.
+void LowPassFilterFirS16::reset()
+{
+    fill(m_buf.begin(), m_buf.begin() + 2 * m_order, 0);
+    m_pos = 0;
 }
 
 
@@ -171,22 +646,92 @@ void LowPassFilterFirIQ::process(const IQSampleVector& samples_in,
 
 // Construct low-pass filter with optional downsampling.
 DownsampleFilter::DownsampleFilter(unsigned int filter_order, double cutoff,
-                                   double downsample, bool integer_factor)
+                                   double downsample, bool integer_factor,
+                                   unsigned int num_phases, unsigned int channels,
+                                   const FirDesign& design)
     : m_downsample(downsample)
     , m_downsample_int(integer_factor ? lrint(downsample) : 0)
+    , m_num_phases(integer_factor ? 0 : num_phases)
     , m_pos_int(0)
     , m_pos_frac(0)
     , m_state(filter_order)
+    , m_pair_kernel(select_fir_iq_decim_kernel(simd_detect()))
 {
     assert(downsample >= 1);
     assert(filter_order > 1);
+    assert(channels == 1 || m_num_phases > 0);
 
     // Force the first coefficient to zero and append an extra zero at the
     // end of the array. This ensures we can always obtain (filter_order+1)
     // coefficients by linear interpolation between adjacent array elements.
-    make_lanczos_coeff(filter_order - 1, cutoff, m_coeff);
+    make_fir_lowpass(design, filter_order - 1, cutoff, m_coeff);
     m_coeff.insert(m_coeff.begin(), 0);
     m_coeff.push_back(0);
+
+    // The integer mode uses coefficients 0 .. order, with a zero at 0.
+    if (m_downsample_int != 0 &&
+        filter_order + 1 >= fft_filter_crossover(simd_detect(),
+                                                 m_downsample_int, true)) {
+        m_fft.reset(new FftFilter(SampleVector(m_coeff.begin(), m_coeff.end() - 1),
+                                  m_downsample_int));
+    }
+
+    if (m_num_phases > 0) {
+
+        // Precompute the interpolated coefficients for each phase.
+        // Phase p corresponds to fractional position p / num_phases;
+        // we store (num_phases + 1) phases so that rounding up to the
+        // next whole sample still finds a valid phase.
+        //
+        // Each phase is stored in reverse order so that the filter can
+        // scan forward through the input history:
+        //   m_bank[p*(order+1) + t] = interpolated coeff[order - t]
+        unsigned int ntaps = filter_order + 1;
+        m_bank.resize((m_num_phases + 1) * ntaps);
+        if (design.method == FirDesignMethod::Kaiser) {
+            // Design the prototype at num_phases times the input rate
+            // instead. Linear interpolation between the coefficients
+            // suppresses the images of a tone at frequency f (relative to
+            // the input rate) by only about f^2, 52 dB at f = 0.05; the
+            // prototype rejects them by the full design.atten. Sample k
+            // of the prototype sits at position k / num_phases of the
+            // interpolated table.
+            unsigned int np = m_num_phases;
+            FirDesign proto_design(design);
+            proto_design.transition = design.transition / np;
+            vector<double> proto;
+            make_fir_lowpass(proto_design, np * ntaps, cutoff / np, proto);
+            for (unsigned int p = 0; p <= np; p++) {
+                for (unsigned int t = 0; t < ntaps; t++) {
+                    unsigned int j = filter_order - t;
+                    m_bank[p * ntaps + t] = np * proto[j * np + p];
+                }
+            }
+        } else {
+            for (unsigned int p = 0; p <= m_num_phases; p++) {
+                double k1 = double(p) / double(m_num_phases);
+                double k0 = 1 - k1;
+                for (unsigned int t = 0; t < ntaps; t++) {
+                    unsigned int j = filter_order - t;
+                    m_bank[p * ntaps + t] = m_coeff[j] * k0 + m_coeff[j+1] * k1;
+                }
+            }
+        }
+
+        // The history of the previous block lives at the start of m_buf,
+        // directly followed by the new input samples.
+        m_buf.assign(filter_order, 0);
+
+        if (channels == 2) {
+            // Store each coefficient twice, for the two lanes of a pair.
+            SampleVector bank2(2 * m_bank.size());
+            for (unsigned int k = 0; k < m_bank.size(); k++)
+                bank2[2*k] = bank2[2*k+1] = m_bank[k];
+            m_bank.swap(bank2);
+            m_buf.clear();
+            m_pairbuf.assign(filter_order, 0);
+        }
+    }
 }
 
 
@@ -198,6 +743,18 @@ void DownsampleFilter::process(const SampleVector& samples_in,
     unsigned int order = m_state.size();
     unsigned int n = samples_in.size();
 
+    if (m_num_phases > 0) {
+        process_polyphase(samples_in, samples_out);
+        return;
+    }
+
+    if (m_fft) {
+        samples_out.resize(n / m_downsample_int + 1);
+        samples_out.resize(m_fft->process(samples_in.data(), n,
+                                          samples_out.data()));
+        return;
+    }
+
     if (m_downsample_int != 0) {
 
         // Integer downsample factor, no linear interpolation.
@@ -287,6 +844,380 @@ void DownsampleFilter::process(const SampleVector& samples_in,
 }
 
 
+// Process samples through the polyphase filter bank.
+void DownsampleFilter::process_polyphase(const SampleVector& samples_in,
+                                         SampleVector& samples_out)
+{
+    unsigned int order = m_state.size();
+    unsigned int ntaps = order + 1;
+    unsigned int n = samples_in.size();
+
+    // Append the new samples to the history. Input sample x[k] of this
+    // block is found at m_buf[order + k], so the taps for an output
+    // sample at integer position pi are m_buf[pi .. pi+order].
+    m_buf.resize(order + n);
+    copy(samples_in.begin(), samples_in.end(), m_buf.begin() + order);
+
+    // Estimate number of output samples we can produce in this run.
+    Sample p = m_pos_frac;
+    Sample pstep = m_downsample;
+    unsigned int n_out = int(2 + n / pstep);
+
+    samples_out.resize(n_out);
+
+    // Produce output samples.
+    unsigned int i = 0;
+    Sample pf = p;
+    unsigned int pi = int(pf);
+    while (pi < n) {
+        unsigned int phase = lrint((pf - pi) * m_num_phases);
+        const Sample *h = m_bank.data() + phase * ntaps;
+        const Sample *x = m_buf.data() + pi;
+
+        // Four partial sums to shorten the dependency chain.
+        Sample y0 = 0, y1 = 0, y2 = 0, y3 = 0;
+        unsigned int t = 0;
+        for (; t + 4 <= ntaps; t += 4) {
+            y0 += h[t]   * x[t];
+            y1 += h[t+1] * x[t+1];
+            y2 += h[t+2] * x[t+2];
+            y3 += h[t+3] * x[t+3];
+        }
+        for (; t < ntaps; t++)
+            y0 += h[t] * x[t];
+        samples_out[i] = (y0 + y1) + (y2 + y3);
+
+        i++;
+        pf = p + i * pstep;
+        pi = int(pf);
+    }
+
+    // We may overestimate the number of samples by 1 or 2.
+    assert(i <= n_out && i + 2 >= n_out);
+    samples_out.resize(i);
+
+    // Update fractional index of start position in text sample block.
+    // Limit to 0 to avoid catastrophic results of rounding errors.
+    m_pos_frac = pf - n;
+    if (m_pos_frac < 0)
+        m_pos_frac = 0;
+
+    // Keep the last "order" samples as history for the next block.
+    copy(m_buf.end() - order, m_buf.end(), m_buf.begin());
+    m_buf.resize(order);
+}
+
+
+// Process pairs of samples through the polyphase filter bank.
+void DownsampleFilter::process(const IQSampleVector& samples_in,
+                               IQSampleVector& samples_out)
+{
+    RTTIProfiler f3("DownsampleFilter::process");
+    unsigned int order = m_state.size();
+    unsigned int ntaps = order + 1;
+    unsigned int n = samples_in.size();
+
+    assert(m_pairbuf.size() == order);
+
+    // Same as process_polyphase(), with one kernel call per output pair.
+    m_pairbuf.resize(order + n);
+    copy(samples_in.begin(), samples_in.end(), m_pairbuf.begin() + order);
+
+    Sample p = m_pos_frac;
+    Sample pstep = m_downsample;
+    unsigned int n_out = int(2 + n / pstep);
+
+    samples_out.resize(n_out);
+
+    unsigned int i = 0;
+    Sample pf = p;
+    unsigned int pi = int(pf);
+    while (pi < n) {
+        unsigned int phase = lrint((pf - pi) * m_num_phases);
+        m_pair_kernel(m_pairbuf.data() + pi, m_bank.data() + 2 * phase * ntaps,
+                      order, 1, 1, samples_out.data() + i);
+        i++;
+        pf = p + i * pstep;
+        pi = int(pf);
+    }
+
+    assert(i <= n_out && i + 2 >= n_out);
+    samples_out.resize(i);
+
+    m_pos_frac = pf - n;
+    if (m_pos_frac < 0)
+        m_pos_frac = 0;
+
+    copy(m_pairbuf.end() - order, m_pairbuf.end(), m_pairbuf.begin());
+    m_pairbuf.resize(order);
+}
+
+
+// Clear the filter history.
+void DownsampleFilter::reset()
+{
+    fill(m_state.begin(), m_state.end(), 0);
+    fill(m_buf.begin(), m_buf.end(), 0);
+    fill(m_pairbuf.begin(), m_pairbuf.end(), IQSample(0));
+    m_pos_int = 0;
+    m_pos_frac = 0;
+    if (m_fft)
+        m_fft->reset();
+}
+
+
+/* ****************  class HalfbandDecimator  **************** */
+
+// Construct halfband decimator.
+HalfbandDecimator::HalfbandDecimator(unsigned int filter_order,
+                                     unsigned int channels,
+                                     const FirDesign& design)
+    : m_order(filter_order)
+    , m_pos(0)
+{
+    assert(filter_order % 4 == 2);
+
+    // A windowed sinc with cutoff 0.25 has zeros at every even distance
+    // from the center, which is at odd index (order / 2). The passband
+    // ripple of a halfband filter mirrors the stopband, so the Kaiser
+    // window is designed for equal deviation in both bands.
+    SampleVector coeff;
+    if (design.method == FirDesignMethod::Lanczos) {
+        make_fir_lowpass(design, filter_order, 0.25, coeff);
+    } else {
+        double dev = pow(10.0, -design.atten / 20);
+        double ripple = 20 * log10((1 + dev) / (1 - dev));
+        FirDesign kaiser(FirDesignMethod::Kaiser, 0, ripple, design.atten);
+        make_fir_lowpass(kaiser, filter_order, 0.25, coeff);
+    }
+    for (unsigned int t = 0; t < filter_order / 2; t += 2)
+        m_coeff.push_back(coeff[t]);
+    m_center = coeff[filter_order / 2];
+
+    if (channels == 2)
+        m_pairbuf.assign(filter_order, 0);
+    else
+        m_buf.assign(filter_order, 0);
+}
+
+
+// Process samples or pairs of samples with the history in "buf".
+template <class T>
+void HalfbandDecimator::process(const vector<T>& samples_in,
+                                vector<T>& samples_out, vector<T>& buf)
+{
+    unsigned int order = m_order;
+    unsigned int ntaps = m_coeff.size();
+    unsigned int n = samples_in.size();
+
+    assert(buf.size() == order);
+
+    // Append the new samples to the history. The taps for the output
+    // sample at position p are buf[p .. p+order].
+    buf.resize(order + n);
+    copy(samples_in.begin(), samples_in.end(), buf.begin() + order);
+
+    samples_out.resize(n > m_pos ? (n - m_pos + 1) / 2 : 0);
+
+    unsigned int p = m_pos;
+    for (unsigned int i = 0; i < samples_out.size(); i++, p += 2) {
+        const T *x = buf.data() + p;
+        T y = m_center * x[order / 2];
+        for (unsigned int k = 0; k < ntaps; k++)
+            y += m_coeff[k] * (x[2*k] + x[order-2*k]);
+        samples_out[i] = y;
+    }
+
+    // Keep the last "order" samples as history for the next block.
+    m_pos = p - n;
+    copy(buf.end() - order, buf.end(), buf.begin());
+    buf.resize(order);
+}
+
+
+// Process samples.
+void HalfbandDecimator::process(const SampleVector& samples_in,
+                                SampleVector& samples_out)
+{
+    process(samples_in, samples_out, m_buf);
+}
+
+
+// Process pairs of samples.
+void HalfbandDecimator::process(const IQSampleVector& samples_in,
+                                IQSampleVector& samples_out)
+{
+    process(samples_in, samples_out, m_pairbuf);
+}
+
+
+// Clear the filter history.
+void HalfbandDecimator::reset()
+{
+    fill(m_buf.begin(), m_buf.end(), 0);
+    fill(m_pairbuf.begin(), m_pairbuf.end(), IQSample(0));
+    m_pos = 0;
+}
+
+
+/* ****************  class MultistageDownsampleFilter  **************** */
+
+// Return the number of halfband stages for the specified filter.
+unsigned int MultistageDownsampleFilter::halfband_stages(double cutoff,
+                                                         double downsample,
+                                                         unsigned int max_stages,
+                                                         const FirDesign& design)
+{
+    // The final stage is sized from the transition width, so without one
+    // the filter runs as a single stage.
+    if (design.transition <= 0)
+        return 0;
+
+    // A stage needs its passband below 0.15 of its input rate, so that the
+    // short halfband filter has a wide transition band, and must not
+    // decimate below the output rate.
+    unsigned int stages = 0;
+    while (stages < max_stages && cutoff <= 0.15 && downsample >= 2) {
+        cutoff *= 2;
+        downsample /= 2;
+        stages++;
+    }
+    return stages;
+}
+
+
+// Return the design of the halfband stages.
+FirDesign MultistageDownsampleFilter::halfband_design(const FirDesign& design)
+{
+    // A Lanczos halfband filter levels off at 55 to 75 dB of alias
+    // rejection, well below the single stage filter it replaces. With
+    // Lanczos, the stages therefore use a Kaiser window for 100 dB, which
+    // is also shorter.
+    if (design.method == FirDesignMethod::Lanczos)
+        return FirDesign(FirDesignMethod::Kaiser, 0, 0.1, 100);
+    return design;
+}
+
+
+// Return the design of the final stage.
+FirDesign MultistageDownsampleFilter::final_design(const FirDesign& design,
+                                                   unsigned int stages)
+{
+    if (stages == 0)
+        return design;
+
+    // The final stage runs at a few times the output rate, where the
+    // images of the passband around the stage input rate fold back into
+    // the audio band. A Kaiser design gets a polyphase bank designed at
+    // the phase rate (see DownsampleFilter) that rejects them as well as
+    // the halfband stages reject their aliases. The transition band
+    // keeps its width in Hz, so it gets wider relative to the reduced
+    // sample rate.
+    return FirDesign(FirDesignMethod::Kaiser,
+                     ldexp(design.transition, stages),
+                     design.ripple, halfband_design(design).atten);
+}
+
+
+// Return the order of the final stage.
+unsigned int MultistageDownsampleFilter::final_order(unsigned int filter_order,
+                                                     double cutoff,
+                                                     unsigned int stages,
+                                                     const FirDesign& design)
+{
+    FirDesign last_design(final_design(design, stages));
+    if (last_design.method == FirDesignMethod::Lanczos)
+        return max(2u, filter_order);
+
+    // DownsampleFilter designs one order less than it is given and pads
+    // the coefficients with a zero.
+    return fir_lowpass_order(last_design, ldexp(cutoff, stages)) + 1;
+}
+
+
+// Construct multistage downsampling filter.
+MultistageDownsampleFilter::MultistageDownsampleFilter(unsigned int filter_order,
+                                                       double cutoff,
+                                                       double downsample,
+                                                       unsigned int num_phases,
+                                                       unsigned int max_stages,
+                                                       unsigned int channels,
+                                                       const FirDesign& design)
+    : m_stages(halfband_stages(cutoff, downsample, max_stages, design))
+    , m_buf(channels == 1 ? m_stages : 0)
+    , m_pairbuf(channels == 2 ? m_stages : 0)
+    , m_final(final_order(filter_order, cutoff, m_stages, design),
+              ldexp(cutoff, m_stages),
+              ldexp(downsample, -int(m_stages)),
+              false,
+              num_phases << m_stages,   // same time resolution as one stage
+              channels,
+              final_design(design, m_stages))
+{
+    FirDesign stage_design(halfband_design(design));
+    for (unsigned int s = 0; s < m_stages; s++) {
+        // Transition band from the passband edge to its alias.
+        double width = 0.5 - 2 * ldexp(cutoff, s);
+        unsigned int order = kaiser_halfband_order(width, stage_design.atten);
+        m_halfband.push_back(HalfbandDecimator(order, channels, stage_design));
+    }
+}
+
+
+// Process samples.
+void MultistageDownsampleFilter::process(const SampleVector& samples_in,
+                                         SampleVector& samples_out)
+{
+    RTTIProfiler f3("MultistageDownsampleFilter::process");
+    const SampleVector *in = &samples_in;
+    for (unsigned int s = 0; s < m_halfband.size(); s++) {
+        m_halfband[s].process(*in, m_buf[s]);
+        in = &m_buf[s];
+    }
+    m_final.process(*in, samples_out);
+}
+
+
+// Process two signals of equal length.
+void MultistageDownsampleFilter::process(const SampleVector& samples_in0,
+                                         const SampleVector& samples_in1,
+                                         SampleVector& samples_out0,
+                                         SampleVector& samples_out1)
+{
+    RTTIProfiler f3("MultistageDownsampleFilter::process");
+    unsigned int n = samples_in0.size();
+    assert(samples_in1.size() == n);
+
+    m_pairs_in.resize(n);
+    for (unsigned int i = 0; i < n; i++)
+        m_pairs_in[i] = IQSample(samples_in0[i], samples_in1[i]);
+
+    const IQSampleVector *in = &m_pairs_in;
+    for (unsigned int s = 0; s < m_halfband.size(); s++) {
+        m_halfband[s].process(*in, m_pairbuf[s]);
+        in = &m_pairbuf[s];
+    }
+    m_final.process(*in, m_pairs_out);
+
+    unsigned int n_out = m_pairs_out.size();
+    samples_out0.resize(n_out);
+    samples_out1.resize(n_out);
+    for (unsigned int i = 0; i < n_out; i++) {
+        samples_out0[i] = m_pairs_out[i].real();
+        samples_out1[i] = m_pairs_out[i].imag();
+    }
+}
+
+
+// Clear the filter history.
+void MultistageDownsampleFilter::reset()
+{
+    for (HalfbandDecimator& h : m_halfband)
+        h.reset();
+    m_final.reset();
+}
+
+
 /* ****************  class LowPassFilterRC  **************** */
 
 // Construct 1st order low-pass IIR filter.
@@ -533,4 +1464,51 @@ void HighPassFilterIir::process_inplace(SampleVector& samples)
     }
 }
 
+
+/* ****************  class DriftResampler  **************** */
+
+// Construct resampler.
+DriftResampler::DriftResampler(unsigned int channels)
+    : m_channels(channels)
+    , m_step(1.0)
+    , m_pos(0)
+    , m_last(channels, 0)
+{ }
+
+
+// Process samples.
+void DriftResampler::process(const SampleVector& samples_in,
+                             SampleVector& samples_out)
+{
+    const unsigned int ch = m_channels;
+    const int nin = samples_in.size() / ch;
+
+    // Output frame k lies at input position m_pos + k * m_step; frame -1
+    // is the last frame of the previous block.
+    unsigned int nmax = 0;
+    if (m_pos < nin - 1) {
+        nmax = (unsigned int)((nin - 1 - m_pos) / m_step) + 2;
+    }
+    samples_out.resize(nmax * ch);
+
+    double pos = m_pos;
+    unsigned int k = 0;
+    for (; pos < nin - 1; k++) {
+        int i = (int)floor(pos);
+        Sample f = pos - i;
+        const Sample *a = (i < 0) ? m_last.data() : &samples_in[i * ch];
+        const Sample *b = &samples_in[(i + 1) * ch];
+        for (unsigned int c = 0; c < ch; c++) {
+            samples_out[k * ch + c] = a[c] + f * (b[c] - a[c]);
+        }
+        pos += m_step;
+    }
+    samples_out.resize(k * ch);
+
+    if (nin > 0) {
+        m_pos = pos - nin;
+        copy(samples_in.end() - ch, samples_in.end(), m_last.begin());
+    }
+}
+
 /* end */
@@ -1,8 +1,12 @@
 #ifndef SOFTFM_FILTER_H
 #define SOFTFM_FILTER_H
 
+#include <memory>
 #include <vector>
 #include "SoftFM.h"
+#include "SimdKernels.h"
+#include "FilterDesign.h"
+#include "Fft.h"
 
 class SampleBufferBlock;
 
@@ -26,13 +30,257 @@ public:
     void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
     void Process(const SampleBufferBlock* samples_in, IQSampleVector& samples_out);
 
+    /** Process n samples from samples_in into samples_out. */
+    void process(const IQSample *samples_in, unsigned int n,
+                 IQSample *samples_out);
+
 private:
     unsigned int    m_index;
     IQSampleVector  m_table;
 };
 
 
-/** Low-pass filter for IQ samples, based on Lanczos FIR filter. */
+/**
+ *  Fine tuner based on a numerically controlled oscillator.
+ *
+ *  Unlike FineTuner, the frequency shift is not rounded to a table step.
+ *  The oscillator is generated by a recursive complex rotator and is
+ *  periodically re-seeded from a double precision phase accumulator,
+ *  so amplitude and phase errors of the rotator cannot build up.
+ */
+class NcoTuner
+{
+public:
+
+    /**
+     * Construct NCO fine tuner.
+     *
+     * freq_shift :: Frequency shift relative to the sample rate
+     *               (valid range -0.5 .. 0.5).
+     * simd       :: Instruction set for the rotation kernel
+     *               (default: best level supported by the CPU).
+     */
+    NcoTuner(double freq_shift, SimdLevel simd=simd_detect());
+
+    /** Process samples. */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+    void Process(const SampleBufferBlock* samples_in, IQSampleVector& samples_out);
+
+    /** Process n samples from samples_in into samples_out. */
+    void process(const IQSample *samples_in, unsigned int n,
+                 IQSample *samples_out);
+
+    /**
+     * Advance the oscillator over n samples that were lost in a gap of
+     * the input, so it stays in phase with the sample stream.
+     */
+    void skip(std::uint64_t n);
+
+private:
+    /** Number of samples between re-seeding the rotator. */
+    static const unsigned int renormalize_interval = 1024;
+
+    double      m_phase_step;
+    double      m_phase;
+    IQSample    m_step;
+    IQSample    m_phasors[nco_lanes];
+    NcoKernel   m_kernel;
+};
+
+
+/**
+ *  Fine tuner for raw 8-bit receiver samples with 16-bit fixed-point output.
+ *
+ *  Works like FineTuner, but takes unsigned 8-bit I/Q pairs straight from
+ *  the receiver and produces Q14 int16 I/Q pairs (1 << 14 is full scale),
+ *  so the IF filter can run on integers as well. The oscillator table is
+ *  stored as int16 pairs for pmaddwd.
+ */
+class FineTunerU8
+{
+public:
+
+    /**
+     * Construct fine tuner.
+     *
+     * table_size :: Size of internal sin/cos tables, determines the resolution
+     *               of the frequency shift.
+     * freq_shift :: Frequency shift. Signal frequency will be shifted by
+     *               (sample_rate * freq_shift / table_size).
+     * simd       :: Instruction set for the tuner kernel
+     *               (default: best level supported by the CPU).
+     */
+    FineTunerU8(unsigned int table_size, int freq_shift,
+                SimdLevel simd=simd_detect());
+
+    /** Process n samples (2 * n bytes) into 2 * n int16 values. */
+    void process(const std::uint8_t *samples_in, unsigned int n,
+                 std::int16_t *samples_out);
+
+private:
+    unsigned int                m_index;
+    std::vector<std::int16_t>   m_table_a;
+    std::vector<std::int16_t>   m_table_b;
+    TunerU8Kernel               m_kernel;
+};
+
+
+/**
+ *  FIR filter for IQ samples by FFT fast convolution (overlap-save).
+ *
+ *  Drop-in replacement for LowPassFilterFirIQ with the same response,
+ *  decimation and interface. Each block of input is transformed together
+ *  with the last filter_order samples of history, multiplied by the
+ *  spectrum of the filter and transformed back; the first filter_order
+ *  outputs wrap around and are dropped. The FFT is about 4 times as long
+ *  as the filter, so the cost per sample grows with log(taps) instead of
+ *  taps. All output samples are computed before decimating.
+ *
+ *  There is no extra latency: a short input block is zero padded.
+ */
+class FftFilterIQ
+{
+public:
+
+    /**
+     * Construct low-pass filter.
+     *
+     * filter_order :: FIR filter order.
+     * cutoff       :: Cutoff frequency relative to the full sample rate
+     *                 (valid range 0.0 ... 0.5).
+     * downsample   :: Integer decimation factor (>= 1) or 1 to disable.
+     * design       :: Filter design, as for LowPassFilterFirIQ.
+     * simd         :: Instruction set for the FFT
+     *                 (default: best level supported by the CPU).
+     */
+    FftFilterIQ(unsigned int filter_order, double cutoff,
+                unsigned int downsample=1,
+                const FirDesign& design=FirDesign(),
+                SimdLevel simd=simd_detect());
+
+    /**
+     * Construct filter from its coefficients.
+     *
+     * coeff        :: (filter_order + 1) coefficients; the output at
+     *                 position p is sum(coeff[j] * input[p - j]).
+     * downsample   :: Integer decimation factor (>= 1) or 1 to disable.
+     * simd         :: Instruction set for the FFT.
+     */
+    explicit FftFilterIQ(const std::vector<IQSample::value_type>& coeff,
+                         unsigned int downsample=1,
+                         SimdLevel simd=simd_detect());
+
+    /** Process samples. */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+
+    /**
+     * Process n samples from samples_in into samples_out.
+     * The output buffer must not overlap the input buffer and must have
+     * room for (n / downsample + 1) samples.
+     *
+     * Return the number of output samples.
+     */
+    unsigned int process(const IQSample *samples_in, unsigned int n,
+                         IQSample *samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+    /** Return the number of input samples per FFT. */
+    unsigned int block_length() const
+    {
+        return m_block;
+    }
+
+private:
+    /** Set the filter spectrum from the coefficients. */
+    void init(const std::vector<IQSample::value_type>& coeff);
+
+    unsigned int    m_order;
+    unsigned int    m_block;
+    unsigned int    m_downsample;
+    unsigned int    m_pos;
+    Fft             m_fft;
+    IQSampleVector  m_spectrum;     // filter spectrum divided by FFT size
+    IQSampleVector  m_hist;
+    IQSampleVector  m_work;
+};
+
+
+/**
+ *  FIR filter for real-valued signals by FFT fast convolution.
+ *
+ *  Same overlap-save scheme as FftFilterIQ, with a real FFT.
+ */
+class FftFilter
+{
+public:
+
+    /**
+     * Construct filter from its coefficients.
+     *
+     * coeff        :: (filter_order + 1) coefficients; the output at
+     *                 position p is sum(coeff[j] * input[p - j]).
+     * downsample   :: Integer decimation factor (>= 1) or 1 to disable.
+     * simd         :: Instruction set for the FFT
+     *                 (default: best level supported by the CPU).
+     */
+    explicit FftFilter(const SampleVector& coeff, unsigned int downsample=1,
+                       SimdLevel simd=simd_detect());
+
+    /**
+     * Process n samples from samples_in into samples_out.
+     * The output buffer must have room for (n / downsample + 1) samples.
+     *
+     * Return the number of output samples.
+     */
+    unsigned int process(const Sample *samples_in, unsigned int n,
+                         Sample *samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+    /** Return the number of input samples per FFT. */
+    unsigned int block_length() const
+    {
+        return m_block;
+    }
+
+private:
+    unsigned int    m_order;
+    unsigned int    m_block;
+    unsigned int    m_downsample;
+    unsigned int    m_pos;
+    RealFft         m_fft;
+    IQSampleVector  m_spectrum;     // filter spectrum divided by FFT size
+    IQSampleVector  m_bins;
+    SampleVector    m_hist;
+    SampleVector    m_work;
+};
+
+
+/**
+ * Return the number of taps from which FFT convolution is faster than a
+ * direct form filter: LowPassFilterFirIQ with the kernels of the given
+ * instruction set, or the integer mode of DownsampleFilter (real = true).
+ * A decimating direct form filter only computes every Nth output, so the
+ * crossover grows with the decimation factor.
+ */
+unsigned int fft_filter_crossover(SimdLevel simd, unsigned int downsample=1,
+                                  bool real=false);
+
+
+/**
+ *  Low-pass filter for IQ samples, based on FIR filter.
+ *
+ *  Step 1: Low-pass FIR filter (Lanczos by default, see FirDesign)
+ *  Step 2: (optional) Decimation by an integer factor; only the output
+ *          samples that are kept are actually computed.
+ *
+ *  The filter runs a vectorized kernel (SSE2, AVX2, AVX-512 or NEON)
+ *  when the CPU supports it, and a portable scalar kernel otherwise.
+ *  Filters longer than fft_filter_crossover() taps run as FftFilterIQ.
+ */
 class LowPassFilterFirIQ
 {
 public:
@@ -43,23 +291,129 @@ public:
      * filter_order :: FIR filter order.
      * cutoff       :: Cutoff frequency relative to the full sample rate
      *                 (valid range 0.0 ... 0.5).
+     * downsample   :: Integer decimation factor (>= 1) or 1 to disable.
+     * design       :: Filter design (see make_fir_lowpass); the order
+     *                 is given, fir_lowpass_order finds one that meets
+     *                 the quality target.
+     * simd         :: Instruction set for the filter kernel
+     *                 (default: best level supported by the CPU).
      */
-    LowPassFilterFirIQ(unsigned int filter_order, double cutoff);
+    LowPassFilterFirIQ(unsigned int filter_order, double cutoff,
+                       unsigned int downsample=1,
+                       const FirDesign& design=FirDesign(),
+                       SimdLevel simd=simd_detect());
 
     /** Process samples. */
     void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
 
+    /**
+     * Process n samples from samples_in into samples_out.
+     * The output buffer must not overlap the input buffer and must have
+     * room for (n / downsample + 1) samples.
+     *
+     * Return the number of output samples.
+     */
+    unsigned int process(const IQSample *samples_in, unsigned int n,
+                         IQSample *samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+    /**
+     * Return the number of input samples per FFT, or 0 if the filter
+     * runs in direct form. Blocks of a multiple of this length avoid
+     * zero padding.
+     */
+    unsigned int fft_block_length() const
+    {
+        return m_fft ? m_fft->block_length() : 0;
+    }
+
 private:
     std::vector<IQSample::value_type> m_coeff;
+    std::vector<IQSample::value_type> m_coeff2;
     IQSampleVector  m_state;
+    IQSampleVector  m_head;
+    unsigned int    m_downsample;
+    unsigned int    m_pos;
+    FirIQKernel     m_kernel;
+    FirIQDecimKernel m_decim_kernel;
+    std::unique_ptr<FftFilterIQ> m_fft;
+};
+
+
+/**
+ *  Low-pass filter for 16-bit fixed-point IQ samples, with float output.
+ *
+ *  Same response and decimation as LowPassFilterFirIQ, but the
+ *  coefficients are rounded to Q14 and the products are summed in 32-bit
+ *  integers (pmaddwd on x86). The input is Q14 as produced by FineTunerU8;
+ *  the output is scaled back to float, where 1.0 is full scale.
+ */
+class LowPassFilterFirS16
+{
+public:
+
+    /**
+     * Construct low-pass filter.
+     *
+     * filter_order :: FIR filter order.
+     * cutoff       :: Cutoff frequency relative to the full sample rate
+     *                 (valid range 0.0 ... 0.5).
+     * downsample   :: Integer decimation factor (>= 1) or 1 to disable.
+     * design       :: Filter design method, as for LowPassFilterFirIQ.
+     * simd         :: Instruction set for the filter kernel
+     *                 (default: best level supported by the CPU).
+     */
+    LowPassFilterFirS16(unsigned int filter_order, double cutoff,
+                        unsigned int downsample=1,
+                        const FirDesign& design=FirDesign(),
+                        SimdLevel simd=simd_detect());
+
+    /**
+     * Process n samples (2 * n int16 values) into samples_out.
+     * The output buffer must have room for (n / downsample + 1) samples.
+     *
+     * Return the number of output samples.
+     */
+    unsigned int process(const std::int16_t *samples_in, unsigned int n,
+                         IQSample *samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+private:
+    /** Samples after the end of the input that the kernels may read. */
+    static const unsigned int slack = 8;
+
+    unsigned int    m_order;
+    unsigned int    m_downsample;
+    unsigned int    m_pos;
+    std::vector<std::int16_t> m_coeff;
+    std::vector<std::int16_t> m_buf;
+    std::vector<std::int16_t> m_scratch;
+    FirS16Kernel        m_kernel;
+    FirS16DecimKernel   m_decim_kernel;
 };
 
 
 /**
  *  Downsampler with low-pass FIR filter for real-valued signals.
  *
- *  Step 1: Low-pass filter based on Lanczos FIR filter
+ *  Step 1: Low-pass FIR filter (Lanczos by default, see FirDesign)
  *  Step 2: (optional) Decimation by an arbitrary factor (integer or float)
+ *
+ *  Fractional decimation either interpolates the FIR coefficients for
+ *  every output sample, or picks the nearest phase from a precomputed
+ *  polyphase filter bank. With a Kaiser design the bank is designed at
+ *  the phase rate; otherwise its phases are interpolated from the FIR
+ *  coefficients as well. Integer decimation with a filter longer than
+ *  fft_filter_crossover() taps runs as FftFilter.
+ *
+ *  In the polyphase mode the filter can also run on two channels at
+ *  once, packed as the real and imaginary parts of IQSample. Both channels
+ *  share the coefficients and the timing; the FIR IQ kernel works on the
+ *  pairs as it does on I and Q.
  */
 class DownsampleFilter
 {
@@ -74,22 +428,194 @@ public:
      * downsample   :: Decimation factor (>= 1) or 1 to disable
      * integer_factor :: Enables a faster and more precise algorithm that
      *                   only works for integer downsample factors.
+     * num_phases   :: Number of phases in the polyphase filter bank used
+     *                 for fractional downsampling, or 0 to interpolate
+     *                 coefficients for every output sample.
+     *                 Ignored if integer_factor is true.
+     * channels     :: 1, or 2 for pairs of samples (needs num_phases > 0
+     *                 and integer_factor false).
+     * design       :: Filter design, as for LowPassFilterFirIQ.
      *
      * The output sample rate is (input_sample_rate / downsample)
      */
     DownsampleFilter(unsigned int filter_order, double cutoff,
-                     double downsample=1, bool integer_factor=true);
+                     double downsample=1, bool integer_factor=true,
+                     unsigned int num_phases=0, unsigned int channels=1,
+                     const FirDesign& design=FirDesign());
 
     /** Process samples. */
     void process(const SampleVector& samples_in, SampleVector& samples_out);
 
+    /** Process pairs of samples (2 channels). */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
 private:
+    /** Process samples through the polyphase filter bank. */
+    void process_polyphase(const SampleVector& samples_in,
+                           SampleVector& samples_out);
+
     double          m_downsample;
     unsigned int    m_downsample_int;
+    unsigned int    m_num_phases;
     unsigned int    m_pos_int;
     Sample          m_pos_frac;
     SampleVector    m_coeff;
     SampleVector    m_state;
+    SampleVector    m_bank;
+    SampleVector    m_buf;
+    IQSampleVector  m_pairbuf;
+    FirIQDecimKernel m_pair_kernel;
+    std::unique_ptr<FftFilter> m_fft;
+};
+
+
+/**
+ *  Low-pass filter with downsampling by 2.
+ *
+ *  Halfband FIR filter with cutoff at a quarter of the input sample
+ *  rate, Lanczos or Kaiser windowed. Every other coefficient except the
+ *  center one is zero, and the coefficients are symmetric. Each output
+ *  sample therefore costs (filter_order + 6) / 4 multiplications per
+ *  channel.
+ */
+class HalfbandDecimator
+{
+public:
+
+    /**
+     * Construct halfband decimator.
+     *
+     * filter_order :: FIR filter order, of the form (4 * m + 2).
+     * channels     :: 1, or 2 for pairs of samples.
+     * design       :: Lanczos, or otherwise a Kaiser window for
+     *                 design.atten (see kaiser_halfband_order). An
+     *                 equiripple design would not keep the zero taps.
+     */
+    explicit HalfbandDecimator(unsigned int filter_order,
+                               unsigned int channels=1,
+                               const FirDesign& design=FirDesign());
+
+    /** Process samples. */
+    void process(const SampleVector& samples_in, SampleVector& samples_out);
+
+    /** Process pairs of samples (2 channels). */
+    void process(const IQSampleVector& samples_in, IQSampleVector& samples_out);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+private:
+    template <class T>
+    void process(const std::vector<T>& samples_in, std::vector<T>& samples_out,
+                 std::vector<T>& buf);
+
+    unsigned int    m_order;
+    unsigned int    m_pos;
+    SampleVector    m_coeff;    // nonzero coefficients left of the center
+    Sample          m_center;
+    SampleVector    m_buf;
+    IQSampleVector  m_pairbuf;
+};
+
+
+/**
+ *  Low-pass filter with fractional downsampling in several stages.
+ *
+ *  Works like the polyphase mode of DownsampleFilter, but first halves
+ *  the sample rate with HalfbandDecimator stages for as long as the
+ *  passband stays below 0.15 of the stage input rate. The final
+ *  DownsampleFilter then runs at the reduced rate with a proportionally
+ *  shorter filter and the same transition width in Hz. Its polyphase
+ *  bank is designed at the phase rate, so the images of the passband
+ *  around the reduced rate, which fold back into the passband at the
+ *  output rate, get the same rejection as the aliases of the halfband
+ *  stages.
+ *
+ *  With two channels, both signals pass the stages as pairs of samples
+ *  through one chain, so they always have the same timing.
+ */
+class MultistageDownsampleFilter
+{
+public:
+
+    /**
+     * Construct multistage downsampling filter.
+     *
+     * filter_order :: FIR filter order of an equivalent single stage
+     *                 filter at the input sample rate
+     * cutoff       :: Cutoff frequency relative to the full input sample rate
+     * downsample   :: Decimation factor (>= 1, need not be an integer)
+     * num_phases   :: Number of phases in the polyphase filter bank
+     *                 of a single stage filter. The final stage after
+     *                 s halfband stages gets (num_phases << s) phases,
+     *                 which keeps the time resolution.
+     * max_stages   :: Maximum number of halfband stages;
+     *                 0 gives a single DownsampleFilter.
+     * channels     :: 1, or 2 to filter two signals together.
+     * design       :: Filter design method and quality target, where
+     *                 design.transition is the transition width of the
+     *                 final filter relative to the input sample rate.
+     *                 Without halfband stages, this is the design of the
+     *                 single DownsampleFilter (of order filter_order with
+     *                 Lanczos). Otherwise every stage is a Kaiser design
+     *                 sized to reach design.atten, or 100 dB with
+     *                 Lanczos, and filter_order is ignored. A design
+     *                 without a transition width gives a single stage.
+     *
+     * The output sample rate is (input_sample_rate / downsample)
+     */
+    MultistageDownsampleFilter(unsigned int filter_order, double cutoff,
+                               double downsample, unsigned int num_phases=256,
+                               unsigned int max_stages=8,
+                               unsigned int channels=1,
+                               const FirDesign& design=FirDesign());
+
+    /** Process samples (1 channel). */
+    void process(const SampleVector& samples_in, SampleVector& samples_out);
+
+    /**
+     * Process two signals of equal length (2 channels).
+     * samples_out0 and samples_out1 get the same length.
+     */
+    void process(const SampleVector& samples_in0, const SampleVector& samples_in1,
+                 SampleVector& samples_out0, SampleVector& samples_out1);
+
+    /** Clear the filter history, e.g. after a gap in the input. */
+    void reset();
+
+    /** Return the number of halfband stages. */
+    unsigned int num_halfband_stages() const
+    {
+        return m_halfband.size();
+    }
+
+private:
+    /** Return the number of halfband stages for the specified filter. */
+    static unsigned int halfband_stages(double cutoff, double downsample,
+                                        unsigned int max_stages,
+                                        const FirDesign& design);
+
+    /** Return the design of the halfband stages. */
+    static FirDesign halfband_design(const FirDesign& design);
+
+    /** Return the design of the final stage. */
+    static FirDesign final_design(const FirDesign& design, unsigned int stages);
+
+    /** Return the order of the final stage. */
+    static unsigned int final_order(unsigned int filter_order, double cutoff,
+                                    unsigned int stages,
+                                    const FirDesign& design);
+
+    unsigned int                   m_stages;
+    std::vector<HalfbandDecimator> m_halfband;
+    std::vector<SampleVector>      m_buf;
+    std::vector<IQSampleVector>    m_pairbuf;
+    IQSampleVector                 m_pairs_in;
+    IQSampleVector                 m_pairs_out;
+    DownsampleFilter               m_final;
 };
 
 
@@ -172,4 +698,45 @@ private:
     Sample x1, x2, y1, y2;
 };
 
+
+/**
+ *  Resample by a ratio very close to 1 using linear interpolation.
+ *
+ *  Meant to absorb the clock difference between the receiver and the
+ *  sound card (typically less than 0.1 %), not to convert sample rates.
+ *  Works on interleaved samples; the ratio may change between blocks
+ *  without discontinuities.
+ */
+class DriftResampler
+{
+public:
+
+    /**
+     * Construct resampler.
+     *
+     * channels :: Number of interleaved channels.
+     */
+    explicit DriftResampler(unsigned int channels);
+
+    /** Set the ratio of output sample rate to input sample rate. */
+    void set_ratio(double ratio)
+    {
+        m_step = 1.0 / ratio;
+    }
+
+    double get_ratio() const
+    {
+        return 1.0 / m_step;
+    }
+
+    /** Process interleaved samples. */
+    void process(const SampleVector& samples_in, SampleVector& samples_out);
+
+private:
+    unsigned int    m_channels;
+    double          m_step;     // input frames per output frame
+    double          m_pos;      // next output frame; -1 is the last frame of the previous block
+    SampleVector    m_last;     // last frame of the previous block
+};
+
 #endif
@@ -0,0 +1,625 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <complex>
+
+#include "FilterDesign.h"
+
+/********** DEBUG SETUP **********/
+#define ENABLE_SDEBUG
+#define DEBUG_PREFIX "FilterDesign: "
+#include "utils/singleton.h"
+#include "utils/screenlogger.h"
+/*********************************/
+
+using namespace std;
+using namespace LF::utils;
+
+
+// Return a printable name for a design method.
+const char * fir_design_name(FirDesignMethod method)
+{
+    switch (method) {
+        case FirDesignMethod::Kaiser:       return "kaiser";
+        case FirDesignMethod::Equiripple:   return "equiripple";
+        default:                            return "lanczos";
+    }
+}
+
+
+// Parse a design method name.
+bool parse_fir_design(const char *name, FirDesignMethod& method)
+{
+    if (strcmp(name, "lanczos") == 0) {
+        method = FirDesignMethod::Lanczos;
+    } else if (strcmp(name, "kaiser") == 0) {
+        method = FirDesignMethod::Kaiser;
+    } else if (strcmp(name, "equiripple") == 0 || strcmp(name, "remez") == 0) {
+        method = FirDesignMethod::Equiripple;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+/** Convert peak to peak passband ripple in dB to the allowed deviation. */
+static double ripple_deviation(double ripple)
+{
+    double g = pow(10.0, ripple / 20);
+    return (g - 1) / (g + 1);
+}
+
+
+/** Convert stopband attenuation in dB to the allowed deviation. */
+static double atten_deviation(double atten)
+{
+    return pow(10.0, -atten / 20);
+}
+
+
+/** Prepare Lanczos FIR filter coefficients. */
+template <class T>
+static void make_lanczos_coeff(unsigned int filter_order, double cutoff,
+                               vector<T>& coeff)
+{
+    coeff.resize(filter_order + 1);
+
+    // Prepare Lanczos FIR filter.
+    //   t[i]     =  (i - order/2)
+    //   coeff[i] =  Sinc(2 * cutoff * t[i]) * Sinc(t[i] / (order/2 + 1))
+    //   coeff    /= sum(coeff)
+
+    double ysum = 0.0;
+
+    // Calculate filter kernel.
+    for (int i = 0; i <= (int)filter_order; i++) {
+        int t2 = 2 * i - filter_order;
+
+        double y;
+        if (t2 == 0) {
+            y = 1.0;
+        } else {
+            double x1 = cutoff * t2;
+            double x2 = t2 / double(filter_order + 2);
+            y = ( sin(M_PI * x1) / M_PI / x1 ) *
+                ( sin(M_PI * x2) / M_PI / x2 );
+        }
+
+        coeff[i] = y;
+        ysum += y;
+    }
+
+    // Apply correction factor to ensure unit gain at DC.
+    for (unsigned i = 0; i <= filter_order; i++) {
+        coeff[i] /= ysum;
+    }
+}
+
+
+/** Modified Bessel function of the first kind, order 0. */
+static double bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 500 && term > 1.0e-14 * sum; k++) {
+        double h = x / (2 * k);
+        term *= h * h;
+        sum += term;
+    }
+    return sum;
+}
+
+
+/** Return the Kaiser window parameter for a stopband attenuation in dB. */
+static double kaiser_beta(double atten)
+{
+    if (atten > 50)
+        return 0.1102 * (atten - 8.7);
+    if (atten >= 21)
+        return 0.5842 * pow(atten - 21, 0.4) + 0.07886 * (atten - 21);
+    return 0;
+}
+
+
+/** Prepare Kaiser-windowed sinc coefficients with unit gain at DC. */
+static void make_kaiser_coeff(unsigned int filter_order, double cutoff,
+                              double atten, vector<double>& coeff)
+{
+    coeff.resize(filter_order + 1);
+
+    double beta = kaiser_beta(atten);
+    double i0_beta = bessel_i0(beta);
+    double half = 0.5 * filter_order;
+    double ysum = 0;
+
+    for (unsigned int i = 0; i <= filter_order; i++) {
+        double t = i - half;
+        double y = (t == 0) ? 1.0 : sin(2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+        double r = (half > 0) ? t / half : 0;
+        y *= bessel_i0(beta * sqrt(max(0.0, 1 - r * r))) / i0_beta;
+        coeff[i] = y;
+        ysum += y;
+    }
+
+    for (unsigned int i = 0; i <= filter_order; i++)
+        coeff[i] /= ysum;
+}
+
+
+/**
+ * Barycentric weights 1 / prod_{j != k} (x[k] - x[j]) for the first n
+ * points, up to a common factor. The products are summed as logarithms
+ * because they over- or underflow for a few hundred points.
+ */
+static void barycentric_weights(const vector<double>& x, unsigned int n,
+                                vector<double>& w)
+{
+    vector<double> lw(n);
+    w.resize(n);
+    double lmax = -HUGE_VAL;
+    for (unsigned int k = 0; k < n; k++) {
+        double l = 0;
+        int sign = 1;
+        for (unsigned int j = 0; j < n; j++) {
+            if (j == k)
+                continue;
+            double d = 2 * (x[k] - x[j]);
+            if (d < 0)
+                sign = -sign;
+            l -= log(fabs(d));
+        }
+        lw[k] = l;
+        w[k] = sign;
+        lmax = max(lmax, l);
+    }
+    for (unsigned int k = 0; k < n; k++)
+        w[k] *= exp(lw[k] - lmax);
+}
+
+
+/** Evaluate the barycentric interpolation through (x[k], y[k]) at xx. */
+static double barycentric_eval(const vector<double>& x,
+                               const vector<double>& y,
+                               const vector<double>& w,
+                               unsigned int n, double xx)
+{
+    double num = 0, den = 0;
+    for (unsigned int k = 0; k < n; k++) {
+        double d = xx - x[k];
+        if (d == 0)
+            return y[k];
+        double q = w[k] / d;
+        num += q * y[k];
+        den += q;
+    }
+    return num / den;
+}
+
+
+/**
+ * Prepare equiripple low-pass coefficients with the Parks-McClellan
+ * (Remez exchange) algorithm.
+ *
+ * The amplitude response of a symmetric filter of even order N is a
+ * cosine series A(w) = sum a[k] cos(k w) with N/2 + 1 terms. For odd
+ * order it is cos(w/2) times such a series with (N+1)/2 terms; the
+ * algorithm then approximates D / cos(w/2) with weight W cos(w/2).
+ *
+ * Return false if the exchange does not converge within its iteration
+ * limit; the coefficients are then left unchanged.
+ */
+static bool make_remez_coeff(unsigned int filter_order,
+                             double pass_edge, double stop_edge,
+                             double pass_dev, double stop_dev,
+                             vector<double>& coeff)
+{
+    bool odd = (filter_order % 2) != 0;
+    unsigned int nterms = odd ? (filter_order + 1) / 2 : filter_order / 2 + 1;
+    unsigned int next = nterms + 1;
+
+    pass_edge = max(0.0, pass_edge);
+    stop_edge = min(0.5, stop_edge);
+
+    // Dense frequency grid, about 16 points per cosine term.
+    vector<double> freq, des, wt;
+    double spacing = 0.5 / (16 * nterms);
+    unsigned int npass = max(2u, unsigned(ceil(pass_edge / spacing)) + 1);
+    unsigned int nstop = unsigned(ceil((0.5 - stop_edge) / spacing)) + 1;
+    for (unsigned int i = 0; i < npass; i++) {
+        freq.push_back(pass_edge * i / (npass - 1));
+        des.push_back(1);
+        wt.push_back(1 / pass_dev);
+    }
+    for (unsigned int i = 0; i < nstop; i++) {
+        // A stopband that starts at half the sample rate is a single point.
+        double f = (nstop > 1) ? stop_edge + (0.5 - stop_edge) * i / (nstop - 1)
+                               : stop_edge;
+        // The odd-order response is zero at half the sample rate anyway.
+        if (odd && f > 0.5 - 0.25 * spacing)
+            break;
+        freq.push_back(f);
+        des.push_back(0);
+        wt.push_back(1 / stop_dev);
+    }
+    unsigned int ngrid = freq.size();
+
+    vector<double> gx(ngrid);
+    for (unsigned int i = 0; i < ngrid; i++) {
+        gx[i] = cos(2 * M_PI * freq[i]);
+        if (odd) {
+            double c = cos(M_PI * freq[i]);
+            des[i] /= c;
+            wt[i] *= c;
+        }
+    }
+    assert(ngrid > next);
+
+    // Start with extremal frequencies spread evenly over the grid.
+    vector<unsigned int> ext(next);
+    for (unsigned int k = 0; k < next; k++)
+        ext[k] = (unsigned long)k * (ngrid - 1) / nterms;
+
+    vector<double> x(next), y(nterms), w, err(ngrid);
+    double delta = 0;
+
+    // Find the deviation for which the response alternates on the
+    // extremals, interpolate the response through the first nterms of
+    // them and evaluate the weighted error on the grid.
+    auto solve = [&]() {
+        for (unsigned int k = 0; k < next; k++)
+            x[k] = gx[ext[k]];
+
+        barycentric_weights(x, next, w);
+        double num = 0, den = 0;
+        for (unsigned int k = 0; k < next; k++) {
+            double s = (k % 2) ? -1 : 1;
+            num += w[k] * des[ext[k]];
+            den += s * w[k] / wt[ext[k]];
+        }
+        delta = num / den;
+
+        for (unsigned int k = 0; k < nterms; k++) {
+            double s = (k % 2) ? -1 : 1;
+            y[k] = des[ext[k]] - s * delta / wt[ext[k]];
+        }
+        barycentric_weights(x, nterms, w);
+        for (unsigned int i = 0; i < ngrid; i++)
+            err[i] = wt[i] * (des[i] - barycentric_eval(x, y, w, nterms, gx[i]));
+    };
+
+    const int max_iter = 100;
+    for (int iter = 0; iter < max_iter; iter++) {
+
+        solve();
+
+        // Local extrema of the error within each band that are at least
+        // as large as the deviation; the band edges count as extrema if
+        // the error falls away from them. The old extremals stay
+        // candidates, so rounding errors in a tiny deviation can not
+        // break the alternation.
+        vector<bool> was_ext(ngrid, false);
+        for (unsigned int i : ext)
+            was_ext[i] = true;
+        vector<unsigned int> alt;
+        for (unsigned int i = 0; i < ngrid; i++) {
+            bool first = (i == 0 || i == npass);
+            bool last = (i + 1 == npass || i + 1 == ngrid);
+            double s = (err[i] < 0) ? -1 : 1;
+            double e = s * err[i];
+            if (!was_ext[i]) {
+                if (e < (1 - 1.0e-6) * fabs(delta))
+                    continue;
+                if ((!first && e < s * err[i-1]) || (!last && e < s * err[i+1]))
+                    continue;
+            }
+
+            // Of neighbours with the same sign, keep the larger one.
+            if (!alt.empty() && (err[i] > 0) == (err[alt.back()] > 0)) {
+                if (e > fabs(err[alt.back()]))
+                    alt.back() = i;
+            } else {
+                alt.push_back(i);
+            }
+        }
+
+        // The old extremals alternate, so this only happens if the
+        // deviation has the wrong sign at one of them.
+        if (alt.size() < next)
+            break;
+
+        // Remove the extremals with the smallest error until next are
+        // left. An inner one leaves two neighbours of the same sign, of
+        // which the smaller one goes as well.
+        while (alt.size() > next) {
+            unsigned int j = 0;
+            if (alt.size() == next + 1) {
+                if (fabs(err[alt.front()]) >= fabs(err[alt.back()]))
+                    j = alt.size() - 1;
+            } else {
+                for (unsigned int k = 1; k < alt.size(); k++) {
+                    if (fabs(err[alt[k]]) < fabs(err[alt[j]]))
+                        j = k;
+                }
+            }
+            alt.erase(alt.begin() + j);
+            if (j > 0 && j < alt.size()) {
+                if (fabs(err[alt[j-1]]) < fabs(err[alt[j]]))
+                    j--;
+                alt.erase(alt.begin() + j);
+            }
+        }
+
+        double emax = 0;
+        for (unsigned int i : alt)
+            emax = max(emax, fabs(err[i]));
+        bool done = (alt == ext) || (emax - fabs(delta) <= 1.0e-6 * emax);
+        ext = alt;
+        if (done)
+            break;
+    }
+
+    // Response through the final extremals. The exchange has converged if
+    // the error nowhere exceeds the deviation on the extremals.
+    solve();
+    double emax = 0;
+    for (unsigned int i = 0; i < ngrid; i++)
+        emax = max(emax, fabs(err[i]));
+    if (!(emax <= (1 + 1.0e-3) * fabs(delta)))
+        return false;
+
+    // Recover the cosine series from the response at nterms frequencies
+    // spread evenly over [0, pi] (inverse DCT-I).
+    vector<double> a(nterms);
+    if (nterms == 1) {
+        a[0] = y[0];
+    } else {
+        unsigned int m = nterms - 1;
+        vector<double> resp(nterms);
+        for (unsigned int j = 0; j <= m; j++)
+            resp[j] = barycentric_eval(x, y, w, nterms, cos(M_PI * j / m));
+        for (unsigned int k = 0; k <= m; k++) {
+            double sum = 0;
+            for (unsigned int j = 0; j <= m; j++) {
+                double v = resp[j] * cos(M_PI * double(k) * j / m);
+                sum += (j == 0 || j == m) ? 0.5 * v : v;
+            }
+            a[k] = sum * ((k == 0 || k == m) ? 1.0 : 2.0) / m;
+        }
+    }
+
+    // Convert the cosine series to filter taps.
+    coeff.assign(filter_order + 1, 0);
+    if (odd) {
+        // cos(w/2) cos(k w) = (cos((k+1/2) w) + cos((k-1/2) w)) / 2
+        unsigned int m = nterms;
+        vector<double> b(m + 1, 0);
+        for (unsigned int k = 0; k < m; k++) {
+            if (k == 0) {
+                b[1] += a[0];
+            } else {
+                b[k] += 0.5 * a[k];
+                b[k+1] += 0.5 * a[k];
+            }
+        }
+        for (unsigned int k = 1; k <= m; k++) {
+            coeff[m - k] = 0.5 * b[k];
+            coeff[m - 1 + k] = 0.5 * b[k];
+        }
+    } else {
+        unsigned int c = filter_order / 2;
+        coeff[c] = a[0];
+        for (unsigned int k = 1; k < nterms; k++) {
+            coeff[c - k] = 0.5 * a[k];
+            coeff[c + k] = 0.5 * a[k];
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * Return the edges of the transition band of a design, which ends at
+ * half the sample rate at the latest.
+ */
+static void fir_band_edges(const FirDesign& design, double cutoff,
+                           double& pass_edge, double& stop_edge)
+{
+    pass_edge = max(0.0, cutoff - 0.5 * design.transition);
+    stop_edge = min(0.5, cutoff + 0.5 * design.transition);
+}
+
+
+// Compute low-pass FIR filter coefficients.
+template <class T>
+void make_fir_lowpass(const FirDesign& design, unsigned int filter_order,
+                      double cutoff, vector<T>& coeff)
+{
+    assert(cutoff > 0 && cutoff <= 0.5);
+
+    if (design.method == FirDesignMethod::Lanczos) {
+        make_lanczos_coeff(filter_order, cutoff, coeff);
+        return;
+    }
+
+    double pass_dev = ripple_deviation(design.ripple);
+    double stop_dev = atten_deviation(design.atten);
+    double pass_edge, stop_edge;
+    fir_band_edges(design, cutoff, pass_edge, stop_edge);
+
+    // The window gives equal deviation in both bands; it is also the
+    // fallback if the exchange does not converge.
+    vector<double> c;
+    if (design.method == FirDesignMethod::Kaiser ||
+        !make_remez_coeff(filter_order, pass_edge, stop_edge,
+                          pass_dev, stop_dev, c)) {
+        double atten = -20 * log10(min(pass_dev, stop_dev));
+        make_kaiser_coeff(filter_order, 0.5 * (pass_edge + stop_edge),
+                          atten, c);
+    }
+    coeff.assign(c.begin(), c.end());
+}
+
+template void make_fir_lowpass(const FirDesign&, unsigned int, double,
+                               vector<float>&);
+template void make_fir_lowpass(const FirDesign&, unsigned int, double,
+                               vector<double>&);
+
+
+// Measure passband ripple and stopband attenuation of a low-pass filter.
+void measure_fir_lowpass(const vector<double>& coeff,
+                         double pass_edge, double stop_edge,
+                         double& ripple, double& atten)
+{
+    unsigned int ntaps = coeff.size();
+    double half = 0.5 * (ntaps - 1);
+
+    // Amplitude response of a symmetric filter, as the real part of
+    // exp(-j w half) * sum(coeff[i] * z^i) with z = exp(j w).
+    auto response = [&](double f) {
+        complex<double> z = polar(1.0, 2 * M_PI * f);
+        complex<double> s = 0;
+        for (unsigned int i = ntaps; i-- > 0; )
+            s = s * z + coeff[i];
+        return real(s * polar(1.0, -2 * M_PI * f * half));
+    };
+
+    unsigned int npoints = 8 * ntaps + 16;
+    double dc = fabs(response(0));
+    double pmin = dc, pmax = dc, smax = 0;
+    if (pass_edge > 0) {
+        for (unsigned int i = 1; i <= npoints; i++) {
+            double y = fabs(response(pass_edge * i / npoints));
+            pmin = min(pmin, y);
+            pmax = max(pmax, y);
+        }
+    }
+    for (unsigned int i = 0; i <= npoints; i++) {
+        double f = stop_edge + (0.5 - stop_edge) * i / npoints;
+        smax = max(smax, fabs(response(f)));
+    }
+
+    ripple = 20 * log10(pmax / max(pmin, 1.0e-30));
+    atten = -20 * log10(max(smax, 1.0e-30) / dc);
+}
+
+
+/** Return true if the design of the given order meets its target. */
+static bool fir_meets_target(const FirDesign& design, unsigned int filter_order,
+                             double cutoff)
+{
+    vector<double> coeff;
+    make_fir_lowpass(design, filter_order, cutoff, coeff);
+
+    double pass_edge, stop_edge, ripple, atten;
+    fir_band_edges(design, cutoff, pass_edge, stop_edge);
+    measure_fir_lowpass(coeff, pass_edge, stop_edge, ripple, atten);
+    return ripple <= design.ripple && atten >= design.atten;
+}
+
+
+// Return the smallest filter order that meets the target.
+unsigned int fir_lowpass_order(const FirDesign& design, double cutoff)
+{
+    assert(design.transition > 0);
+
+    double pass_dev = ripple_deviation(design.ripple);
+    double stop_dev = atten_deviation(design.atten);
+    double pass_edge, stop_edge;
+    fir_band_edges(design, cutoff, pass_edge, stop_edge);
+    double df = stop_edge - pass_edge;
+
+    // Estimate from Kaiser's formulas.
+    double est;
+    if (design.method == FirDesignMethod::Equiripple) {
+        est = (-20 * log10(sqrt(pass_dev * stop_dev)) - 13) / (14.6 * df);
+    } else {
+        double a = -20 * log10(min(pass_dev, stop_dev));
+        est = (a > 21) ? (a - 7.95) / (14.36 * df) : 0.9222 / df;
+    }
+
+    // Search around the estimate: find an order that fails and one that
+    // meets the target, then bisect. Every order kept as "good" has been
+    // checked, except the limit when the upward search reaches it.
+    const unsigned int min_order = 2;
+    const unsigned int max_order = 8 * unsigned(ceil(est)) + 64;
+    unsigned int good = max(min_order, unsigned(ceil(est)));
+    unsigned int bad = min_order - 1;
+    bool met = true;
+
+    if (fir_meets_target(design, good, cutoff)) {
+        unsigned int step = max(1u, good / 16);
+        while (good > min_order) {
+            unsigned int n = (good > min_order + step) ? good - step : min_order;
+            if (!fir_meets_target(design, n, cutoff)) {
+                bad = n;
+                break;
+            }
+            good = n;
+            step *= 2;
+        }
+    } else {
+        unsigned int step = max(1u, good / 16);
+        bad = good;
+        for (;;) {
+            good = min(max_order, bad + step);
+            if (fir_meets_target(design, good, cutoff))
+                break;
+            if (good == max_order) {
+                met = false;
+                break;
+            }
+            bad = good;
+            step *= 2;
+        }
+    }
+
+    while (met && good > bad + 1) {
+        unsigned int n = bad + (good - bad) / 2;
+        if (fir_meets_target(design, n, cutoff))
+            good = n;
+        else
+            bad = n;
+    }
+
+    // A target that is never met, e.g. beyond the sidelobe level of the
+    // Lanczos window, gives the longest filter tried.
+    if (!met) {
+        SWAR("%s FIR filter misses its target "
+             "(%.2f dB ripple, %.1f dB attenuation) at order %u",
+             fir_design_name(design.method), design.ripple,
+             design.atten, good);
+    }
+
+    return good;
+}
+
+
+// Return the order of a Kaiser-windowed halfband filter.
+unsigned int kaiser_halfband_order(double transition, double atten)
+{
+    // The passband and stopband deviations of a halfband filter are
+    // equal, so only the attenuation matters.
+    double n = (atten > 21) ? (atten - 7.95) / (14.36 * transition)
+                            : 0.9222 / transition;
+    unsigned int m = max(1u, unsigned(ceil((n - 2) / 4)));
+
+    // Kaiser's formula is a few dB short for the wide transition bands of
+    // short halfband filters, so check the estimate and grow it until the
+    // stopband from the transition band to half the sample rate meets the
+    // target.
+    double stop_edge = min(0.5, 0.25 + 0.5 * transition);
+    const unsigned int max_m = 8 * m;
+    for (; m < max_m; m++) {
+        vector<double> coeff;
+        double ripple, stop_atten;
+        make_kaiser_coeff(4 * m + 2, 0.25, atten, coeff);
+        measure_fir_lowpass(coeff, 0, stop_edge, ripple, stop_atten);
+        if (stop_atten >= atten)
+            break;
+    }
+    return 4 * m + 2;
+}
+
+/* end */
@@ -0,0 +1,98 @@
+#ifndef SOFTFM_FILTERDESIGN_H
+#define SOFTFM_FILTERDESIGN_H
+
+#include <vector>
+
+/** Design method for low-pass FIR filters. */
+enum class FirDesignMethod
+{
+    Lanczos,        // windowed sinc with a Lanczos window; order chosen by the caller
+    Kaiser,         // windowed sinc with a Kaiser window
+    Equiripple      // Parks-McClellan (Remez exchange)
+};
+
+/** Return a printable name for a design method. */
+const char * fir_design_name(FirDesignMethod method);
+
+/** Parse a design method name; return false if unknown. */
+bool parse_fir_design(const char *name, FirDesignMethod& method);
+
+
+/**
+ *  Low-pass FIR design: method and quality target.
+ *
+ *  The transition band is centered on the cutoff frequency passed along
+ *  with the design, so the cutoff is always the -6 dB point for the
+ *  windowed designs and the middle of the transition band for equiripple.
+ *  Lanczos ignores the quality target; its response depends on the filter
+ *  order only.
+ */
+struct FirDesign
+{
+    FirDesignMethod method;
+    double transition;      // width of the transition band, relative to the sample rate
+    double ripple;          // maximum passband ripple in dB (peak to peak)
+    double atten;           // minimum stopband attenuation in dB
+
+    explicit FirDesign(FirDesignMethod method=FirDesignMethod::Lanczos,
+                       double transition=0, double ripple=0.1,
+                       double atten=60)
+        : method(method)
+        , transition(transition)
+        , ripple(ripple)
+        , atten(atten)
+    { }
+};
+
+
+/**
+ * Compute low-pass FIR filter coefficients.
+ *
+ * design       :: Design method and quality target.
+ * filter_order :: FIR filter order; (filter_order + 1) coefficients.
+ * cutoff       :: Center of the transition band relative to the sample rate
+ *                 (valid range 0.0 ... 0.5).
+ * coeff        :: Output coefficients, symmetric. The windowed designs are
+ *                 scaled to unit gain at DC; equiripple keeps DC within the
+ *                 passband ripple.
+ *
+ * A transition band that reaches past half the sample rate is cut off
+ * there. If the Remez exchange does not converge (in practice only for
+ * orders far above what the target needs, where the deviation gets lost
+ * in rounding errors), equiripple falls back to the Kaiser design.
+ */
+template <class T>
+void make_fir_lowpass(const FirDesign& design, unsigned int filter_order,
+                      double cutoff, std::vector<T>& coeff);
+
+/**
+ * Return the smallest filter order for which the design meets its ripple
+ * and attenuation target (with Lanczos: the same target in a transition
+ * band of design.transition). The order is found by designing and
+ * measuring filters around an estimate, so it costs a few designs. If no
+ * order up to 8 times the estimate meets the target, a warning is
+ * printed and the longest filter tried is returned.
+ */
+unsigned int fir_lowpass_order(const FirDesign& design, double cutoff);
+
+/**
+ * Measure a low-pass filter on a dense frequency grid.
+ *
+ * ripple       :: Output, peak to peak passband ripple in dB over
+ *                 [0, pass_edge].
+ * atten        :: Output, stopband attenuation in dB (relative to the
+ *                 gain at DC) over [stop_edge, 0.5].
+ */
+void measure_fir_lowpass(const std::vector<double>& coeff,
+                         double pass_edge, double stop_edge,
+                         double& ripple, double& atten);
+
+/**
+ * Return the order of a Kaiser-windowed halfband filter (cutoff 0.25) of
+ * the form (4 * m + 2) that reaches the attenuation target with a
+ * transition band of the given width. Like fir_lowpass_order, it checks
+ * the estimate by designing and measuring the filter.
+ */
+unsigned int kaiser_halfband_order(double transition, double atten);
+
+#endif
@@ -3,8 +3,7 @@
 #include <cmath>
 
 #include "FmDecode.h"
-#include "fastatan2.h"
-
+#include "IQSampleSource.h"
 #include "utils/profiler.h"
 #include "utils/systemutils.h"
 
@@ -23,29 +22,18 @@ const double FmDecoder::default_bandwidth_if  = 100000;
 const double FmDecoder::default_freq_dev      =  75000;
 const double FmDecoder::default_bandwidth_pcm =  15000;
 const double FmDecoder::pilot_freq            =  19000;
-
-/** Compute RMS level over a small prefix of the specified sample vector. */
-static IQSample::value_type rms_level_approx(const IQSampleVector& samples)
-{
-    unsigned int n = samples.size();
-    n = (n + 63) / 64;
-
-    IQSample::value_type level = 0;
-    for (unsigned int i = 0; i < n; i++) {
-        const IQSample& s = samples[i];
-        IQSample::value_type re = s.real(), im = s.imag();
-        level += re * re + im * im;
-    }
-
-    return sqrt(level / n);
-}
+const unsigned int FmDecoder::frontend_tile_size;
+const unsigned int FmDecoder::raw_tuning_table_size;
 
 
 /* ****************  class PhaseDiscriminator  **************** */
 
 // Construct phase discriminator.
-PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev)
+PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev,
+                                       Atan2Accuracy accuracy,
+                                       SimdLevel simd)
     : m_freq_scale_factor(1.0 / (max_freq_dev * 2.0 * M_PI))
+    , m_kernel(select_phase_disc_kernel(simd, accuracy))
 { }
 
 
@@ -53,33 +41,37 @@ PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev)
 void PhaseDiscriminator::process(const IQSampleVector& samples_in,
                                  SampleVector& samples_out)
 {
-    size_t n = samples_in.size();
-    IQSample s0 = m_last_sample;
+    samples_out.resize(samples_in.size());
+    process(samples_in.data(), samples_in.size(), samples_out.data());
+}
 
-    samples_out.resize(n);
 
-    for (unsigned int i = 0; i < n; i++) {
-        IQSample s1(samples_in[i]);
-        IQSample d(conj(s0) * s1);
-// TODO : implement fast approximation of atan2
-#if 1
-        // using fast approximation
-        Sample w = static_cast<Sample>(fastatan2(static_cast<float>(d.imag()), static_cast<float>(d.real())));
-#else
-        Sample w = atan2(d.imag(), d.real());
-#endif
-        samples_out[i] = w * m_freq_scale_factor;
-        s0 = s1;
-    }
+// Process n samples.
+void PhaseDiscriminator::process(const IQSample *samples_in, unsigned int n,
+                                 Sample *samples_out)
+{
+    if (n == 0)
+        return;
 
-    m_last_sample = s0;
+    m_kernel(samples_in, n, m_last_sample, m_freq_scale_factor, samples_out);
+    m_last_sample = samples_in[n-1];
+}
+
+
+// Forget the previous sample.
+void PhaseDiscriminator::reset()
+{
+    m_last_sample = 0;
 }
 
 
 /* ****************  class PilotPhaseLock  **************** */
 
 // Construct phase-locked loop.
-PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
+PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal,
+                               unsigned int subblock, SimdLevel simd)
+    : m_subblock(subblock)
+    , m_mix_kernel(select_pilot_mix_kernel(simd))
 {
     /*
      * This is a type-2, 4th order phase-locked loop.
@@ -97,6 +89,7 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     // Set min/max locking frequencies.
     m_minfreq = (freq - bandwidth) * 2.0 * M_PI;
     m_maxfreq = (freq + bandwidth) * 2.0 * M_PI;
+    m_centerfreq = freq * 2.0 * M_PI;
 
     // Set valid signal threshold.
     m_minsignal  = minsignal;
@@ -104,6 +97,10 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     m_lock_cnt   = 0;
     m_pilot_level = 0;
 
+    // At most a few PPS events per block; reserve room so that the
+    // first event does not allocate while decoding.
+    m_pps_events.reserve(4);
+
     // Create 2nd order filter for I/Q representation of phase error.
     // Filter has two poles, unit DC gain.
     double p1 = exp(-1.146 * bandwidth * 2.0 * M_PI);
@@ -121,8 +118,34 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     // the frequency. Then the frequency is integrated to produce the phase.
     // These integrators form the two remaining poles, both at z = 1.
 
+    // The same loop at the sub-block rate: the phasor filter poles become
+    // p**N for N samples per sub-block. The loop filter is a PI controller
+    // with proportional gain -b1 and integral gain (b0 + b1) per sample,
+    // so the integral gain is N times larger per sub-block.
+    if (m_subblock > 0) {
+        double n = m_subblock;
+        double p1n = pow(p1, n);
+        double p2n = pow(p2, n);
+        m_sub_phasor_a1 = - p1n - p2n;
+        m_sub_phasor_a2 = p1n * p2n;
+        m_sub_phasor_b0 = 1 + m_sub_phasor_a1 + m_sub_phasor_a2;
+        m_sub_loopfilter_b0 = n * (m_loopfilter_b0 + m_loopfilter_b1)
+                              - m_loopfilter_b1;
+    }
+
     // Initialize frequency and phase.
-    m_freq  = freq * 2.0 * M_PI;
+    reset();
+
+    // Initialize PPS generator.
+    m_pps_cnt       = 0;
+    m_sample_cnt    = 0;
+}
+
+
+// Restart the loop from the center frequency.
+void PilotPhaseLock::reset()
+{
+    m_freq  = m_centerfreq;
     m_phase = 0;
 
     m_phasor_i1 = 0;
@@ -131,10 +154,12 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth, double minsignal)
     m_phasor_q2 = 0;
     m_loopfilter_x1 = 0;
 
-    // Initialize PPS generator.
+    m_sub_mix   = 0;
+    m_sub_count = 0;
+
+    m_lock_cnt = 0;
+    m_pilot_level = 0;
     m_pilot_periods = 0;
-    m_pps_cnt       = 0;
-    m_sample_cnt    = 0;
 }
 
 
@@ -149,6 +174,38 @@ void PilotPhaseLock::process(const SampleVector& samples_in,
     bool was_locked = (m_lock_cnt >= m_lock_delay);
     m_pps_events.clear();
 
+    if (m_subblock > 0)
+        process_subblocks(samples_in, samples_out, was_locked);
+    else
+        process_samples(samples_in, samples_out, was_locked);
+
+    // Update lock status.
+    if (2 * m_pilot_level > m_minsignal) {
+        if (m_lock_cnt < m_lock_delay)
+            m_lock_cnt += n;
+    } else {
+        m_lock_cnt = 0;
+    }
+
+    // Drop PPS events when pilot not locked.
+    if (m_lock_cnt < m_lock_delay) {
+        m_pilot_periods = 0;
+        m_pps_cnt = 0;
+        m_pps_events.clear();
+    }
+
+    // Update sample counter.
+    m_sample_cnt += n;
+}
+
+
+// Run the loop for every sample.
+void PilotPhaseLock::process_samples(const SampleVector& samples_in,
+                                     SampleVector& samples_out,
+                                     bool was_locked)
+{
+    unsigned int n = samples_in.size();
+
     if (n > 0)
         m_pilot_level = 1000.0;
 
@@ -208,45 +265,166 @@ void PilotPhaseLock::process(const SampleVector& samples_in,
         m_phase += m_freq;
         if (m_phase > 2.0 * M_PI) {
             m_phase -= 2.0 * M_PI;
-            m_pilot_periods++;
-
-            // Generate pulse-per-second.
-            if (m_pilot_periods == pilot_frequency) {
-                m_pilot_periods = 0;
-                if (was_locked) {
-                    struct PpsEvent ev;
-                    ev.pps_index      = m_pps_cnt;
-                    ev.sample_index   = m_sample_cnt + i;
-                    ev.block_position = double(i) / double(n);
-                    m_pps_events.push_back(ev);
-                    m_pps_cnt++;
-                }
-            }
+            pilot_period(i, n, was_locked);
         }
     }
+}
 
-    // Update lock status.
-    if (2 * m_pilot_level > m_minsignal) {
-        if (m_lock_cnt < m_lock_delay)
-            m_lock_cnt += n;
-    } else {
-        m_lock_cnt = 0;
+
+// Run the loop once per sub-block.
+void PilotPhaseLock::process_subblocks(const SampleVector& samples_in,
+                                       SampleVector& samples_out,
+                                       bool was_locked)
+{
+    unsigned int n = samples_in.size();
+
+    // Detect pilot level (conservative) over the sub-blocks that end in
+    // this block; keep the last level if none does.
+    Sample pilot_level = 1000.0;
+    bool   level_valid = false;
+
+    unsigned int i = 0;
+    while (i < n) {
+
+        // Generate the locked tone up to the end of the sub-block with
+        // constant frequency, seeding the rotator from the exact phase.
+        unsigned int k = min(n - i, m_subblock - m_sub_count);
+        IQSample phasors[nco_lanes];
+        complex<double> w = polar(1.0, double(m_freq));
+        complex<double> z = polar(1.0, double(m_phase));
+        for (unsigned int l = 0; l < nco_lanes; l++) {
+            phasors[l] = IQSample(z);
+            z *= w;
+        }
+        complex<double> w2 = w * w, w4 = w2 * w2;
+        IQSample step(w4 * w4);
+
+        unsigned int kv = k - k % nco_lanes;
+        m_sub_mix += m_mix_kernel(samples_in.data() + i, kv, phasors, step,
+                                  samples_out.data() + i);
+        for (unsigned int j = kv; j < k; j++) {
+            Sample psin = phasors[j-kv].imag();
+            Sample pcos = phasors[j-kv].real();
+            samples_out[i+j] = 2 * psin * pcos;
+            m_sub_mix += samples_in[i+j] * IQSample(psin, pcos);
+        }
+
+        // Update locked phase; sample j ends a pilot period if
+        // phase + (j + 1) * freq crosses 2*Pi.
+        double start = m_phase;
+        double phase = start + double(k) * m_freq;
+        while (phase > 2.0 * M_PI) {
+            double j = ceil((2.0 * M_PI - start) / m_freq) - 1;
+            pilot_period(i + unsigned(max(0.0, min(double(k - 1), j))), n, was_locked);
+            start -= 2.0 * M_PI;
+            phase -= 2.0 * M_PI;
+        }
+        m_phase = phase;
+
+        i += k;
+        m_sub_count += k;
+        if (m_sub_count < m_subblock)
+            break;
+
+        // Run the averaged IQ phase error through the low-pass filter.
+        Sample phasor_i = m_sub_phasor_b0 * m_sub_mix.real() / m_subblock
+                          - m_sub_phasor_a1 * m_phasor_i1
+                          - m_sub_phasor_a2 * m_phasor_i2;
+        Sample phasor_q = m_sub_phasor_b0 * m_sub_mix.imag() / m_subblock
+                          - m_sub_phasor_a1 * m_phasor_q1
+                          - m_sub_phasor_a2 * m_phasor_q2;
+        m_phasor_i2 = m_phasor_i1;
+        m_phasor_i1 = phasor_i;
+        m_phasor_q2 = m_phasor_q1;
+        m_phasor_q1 = phasor_q;
+        m_sub_mix   = 0;
+        m_sub_count = 0;
+
+        // Convert I/Q ratio to estimate of phase error.
+        Sample phase_err;
+        if (phasor_i > abs(phasor_q)) {
+            phase_err = phasor_q / phasor_i;
+        } else if (phasor_q > 0) {
+            phase_err = 1;
+        } else {
+            phase_err = -1;
+        }
+
+        pilot_level = min(pilot_level, phasor_i);
+        level_valid = true;
+
+        // Run phase error through loop filter and update frequency estimate.
+        m_freq += m_sub_loopfilter_b0 * phase_err
+                  + m_loopfilter_b1 * m_loopfilter_x1;
+        m_loopfilter_x1 = phase_err;
+
+        // Limit frequency to allowable range.
+        m_freq = max(m_minfreq, min(m_maxfreq, m_freq));
     }
 
-    // Drop PPS events when pilot not locked.
-    if (m_lock_cnt < m_lock_delay) {
+    if (level_valid)
+        m_pilot_level = pilot_level;
+}
+
+
+// Count a pilot period and generate pulse-per-second.
+void PilotPhaseLock::pilot_period(unsigned int i, unsigned int n, bool was_locked)
+{
+    m_pilot_periods++;
+    if (m_pilot_periods == pilot_frequency) {
         m_pilot_periods = 0;
-        m_pps_cnt = 0;
-        m_pps_events.clear();
+        if (was_locked) {
+            struct PpsEvent ev;
+            ev.pps_index      = m_pps_cnt;
+            ev.sample_index   = m_sample_cnt + i;
+            ev.block_position = double(i) / double(n);
+            ev.unix_time      = 0;
+            m_pps_events.push_back(ev);
+            m_pps_cnt++;
+        }
     }
-
-    // Update sample counter.
-    m_sample_cnt += n;
 }
 
 
 /* ****************  class FmDecoder  **************** */
 
+/**
+ * Return the design of one decoder filter: the quality target from the
+ * options with a transition band of the given width.
+ */
+static FirDesign stage_design(const FmDecoderOptions& options, double transition)
+{
+    FirDesign design(options.filter);
+    design.transition = transition;
+    return design;
+}
+
+
+/**
+ * Return the order of one decoder filter: lanczos_order with Lanczos,
+ * otherwise the smallest order that meets the quality target.
+ */
+static unsigned int stage_order(const FirDesign& design, double cutoff,
+                                unsigned int lanczos_order)
+{
+    if (design.method == FirDesignMethod::Lanczos)
+        return lanczos_order;
+    return fir_lowpass_order(design, cutoff);
+}
+
+
+/**
+ * Return the transition width of the audio filter in Hz: 2 kHz on
+ * either side of the audio bandwidth, narrower if the stopband would
+ * otherwise reach the stereo pilot or the output Nyquist frequency.
+ */
+static double audio_transition(double sample_rate_pcm, double bandwidth_pcm)
+{
+    double stop = min(FmDecoder::pilot_freq, 0.5 * sample_rate_pcm);
+    return min(min(4000.0, 2 * (stop - bandwidth_pcm)), bandwidth_pcm);
+}
+
+
 FmDecoder::FmDecoder(double sample_rate_if,
                      double tuning_offset,
                      double sample_rate_pcm,
@@ -255,16 +433,23 @@ FmDecoder::FmDecoder(double sample_rate_if,
                      double bandwidth_if,
                      double freq_dev,
                      double bandwidth_pcm,
-                     unsigned int downsample)
+                     unsigned int downsample,
+                     const FmDecoderOptions& options)
 
     // Initialize member fields
     : m_sample_rate_if(sample_rate_if)
     , m_sample_rate_baseband(sample_rate_if / downsample)
     , m_tuning_table_size(64)
     , m_tuning_shift(lrint(-64.0 * tuning_offset / sample_rate_if))
+    , m_raw_tuning_shift(lrint(-double(raw_tuning_table_size) *
+                               tuning_offset / sample_rate_if))
+    , m_tuning_offset(tuning_offset)
+    , m_exact_tuning(options.exact_tuning)
     , m_freq_dev(freq_dev)
     , m_downsample(downsample)
     , m_stereo_enabled(stereo)
+    , m_if_decimation(options.if_decimation && downsample > 1)
+    , m_raw_frontend(false)
     , m_stereo_detected(false)
     , m_if_level(0)
     , m_baseband_mean(0)
@@ -273,33 +458,67 @@ FmDecoder::FmDecoder(double sample_rate_if,
     // Construct FineTuner
     , m_finetuner(m_tuning_table_size, m_tuning_shift)
 
+    // Construct NcoTuner
+    , m_ncotuner(-tuning_offset / sample_rate_if)
+
     // Construct LowPassFilterFirIQ
-    , m_iffilter(10, bandwidth_if / sample_rate_if)
+    // When decimating in the IF filter, this filter must also suppress
+    // everything that would alias into the baseband, so with Lanczos it
+    // needs as many taps as the baseband downsampler. The designed
+    // filters pass 3/4 of the IF bandwidth flat and stop above 5/4 of it,
+    // which is below the alias of the passband.
+    , m_iffilter(
+        stage_order(stage_design(options, 0.5 * bandwidth_if / sample_rate_if),
+                    bandwidth_if / sample_rate_if,
+                    m_if_decimation ? 8 * downsample : 10), // filter_order
+        bandwidth_if / sample_rate_if,                      // cutoff
+        m_if_decimation ? downsample : 1,                   // downsample
+        stage_design(options, 0.5 * bandwidth_if / sample_rate_if))
+
+    // Construct 16-bit FineTunerU8 and LowPassFilterFirS16
+    , m_finetuner_u8(raw_tuning_table_size, m_raw_tuning_shift)
+    , m_iffilter_s16(
+        stage_order(stage_design(options, 0.5 * bandwidth_if / sample_rate_if),
+                    bandwidth_if / sample_rate_if,
+                    m_if_decimation ? 8 * downsample : 10), // filter_order
+        bandwidth_if / sample_rate_if,                      // cutoff
+        m_if_decimation ? downsample : 1,                   // downsample
+        stage_design(options, 0.5 * bandwidth_if / sample_rate_if))
 
     // Construct PhaseDiscriminator
-    , m_phasedisc(freq_dev / sample_rate_if)
+    , m_phasedisc(freq_dev / (m_if_decimation ? m_sample_rate_baseband
+                                              : sample_rate_if),
+                  options.atan2_accuracy)
 
     // Construct DownsampleFilter for baseband
-    , m_resample_baseband(8 * downsample, 0.4 / downsample, downsample, true)
+    // The designed filter is flat up to 0.3 of the output rate and stops
+    // at its Nyquist frequency. DownsampleFilter designs one order less
+    // than it is given.
+    , m_resample_baseband(
+        stage_order(stage_design(options, 0.2 / downsample),
+                    0.4 / downsample, 8 * downsample - 1) + 1,  // filter_order
+        0.4 / downsample,                                   // cutoff
+        downsample,                                         // downsample
+        true, 0, 1,                                         // integer_factor, num_phases, channels
+        stage_design(options, 0.2 / downsample))
 
     // Construct PilotPhaseLock
     , m_pilotpll(pilot_freq / m_sample_rate_baseband,       // freq
                  50 / m_sample_rate_baseband,               // bandwidth
-                 0.01)                                      // minsignal (was 0.04)
+                 0.01,                                      // minsignal (was 0.04)
+                 options.pilot_subblock)                    // subblock
 
-    // Construct DownsampleFilter for mono channel
-    , m_resample_mono(
+    // Construct MultistageDownsampleFilter for mono and stereo channels
+    , m_resample_audio(
         int(m_sample_rate_baseband / 1000.0),               // filter_order
         bandwidth_pcm / m_sample_rate_baseband,             // cutoff
         m_sample_rate_baseband / sample_rate_pcm,           // downsample
-        false)                                              // integer_factor
-
-    // Construct DownsampleFilter for stereo channel
-    , m_resample_stereo(
-        int(m_sample_rate_baseband / 1000.0),               // filter_order
-        bandwidth_pcm / m_sample_rate_baseband,             // cutoff
-        m_sample_rate_baseband / sample_rate_pcm,           // downsample
-        false)                                              // integer_factor
+        256,                                                // num_phases
+        options.audio_halfband ? 8 : 0,                     // max_stages
+        stereo ? 2 : 1,                                     // channels
+        stage_design(options,
+                     audio_transition(sample_rate_pcm, bandwidth_pcm) /
+                     m_sample_rate_baseband))
 
     // Construct HighPassFilterIir
     , m_dcblock_mono(30.0 / sample_rate_pcm)
@@ -312,136 +531,187 @@ FmDecoder::FmDecoder(double sample_rate_if,
         (deemphasis == 0) ? 1.0 : (deemphasis * sample_rate_pcm * 1.0e-6))
 
 {
-    // nothing more to do
+    // Scratch buffers for one tile of the fused front end.
+    // With an FFT IF filter, round the tile up to whole FFT blocks so that
+    // no block is transformed for only part of its length.
+    unsigned int if_downsample = m_if_decimation ? m_downsample : 1;
+    unsigned int tile = frontend_tile_size * if_downsample;
+    unsigned int fft_block = m_iffilter.fft_block_length();
+    if (fft_block > 0)
+        tile = ((tile + fft_block - 1) / fft_block) * fft_block;
+    m_buf_iftuned.resize(tile);
+    m_buf_iftuned_s16.resize(2 * tile);
+    m_buf_iffiltered.resize(tile / if_downsample + 1);
 }
 
 
-void FmDecoder::process(const IQSampleVector& samples_in, SampleVector& audio)
+// Fine tune and filter one tile of IQ samples.
+unsigned int FmDecoder::tune_and_filter(const IQSample *samples_in,
+                                        unsigned int n)
 {
-    // Fine tuning.
-    m_finetuner.process(samples_in, m_buf_iftuned);
-
-    // Low pass filter to isolate station.
-    m_iffilter.process(m_buf_iftuned, m_buf_iffiltered);
+    if (m_exact_tuning)
+        m_ncotuner.process(samples_in, n, m_buf_iftuned.data());
+    else
+        m_finetuner.process(samples_in, n, m_buf_iftuned.data());
 
-    // Measure IF level.
-    double if_rms = rms_level_approx(m_buf_iffiltered);
-    m_if_level = 0.95 * m_if_level + 0.05 * if_rms;
+    return m_iffilter.process(m_buf_iftuned.data(), n,
+                              m_buf_iffiltered.data());
+}
 
-    // Extract carrier frequency.
-    m_phasedisc.process(m_buf_iffiltered, m_buf_baseband);
 
-    // Downsample baseband signal to reduce processing.
-    if (m_downsample > 1) {
-        SampleVector tmp(move(m_buf_baseband));
-        m_resample_baseband.process(tmp, m_buf_baseband);
-    }
-
-    // Measure baseband level.
-    double baseband_mean, baseband_rms;
-    samples_mean_rms(m_buf_baseband, baseband_mean, baseband_rms);
-    m_baseband_mean  = 0.95 * m_baseband_mean + 0.05 * baseband_mean;
-    m_baseband_level = 0.95 * m_baseband_level + 0.05 * baseband_rms;
-
-    // Extract mono audio signal.
-    m_resample_mono.process(m_buf_baseband, m_buf_mono);
+// Fine tune and filter one tile of raw 8-bit samples.
+unsigned int FmDecoder::tune_and_filter(const uint8_t *samples_in,
+                                        unsigned int n)
+{
+    m_finetuner_u8.process(samples_in, n, m_buf_iftuned_s16.data());
+    return m_iffilter_s16.process(m_buf_iftuned_s16.data(), n,
+                                  m_buf_iffiltered.data());
+}
 
-    // DC blocking
-    m_dcblock_mono.process_inplace(m_buf_mono);
 
-    if (m_stereo_enabled) {
+// Run fine tuner, IF filter and phase discriminator in tiles.
+template <class T>
+void FmDecoder::demodulate(const T *samples_in, unsigned int n)
+{
+    RTTIProfiler f("FmDecoder::demodulate");
 
-        // Lock on stereo pilot.
-        m_pilotpll.process(m_buf_baseband, m_buf_rawstereo);
-        m_stereo_detected = m_pilotpll.locked();
+    unsigned int tile = m_buf_iftuned.size();
+    unsigned int if_downsample = m_if_decimation ? m_downsample : 1;
 
-        // Demodulate stereo signal.
-        demod_stereo(m_buf_baseband, m_buf_rawstereo);
+    m_buf_baseband.resize(n / if_downsample + 1);
 
-        // Extract audio and downsample.
-        // NOTE: This MUST be done even if no stereo signal is detected yet,
-        // because the downsamplers for mono and stereo signal must be
-        // kept in sync.
-        m_resample_stereo.process(m_buf_rawstereo, m_buf_stereo);
+    // Estimate the RMS IF level over the first 1/64 of the filtered block.
+    unsigned int nlevel = (n / if_downsample + 63) / 64;
+    IQSample::value_type level = 0;
 
-        // DC blocking
-        m_dcblock_stereo.process_inplace(m_buf_stereo);
+    unsigned int m = 0;
+    for (unsigned int p = 0; p < n; p += tile) {
+        unsigned int k = min(tile, n - p);
 
-        if (m_stereo_detected) {
-            // Extract left/right channels from (L+R) / (L-R) signals.
-            stereo_to_left_right(m_buf_mono, m_buf_stereo, audio);
-            // Stereo deemphasis to L and R
-            m_deemph_stereo.process_inplace(audio);
+        // Fine tuning and low pass filter to isolate station
+        // (and decimate, if enabled). Raw samples are byte pairs.
+        k = tune_and_filter(samples_in + (sizeof(T) == 1 ? 2 * p : p), k);
 
-        } else {
+        // Accumulate IF level.
+        for (unsigned int i = 0; m + i < nlevel && i < k; i++) {
+            const IQSample& s = m_buf_iffiltered[i];
+            IQSample::value_type re = s.real(), im = s.imag();
+            level += re * re + im * im;
+        }
 
-            // Mono deemphasis
-            m_deemph_mono.process_inplace(m_buf_mono);
-            // Duplicate mono signal in left/right channels.
-            mono_to_left_right(m_buf_mono, audio);
+        // Extract carrier frequency.
+        m_phasedisc.process(m_buf_iffiltered.data(), k,
+                            m_buf_baseband.data() + m);
+        m += k;
+    }
 
-        }
+    m_buf_baseband.resize(m);
 
-    } else {
+    // Measure IF level.
+    double if_rms = sqrt(level / nlevel);
+    m_if_level = 0.95 * m_if_level + 0.05 * if_rms;
+}
 
-        // Mono deemphasis
-        m_deemph_mono.process_inplace(m_buf_mono);
-        // Just return mono channel.
-        audio = move(m_buf_mono);
 
-    }
+void FmDecoder::process(const IQSampleVector& samples_in, SampleVector& audio)
+{
+    process_frontend(samples_in.data(), samples_in.size(), m_buf_frontend);
+    process_backend(m_buf_frontend, audio);
 }
 
 void FmDecoder::Process(const SampleBufferBlock* samples_in, SampleVector& audio)
 {
     RTTIProfiler f1("FmDecoder::Process");
-    // Fine tuning.
-    m_finetuner.Process(samples_in, m_buf_iftuned);
+    StreamTime time;
+    time.sample_index = samples_in->sample_index;
+    time.num_samples = samples_in->size;
+    time.capture = samples_in->capture_time;
+    process_frontend(samples_in->samples, samples_in->size, m_buf_frontend);
+    process_backend(m_buf_frontend, audio, time);
+}
 
-    // Low pass filter to isolate station.
-    m_iffilter.process(m_buf_iftuned, m_buf_iffiltered);
+void FmDecoder::Process(const RawSampleBufferBlock* samples_in, SampleVector& audio)
+{
+    RTTIProfiler f1("FmDecoder::Process");
+    StreamTime time;
+    time.sample_index = samples_in->sample_index;
+    time.num_samples = samples_in->size;
+    time.capture = samples_in->capture_time;
+    process_frontend(samples_in->samples, samples_in->size, m_buf_frontend);
+    process_backend(m_buf_frontend, audio, time);
+}
 
-    // Measure IF level.
-    double if_rms = rms_level_approx(m_buf_iffiltered);
-    m_if_level = 0.95 * m_if_level + 0.05 * if_rms;
 
-    // Extract carrier frequency.
-    m_phasedisc.process(m_buf_iffiltered, m_buf_baseband);
+// Run tuner, IF filter, discriminator and baseband downsampler.
+void FmDecoder::process_frontend(const IQSample *samples_in, unsigned int n,
+                                 SampleVector& baseband)
+{
+    // Fine tuning, IF filter and phase discrimination.
+    demodulate(samples_in, n);
+    finish_frontend(baseband);
+}
 
+
+// Run 16-bit tuner and IF filter, then discriminator and downsampler.
+void FmDecoder::process_frontend(const uint8_t *samples_in, unsigned int n,
+                                 SampleVector& baseband)
+{
+    // Fine tuning, IF filter and phase discrimination.
+    m_raw_frontend = true;
+    demodulate(samples_in, n);
+    finish_frontend(baseband);
+}
+
+
+// Downsample and measure the baseband signal.
+void FmDecoder::finish_frontend(SampleVector& baseband)
+{
     // Downsample baseband signal to reduce processing.
-    if (m_downsample > 1) {
-        SampleVector tmp(move(m_buf_baseband));
-        m_resample_baseband.process(tmp, m_buf_baseband);
+    if (m_downsample > 1 && !m_if_decimation) {
+        m_resample_baseband.process(m_buf_baseband, baseband);
+    } else {
+        baseband.swap(m_buf_baseband);
     }
 
     // Measure baseband level.
     double baseband_mean, baseband_rms;
-    samples_mean_rms(m_buf_baseband, baseband_mean, baseband_rms);
+    samples_mean_rms(baseband, baseband_mean, baseband_rms);
     m_baseband_mean  = 0.95 * m_baseband_mean + 0.05 * baseband_mean;
     m_baseband_level = 0.95 * m_baseband_level + 0.05 * baseband_rms;
+}
+
+
+// Run the back end and remember which IQ samples it was fed.
+void FmDecoder::process_backend(const SampleVector& baseband, SampleVector& audio,
+                                const StreamTime& time)
+{
+    process_backend(baseband, audio);
+    m_backend_time = time;
+}
 
-    // Extract mono audio signal.
-    m_resample_mono.process(m_buf_baseband, m_buf_mono);
 
-    // DC blocking
-    m_dcblock_mono.process_inplace(m_buf_mono);
+// Run stereo PLL, audio filters and de-emphasis.
+void FmDecoder::process_backend(const SampleVector& baseband, SampleVector& audio)
+{
+    m_backend_time = StreamTime();
 
     if (m_stereo_enabled) {
 
         // Lock on stereo pilot.
-        m_pilotpll.process(m_buf_baseband, m_buf_rawstereo);
+        m_pilotpll.process(baseband, m_buf_rawstereo);
         m_stereo_detected = m_pilotpll.locked();
 
         // Demodulate stereo signal.
-        demod_stereo(m_buf_baseband, m_buf_rawstereo);
+        demod_stereo(baseband, m_buf_rawstereo);
 
-        // Extract audio and downsample.
+        // Extract mono and stereo audio and downsample both in one pass.
         // NOTE: This MUST be done even if no stereo signal is detected yet,
-        // because the downsamplers for mono and stereo signal must be
-        // kept in sync.
-        m_resample_stereo.process(m_buf_rawstereo, m_buf_stereo);
+        // because the shared resampler keeps the history of both signals.
+        m_resample_audio.process(baseband, m_buf_rawstereo,
+                                 m_buf_mono, m_buf_stereo);
 
         // DC blocking
+        m_dcblock_mono.process_inplace(m_buf_mono);
         m_dcblock_stereo.process_inplace(m_buf_stereo);
 
         if (m_stereo_detected) {
@@ -461,12 +731,54 @@ void FmDecoder::Process(const SampleBufferBlock* samples_in, SampleVector& audio
 
     } else {
 
+        // Extract mono audio signal.
+        m_resample_audio.process(baseband, m_buf_mono);
+
+        // DC blocking
+        m_dcblock_mono.process_inplace(m_buf_mono);
+
         // Mono deemphasis
         m_deemph_mono.process_inplace(m_buf_mono);
-        // Just return mono channel.
-        audio = move(m_buf_mono);
+        // Just return mono channel. Swap rather than move, so that both
+        // buffers keep their capacity for the next block.
+        audio.swap(m_buf_mono);
+
+    }
+}
 
+
+// Return PPS events of the last block, timed by its capture time.
+vector<PilotPhaseLock::PpsEvent> FmDecoder::get_pps_events() const
+{
+    vector<PilotPhaseLock::PpsEvent> events = m_pilotpll.get_pps_events();
+    if (m_backend_time.capture.valid()) {
+        // The capture time belongs to the last IQ sample of the block.
+        double block_time = m_backend_time.num_samples / m_sample_rate_if;
+        for (PilotPhaseLock::PpsEvent& ev : events) {
+            ev.unix_time = m_backend_time.capture.realtime_ns * 1.0e-9
+                           - (1.0 - ev.block_position) * block_time;
+        }
     }
+    return events;
+}
+
+
+// Clear the front end state after a gap in the input.
+void FmDecoder::reset_frontend()
+{
+    m_iffilter.reset();
+    m_iffilter_s16.reset();
+    m_phasedisc.reset();
+    m_resample_baseband.reset();
+}
+
+
+// Clear the back end state after a gap in the input.
+void FmDecoder::reset_backend()
+{
+    m_pilotpll.reset();
+    m_stereo_detected = false;
+    m_resample_audio.reset();
 }
 
 
@@ -521,14 +833,41 @@ void FmDecoder::stereo_to_left_right(const SampleVector& samples_mono,
 
 /* end */
 
-#include "RtlSdrSource.h"
 #include "AudioOutput.h"
+#include "ThreadAffinity.h"
+#include "AllocCounter.h"
+
+const unsigned int FmDecoderThread::pipeline_depth;
+const unsigned int FmDecoderThread::alloc_warmup_blocks;
 
-FmDecoderThread::FmDecoderThread(RtlSdrSource* src, AudioOutput* output) :
+// Pin the calling decoder thread to the index-th pinnable core.
+static void pin_decoder_thread(const char* name, unsigned int index)
+{
+    unsigned int cpu = 0;
+    if (!pin_current_thread_to_cpu(index, &cpu))
+    {
+        SWAR("can not pin the %s thread to CPU %u", name, cpu);
+    }
+}
+
+FmDecoderThread::FmDecoderThread(IQSampleSource* src, AudioOutput* output,
+                                 bool pipelined, bool drain, unsigned int batch_samples) :
     mSource(src),
-    mAudioOutput(output)
+    mAudioOutput(output),
+    mPipelined(pipelined),
+    mRealtime(src->realtime()),
+    mDrain(drain),
+    mBatchSamples(batch_samples)
 {
-    mThread.Start();
+    // The drain loop starts in CreateDecoder, once mDecoder is set.
+    if (!mDrain)
+    {
+        mThread.Start();
+    }
+    if (mPipelined)
+    {
+        mBackEndThread.Start();
+    }
     CONNECT(mSource->NEW_DATA, FmDecoderThread, OnNewIQSamples, this);
 }
 
@@ -540,7 +879,8 @@ bool FmDecoderThread::CreateDecoder(double sample_rate_if,
                                     double bandwidth_if,
                                     double freq_dev,
                                     double bandwidth_pcm,
-                                    unsigned int downsample)
+                                    unsigned int downsample,
+                                    const FmDecoderOptions& options)
 {
     bool ret = false;
 
@@ -554,7 +894,13 @@ bool FmDecoderThread::CreateDecoder(double sample_rate_if,
                                  bandwidth_if,
                                  freq_dev,
                                  bandwidth_pcm,
-                                 downsample);
+                                 downsample,
+                                 options);
+        if (mDrain)
+        {
+            // Starting the thread publishes mDecoder to the drain loop.
+            mDrainThread = new std::thread(&FmDecoderThread::DrainLoop, this);
+        }
         ret = true;
     }
 
@@ -563,45 +909,504 @@ bool FmDecoderThread::CreateDecoder(double sample_rate_if,
 
 FmDecoderThread::~FmDecoderThread()
 {
+    if (mDrainThread)
+    {
+        mDrainStop = true;
+        mWakeup.Signal();
+        mDrainThread->join();
+        delete mDrainThread;
+    }
     mThread.Stop();
+    if (mPipelined)
+    {
+        mBackEndThread.Stop();
+    }
 }
 
-void FmDecoderThread::OnNewIQSamples(RtlSdrSource*)
+FmDecoderThread::LatencyStats FmDecoderThread::GetLatencyStats() const
 {
-    SCHEDULE_TASK(&mThread, &FmDecoderThread::DecodeIQSamples, this);
+    std::lock_guard<std::mutex> lock(mLatencyMutex);
+    return mLatency;
+}
+
+FmDecoderThread::WakeupStats FmDecoderThread::GetWakeupStats() const
+{
+    std::lock_guard<std::mutex> lock(mLatencyMutex);
+    return mWakeups;
+}
+
+void FmDecoderThread::WaitIdle()
+{
+    if (mDrain && mDrainThread == nullptr)
+    {
+        // No decoder yet, so nothing is queued.
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mIdleMutex);
+        mIdle = false;
+    }
+    if (mDrain)
+    {
+        // Handled after the drain loop has taken every available block.
+        mIdleRequested = true;
+        mWakeup.Signal();
+    }
+    else
+    {
+        // Tasks run in order, so the marker runs after all queued blocks.
+        SCHEDULE_TASK(&mThread, &FmDecoderThread::FrontEndIdle, this);
+    }
+
+    std::unique_lock<std::mutex> lock(mIdleMutex);
+    mIdleCond.wait(lock, [this] { return mIdle; });
+}
+
+void FmDecoderThread::FrontEndIdle()
+{
+    if (mPipelined)
+    {
+        SCHEDULE_TASK(&mBackEndThread, &FmDecoderThread::BackEndIdle, this);
+    }
+    else
+    {
+        BackEndIdle();
+    }
+}
+
+void FmDecoderThread::BackEndIdle()
+{
+    {
+        std::lock_guard<std::mutex> lock(mIdleMutex);
+        mIdle = true;
+    }
+    mIdleCond.notify_all();
+}
+
+void FmDecoderThread::OnNewIQSamples(IQSampleSource*)
+{
+    if (mDrain)
+    {
+        // Runs on the source thread: remember when the first block
+        // arrived since the last wakeup and poke the drain loop.
+        Clock::rep none = 0;
+        mSignalTime.compare_exchange_strong(none, Clock::now().time_since_epoch().count());
+        mWakeup.Signal();
+        return;
+    }
 
+    // Queueing the task runs on the source thread; count what it allocates.
+    std::uint64_t allocs = alloc_count_thread();
+    SCHEDULE_TASK(&mThread, &FmDecoderThread::DecodeIQSamples, this);
+    CountAllocations(alloc_count_thread() - allocs);
 }
 
 void FmDecoderThread::DecodeIQSamples()
 {
     RTTIProfiler f("FmDecoderThread::DecodeIQSamples");
-    if (mDecoder)
+    if (mDecoder == nullptr)
     {
-        SampleBufferBlock* block = mSource->GetBlockToRead();
-        if (block)
+        return;
+    }
+
+    Clock::time_point start = Clock::now();
+    std::uint64_t allocs = alloc_count_thread();
+
+    bool gap = false;
+    StreamTime time;
+    if (!mPipelined)
+    {
+        if (DecodeFrontEnd(&mBaseband, gap, time))
         {
             ++mBlocks;
-
-            SampleVector audio;
-            mDecoder->Process(block, audio);
-            mSource->UpdateReadState();
-            mAudioOutput->write(audio);
+            if (gap)
+            {
+                mDecoder->reset_backend();
+            }
+            DecodeBackEnd(mBaseband, time);
+            CountAllocations(alloc_count_thread() - allocs);
+            UpdateLatency(start);
             if (mPrintStats)
             {
-                PRINT("\rblk=%6d  freq=%8.4fMHz  IF=%+5.1fdB  BB=%+5.1fdB  ",
-                      mBlocks,
-                      (mSource->get_frequency() + mDecoder->get_tuning_offset()) * 1.0e-6,
-                      20 * log10(mDecoder->get_if_level()),
-                      20 * log10(mDecoder->get_baseband_level()) + 3.01);
-                if (mDecoder->stereo_detected())
-                {
-                    PRINT("stereo (level: %.4f)", mDecoder->get_pilot_level());
-                }
-                else
-                {
-                    PRINT("                      ");
-                }
+                PrintStats(GetFrontEndStats());
             }
         }
+        return;
+    }
+
+    // Leave core 0 to the dongle thread and the OS.
+    if (!mFrontEndPinned)
+    {
+        pin_decoder_thread("front end", 0);
+        mFrontEndPinned = true;
+    }
+
+    BasebandBlock* out = GetPipelineBlock();
+    if (out)
+    {
+        if (DecodeFrontEnd(&out->samples, gap, out->time))
+        {
+            ++mBlocks;
+            out->start = start;
+            out->gap = gap;
+            out->stats = GetFrontEndStats();
+            mPipeline.UpdateWriteState();
+            SCHEDULE_TASK(&mBackEndThread, &FmDecoderThread::DecodeBaseband, this);
+            CountAllocations(alloc_count_thread() - allocs);
+        }
+    }
+    else if (DecodeFrontEnd(nullptr, gap, time))
+    {
+        // Back end can not keep up; drop the block like the source does.
+        // The next block will not continue the stream and counts as a gap.
+        ++mBlocks;
+        SWAR("Pipeline is full");
+    }
+}
+
+// Run the front end on the next source block; drop it if baseband is null.
+// Set gap if the block does not continue the previously decoded one,
+// and set time to the samples and capture time of the block.
+bool FmDecoderThread::DecodeFrontEnd(SampleVector* baseband, bool& gap, StreamTime& time)
+{
+    if (mSource->raw_samples())
+    {
+        RawSampleBufferBlock* block = mSource->GetRawBlockToRead();
+        if (block == nullptr)
+        {
+            return false;
+        }
+        if (baseband)
+        {
+            gap = StartBlock(block->sample_index, block->size);
+            mDecoder->process_frontend(block->samples, block->size, *baseband);
+        }
+        time.sample_index = block->sample_index;
+        time.num_samples = block->size;
+        time.capture = block->capture_time;
+        mSource->UpdateRawReadState();
+    }
+    else
+    {
+        SampleBufferBlock* block = mSource->GetBlockToRead();
+        if (block == nullptr)
+        {
+            return false;
+        }
+        if (baseband)
+        {
+            gap = StartBlock(block->sample_index, block->size);
+            mDecoder->process_frontend(block->samples, block->size, *baseband);
+        }
+        time.sample_index = block->sample_index;
+        time.num_samples = block->size;
+        time.capture = block->capture_time;
+        mSource->UpdateReadState();
+    }
+    return true;
+}
+
+// Check a block for a gap in the sample stream and reset the front end
+// if there is one; return true on a gap.
+bool FmDecoderThread::StartBlock(std::uint64_t sample_index, std::size_t size)
+{
+    bool gap = sample_index != mNextSampleIndex;
+    if (gap)
+    {
+        ++mGaps;
+        SDEB("gap before sample %llu (expected %llu)",
+             (unsigned long long)sample_index,
+             (unsigned long long)mNextSampleIndex);
+        mDecoder->reset_frontend();
+    }
+    mNextSampleIndex = sample_index + size;
+    return gap;
+}
+
+void FmDecoderThread::DrainLoop()
+{
+    SDEB("Started DrainLoop");
+    while (!mDrainStop)
+    {
+        mWakeup.Wait();
+        if (mDrainStop)
+        {
+            break;
+        }
+
+        Clock::rep signalled = mSignalTime.exchange(0);
+        if (signalled)
+        {
+            double latency = std::chrono::duration<double>(
+                Clock::now() - Clock::time_point(Clock::duration(signalled))).count();
+            std::lock_guard<std::mutex> lock(mLatencyMutex);
+            ++mWakeups.wakeups;
+            mWakeupTotal += latency;
+            mWakeups.mean = mWakeupTotal / mWakeups.wakeups;
+            mWakeups.max = std::max(mWakeups.max, latency);
+        }
+
+        DrainBlocks();
+        if (mIdleRequested.exchange(false))
+        {
+            FrontEndIdle();
+        }
+    }
+    SDEB("Stopped DrainLoop");
+}
+
+// Decode every block in the source ring, joining the baseband of
+// consecutive blocks into batches for the back end.
+void FmDecoderThread::DrainBlocks()
+{
+    RTTIProfiler f("FmDecoderThread::DrainBlocks");
+    if (mPipelined && !mFrontEndPinned)
+    {
+        pin_decoder_thread("front end", 0);
+        mFrontEndPinned = true;
+    }
+
+    std::uint64_t blocks = 0;
+    std::uint64_t batches = 0;
+    StreamTime batch;
+    bool batch_gap = false;
+    Clock::time_point batch_start;
+    std::uint64_t allocs = alloc_count_thread();
+
+    for (;;)
+    {
+        Clock::time_point start = Clock::now();
+        bool gap = false;
+        StreamTime time;
+        if (!DecodeFrontEnd(&mBaseband, gap, time))
+        {
+            break;
+        }
+        ++mBlocks;
+        ++blocks;
+
+        // The back end must not run across a gap.
+        if (gap && batch.num_samples)
+        {
+            DecodeBatch(batch_gap, batch_start, batch);
+            ++batches;
+            batch.num_samples = 0;
+        }
+
+        if (batch.num_samples == 0)
+        {
+            // Swap rather than copy; both buffers keep their capacity.
+            mBatch.swap(mBaseband);
+            batch = time;
+            batch_gap = gap;
+            batch_start = start;
+        }
+        else
+        {
+            mBatch.insert(mBatch.end(), mBaseband.begin(), mBaseband.end());
+            batch.num_samples += time.num_samples;
+            batch.capture = time.capture;
+        }
+
+        if (batch.num_samples >= mBatchSamples)
+        {
+            DecodeBatch(batch_gap, batch_start, batch);
+            ++batches;
+            batch.num_samples = 0;
+        }
+    }
+
+    // Never wait for more blocks; decode what was collected.
+    if (batch.num_samples)
+    {
+        DecodeBatch(batch_gap, batch_start, batch);
+        ++batches;
+    }
+
+    CountAllocations(alloc_count_thread() - allocs);
+    std::lock_guard<std::mutex> lock(mLatencyMutex);
+    mWakeups.blocks += blocks;
+    mWakeups.batches += batches;
+}
+
+// Run the back end on mBatch, or hand it to the back end thread.
+void FmDecoderThread::DecodeBatch(bool gap, Clock::time_point start,
+                                  const StreamTime& time)
+{
+    if (!mPipelined)
+    {
+        if (gap)
+        {
+            mDecoder->reset_backend();
+        }
+        DecodeBackEnd(mBatch, time);
+        UpdateLatency(start);
+        if (mPrintStats)
+        {
+            PrintStats(GetFrontEndStats());
+        }
+        return;
+    }
+
+    BasebandBlock* out = GetPipelineBlock();
+    if (out == nullptr)
+    {
+        // Back end can not keep up; the next batch does not continue this one.
+        mBackEndGap = true;
+        SWAR("Pipeline is full");
+        return;
+    }
+    out->samples.swap(mBatch);
+    out->start = start;
+    out->time = time;
+    out->gap = gap || mBackEndGap;
+    out->stats = GetFrontEndStats();
+    mBackEndGap = false;
+    mPipeline.UpdateWriteState();
+    SCHEDULE_TASK(&mBackEndThread, &FmDecoderThread::DecodeBaseband, this);
+}
+
+void FmDecoderThread::DecodeBaseband()
+{
+    RTTIProfiler f("FmDecoderThread::DecodeBaseband");
+    if (!mBackEndPinned)
+    {
+        pin_decoder_thread("back end", 1);
+        mBackEndPinned = true;
+    }
+
+    BasebandBlock* in = mPipeline.GetBlockToRead();
+    if (in)
+    {
+        std::uint64_t allocs = alloc_count_thread();
+        if (in->gap)
+        {
+            mDecoder->reset_backend();
+        }
+        DecodeBackEnd(in->samples, in->time);
+        Clock::time_point start = in->start;
+        FrontEndStats stats = in->stats;
+        mPipeline.UpdateReadState();
+        if (!mRealtime)
+        {
+            mPipelineSpace.Signal();
+        }
+        CountAllocations(alloc_count_thread() - allocs);
+        UpdateLatency(start);
+        if (mPrintStats)
+        {
+            PrintStats(stats);
+        }
+    }
+}
+
+// Return a free pipeline block, or null if the pipeline is full. A source
+// that does not run in real time waits for its consumer and never drops
+// samples, so wait for the back end to free a block instead.
+FmDecoderThread::BasebandBlock* FmDecoderThread::GetPipelineBlock()
+{
+    BasebandBlock* out = mPipeline.GetBlockToWrite();
+    while (out == nullptr && !mRealtime)
+    {
+        // Every block in the pipeline has a back end task queued, so
+        // the back end frees one without help from this thread.
+        mPipelineSpace.Wait();
+        out = mPipeline.GetBlockToWrite();
+    }
+    return out;
+}
+
+// Run the back end, write the audio and the PPS events.
+void FmDecoderThread::DecodeBackEnd(const SampleVector& baseband, const StreamTime& time)
+{
+    mDecoder->process_backend(baseband, mAudio, time);
+    mAudioOutput->write_stamped(mAudio, time.capture);
+    if (mPpsFile)
+    {
+        WritePps();
+    }
+}
+
+void FmDecoderThread::WritePps()
+{
+    for (const PilotPhaseLock::PpsEvent& ev : mDecoder->get_pps_events())
+    {
+        fprintf(mPpsFile, "%8llu %14llu %18.6f\n",
+                (unsigned long long)ev.pps_index,
+                (unsigned long long)ev.sample_index,
+                ev.unix_time);
+        fflush(mPpsFile);
+    }
+}
+
+void FmDecoderThread::UpdateLatency(Clock::time_point start)
+{
+    double latency = std::chrono::duration<double>(Clock::now() - start).count();
+    std::lock_guard<std::mutex> lock(mLatencyMutex);
+    ++mLatency.blocks;
+    mLatencyTotal += latency;
+    mLatency.mean = mLatencyTotal / mLatency.blocks;
+    mLatency.max = std::max(mLatency.max, latency);
+}
+
+void FmDecoderThread::CountAllocations(std::uint64_t allocs)
+{
+    // The first blocks size the buffers; after that nothing should allocate.
+    if (mBlocks > alloc_warmup_blocks)
+    {
+        mAllocs += allocs;
+    }
+}
+
+// Copy the front end state for PrintStats; call on the front end thread.
+FmDecoderThread::FrontEndStats FmDecoderThread::GetFrontEndStats() const
+{
+    FrontEndStats stats;
+    stats.if_level = mDecoder->get_if_level();
+    stats.baseband_level = mDecoder->get_baseband_level();
+    stats.tuning_offset = mDecoder->get_tuning_offset();
+    return stats;
+}
+
+void FmDecoderThread::PrintStats(const FrontEndStats& stats)
+{
+    PRINT("\rblk=%6d  freq=%8.4fMHz  IF=%+5.1fdB  BB=%+5.1fdB  lat=%5.1fms  ",
+          mBlocks.load(),
+          (mSource->get_frequency() + stats.tuning_offset) * 1.0e-6,
+          20 * log10(stats.if_level),
+          20 * log10(stats.baseband_level) + 3.01,
+          GetLatencyStats().mean * 1.0e3);
+    if (mAudioOutput->get_latency_stats().blocks)
+    {
+        PRINT("cap=%5.1fms  ", mAudioOutput->get_latency_stats().last * 1.0e3);
+    }
+    AudioOutput::BufferStats buf;
+    if (mAudioOutput->get_buffer_stats(buf))
+    {
+        PRINT("buf=%4.1fms (%4.1f-%4.1f) xrun=%llu/%llu  ",
+              buf.fill * 1.0e3, buf.low * 1.0e3, buf.high * 1.0e3,
+              (unsigned long long)buf.underruns, (unsigned long long)buf.overruns);
+        if (buf.drift_ppm != 0)
+        {
+            PRINT("drift=%+4.0fppm  ", buf.drift_ppm);
+        }
+    }
+    if (alloc_counter_enabled())
+    {
+        PRINT("alloc=%llu  ", (unsigned long long)mAllocs.load());
+    }
+    SampleRingStats overruns = mSource->GetOverrunStats();
+    if (overruns.overruns || mGaps)
+    {
+        PRINT("ovr=%llu gap=%llu  ", (unsigned long long)overruns.overruns,
+              (unsigned long long)mGaps.load());
+    }
+    if (mDecoder->stereo_detected())
+    {
+        PRINT("stereo (level: %.4f)", mDecoder->get_pilot_level());
+    }
+    else
+    {
+        PRINT("                      ");
     }
 }
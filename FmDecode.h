@@ -8,6 +8,7 @@
 #include "Filter.h"
 
 class SampleBufferBlock;
+class RawSampleBufferBlock;
 
 /* Detect frequency by phase discrimination between successive samples. */
 class PhaseDiscriminator
@@ -19,8 +20,12 @@ public:
      *
      * max_freq_dev :: Full scale frequency deviation relative to the
      *                 full sample frequency.
+     * accuracy     :: Accuracy tier of the atan2 approximation.
+     * simd         :: Instruction set level for the vectorized kernel.
      */
-    PhaseDiscriminator(double max_freq_dev);
+    PhaseDiscriminator(double max_freq_dev,
+                       Atan2Accuracy accuracy=Atan2Accuracy::Fast,
+                       SimdLevel simd=simd_detect());
 
     /**
      * Process samples.
@@ -29,9 +34,20 @@ public:
      */
     void process(const IQSampleVector& samples_in, SampleVector& samples_out);
 
+    /** Process n samples from samples_in into samples_out. */
+    void process(const IQSample *samples_in, unsigned int n,
+                 Sample *samples_out);
+
+    /**
+     * Forget the previous sample, e.g. after a gap in the input.
+     * The first output sample after a reset is zero.
+     */
+    void reset();
+
 private:
-    const Sample m_freq_scale_factor;
-    IQSample     m_last_sample;
+    const Sample    m_freq_scale_factor;
+    IQSample        m_last_sample;
+    PhaseDiscKernel m_kernel;
 };
 
 
@@ -49,6 +65,7 @@ public:
         std::uint64_t   pps_index;
         std::uint64_t   sample_index;
         double          block_position;
+        double          unix_time;      // 0 if the block had no capture time
     };
 
     /**
@@ -58,8 +75,17 @@ public:
      *               (0.5 is Nyquist)
      * bandwidth  :: bandwidth relative to sample frequency
      * minsignal  :: minimum pilot amplitude
+     * subblock   :: 0 to run the loop for every sample; otherwise run the
+     *               loop filter once per this many samples on the averaged
+     *               phase error, with the oscillator generated by a
+     *               vectorized rotator (fastest for multiples of nco_lanes).
+     *               The loop bandwidth must be far below
+     *               (sample rate / subblock).
+     * simd       :: Instruction set for the oscillator kernel
+     *               (default: best level supported by the CPU).
      */
-    PilotPhaseLock(double freq, double bandwidth, double minsignal);
+    PilotPhaseLock(double freq, double bandwidth, double minsignal,
+                   unsigned int subblock=0, SimdLevel simd=simd_detect());
 
     /**
      * Process samples and extract 19 kHz pilot tone.
@@ -67,6 +93,12 @@ public:
      */
     void process(const SampleVector& samples_in, SampleVector& samples_out);
 
+    /**
+     * Restart the loop from the center frequency, e.g. after a gap in
+     * the input. PPS counters continue.
+     */
+    void reset();
+
     /** Return true if the phase-locked loop is locked. */
     bool locked() const
     {
@@ -86,11 +118,28 @@ public:
     }
 
 private:
-    Sample  m_minfreq, m_maxfreq;
+    /** Run the loop for every sample. */
+    void process_samples(const SampleVector& samples_in, SampleVector& samples_out,
+                         bool was_locked);
+
+    /** Run the loop once per sub-block. */
+    void process_subblocks(const SampleVector& samples_in, SampleVector& samples_out,
+                           bool was_locked);
+
+    /** Count a pilot period that ended at sample i of n; emit PPS events. */
+    void pilot_period(unsigned int i, unsigned int n, bool was_locked);
+
+    Sample  m_minfreq, m_maxfreq, m_centerfreq;
     Sample  m_phasor_b0, m_phasor_a1, m_phasor_a2;
     Sample  m_phasor_i1, m_phasor_i2, m_phasor_q1, m_phasor_q2;
     Sample  m_loopfilter_b0, m_loopfilter_b1;
     Sample  m_loopfilter_x1;
+    unsigned int    m_subblock;
+    Sample  m_sub_phasor_b0, m_sub_phasor_a1, m_sub_phasor_a2;
+    Sample  m_sub_loopfilter_b0;
+    IQSample        m_sub_mix;
+    unsigned int    m_sub_count;
+    PilotMixKernel  m_mix_kernel;
     Sample  m_freq, m_phase;
     Sample  m_minsignal;
     Sample  m_pilot_level;
@@ -103,6 +152,60 @@ private:
 };
 
 
+/** Optional processing modes for FmDecoder. */
+struct FmDecoderOptions
+{
+    /**
+     * Decimate inside the IF filter instead of after the phase
+     * discriminator. The IF filter then only computes every Nth output
+     * sample and the discriminator runs at the reduced baseband rate.
+     */
+    bool if_decimation = false;
+
+    /**
+     * Tune with an NCO (exact frequency offset) instead of the 64-entry
+     * table of FineTuner, which rounds the offset to (sample_rate / 64).
+     */
+    bool exact_tuning = true;
+
+    /**
+     * Accuracy of the atan2 approximation in the phase discriminator.
+     * Fast is accurate to 0.3 degrees, which is below the noise floor of
+     * most broadcast signals; Accurate costs a few more multiplies.
+     */
+    Atan2Accuracy atan2_accuracy = Atan2Accuracy::Fast;
+
+    /**
+     * Baseband samples per update of the stereo pilot PLL loop filter;
+     * 0 runs the loop for every sample (sin/cos per sample, slow).
+     * See PilotPhaseLock.
+     */
+    unsigned int pilot_subblock = 32;
+
+    /**
+     * Decimate the mono and stereo audio signals in halfband stages
+     * before the final fractional resampler, instead of running one
+     * long filter at the baseband rate. The stages and the final
+     * resampler reject aliases and images by filter.atten, or 100 dB
+     * with Lanczos ("softfm_bench -T" checks them against the single
+     * stage). Off by default: with the SIMD FIR kernels the single
+     * stage is about as fast.
+     */
+    bool audio_halfband = false;
+
+    /**
+     * Design method and quality target of the IF, baseband and audio
+     * filters. Lanczos keeps the fixed filter orders (10 taps for the IF
+     * filter, 8 per unit of downsampling for the baseband filter, one per
+     * kHz of baseband rate for the audio filter). Kaiser and equiripple
+     * size every filter to the smallest order that reaches filter.ripple
+     * and filter.atten; the transition bands are set per stage and
+     * filter.transition is ignored.
+     */
+    FirDesign filter;
+};
+
+
 /** Complete decoder for FM broadcast signal. */
 class FmDecoder
 {
@@ -132,6 +235,7 @@ public:
      *                     (15 kHz for broadcast FM)
      * downsample       :: Downsampling factor to apply after FM demodulation.
      *                     Set to 1 to disable.
+     * options          :: Optional processing modes.
      */
     FmDecoder(double sample_rate_if,
               double tuning_offset,
@@ -141,7 +245,8 @@ public:
               double bandwidth_if=default_bandwidth_if,
               double freq_dev=default_freq_dev,
               double bandwidth_pcm=default_bandwidth_pcm,
-              unsigned int downsample=1);
+              unsigned int downsample=1,
+              const FmDecoderOptions& options=FmDecoderOptions());
 
     /**
      * Process IQ samples and return audio samples.
@@ -152,7 +257,58 @@ public:
      * vector only contains samples for one channel.
      */
     void process(const IQSampleVector& samples_in, SampleVector& audio);
+
+    /**
+     * Process a block from an IQSampleSource. The capture time of the
+     * block is used to time the PPS events of this block.
+     */
     void Process(const SampleBufferBlock* samples_in, SampleVector& audio);
+    void Process(const RawSampleBufferBlock* samples_in, SampleVector& audio);
+
+    /**
+     * Run the front end of the decoder: fine tuner, IF filter, phase
+     * discriminator and baseband downsampler. Produces the baseband
+     * signal at the downsampled rate.
+     *
+     * Front end and back end use separate state, so they may run on
+     * two threads as long as each is only called from one thread and
+     * the baseband blocks are passed on in order.
+     */
+    void process_frontend(const IQSample *samples_in, unsigned int n,
+                          SampleVector& baseband);
+
+    /**
+     * Run the front end on raw unsigned 8-bit I/Q pairs (2 * n bytes).
+     *
+     * Fine tuner and IF filter run in 16-bit fixed point and samples are
+     * only converted to float at the phase discriminator. The tuner uses
+     * a table of raw_tuning_table_size entries instead of the NCO.
+     */
+    void process_frontend(const std::uint8_t *samples_in, unsigned int n,
+                          SampleVector& baseband);
+
+    /**
+     * Run the back end of the decoder: stereo pilot PLL, mono and stereo
+     * audio extraction, DC blocking and de-emphasis.
+     */
+    void process_backend(const SampleVector& baseband, SampleVector& audio);
+
+    /**
+     * Run the back end on baseband that the front end made from the IQ
+     * samples described by "time", which times the PPS events.
+     */
+    void process_backend(const SampleVector& baseband, SampleVector& audio,
+                         const StreamTime& time);
+
+    /**
+     * Clear the state of the front end or back end after a gap in the
+     * input, so the next block starts cleanly instead of being spliced
+     * onto unrelated history. De-emphasis and DC blocking keep their
+     * state to smooth the transition. Call each from the thread that
+     * runs that half of the decoder.
+     */
+    void reset_frontend();
+    void reset_backend();
 
     /** Return true if a stereo signal is detected. */
     bool stereo_detected() const
@@ -163,7 +319,11 @@ public:
     /** Return actual frequency offset in Hz with respect to receiver LO. */
     double get_tuning_offset() const
     {
-        double tuned = - m_tuning_shift * m_sample_rate_if /
+        double tuned = m_raw_frontend ?
+                       - m_raw_tuning_shift * m_sample_rate_if /
+                       double(raw_tuning_table_size) :
+                       m_exact_tuning ? m_tuning_offset :
+                       - m_tuning_shift * m_sample_rate_if /
                        double(m_tuning_table_size);
         return tuned + m_baseband_mean * m_freq_dev;
     }
@@ -186,13 +346,42 @@ public:
         return m_pilotpll.get_pilot_level();
     }
 
-    /** Return PPS events from the most recently processed block. */
-    std::vector<PilotPhaseLock::PpsEvent> get_pps_events() const
-    {
-        return m_pilotpll.get_pps_events();
-    }
+    /**
+     * Return PPS events from the most recently processed block, with
+     * their Unix time if the block had a capture time.
+     */
+    std::vector<PilotPhaseLock::PpsEvent> get_pps_events() const;
 
 private:
+    /** Number of IF filter output samples per tile in the fused front end. */
+    static const unsigned int frontend_tile_size = 1024;
+
+    /** Size of the oscillator table of the 8-bit fine tuner. */
+    static const unsigned int raw_tuning_table_size = 1024;
+
+    /**
+     * Run fine tuner, IF filter and phase discriminator over a block
+     * of IQ samples. Writes the (not yet downsampled) baseband signal
+     * to m_buf_baseband and updates the IF level.
+     *
+     * The block is processed in small tiles that pass through all three
+     * stages while they are still in cache. The output is identical to
+     * running each stage over the complete block.
+     */
+    template <class T>
+    void demodulate(const T *samples_in, unsigned int n);
+
+    /**
+     * Fine tune and filter one tile into m_buf_iffiltered.
+     * Return the number of filtered samples.
+     */
+    unsigned int tune_and_filter(const IQSample *samples_in, unsigned int n);
+    unsigned int tune_and_filter(const std::uint8_t *samples_in,
+                                 unsigned int n);
+
+    /** Downsample the demodulated signal and measure the baseband level. */
+    void finish_frontend(SampleVector& baseband);
+
     /** Demodulate stereo L-R signal. */
     void demod_stereo(const SampleVector& samples_baseband,
                       SampleVector& samples_stereo);
@@ -211,44 +400,100 @@ private:
     const double    m_sample_rate_baseband;
     const int       m_tuning_table_size;
     const int       m_tuning_shift;
+    const int       m_raw_tuning_shift;
+    const double    m_tuning_offset;
+    const bool      m_exact_tuning;
     const double    m_freq_dev;
     const unsigned int m_downsample;
     const bool      m_stereo_enabled;
+    const bool      m_if_decimation;
+    bool            m_raw_frontend;
     bool            m_stereo_detected;
     double          m_if_level;
     double          m_baseband_mean;
     double          m_baseband_level;
+    StreamTime      m_backend_time;
 
     IQSampleVector  m_buf_iftuned;
+    std::vector<std::int16_t> m_buf_iftuned_s16;
     IQSampleVector  m_buf_iffiltered;
     SampleVector    m_buf_baseband;
+    SampleVector    m_buf_frontend;
     SampleVector    m_buf_mono;
     SampleVector    m_buf_rawstereo;
     SampleVector    m_buf_stereo;
 
     FineTuner           m_finetuner;
+    NcoTuner            m_ncotuner;
     LowPassFilterFirIQ  m_iffilter;
+    FineTunerU8         m_finetuner_u8;
+    LowPassFilterFirS16 m_iffilter_s16;
     PhaseDiscriminator  m_phasedisc;
     DownsampleFilter    m_resample_baseband;
     PilotPhaseLock      m_pilotpll;
-    DownsampleFilter    m_resample_mono;
-    DownsampleFilter    m_resample_stereo;
+    MultistageDownsampleFilter m_resample_audio;
     HighPassFilterIir   m_dcblock_mono;
     HighPassFilterIir   m_dcblock_stereo;
     LowPassFilterRC     m_deemph_mono;
     LowPassFilterRC     m_deemph_stereo;
 };
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+
+#include <thread>
+
 #include "threads/iothread.h"
+#include "SpscRing.h"
+#include "WakeupEvent.h"
 
-class RtlSdrSource;
+class IQSampleSource;
 class AudioOutput;
 
 class FmDecoderThread
 {
 public:
-    FmDecoderThread(RtlSdrSource* src,
-                    AudioOutput* output);
+    /** End-to-end latency, from taking a block from the source to writing its audio. */
+    struct LatencyStats
+    {
+        std::uint64_t   blocks;
+        double          mean;       // seconds
+        double          max;        // seconds
+    };
+
+    /** Drain mode: wakeups of the decoder thread and what they found. */
+    struct WakeupStats
+    {
+        std::uint64_t   wakeups;
+        std::uint64_t   blocks;     // source blocks decoded
+        std::uint64_t   batches;    // back end runs
+        double          mean;       // seconds from NEW_DATA to decoding
+        double          max;        // seconds
+    };
+
+    /**
+     * pipelined     :: Run the decoder front end and back end on two threads
+     *                  pinned to separate cores, connected by a lock-free ring.
+     *                  When the ring is full, blocks from a real-time source
+     *                  are dropped; otherwise the front end waits.
+     * drain         :: Decode on a dedicated thread woken by an eventfd,
+     *                  which takes all available blocks per wakeup instead
+     *                  of one block per NEW_DATA task. The thread starts
+     *                  in CreateDecoder; blocks that arrive earlier wait
+     *                  in the source ring.
+     * batch_samples :: In drain mode, join the baseband of consecutive
+     *                  blocks for the back end until this many IQ samples
+     *                  are collected (0 = every block on its own). Only
+     *                  blocks that are already waiting are joined.
+     */
+    FmDecoderThread(IQSampleSource* src,
+                    AudioOutput* output,
+                    bool pipelined = false,
+                    bool drain = false,
+                    unsigned int batch_samples = 0);
     bool CreateDecoder(double sample_rate_if,
                        double tuning_offset,
                        double sample_rate_pcm,
@@ -257,21 +502,127 @@ public:
                        double bandwidth_if = FmDecoder::default_bandwidth_if,
                        double freq_dev = FmDecoder::default_freq_dev,
                        double bandwidth_pcm = FmDecoder::default_bandwidth_pcm,
-                       unsigned int downsample = 1);
+                       unsigned int downsample = 1,
+                       const FmDecoderOptions& options = FmDecoderOptions());
 
     ~FmDecoderThread();
 
+    LatencyStats GetLatencyStats() const;
+
+    WakeupStats GetWakeupStats() const;
+
+    /**
+     * Write a line per PPS event to "file" (not owned), timed by the
+     * capture time of the blocks; nullptr to stop. Call before starting
+     * the source.
+     */
+    void SetPpsFile(std::FILE* file)
+    {
+        mPpsFile = file;
+    }
+
+    /** Wait until every block taken from the source is decoded and written. */
+    void WaitIdle();
+
+    /**
+     * Return the number of heap allocations made while decoding after
+     * the first blocks (always 0 unless built with SOFTFM_COUNT_ALLOCS).
+     */
+    std::uint64_t GetSteadyStateAllocations() const
+    {
+        return mAllocs;
+    }
+
 private:
-    void OnNewIQSamples(RtlSdrSource*);
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Front end state shown in the statistics line. It is copied on the
+     * front end thread, because the back end thread prints the line.
+     */
+    struct FrontEndStats
+    {
+        double if_level;
+        double baseband_level;
+        double tuning_offset;
+    };
+
+    /** Front end output handed to the back end thread. */
+    struct BasebandBlock
+    {
+        SampleVector samples;
+        Clock::time_point start;
+        StreamTime time;
+        bool gap;       // samples were lost before this block
+        FrontEndStats stats;
+    };
+
+    /** Number of baseband blocks between front end and back end. */
+    static const unsigned int pipeline_depth = 8;
+
+    /** Number of blocks before allocations are counted. */
+    static const unsigned int alloc_warmup_blocks = 16;
+
+    void OnNewIQSamples(IQSampleSource*);
     void DecodeIQSamples();
+    bool DecodeFrontEnd(SampleVector* baseband, bool& gap, StreamTime& time);
+    bool StartBlock(std::uint64_t sample_index, std::size_t size);
+    void DrainLoop();
+    void DrainBlocks();
+    void DecodeBatch(bool gap, Clock::time_point start, const StreamTime& time);
+    void DecodeBackEnd(const SampleVector& baseband, const StreamTime& time);
+    void WritePps();
+    void DecodeBaseband();
+    BasebandBlock* GetPipelineBlock();
+    void FrontEndIdle();
+    void BackEndIdle();
+    void UpdateLatency(Clock::time_point start);
+    void CountAllocations(std::uint64_t allocs);
+    FrontEndStats GetFrontEndStats() const;
+    void PrintStats(const FrontEndStats& stats);
 
     LF::threads::IOThread mThread;
+    LF::threads::IOThread mBackEndThread;
     FmDecoder* mDecoder { nullptr };
-    RtlSdrSource* mSource { nullptr };
+    IQSampleSource* mSource { nullptr };
     AudioOutput* mAudioOutput { nullptr };
 
+    const bool mPipelined;
+    const bool mRealtime;           // the source drops samples if we fall behind
+    WakeupEvent mPipelineSpace;     // the back end freed a pipeline block
+    bool mFrontEndPinned { false };
+    bool mBackEndPinned { false };
+    SpscRing<BasebandBlock> mPipeline { pipeline_depth };
+    SampleVector mBaseband;
+    SampleVector mAudio;
+    std::uint64_t mNextSampleIndex { 0 };
+    std::FILE* mPpsFile { nullptr };
+
+    // Drain mode.
+    const bool mDrain;
+    const unsigned int mBatchSamples;
+    std::thread* mDrainThread { nullptr };
+    WakeupEvent mWakeup;
+    std::atomic<bool> mDrainStop { false };
+    std::atomic<bool> mIdleRequested { false };
+    std::atomic<Clock::rep> mSignalTime { 0 };  // first NEW_DATA since the last wakeup
+    SampleVector mBatch;
+    bool mBackEndGap { false };     // a batch was dropped at the pipeline
+    WakeupStats mWakeups { 0, 0, 0, 0, 0 };
+    double mWakeupTotal { 0 };
+
+    mutable std::mutex mLatencyMutex;
+    LatencyStats mLatency { 0, 0, 0 };
+    double mLatencyTotal { 0 };
+
+    std::mutex mIdleMutex;
+    std::condition_variable mIdleCond;
+    bool mIdle { true };
+
     bool mPrintStats { true };
-    uint32_t mBlocks { 0 };
+    std::atomic<uint32_t> mBlocks { 0 };
+    std::atomic<std::uint64_t> mAllocs { 0 };
+    std::atomic<std::uint64_t> mGaps { 0 };
 };
 
 #endif
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+
+#include "threads/signals.h"
+
+#include "SoftFM.h"
+#include "SimdKernels.h"
+#include "SampleRing.h"
+
+#define DEFAULT_BUF_LENGTH (1 * 16384)
+
+/** Block of IQ samples in a SampleRing. */
+class SampleBufferBlock
+{
+public:
+    static const size_t sample_bytes = sizeof(IQSample);
+
+    IQSample* samples { nullptr };
+    size_t size { 0 };
+    size_t capacity { 0 };
+    std::uint64_t sample_index { 0 };   // stream index of samples[0]
+    std::uint64_t dropped { 0 };        // samples the source discarded since the previous block
+    CaptureTime capture_time;           // when the block (its last sample) was received
+};
+
+/**
+ *  Block of raw unsigned 8-bit I/Q pairs as delivered by the receiver,
+ *  for decoders with an integer front end. A quarter of the size of
+ *  SampleBufferBlock for the same number of samples.
+ */
+class RawSampleBufferBlock
+{
+public:
+    static const size_t sample_bytes = 2;
+
+    std::uint8_t* samples { nullptr };
+    size_t size { 0 };      // number of I/Q pairs
+    size_t capacity { 0 };
+    std::uint64_t sample_index { 0 };
+    std::uint64_t dropped { 0 };
+    CaptureTime capture_time;
+};
+
+/**
+ *  Asynchronous source of IQ sample blocks.
+ *
+ *  The source fills SampleBufferBlocks in a SampleRing, whose size is set
+ *  with set_ring_config(), on its own thread and emits NEW_DATA
+ *  for every block; the consumer takes blocks with GetBlockToRead() and
+ *  returns them with UpdateReadState(). Sources that support it can be
+ *  created in raw mode instead, where they fill RawSampleBufferBlocks
+ *  without conversion and the consumer uses GetRawBlockToRead() and
+ *  UpdateRawReadState().
+ *
+ *  Every block carries the stream index of its first sample. When the
+ *  source had to drop samples, the index jumps; consumers must treat
+ *  such a block as the start of a new, unrelated stretch of signal.
+ *  Blocks are also stamped with the time they were received.
+ */
+class IQSampleSource
+{
+public:
+    Signal<void(IQSampleSource*)> NEW_DATA;
+
+    virtual ~IQSampleSource() {}
+
+    /** Start streaming on the source thread. */
+    virtual bool StartAsync() = 0;
+
+    /** Stop streaming and join the source thread. */
+    virtual bool StopAsync() = 0;
+
+    /** Return sample frequency in Hz. */
+    virtual std::uint32_t get_sample_rate() = 0;
+
+    /** Return center frequency in Hz. */
+    virtual std::uint32_t get_frequency() = 0;
+
+    /**
+     * Set DC offset and I/Q imbalance correction. The correction is
+     * applied while converting raw samples; call before StartAsync().
+     */
+    void set_iq_correction(const IQCorrection& correction)
+    {
+        mCorrection = correction;
+    }
+
+    /**
+     * Set block length, number of blocks and memory of the ring between
+     * the source and its consumer; call before StartAsync().
+     */
+    void set_ring_config(const SampleRingConfig& config)
+    {
+        mRingConfig = config;
+    }
+
+    virtual SampleBufferBlock* GetBlockToRead() = 0;
+    virtual void UpdateReadState() = 0;
+
+    /**
+     * Return true if the source delivers samples in real time, so that
+     * a consumer which falls behind must drop them. A source that waits
+     * for its consumer (a recording without pacing) returns false.
+     */
+    virtual bool realtime() const
+    {
+        return true;
+    }
+
+    /** Return true if the source delivers RawSampleBufferBlocks. */
+    virtual bool raw_samples() const
+    {
+        return false;
+    }
+
+    virtual RawSampleBufferBlock* GetRawBlockToRead()
+    {
+        return nullptr;
+    }
+
+    virtual void UpdateRawReadState() {}
+
+    /** Return the overrun counters of the sample ring. */
+    virtual SampleRingStats GetOverrunStats() const
+    {
+        return SampleRingStats();
+    }
+
+protected:
+    IQCorrection mCorrection;
+    SampleRingConfig mRingConfig;
+};
@@ -24,10 +24,13 @@ void rtlsdrsrc_callback(unsigned char* buf, uint32_t len, void* ctx)
 }
 
 // Open RTL-SDR device.
-RtlSdrSource::RtlSdrSource(int dev_index, bool async) :
+RtlSdrSource::RtlSdrSource(int dev_index, bool async, bool raw) :
     mAsync(async),
+    mRaw(async && raw),
     m_dev(0),
-    m_block_length(default_block_length)
+    m_block_length(default_block_length),
+    m_num_buffers(0),
+    m_convert(select_u8_to_iq_kernel(simd_detect()))
 {
     int r;
 
@@ -41,19 +44,17 @@ RtlSdrSource::RtlSdrSource(int dev_index, bool async) :
         m_error += strerror(-r);
         m_error += ")";
     }
-
-    if (mAsync)
-    {
-        mSampleBuffer = new LF::utils::SWSRLFList<SampleBufferBlock>("RtlSdrSourceSampleBuffer");
-    }
 }
 
 
 // Close RTL-SDR device.
 RtlSdrSource::~RtlSdrSource()
 {
+    StopAsync();
     if (m_dev)
         rtlsdr_close(m_dev);
+    delete mSampleBuffer;
+    delete mRawBuffer;
 }
 
 
@@ -62,7 +63,8 @@ bool RtlSdrSource::configure(uint32_t sample_rate,
                              uint32_t frequency,
                              int tuner_gain,
                              int block_length,
-                             bool agcmode)
+                             bool agcmode,
+                             int num_buffers)
 {
     int r;
 
@@ -113,6 +115,7 @@ bool RtlSdrSource::configure(uint32_t sample_rate,
                      (block_length > 1024 * 1024) ? 1024 * 1024 :
                      block_length;
     m_block_length -= m_block_length % 4096;
+    m_num_buffers = (num_buffers < 0) ? 0 : num_buffers;
 
     // reset buffer to start streaming
     if (rtlsdr_reset_buffer(m_dev) < 0) {
@@ -128,6 +131,35 @@ bool RtlSdrSource::StartAsync()
     bool ret = false;
     if (mAsync && !mThread)
     {
+        // Every block holds one USB transfer.
+        SampleRingConfig ring = mRingConfig;
+        ring.block_length = m_block_length;
+        bool ok;
+        if (mRaw)
+        {
+            if (mRawBuffer == nullptr)
+            {
+                mRawBuffer = new SampleRing<RawSampleBufferBlock>(ring);
+            }
+            ok = bool(*mRawBuffer);
+        }
+        else
+        {
+            if (mSampleBuffer == nullptr)
+            {
+                mSampleBuffer = new SampleRing<SampleBufferBlock>(ring);
+            }
+            ok = bool(*mSampleBuffer);
+        }
+        if (!ok)
+        {
+            m_error = "can not allocate sample ring";
+            return false;
+        }
+        SDEB("sample ring: %u blocks of %d samples%s", ring.num_blocks,
+             m_block_length, (mRaw ? mRawBuffer->Huge() : mSampleBuffer->Huge()) ?
+             " in huge pages" : "");
+
         mThread = new std::thread(&RtlSdrSource::DongleThread, this, nullptr);
         ret = true;
     }
@@ -139,6 +171,15 @@ bool RtlSdrSource::StopAsync()
     bool ret = false;
     if (mAsync && mThread)
     {
+        // A callback waiting for room in the ring must not hold up the cancel.
+        if (mSampleBuffer)
+        {
+            mSampleBuffer->CancelWrite();
+        }
+        if (mRawBuffer)
+        {
+            mRawBuffer->CancelWrite();
+        }
         rtlsdr_cancel_async(m_dev);
         mThread->join();
         delete mThread;
@@ -207,12 +248,7 @@ bool RtlSdrSource::get_samples(IQSampleVector& samples)
     }
 
     samples.resize(m_block_length);
-    for (int i = 0; i < m_block_length; i++) {
-        int32_t re = buf[2*i];
-        int32_t im = buf[2*i+1];
-        samples[i] = IQSample( (re - 128) / IQSample::value_type(128),
-                               (im - 128) / IQSample::value_type(128) );
-    }
+    m_convert(buf.data(), m_block_length, mCorrection, samples.data());
 
     return true;
 }
@@ -252,46 +288,73 @@ void RtlSdrSource::UpdateReadState()
     }
 }
 
+SampleRingStats RtlSdrSource::GetOverrunStats() const
+{
+    if (mRawBuffer)
+    {
+        return mRawBuffer->Stats();
+    }
+    return mSampleBuffer ? mSampleBuffer->Stats() : SampleRingStats();
+}
+
+RawSampleBufferBlock* RtlSdrSource::GetRawBlockToRead()
+{
+    if (mRawBuffer)
+    {
+        return mRawBuffer->GetBlockToRead();
+    }
+    return nullptr;
+}
+
+void RtlSdrSource::UpdateRawReadState()
+{
+    if (mRawBuffer)
+    {
+        mRawBuffer->UpdateReadState();
+    }
+}
+
 void RtlSdrSource::DongleThread(void*)
 {
     SDEB("Started DongleThread");
-    rtlsdr_read_async(m_dev, rtlsdrsrc_callback, this, 0, 0);
+    rtlsdr_read_async(m_dev, rtlsdrsrc_callback, this,
+                      m_num_buffers, 2 * m_block_length);
     SDEB("Stopped DongleThread");
 }
 
 void RtlSdrSource::DongleCallback(uint8_t* buf, size_t len)
 {
     SDEB("+");
-//    auto* s = &mDongleState;
-//    struct demod_state *d = s->demod_target;
-
+    // Runs on the librtlsdr USB thread; keep it short to avoid dropping samples.
+    // The transfer has just completed, so this is the time of its last sample.
+    CaptureTime now = CaptureTime::now();
     size_t iqSamples = len / 2;
-    SampleBufferBlock* block = mSampleBuffer->GetBlockToWrite();
-    if (block)
+    if (mRawBuffer)
     {
-        for (size_t i = 0; i < iqSamples; ++i)
+        iqSamples = min(iqSamples, size_t(mRawBuffer->BlockLength()));
+        RawSampleBufferBlock* raw = mRawBuffer->BeginWrite(iqSamples);
+        if (raw == nullptr)
         {
-            int32_t re = buf[2 * i];
-            int32_t im = buf[2 * i + 1];
-            block->samples[i] = IQSample((re - 128) / IQSample::value_type(128),
-                                         (im - 128) / IQSample::value_type(128));
+            SWAR("RawBuffer is full, dropped %zu samples", iqSamples);
+            return;
         }
-        block->size = iqSamples;
-//        if (!s->offset_tuning)
-//        {
-//            rotate_90(buf, len);
-//        }
-//        for (int i = 0; i < (int)len; i++)
-//        {
-//            block->buf16[i] = (int16_t)buf[i] - 127;
-//        }
-//        block->len = len;
-        mSampleBuffer->UpdateWriteState();
+        memcpy(raw->samples, buf, 2 * iqSamples);
+        raw->capture_time = now;
+        mRawBuffer->EndWrite();
+        NEW_DATA.Emit(this);
+        return;
     }
-    else
+
+    iqSamples = min(iqSamples, size_t(mSampleBuffer->BlockLength()));
+    SampleBufferBlock* block = mSampleBuffer->BeginWrite(iqSamples);
+    if (block == nullptr)
     {
-        SWAR("SampleBuffer is full");
+        SWAR("SampleBuffer is full, dropped %zu samples", iqSamples);
+        return;
     }
+    m_convert(buf, iqSamples, mCorrection, block->samples);
+    block->capture_time = now;
+    mSampleBuffer->EndWrite();
     NEW_DATA.Emit(this);
 }
 
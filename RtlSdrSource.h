@@ -5,44 +5,22 @@
 #include <vector>
 #include <thread>
 
-#include "threads/signals.h"
-#include "utils/swsrlflist.h"
-
-#include "SoftFM.h"
-
-#define MAXIMUM_OVERSAMPLE 16
-#define DEFAULT_BUF_LENGTH (1 * 16384)
-#define MAXIMUM_BUF_LENGTH (MAXIMUM_OVERSAMPLE * DEFAULT_BUF_LENGTH)
-
-class SampleBufferBlock : public LF::utils::SWSRLFListBlock
-{
-public:
-    IQSample samples[MAXIMUM_BUF_LENGTH];
-    size_t size;
-};
-
-class IQSampleSource
-{
-public:
-//    virtual ~SampleSource() {}
-//    virtual bool Start() = 0;
-//    SampleSource();
-//    Signal<void(SampleSource*)> NEW_DATA;
-
-    virtual SampleBufferBlock* GetBlockToRead() = 0;
-    virtual void UpdateReadState() = 0;
-};
+#include "IQSampleSource.h"
 
 class RtlSdrSource : public IQSampleSource
 {
 public:
 
-    Signal<void(RtlSdrSource*)> NEW_DATA;
-
     static const int default_block_length = 65536;
 
-    /** Open RTL-SDR device. */
-    RtlSdrSource(int dev_index, bool async = false);
+    /**
+     * Open RTL-SDR device.
+     *
+     * async    :: stream blocks from a thread, see StartAsync().
+     * raw      :: in async mode, deliver RawSampleBufferBlocks with the
+     *             unconverted 8-bit samples (no I/Q correction).
+     */
+    RtlSdrSource(int dev_index, bool async = false, bool raw = false);
 
     /** Close RTL-SDR device. */
     ~RtlSdrSource();
@@ -53,7 +31,11 @@ public:
      * sample_rate  :: desired sample rate in Hz.
      * frequency    :: desired center frequency in Hz.
      * tuner_gain   :: desired tuner gain in 0.1 dB, or INT_MIN for auto-gain.
-     * block_length :: preferred number of samples per block.
+     * block_length :: preferred number of samples per block; in async
+     *                 mode also the length of the USB transfers.
+     * agcmode      :: enable the RTL2832 AGC.
+     * num_buffers  :: number of USB transfer buffers in async mode
+     *                 (0 = librtlsdr default).
      *
      * Return true for success, false if an error occurred.
      */
@@ -61,16 +43,17 @@ public:
                    std::uint32_t frequency,
                    int tuner_gain,
                    int block_length=default_block_length,
-                   bool agcmode=false);
+                   bool agcmode=false,
+                   int num_buffers=0);
 
-    bool StartAsync();
-    bool StopAsync();
+    bool StartAsync() override;
+    bool StopAsync() override;
 
     /** Return current sample frequency in Hz. */
-    std::uint32_t get_sample_rate();
+    std::uint32_t get_sample_rate() override;
 
     /** Return current center frequency in Hz. */
-    std::uint32_t get_frequency();
+    std::uint32_t get_frequency() override;
 
     /** Return current tuner gain in units of 0.1 dB. */
     int get_tuner_gain();
@@ -112,9 +95,21 @@ public:
     SampleBufferBlock* GetBlockToRead() override;
     void UpdateReadState() override;
 
+    bool raw_samples() const override
+    {
+        return mRaw;
+    }
+
+    RawSampleBufferBlock* GetRawBlockToRead() override;
+    void UpdateRawReadState() override;
+
+    SampleRingStats GetOverrunStats() const override;
+
 private:
     const bool mAsync;
-    LF::utils::SWSRLFList<SampleBufferBlock>* mSampleBuffer { nullptr };
+    const bool mRaw;
+    SampleRing<SampleBufferBlock>* mSampleBuffer { nullptr };
+    SampleRing<RawSampleBufferBlock>* mRawBuffer { nullptr };
     std::thread* mThread { nullptr };
 
     void DongleThread(void*);
@@ -122,6 +117,8 @@ private:
 
     struct rtlsdr_dev * m_dev;
     int                 m_block_length;
+    int                 m_num_buffers;
+    U8ToIQKernel        m_convert;
     std::string         m_devname;
     std::string         m_error;
 
@@ -0,0 +1,88 @@
+#include <cstdlib>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#include "SampleRing.h"
+
+static const std::size_t huge_page_size = 2 * 1024 * 1024;
+static const std::size_t page_size = 4096;
+
+HugePageMemory::HugePageMemory(std::size_t size, bool hugepages)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+#ifdef __linux__
+    if (hugepages)
+    {
+        // Explicit huge pages; only available if the administrator reserved them.
+        std::size_t huge_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+        void* data = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+        {
+            mData = data;
+            mSize = huge_size;
+            mHuge = true;
+            return;
+        }
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        return;
+    }
+    mData = data;
+    mSize = size;
+
+#ifdef MADV_HUGEPAGE
+    if (hugepages)
+    {
+        // Ask for transparent huge pages instead; failure is harmless.
+        madvise(mData, mSize, MADV_HUGEPAGE);
+    }
+#endif
+#else
+    // No anonymous mappings here; use page aligned heap memory instead.
+    (void)hugepages;
+    void* data = nullptr;
+#ifdef _WIN32
+    data = _aligned_malloc(size, page_size);
+#else
+    if (posix_memalign(&data, page_size, size) != 0)
+    {
+        data = nullptr;
+    }
+#endif
+    if (data == nullptr)
+    {
+        return;
+    }
+    mData = data;
+    mSize = size;
+#endif
+}
+
+HugePageMemory::~HugePageMemory()
+{
+    if (mData)
+    {
+#if defined(__linux__)
+        munmap(mData, mSize);
+#elif defined(_WIN32)
+        _aligned_free(mData);
+#else
+        std::free(mData);
+#endif
+    }
+}
+
+/* end */
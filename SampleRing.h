@@ -0,0 +1,247 @@
+#ifndef SOFTFM_SAMPLERING_H
+#define SOFTFM_SAMPLERING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "SpscRing.h"
+#include "WakeupEvent.h"
+
+/** What the writer of a SampleRing does when the ring is full. */
+enum class OverrunPolicy
+{
+    DropNewest,     // discard the samples that do not fit
+    DropOldest,     // discard the oldest block the reader has not taken yet
+    Block           // wait until the reader returns a block
+};
+
+/** Size of the block ring between an IQ sample source and its consumer. */
+struct SampleRingConfig
+{
+    unsigned int block_length = 0;  // IQ samples per block (0 = source default)
+    unsigned int num_blocks = 16;   // blocks in the ring
+    bool hugepages = true;          // back the ring with huge pages if possible
+    OverrunPolicy policy = OverrunPolicy::DropNewest;
+};
+
+/** Overrun counters of a SampleRing. */
+struct SampleRingStats
+{
+    std::uint64_t overruns = 0;         // writes that found the ring full
+    std::uint64_t dropped_samples = 0;  // IQ samples discarded
+};
+
+/**
+ *  Anonymous memory mapping, backed by huge pages when possible.
+ *
+ *  Pages are only made resident when they are first written, so a deep
+ *  ring costs address space but no memory until it fills up. With
+ *  hugepages, explicit huge pages (MAP_HUGETLB) are tried first, then
+ *  transparent huge pages. On platforms other than Linux this is a page
+ *  aligned heap allocation and hugepages is ignored.
+ */
+class HugePageMemory
+{
+public:
+    HugePageMemory(std::size_t size, bool hugepages);
+    ~HugePageMemory();
+
+    HugePageMemory(const HugePageMemory&) = delete;
+    HugePageMemory& operator=(const HugePageMemory&) = delete;
+
+    /** Return the start of the mapping, or nullptr if mapping failed. */
+    void* Data() const
+    {
+        return mData;
+    }
+
+    /** Return true if the mapping uses explicit huge pages. */
+    bool Huge() const
+    {
+        return mHuge;
+    }
+
+private:
+    void* mData { nullptr };
+    std::size_t mSize { 0 };
+    bool mHuge { false };
+};
+
+/**
+ *  SpscRing of sample blocks whose sample arrays live in one mapping.
+ *
+ *  Block must have a "samples" pointer, "size", "capacity", "sample_index"
+ *  and "dropped" fields and a static "sample_bytes" constant (bytes per
+ *  IQ sample). Every block gets room for config.block_length samples.
+ *
+ *  Writers that use BeginWrite() and EndWrite() get the overrun policy
+ *  of the configuration, overrun counters, and blocks stamped with the
+ *  stream index of their first sample, so the reader can see gaps.
+ */
+template <class Block>
+class SampleRing : public SpscRing<Block>
+{
+public:
+    explicit SampleRing(const SampleRingConfig& config) :
+        SpscRing<Block>(config.num_blocks),
+        mPolicy(config.policy),
+        mBlockLength(config.block_length),
+        mStride(Stride(config.block_length)),
+        mMemory(mStride * this->Blocks().size(), config.hugepages)
+    {
+        char* base = static_cast<char*>(mMemory.Data());
+        for (std::size_t i = 0; i < this->Blocks().size(); i++)
+        {
+            Block& block = this->Blocks()[i];
+            block.samples = base ? reinterpret_cast<decltype(block.samples)>(base + i * mStride) : nullptr;
+            block.capacity = base ? config.block_length : 0;
+            block.size = 0;
+        }
+    }
+
+    /** Return true if the sample memory could be mapped. */
+    explicit operator bool() const
+    {
+        return mMemory.Data() != nullptr;
+    }
+
+    /** Return true if the sample memory uses explicit huge pages. */
+    bool Huge() const
+    {
+        return mMemory.Huge();
+    }
+
+    /** Return the number of samples that fit in one block. */
+    unsigned int BlockLength() const
+    {
+        return mMemory.Data() ? mBlockLength : 0;
+    }
+
+    /**
+     * Return a block for the next "n" samples (at most BlockLength()),
+     * applying the overrun policy if the ring is full. The block is
+     * stamped with its sample index and the number of samples dropped
+     * since the previous block; fill it and publish it with EndWrite().
+     * Return nullptr if the samples have to be dropped.
+     */
+    Block* BeginWrite(std::size_t n)
+    {
+        Block* block = this->GetBlockToWrite();
+        if (block == nullptr)
+        {
+            mOverruns.fetch_add(1, std::memory_order_relaxed);
+            if (mPolicy == OverrunPolicy::DropOldest)
+            {
+                Block* oldest = this->DropOldest();
+                if (oldest)
+                {
+                    mDroppedSamples.fetch_add(oldest->size, std::memory_order_relaxed);
+                    mPendingDropped += oldest->size;
+                    block = this->GetBlockToWrite();
+                }
+            }
+            else if (mPolicy == OverrunPolicy::Block)
+            {
+                block = WaitForBlock();
+            }
+        }
+
+        if (block == nullptr)
+        {
+            mDroppedSamples.fetch_add(n, std::memory_order_relaxed);
+            mPendingDropped += n;
+            mNextIndex += n;
+            return nullptr;
+        }
+
+        block->sample_index = mNextIndex;
+        block->dropped = mPendingDropped;
+        block->size = n;
+        mPendingDropped = 0;
+        mNextIndex += n;
+        return block;
+    }
+
+    /** Publish the block returned by BeginWrite(). */
+    void EndWrite()
+    {
+        this->UpdateWriteState();
+    }
+
+    /**
+     * Release the block returned by GetBlockToRead(), and wake up a
+     * writer that waits for room in BeginWrite().
+     */
+    void UpdateReadState()
+    {
+        SpscRing<Block>::UpdateReadState();
+        // Pairs with the fence in WaitForBlock(): either the writer sees
+        // the free block, or this sees that the writer waits.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mWriterWaiting.load(std::memory_order_relaxed))
+        {
+            mSpace.Signal();
+        }
+    }
+
+    /** Stop waiting in BeginWrite() for good; call when streaming stops. */
+    void CancelWrite()
+    {
+        mCancel.store(true, std::memory_order_relaxed);
+        mSpace.Signal();
+    }
+
+    /** Return the overrun counters; may be called from any thread. */
+    SampleRingStats Stats() const
+    {
+        SampleRingStats stats;
+        stats.overruns = mOverruns.load(std::memory_order_relaxed);
+        stats.dropped_samples = mDroppedSamples.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    // Wait until the reader releases a block or writing is cancelled.
+    Block* WaitForBlock()
+    {
+        Block* block = nullptr;
+        mWriterWaiting.store(true, std::memory_order_relaxed);
+        while (!mCancel.load(std::memory_order_relaxed))
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            block = this->GetBlockToWrite();
+            if (block)
+            {
+                break;
+            }
+            mSpace.Wait();
+        }
+        mWriterWaiting.store(false, std::memory_order_relaxed);
+        return block;
+    }
+
+    // Bytes per block, rounded up to whole cache lines.
+    static std::size_t Stride(unsigned int block_length)
+    {
+        std::size_t bytes = std::size_t(block_length) * Block::sample_bytes;
+        return (bytes + 63) & ~std::size_t(63);
+    }
+
+    const OverrunPolicy mPolicy;
+    const unsigned int mBlockLength;
+    const std::size_t mStride;
+    HugePageMemory mMemory;
+
+    // Writer state.
+    std::uint64_t mNextIndex { 0 };
+    std::uint64_t mPendingDropped { 0 };
+
+    std::atomic<bool> mCancel { false };
+    std::atomic<bool> mWriterWaiting { false };
+    WakeupEvent mSpace;     // the reader released a block
+    std::atomic<std::uint64_t> mOverruns { 0 };
+    std::atomic<std::uint64_t> mDroppedSamples { 0 };
+};
+
+#endif
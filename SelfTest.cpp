@@ -0,0 +1,588 @@
+/*
+ * Self tests of filter designs and SIMD kernels for softfm_bench -T.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "Filter.h"
+#include "FilterDesign.h"
+#include "FmDecode.h"
+#include "SelfTest.h"
+#include "SimdKernels.h"
+
+using namespace std;
+
+/** Small deterministic noise source, so every run sees the same input. */
+class TestNoise
+{
+public:
+    explicit TestNoise(uint32_t seed) : m_state(seed) { }
+
+    /** Return uniform noise in the range -1 .. 1. */
+    float next()
+    {
+        m_state = m_state * 1664525u + 1013904223u;
+        return (m_state >> 8) * (2.0f / 16777216.0f) - 1.0f;
+    }
+
+private:
+    uint32_t m_state;
+};
+
+/**
+ * Return the instruction set levels to test: every x86 level up to the
+ * detected one, or NEON, always with the scalar reference first.
+ */
+static vector<SimdLevel> simd_levels()
+{
+    SimdLevel best = simd_detect();
+    vector<SimdLevel> levels { SimdLevel::Scalar };
+    for (SimdLevel l : { SimdLevel::SSE2, SimdLevel::AVX2,
+                         SimdLevel::AVX512, SimdLevel::NEON }) {
+        bool neon = (l == SimdLevel::NEON);
+        if (best == SimdLevel::NEON ? neon : (!neon && l <= best))
+            levels.push_back(l);
+    }
+    return levels;
+}
+
+
+/** Low-pass specification of one decoder filter. */
+struct FilterSpec
+{
+    const char *    name;
+    double          cutoff;         // relative to the sample rate
+    double          transition;     // relative to the sample rate
+};
+
+/** Return the audio filter transition width in Hz, as FmDecoder does. */
+static double audio_transition(double pcm_rate)
+{
+    const double bandwidth_pcm = FmDecoder::default_bandwidth_pcm;
+    double stop = min(FmDecoder::pilot_freq, 0.5 * pcm_rate);
+    return min(min(4000.0, 2 * (stop - bandwidth_pcm)), bandwidth_pcm);
+}
+
+/** Return the baseband sample rate softfm uses for an IF sample rate. */
+static double baseband_rate(double if_rate)
+{
+    return if_rate / max(1, int(if_rate / 215.0e3));
+}
+
+/**
+ * Append the filter specifications that FmDecoder passes to
+ * fir_lowpass_order for one IF and PCM sample rate. This mirrors the
+ * stage_design() calls in the FmDecoder constructor.
+ */
+static void decoder_filter_specs(double if_rate, double pcm_rate,
+                                 vector<FilterSpec>& specs)
+{
+    const double bandwidth_if = FmDecoder::default_bandwidth_if;
+    const double bandwidth_pcm = FmDecoder::default_bandwidth_pcm;
+
+    // Downsampling factor as chosen by softfm.
+    unsigned int downsample = max(1, int(if_rate / 215.0e3));
+
+    specs.push_back(FilterSpec { "if", bandwidth_if / if_rate,
+                                 0.5 * bandwidth_if / if_rate });
+    specs.push_back(FilterSpec { "baseband", 0.4 / downsample,
+                                 0.2 / downsample });
+
+    // Audio filter: the final stage after each possible number of
+    // halfband stages, and the halfband stages themselves (transition
+    // from the passband edge to its alias).
+    double rate = baseband_rate(if_rate);
+    double transition = audio_transition(pcm_rate);
+    double cutoff = bandwidth_pcm / rate;
+    double ratio = rate / pcm_rate;
+    for (unsigned int s = 0; ; s++)
+    {
+        specs.push_back(FilterSpec { "audio", ldexp(cutoff, s),
+                                     ldexp(transition / rate, s) });
+        if (ldexp(cutoff, s) > 0.15 || ldexp(ratio, -int(s)) < 2)
+            break;
+        specs.push_back(FilterSpec { "halfband", 0.25,
+                                     0.5 - 2 * ldexp(cutoff, s) });
+    }
+}
+
+
+/**
+ * Design a halfband stage as HalfbandDecimator does (Kaiser window with
+ * equal deviation in both bands) and check its alias rejection.
+ */
+static bool check_halfband(const FilterSpec& spec, double if_rate,
+                           double pcm_rate, double atten)
+{
+    unsigned int order = kaiser_halfband_order(spec.transition, atten);
+    double dev = pow(10.0, -atten / 20);
+    double ripple = 20 * log10((1 + dev) / (1 - dev));
+    FirDesign design(FirDesignMethod::Kaiser, 0, ripple, atten);
+    vector<double> coeff;
+    make_fir_lowpass(design, order, 0.25, coeff);
+
+    double measured_ripple, measured;
+    measure_fir_lowpass(coeff, 0.25 - 0.5 * spec.transition,
+                        0.25 + 0.5 * spec.transition,
+                        measured_ripple, measured);
+    if (order % 4 != 2 || measured < atten)
+    {
+        fprintf(stderr, "FAIL: halfband if_rate=%.0f pcm_rate=%.0f "
+                "transition=%.4f: order %u, attenuation %.1f dB for %.1f dB\n",
+                if_rate, pcm_rate, spec.transition, order, measured, atten);
+        return false;
+    }
+    return true;
+}
+
+
+// Check designs from a quality target against the target.
+bool selftest_filter_design()
+{
+    const double if_rates[] = { 240000, 1000000, 1200000, 2400000, 3200000 };
+    const double pcm_rates[] = { 44100, 48000 };
+    const double attens[] = { 60, 80, 100 };
+    const FirDesignMethod methods[] = { FirDesignMethod::Kaiser,
+                                        FirDesignMethod::Equiripple };
+    bool ok = true;
+    unsigned int nchecked = 0;
+
+    for (double if_rate : if_rates)
+    {
+        for (double pcm_rate : pcm_rates)
+        {
+            vector<FilterSpec> specs;
+            decoder_filter_specs(if_rate, pcm_rate, specs);
+
+            for (const FilterSpec& spec : specs)
+            {
+                for (double atten : attens)
+                {
+                    if (strcmp(spec.name, "halfband") == 0)
+                    {
+                        ok &= check_halfband(spec, if_rate, pcm_rate, atten);
+                        nchecked++;
+                        continue;
+                    }
+
+                    unsigned int kaiser_order = 0;
+                    for (FirDesignMethod method : methods)
+                    {
+                        FirDesign design(method, spec.transition, 0.1, atten);
+                        unsigned int order = fir_lowpass_order(design, spec.cutoff);
+                        vector<double> coeff;
+                        make_fir_lowpass(design, order, spec.cutoff, coeff);
+
+                        double pass_edge = spec.cutoff - 0.5 * spec.transition;
+                        double stop_edge = min(0.5, spec.cutoff + 0.5 * spec.transition);
+                        double ripple, measured;
+                        measure_fir_lowpass(coeff, pass_edge, stop_edge,
+                                            ripple, measured);
+
+                        // Equiripple needs fewer taps than the window for
+                        // the same target; more means it fell back.
+                        if (method == FirDesignMethod::Kaiser)
+                            kaiser_order = order;
+                        bool pass = ripple <= design.ripple &&
+                                    measured >= design.atten &&
+                                    (method == FirDesignMethod::Kaiser ||
+                                     order <= kaiser_order);
+                        if (!pass)
+                        {
+                            fprintf(stderr, "FAIL: design %s %s if_rate=%.0f "
+                                    "pcm_rate=%.0f cutoff=%.4f transition=%.4f: "
+                                    "order %u (kaiser %u), ripple %.3f dB, "
+                                    "attenuation %.1f dB for %.1f dB\n",
+                                    fir_design_name(method), spec.name,
+                                    if_rate, pcm_rate, spec.cutoff,
+                                    spec.transition, order, kaiser_order,
+                                    ripple, measured, atten);
+                            ok = false;
+                        }
+                        nchecked++;
+                    }
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "filter design: %u designs checked, %s\n",
+            nchecked, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/**
+ * Pass a tone of unit amplitude through a resampler, after a reset, and
+ * return the output without the first quarter, where the filters settle.
+ */
+static void resample_tone(MultistageDownsampleFilter& filter,
+                          unsigned int channels, double freq,
+                          double in_rate, SampleVector& out)
+{
+    unsigned int n = unsigned(0.25 * in_rate);
+    SampleVector in, block, block1;
+    out.clear();
+    filter.reset();
+    for (unsigned int i = 0; i < n; i += 4096)
+    {
+        unsigned int k = min(4096u, n - i);
+        in.resize(k);
+        for (unsigned int j = 0; j < k; j++)
+            in[j] = cos(2 * M_PI * freq / in_rate * (i + j));
+        if (channels == 2)
+            filter.process(in, in, block, block1);
+        else
+            filter.process(in, block);
+        out.insert(out.end(), block.begin(), block.end());
+    }
+    out.erase(out.begin(), out.begin() + out.size() / 4);
+}
+
+/**
+ * Return the amplitude in dB of the component at freq in a signal, from
+ * a Hann windowed DFT.
+ */
+static double tone_level(const SampleVector& x, double freq, double rate)
+{
+    unsigned int n = x.size();
+    double w = 2 * M_PI * freq / rate;
+    double re = 0, im = 0, wsum = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        double h = 0.5 - 0.5 * cos(2 * M_PI * i / n);
+        re += h * x[i] * cos(w * i);
+        im += h * x[i] * sin(w * i);
+        wsum += h;
+    }
+    double amp = 2 * sqrt(re * re + im * im) / wsum;
+    return 20 * log10(max(amp, 1.0e-15));
+}
+
+/** Return the frequency that freq folds to when sampled at rate. */
+static double fold_frequency(double freq, double rate)
+{
+    return fabs(freq - rate * floor(freq / rate + 0.5));
+}
+
+
+// Check the halfband audio resampler against the single stage resampler.
+bool selftest_audio_resampler()
+{
+    const double if_rates[] = { 240000, 1000000, 1200000, 2400000, 3200000 };
+    const double pcm_rates[] = { 44100, 48000 };
+    const double pass_freqs[] = { 1000, 3000, 7000, 12000 };
+    const double alias_freqs[] = { 2000, 9000 };
+    const FirDesignMethod methods[] = { FirDesignMethod::Lanczos,
+                                        FirDesignMethod::Kaiser };
+    const double bandwidth_pcm = FmDecoder::default_bandwidth_pcm;
+    bool ok = true;
+    unsigned int nchecked = 0;
+
+    for (double if_rate : if_rates)
+    {
+        for (double pcm_rate : pcm_rates)
+        {
+            double rate = baseband_rate(if_rate);
+            for (FirDesignMethod method : methods)
+            {
+                for (unsigned int channels = 1; channels <= 2; channels++)
+                {
+                    // The filters as FmDecoder builds them, with and
+                    // without audio_halfband.
+                    FirDesign design(method, audio_transition(pcm_rate) / rate,
+                                     0.1, 80);
+                    MultistageDownsampleFilter single(
+                        int(rate / 1000.0), bandwidth_pcm / rate,
+                        rate / pcm_rate, 256, 0, channels, design);
+                    MultistageDownsampleFilter chain(
+                        int(rate / 1000.0), bandwidth_pcm / rate,
+                        rate / pcm_rate, 256, 8, channels, design);
+                    unsigned int stages = chain.num_halfband_stages();
+
+                    // Tones and the output frequencies where their images
+                    // and aliases land in the passband: images of
+                    // passband tones around the input rate of every
+                    // stage, and tones in the bands that each stage folds
+                    // into the passband.
+                    vector<pair<double, double> > probes;
+                    for (double f : pass_freqs)
+                    {
+                        for (unsigned int k = 0; k <= stages; k++)
+                        {
+                            double image = fold_frequency(ldexp(rate, -int(k)) - f,
+                                                          pcm_rate);
+                            if (image < bandwidth_pcm && fabs(image - f) > 100)
+                                probes.push_back(make_pair(f, image));
+                        }
+                    }
+                    for (double f : alias_freqs)
+                    {
+                        for (unsigned int k = 1; k <= stages; k++)
+                            probes.push_back(make_pair(ldexp(rate, -int(k)) - f, f));
+                        probes.push_back(make_pair(pcm_rate - f, f));
+                        probes.push_back(make_pair(pcm_rate + f, f));
+                    }
+
+                    // The chain must reject them at least as well as the
+                    // single stage, or reach the attenuation of its stages
+                    // (100 dB with Lanczos).
+                    double target = (method == FirDesignMethod::Lanczos)
+                                    ? 100 : design.atten;
+                    SampleVector out_single, out_chain;
+                    for (const pair<double, double>& probe : probes)
+                    {
+                        resample_tone(single, channels, probe.first, rate,
+                                      out_single);
+                        resample_tone(chain, channels, probe.first, rate,
+                                      out_chain);
+                        double level_single = tone_level(out_single,
+                                                         probe.second, pcm_rate);
+                        double level_chain = tone_level(out_chain,
+                                                        probe.second, pcm_rate);
+                        if (level_chain > max(level_single, -target) + 1)
+                        {
+                            fprintf(stderr, "FAIL: audio resampler %s "
+                                    "if_rate=%.0f pcm_rate=%.0f channels=%u: "
+                                    "tone %.0f Hz at %.0f Hz, %u stages "
+                                    "%.1f dB, single stage %.1f dB\n",
+                                    fir_design_name(method), if_rate,
+                                    pcm_rate, channels, probe.first,
+                                    probe.second, stages, level_chain,
+                                    level_single);
+                            ok = false;
+                        }
+                        nchecked++;
+                    }
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "audio resampler: %u images and aliases checked, %s\n",
+            nchecked, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+// Check the vector FIR IQ kernels against the scalar kernels.
+bool selftest_fir_iq_kernels()
+{
+    // Tap counts around the vector widths and the lengths FmDecoder
+    // uses; output lengths that leave every possible tail.
+    const unsigned int orders[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 15, 16, 17,
+                                    31, 32, 33, 63, 64, 65, 80, 127, 128, 255 };
+    const unsigned int lengths[] = { 1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 33, 1001 };
+    const unsigned int strides[] = { 1, 2, 3, 5, 8 };
+
+    vector<SimdLevel> levels = simd_levels();
+    FirIQKernel ref = select_fir_iq_kernel(SimdLevel::Scalar);
+    FirIQDecimKernel ref_decim = select_fir_iq_decim_kernel(SimdLevel::Scalar);
+    TestNoise noise(4711);
+    bool ok = true;
+    unsigned int nchecked = 0;
+
+    for (unsigned int order : orders)
+    {
+        // Random symmetric coefficients, as the kernels expect.
+        SampleVector coeff(order + 1), coeff2(2 * (order + 1));
+        double csum = 0;
+        for (unsigned int j = 0; j <= order / 2; j++)
+        {
+            coeff[j] = coeff[order - j] = noise.next();
+        }
+        for (unsigned int j = 0; j <= order; j++)
+        {
+            coeff2[2*j] = coeff2[2*j+1] = coeff[j];
+            csum += fabs(coeff[j]);
+        }
+
+        // Each output is a sum of (order + 1) products of inputs in
+        // -1 .. 1, so any summation order stays within this bound.
+        double bound = (order + 1) * FLT_EPSILON * csum;
+
+        for (unsigned int n : lengths)
+        {
+            for (unsigned int stride : strides)
+            {
+                IQSampleVector in((n - 1) * stride + order + 1);
+                for (IQSample& x : in)
+                {
+                    x = IQSample(noise.next(), noise.next());
+                }
+
+                IQSampleVector expect(n), out(n);
+                if (stride == 1)
+                    ref(in.data(), coeff.data(), order, n, expect.data());
+                else
+                    ref_decim(in.data(), coeff2.data(), order, n, stride,
+                              expect.data());
+
+                for (SimdLevel level : levels)
+                {
+                    fill(out.begin(), out.end(), IQSample(NAN, NAN));
+                    if (stride == 1)
+                        select_fir_iq_kernel(level)(in.data(), coeff.data(),
+                                                    order, n, out.data());
+                    else
+                        select_fir_iq_decim_kernel(level)(in.data(), coeff2.data(),
+                                                          order, n, stride,
+                                                          out.data());
+
+                    double err = 0;
+                    for (unsigned int i = 0; i < n; i++)
+                    {
+                        double e = max(fabs(out[i].real() - expect[i].real()),
+                                       fabs(out[i].imag() - expect[i].imag()));
+                        err = (e <= err) ? err : e;     // NaN sticks
+                    }
+                    if (!(err <= bound))
+                    {
+                        fprintf(stderr, "FAIL: fir_iq %s order=%u n=%u stride=%u: "
+                                "error %g, bound %g\n", simd_level_name(level),
+                                order, n, stride, err, bound);
+                        ok = false;
+                    }
+                    nchecked++;
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "fir_iq kernels (%u levels): %u cases checked, %s\n",
+            unsigned(levels.size()), nchecked, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+
+/** Append the IQ sample r * exp(j phi). */
+static void push_polar(IQSampleVector& v, double r, double phi)
+{
+    v.push_back(IQSample(r * cos(phi), r * sin(phi)));
+}
+
+
+// Check the phase discriminator kernels against std::atan2.
+bool selftest_phase_disc_kernels()
+{
+    // Documented maximum error of each tier (see Atan2Accuracy).
+    const struct { Atan2Accuracy accuracy; const char *name; double bound; } tiers[] = {
+        { Atan2Accuracy::Fast,     "fast",     5.0e-3 },
+        { Atan2Accuracy::Accurate, "accurate", 1.2e-5 }
+    };
+
+    // Input: the axes and signed zeros in every combination, then phase
+    // steps over the full circle (including multiples of pi/4) at
+    // magnitudes from 1e-6 to 1e3, then random samples.
+    IQSampleVector in;
+    const float zero[] = { 0.0f, -0.0f };
+    for (float a : { 1.0f, -1.0f, 0.0f, -0.0f })
+    {
+        for (float b : zero)
+        {
+            in.push_back(IQSample(a, b));
+            in.push_back(IQSample(b, a));
+            in.push_back(IQSample(1, 0));
+        }
+    }
+    in.push_back(IQSample(0, 0));
+    in.push_back(IQSample(-0.0f, -0.0f));
+    in.push_back(IQSample(0, 1));
+    double phi = 0.3;
+    for (unsigned int k = 0; k <= 4096; k++)
+    {
+        double step = (k % 2) ? M_PI * (k / 2 - 1024) / 1024
+                              : 2 * M_PI * k / 4096 - M_PI;
+        phi += step;
+        push_polar(in, pow(10.0, (k % 19) / 2.0 - 6), phi);
+    }
+    TestNoise noise(815);
+    for (unsigned int k = 0; k < 1000; k++)
+    {
+        in.push_back(IQSample(noise.next(), noise.next()));
+    }
+    const IQSample last(0.6f, -0.8f);
+    unsigned int n = in.size();
+
+    // Reference phase steps; the products of float samples are exact in
+    // double. A zero sample gives a zero product, and the kernels return
+    // zero (of either sign) for it, where std::atan2 may return +-pi.
+    vector<double> expect(n);
+    vector<bool> zero_product(n);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        IQSample s0 = (i == 0) ? last : in[i-1];
+        double re = double(s0.real()) * in[i].real() + double(s0.imag()) * in[i].imag();
+        double im = double(s0.real()) * in[i].imag() - double(s0.imag()) * in[i].real();
+        expect[i] = atan2(im, re);
+        zero_product[i] = (re == 0 && im == 0);
+    }
+
+    // Split points exercise the "last" sample of a previous call and every
+    // vector tail; 0 and n also run empty calls.
+    vector<unsigned int> splits;
+    for (unsigned int k = 0; k <= 40; k++)
+        splits.push_back(k);
+    splits.push_back(n / 2);
+    splits.push_back(n - 1);
+    splits.push_back(n);
+
+    vector<SimdLevel> levels = simd_levels();
+    SampleVector out(n);
+    bool ok = true;
+    unsigned int nchecked = 0;
+
+    for (const auto& tier : tiers)
+    {
+        for (SimdLevel level : levels)
+        {
+            PhaseDiscKernel kernel = select_phase_disc_kernel(level, tier.accuracy);
+            double max_err = 0;
+            for (unsigned int k : splits)
+            {
+                fill(out.begin(), out.end(), Sample(NAN));
+                kernel(in.data(), k, last, 1, out.data());
+                kernel(in.data() + k, n - k, (k == 0) ? last : in[k-1], 1,
+                       out.data() + k);
+
+                for (unsigned int i = 0; i < n; i++)
+                {
+                    // Compare as phases, so +pi and -pi are equal.
+                    double err = zero_product[i] ? fabs(out[i])
+                                                 : fabs(remainder(out[i] - expect[i], 2 * M_PI));
+                    if (!(err <= tier.bound))
+                    {
+                        if (ok || err > max_err)
+                        {
+                            fprintf(stderr, "FAIL: phase_disc %s %s split=%u i=%u: "
+                                    "in=(%g,%g) prev=(%g,%g) out %.7f, expected %.7f\n",
+                                    simd_level_name(level), tier.name, k, i,
+                                    in[i].real(), in[i].imag(),
+                                    (i == 0 ? last : in[i-1]).real(),
+                                    (i == 0 ? last : in[i-1]).imag(),
+                                    out[i], expect[i]);
+                        }
+                        ok = false;
+                    }
+                    max_err = (err <= max_err) ? max_err : err;     // NaN sticks
+                }
+                nchecked++;
+            }
+            fprintf(stderr, "phase_disc %s %s: max error %.2e rad (bound %.1e)\n",
+                    simd_level_name(level), tier.name, max_err, tier.bound);
+        }
+    }
+
+    fprintf(stderr, "phase_disc kernels: %u runs checked, %s\n",
+            nchecked, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/* end */
@@ -0,0 +1,36 @@
+#ifndef SOFTFM_SELFTEST_H
+#define SOFTFM_SELFTEST_H
+
+/*
+ * Self tests run by "softfm_bench -T". Each test prints one line per
+ * failed check to stderr and returns false if any check failed.
+ */
+
+/**
+ * Design every filter that FmDecoder sizes from a quality target
+ * (Kaiser and equiripple, the IF rates softfm accepts) and check the
+ * measured ripple and attenuation against the target.
+ */
+bool selftest_filter_design();
+
+/**
+ * Pass tones through the audio resampler with and without halfband
+ * stages, as FmDecoder builds it, and check that the stages keep the
+ * alias and image rejection of the single stage filter.
+ */
+bool selftest_audio_resampler();
+
+/**
+ * Run the FIR IQ kernels (plain and decimating) of every instruction set
+ * level the CPU supports against the scalar kernels on random input.
+ */
+bool selftest_fir_iq_kernels();
+
+/**
+ * Run the phase discriminator kernels of every supported instruction set
+ * level and both atan2 accuracy tiers against std::atan2, including the
+ * axes, signed zeros and every split of a block into two calls.
+ */
+bool selftest_phase_disc_kernels();
+
+#endif
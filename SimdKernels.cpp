@@ -0,0 +1,2048 @@
+/*
+ *  Vectorized DSP kernels with runtime instruction set selection.
+ *
+ *  Each kernel exists as a portable scalar implementation and as one or
+ *  more hand-vectorized variants. The vectorized variants are compiled
+ *  with per-function target attributes, so the program as a whole does
+ *  not require a CPU with AVX2 or AVX-512. The best variant is selected
+ *  at runtime.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "SimdKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOFTFM_SIMD_X86 1
+#include <immintrin.h>
+#define SOFTFM_TARGET(x) __attribute__((target(x)))
+
+// GCC 12 warns that the "__Y" operand, which avx512fintrin.h leaves
+// uninitialized on purpose in the unmasked forms of many intrinsics, may
+// be used uninitialized. Kernels that trigger it are wrapped in these.
+#if !defined(__clang__)
+#define SOFTFM_AVX512_WARNINGS_OFF \
+    _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"") \
+    _Pragma("GCC diagnostic ignored \"-Wuninitialized\"")
+#define SOFTFM_AVX512_WARNINGS_ON _Pragma("GCC diagnostic pop")
+#else
+#define SOFTFM_AVX512_WARNINGS_OFF
+#define SOFTFM_AVX512_WARNINGS_ON
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SOFTFM_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+
+/* ****************  instruction set detection  **************** */
+
+static SimdLevel detect_cpu_level()
+{
+#if defined(SOFTFM_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::SSE2;
+#elif defined(SOFTFM_SIMD_NEON)
+    return SimdLevel::NEON;
+#endif
+    return SimdLevel::Scalar;
+}
+
+
+// Detect the best instruction set supported by the running CPU.
+// The environment variable SOFTFM_SIMD may be used to force a lower level
+// (for example "scalar" or "sse2") for testing and benchmarking.
+SimdLevel simd_detect()
+{
+    static const SimdLevel level = [] {
+        SimdLevel cpu = detect_cpu_level();
+        const char *env = getenv("SOFTFM_SIMD");
+        if (env == NULL)
+            return cpu;
+        for (SimdLevel l : { SimdLevel::Scalar, SimdLevel::SSE2,
+                             SimdLevel::AVX2, SimdLevel::AVX512,
+                             SimdLevel::NEON }) {
+            if (strcasecmp(env, simd_level_name(l)) == 0 && l <= cpu)
+                return l;
+        }
+        return cpu;
+    }();
+    return level;
+}
+
+
+// Return a printable name for an instruction set level.
+const char * simd_level_name(SimdLevel level)
+{
+    switch (level) {
+        case SimdLevel::SSE2:   return "sse2";
+        case SimdLevel::AVX2:   return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::NEON:   return "neon";
+        default:                return "scalar";
+    }
+}
+
+
+/* ****************  FIR filter for IQ samples  **************** */
+
+// The coefficients are real, so the I and Q components of the interleaved
+// sample array can be treated as independent float lanes. Each vector
+// register holds consecutive output samples with I and Q accumulated in
+// separate lanes.
+//
+// The coefficients are symmetric (coeff[j] == coeff[order-j]), so we add
+// the two input samples that share a coefficient before multiplying.
+// This halves the number of multiplications.
+
+// Compute output samples [i, n) one sample at a time.
+static void fir_iq_scalar_range(const float *x, const Sample *coeff,
+                                unsigned int order,
+                                unsigned int i, unsigned int n, float *y)
+{
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    for (; i < n; i++) {
+        const float *p = x + 2 * i;
+        float acc_i = 0, acc_q = 0;
+        for (unsigned int j = 0; j < half; j++) {
+            float c = coeff[j];
+            acc_i += c * (p[2*j]   + p[2*(order-j)]);
+            acc_q += c * (p[2*j+1] + p[2*(order-j)+1]);
+        }
+        if (center) {
+            float c = coeff[half];
+            acc_i += c * p[2*half];
+            acc_q += c * p[2*half+1];
+        }
+        y[2*i]   = acc_i;
+        y[2*i+1] = acc_q;
+    }
+}
+
+
+static void fir_iq_scalar(const IQSample *samples_in, const Sample *coeff,
+                          unsigned int order, unsigned int n,
+                          IQSample *samples_out)
+{
+    fir_iq_scalar_range(reinterpret_cast<const float*>(samples_in), coeff,
+                        order, 0, n, reinterpret_cast<float*>(samples_out));
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// Same as fir_iq_scalar_range(), but with fused multiply-add so that the
+// leftover samples are rounded exactly like the vector lanes of the
+// AVX2 and AVX-512 kernels. The output for a given sample then does not
+// depend on where the block boundaries fall.
+SOFTFM_TARGET("avx2,fma")
+static void fir_iq_fma_range(const float *x, const Sample *coeff,
+                             unsigned int order,
+                             unsigned int i, unsigned int n, float *y)
+{
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    for (; i < n; i++) {
+        const float *p = x + 2 * i;
+        float acc_i = 0, acc_q = 0;
+        for (unsigned int j = 0; j < half; j++) {
+            float c = coeff[j];
+            acc_i = __builtin_fmaf(c, p[2*j]   + p[2*(order-j)],   acc_i);
+            acc_q = __builtin_fmaf(c, p[2*j+1] + p[2*(order-j)+1], acc_q);
+        }
+        if (center) {
+            float c = coeff[half];
+            acc_i = __builtin_fmaf(c, p[2*half],   acc_i);
+            acc_q = __builtin_fmaf(c, p[2*half+1], acc_q);
+        }
+        y[2*i]   = acc_i;
+        y[2*i+1] = acc_q;
+    }
+}
+
+
+SOFTFM_TARGET("sse2")
+static void fir_iq_sse2(const IQSample *samples_in, const Sample *coeff,
+                        unsigned int order, unsigned int n,
+                        IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    // 4 output samples (2 registers) per iteration.
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float *p = x + 2 * i;
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (unsigned int j = 0; j < half; j++) {
+            __m128 c = _mm_set1_ps(coeff[j]);
+            const float *a = p + 2 * j;
+            const float *b = p + 2 * (order - j);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(c,
+                       _mm_add_ps(_mm_loadu_ps(a), _mm_loadu_ps(b))));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(c,
+                       _mm_add_ps(_mm_loadu_ps(a + 4), _mm_loadu_ps(b + 4))));
+        }
+        if (center) {
+            __m128 c = _mm_set1_ps(coeff[half]);
+            const float *a = p + 2 * half;
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(c, _mm_loadu_ps(a)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(c, _mm_loadu_ps(a + 4)));
+        }
+        _mm_storeu_ps(y + 2 * i, acc0);
+        _mm_storeu_ps(y + 2 * i + 4, acc1);
+    }
+
+    fir_iq_scalar_range(x, coeff, order, i, n, y);
+}
+
+
+SOFTFM_TARGET("avx2,fma")
+static void fir_iq_avx2(const IQSample *samples_in, const Sample *coeff,
+                        unsigned int order, unsigned int n,
+                        IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    // 8 output samples (2 registers) per iteration.
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const float *p = x + 2 * i;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        for (unsigned int j = 0; j < half; j++) {
+            __m256 c = _mm256_set1_ps(coeff[j]);
+            const float *a = p + 2 * j;
+            const float *b = p + 2 * (order - j);
+            acc0 = _mm256_fmadd_ps(c,
+                       _mm256_add_ps(_mm256_loadu_ps(a),
+                                     _mm256_loadu_ps(b)), acc0);
+            acc1 = _mm256_fmadd_ps(c,
+                       _mm256_add_ps(_mm256_loadu_ps(a + 8),
+                                     _mm256_loadu_ps(b + 8)), acc1);
+        }
+        if (center) {
+            __m256 c = _mm256_set1_ps(coeff[half]);
+            const float *a = p + 2 * half;
+            acc0 = _mm256_fmadd_ps(c, _mm256_loadu_ps(a), acc0);
+            acc1 = _mm256_fmadd_ps(c, _mm256_loadu_ps(a + 8), acc1);
+        }
+        _mm256_storeu_ps(y + 2 * i, acc0);
+        _mm256_storeu_ps(y + 2 * i + 8, acc1);
+    }
+
+    fir_iq_fma_range(x, coeff, order, i, n, y);
+}
+
+
+SOFTFM_TARGET("avx512f")
+static void fir_iq_avx512(const IQSample *samples_in, const Sample *coeff,
+                          unsigned int order, unsigned int n,
+                          IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    // 16 output samples (2 registers) per iteration.
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const float *p = x + 2 * i;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        for (unsigned int j = 0; j < half; j++) {
+            __m512 c = _mm512_set1_ps(coeff[j]);
+            const float *a = p + 2 * j;
+            const float *b = p + 2 * (order - j);
+            acc0 = _mm512_fmadd_ps(c,
+                       _mm512_add_ps(_mm512_loadu_ps(a),
+                                     _mm512_loadu_ps(b)), acc0);
+            acc1 = _mm512_fmadd_ps(c,
+                       _mm512_add_ps(_mm512_loadu_ps(a + 16),
+                                     _mm512_loadu_ps(b + 16)), acc1);
+        }
+        if (center) {
+            __m512 c = _mm512_set1_ps(coeff[half]);
+            const float *a = p + 2 * half;
+            acc0 = _mm512_fmadd_ps(c, _mm512_loadu_ps(a), acc0);
+            acc1 = _mm512_fmadd_ps(c, _mm512_loadu_ps(a + 16), acc1);
+        }
+        _mm512_storeu_ps(y + 2 * i, acc0);
+        _mm512_storeu_ps(y + 2 * i + 16, acc1);
+    }
+
+    fir_iq_fma_range(x, coeff, order, i, n, y);
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+#if defined(SOFTFM_SIMD_NEON)
+
+static void fir_iq_neon(const IQSample *samples_in, const Sample *coeff,
+                        unsigned int order, unsigned int n,
+                        IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int half = (order + 1) / 2;
+    bool center = (order % 2 == 0);
+
+    // 4 output samples (2 registers) per iteration.
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float *p = x + 2 * i;
+        float32x4_t acc0 = vdupq_n_f32(0);
+        float32x4_t acc1 = vdupq_n_f32(0);
+        for (unsigned int j = 0; j < half; j++) {
+            float c = coeff[j];
+            const float *a = p + 2 * j;
+            const float *b = p + 2 * (order - j);
+            acc0 = vmlaq_n_f32(acc0, vaddq_f32(vld1q_f32(a), vld1q_f32(b)), c);
+            acc1 = vmlaq_n_f32(acc1, vaddq_f32(vld1q_f32(a + 4),
+                                               vld1q_f32(b + 4)), c);
+        }
+        if (center) {
+            float c = coeff[half];
+            const float *a = p + 2 * half;
+            acc0 = vmlaq_n_f32(acc0, vld1q_f32(a), c);
+            acc1 = vmlaq_n_f32(acc1, vld1q_f32(a + 4), c);
+        }
+        vst1q_f32(y + 2 * i, acc0);
+        vst1q_f32(y + 2 * i + 4, acc1);
+    }
+
+    fir_iq_scalar_range(x, coeff, order, i, n, y);
+}
+
+#endif // SOFTFM_SIMD_NEON
+
+
+// Return the FIR IQ kernel for the specified instruction set level.
+FirIQKernel select_fir_iq_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512: return fir_iq_avx512;
+        case SimdLevel::AVX2:   return fir_iq_avx2;
+        case SimdLevel::SSE2:   return fir_iq_sse2;
+#endif
+#if defined(SOFTFM_SIMD_NEON)
+        case SimdLevel::NEON:   return fir_iq_neon;
+#endif
+        default:                return fir_iq_scalar;
+    }
+}
+
+
+
+/* ****************  decimating FIR filter for IQ samples  **************** */
+
+// Only one output sample is needed per "stride" input samples, so the
+// kernels vectorize along the filter taps instead of along the output
+// samples. The coefficients are stored twice (once for I, once for Q) so
+// that the interleaved input can be multiplied directly. I and Q end up
+// in the even and odd lanes of the accumulator.
+
+static void fir_iq_decim_scalar(const IQSample *samples_in,
+                                const Sample *coeff2,
+                                unsigned int order, unsigned int n,
+                                unsigned int stride, IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int nf = 2 * (order + 1);
+
+    for (unsigned int i = 0; i < n; i++) {
+        const float *p = x + 2 * i * stride;
+        float acc_i = 0, acc_q = 0;
+        for (unsigned int f = 0; f < nf; f += 2) {
+            acc_i += coeff2[f] * p[f];
+            acc_q += coeff2[f] * p[f+1];
+        }
+        y[2*i]   = acc_i;
+        y[2*i+1] = acc_q;
+    }
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+SOFTFM_TARGET("sse2")
+static void fir_iq_decim_sse2(const IQSample *samples_in,
+                              const Sample *coeff2,
+                              unsigned int order, unsigned int n,
+                              unsigned int stride, IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int nf = 2 * (order + 1);
+
+    for (unsigned int i = 0; i < n; i++) {
+        const float *p = x + 2 * i * stride;
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        unsigned int f = 0;
+        for (; f + 8 <= nf; f += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(coeff2 + f),
+                                               _mm_loadu_ps(p + f)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(coeff2 + f + 4),
+                                               _mm_loadu_ps(p + f + 4)));
+        }
+        for (; f + 4 <= nf; f += 4) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(coeff2 + f),
+                                               _mm_loadu_ps(p + f)));
+        }
+
+        // Fold lanes (I0 Q0 I1 Q1) into (I Q).
+        acc0 = _mm_add_ps(acc0, acc1);
+        acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+        float r[4];
+        _mm_storeu_ps(r, acc0);
+
+        for (; f < nf; f += 2) {
+            r[0] += coeff2[f] * p[f];
+            r[1] += coeff2[f] * p[f+1];
+        }
+        y[2*i]   = r[0];
+        y[2*i+1] = r[1];
+    }
+}
+
+
+SOFTFM_TARGET("avx2,fma")
+static void fir_iq_decim_avx2(const IQSample *samples_in,
+                              const Sample *coeff2,
+                              unsigned int order, unsigned int n,
+                              unsigned int stride, IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int nf = 2 * (order + 1);
+
+    for (unsigned int i = 0; i < n; i++) {
+        const float *p = x + 2 * i * stride;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        unsigned int f = 0;
+        for (; f + 16 <= nf; f += 16) {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(coeff2 + f),
+                                   _mm256_loadu_ps(p + f), acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(coeff2 + f + 8),
+                                   _mm256_loadu_ps(p + f + 8), acc1);
+        }
+        for (; f + 8 <= nf; f += 8) {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(coeff2 + f),
+                                   _mm256_loadu_ps(p + f), acc0);
+        }
+
+        // Fold lanes (I0 Q0 I1 Q1 I2 Q2 I3 Q3) into (I Q).
+        acc0 = _mm256_add_ps(acc0, acc1);
+        __m128 v = _mm_add_ps(_mm256_castps256_ps128(acc0),
+                              _mm256_extractf128_ps(acc0, 1));
+        v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        float r[4];
+        _mm_storeu_ps(r, v);
+
+        for (; f < nf; f += 2) {
+            r[0] = __builtin_fmaf(coeff2[f], p[f],   r[0]);
+            r[1] = __builtin_fmaf(coeff2[f], p[f+1], r[1]);
+        }
+        y[2*i]   = r[0];
+        y[2*i+1] = r[1];
+    }
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+#if defined(SOFTFM_SIMD_NEON)
+
+static void fir_iq_decim_neon(const IQSample *samples_in,
+                              const Sample *coeff2,
+                              unsigned int order, unsigned int n,
+                              unsigned int stride, IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    unsigned int nf = 2 * (order + 1);
+
+    for (unsigned int i = 0; i < n; i++) {
+        const float *p = x + 2 * i * stride;
+        float32x4_t acc0 = vdupq_n_f32(0);
+        float32x4_t acc1 = vdupq_n_f32(0);
+        unsigned int f = 0;
+        for (; f + 8 <= nf; f += 8) {
+            acc0 = vmlaq_f32(acc0, vld1q_f32(coeff2 + f), vld1q_f32(p + f));
+            acc1 = vmlaq_f32(acc1, vld1q_f32(coeff2 + f + 4),
+                                   vld1q_f32(p + f + 4));
+        }
+        for (; f + 4 <= nf; f += 4) {
+            acc0 = vmlaq_f32(acc0, vld1q_f32(coeff2 + f), vld1q_f32(p + f));
+        }
+
+        // Fold lanes (I0 Q0 I1 Q1) into (I Q).
+        acc0 = vaddq_f32(acc0, acc1);
+        float32x2_t v = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+        float r[2];
+        vst1_f32(r, v);
+
+        for (; f < nf; f += 2) {
+            r[0] += coeff2[f] * p[f];
+            r[1] += coeff2[f] * p[f+1];
+        }
+        y[2*i]   = r[0];
+        y[2*i+1] = r[1];
+    }
+}
+
+#endif // SOFTFM_SIMD_NEON
+
+
+// Return the decimating FIR IQ kernel for the specified level.
+FirIQDecimKernel select_fir_iq_decim_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return fir_iq_decim_avx2;
+        case SimdLevel::SSE2:   return fir_iq_decim_sse2;
+#endif
+#if defined(SOFTFM_SIMD_NEON)
+        case SimdLevel::NEON:   return fir_iq_decim_neon;
+#endif
+        default:                return fir_iq_decim_scalar;
+    }
+}
+
+
+/* ****************  NCO rotation  **************** */
+
+static void nco_rotate_scalar(const IQSample *samples_in, unsigned int n,
+                              IQSample *phasors, IQSample step,
+                              IQSample *samples_out)
+{
+    // Work on separate real/imaginary arrays so the compiler can
+    // vectorize across the lanes.
+    float pr[nco_lanes], pi[nco_lanes];
+    for (unsigned int k = 0; k < nco_lanes; k++) {
+        pr[k] = phasors[k].real();
+        pi[k] = phasors[k].imag();
+    }
+
+    const float sr = step.real(), si = step.imag();
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+
+    for (unsigned int i = 0; i < n; i += nco_lanes) {
+        for (unsigned int k = 0; k < nco_lanes; k++) {
+            float xr = x[2*(i+k)], xi = x[2*(i+k)+1];
+            y[2*(i+k)]   = xr * pr[k] - xi * pi[k];
+            y[2*(i+k)+1] = xr * pi[k] + xi * pr[k];
+            float tr = pr[k] * sr - pi[k] * si;
+            pi[k]    = pr[k] * si + pi[k] * sr;
+            pr[k]    = tr;
+        }
+    }
+
+    for (unsigned int k = 0; k < nco_lanes; k++)
+        phasors[k] = IQSample(pr[k], pi[k]);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// Multiply interleaved complex numbers: (a + jb) * (c + jd).
+SOFTFM_TARGET("avx2,fma")
+static inline __m256 cmul_avx2(__m256 x, __m256 w)
+{
+    __m256 wr = _mm256_moveldup_ps(w);              // c c
+    __m256 wi = _mm256_movehdup_ps(w);              // d d
+    __m256 xs = _mm256_permute_ps(x, 0xb1);         // b a
+    return _mm256_fmaddsub_ps(x, wr, _mm256_mul_ps(xs, wi));
+}
+
+
+SOFTFM_TARGET("avx2,fma")
+static void nco_rotate_avx2(const IQSample *samples_in, unsigned int n,
+                            IQSample *phasors, IQSample step,
+                            IQSample *samples_out)
+{
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    float *y = reinterpret_cast<float*>(samples_out);
+    float *ph = reinterpret_cast<float*>(phasors);
+
+    // 8 lanes in 2 registers of 4 complex phasors each.
+    __m256 p0 = _mm256_loadu_ps(ph);
+    __m256 p1 = _mm256_loadu_ps(ph + 8);
+    __m256 w = _mm256_setr_ps(step.real(), step.imag(),
+                              step.real(), step.imag(),
+                              step.real(), step.imag(),
+                              step.real(), step.imag());
+
+    for (unsigned int i = 0; i < n; i += nco_lanes) {
+        const float *xp = x + 2 * i;
+        float *yp = y + 2 * i;
+        _mm256_storeu_ps(yp,     cmul_avx2(_mm256_loadu_ps(xp),     p0));
+        _mm256_storeu_ps(yp + 8, cmul_avx2(_mm256_loadu_ps(xp + 8), p1));
+        p0 = cmul_avx2(p0, w);
+        p1 = cmul_avx2(p1, w);
+    }
+
+    _mm256_storeu_ps(ph,     p0);
+    _mm256_storeu_ps(ph + 8, p1);
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+// Return the NCO rotation kernel for the specified level.
+NcoKernel select_nco_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return nco_rotate_avx2;
+#endif
+        default:                return nco_rotate_scalar;
+    }
+}
+
+
+/* ****************  FFT radix-4 stage  **************** */
+
+// Radix-4 butterfly of one transform; "inverse" as in FftRadix4Kernel.
+template <bool Inverse>
+static inline void fft_butterfly4(const IQSample *x, unsigned int xstride,
+                                  IQSample *y, unsigned int ystride,
+                                  IQSample w1, IQSample w2, IQSample w3)
+{
+    IQSample a = x[0];
+    IQSample b = x[xstride];
+    IQSample c = x[2 * xstride];
+    IQSample d = x[3 * xstride];
+    IQSample apc = a + c;
+    IQSample amc = a - c;
+    IQSample bpd = b + d;
+    IQSample bmd = b - d;
+
+    // -j (b - d) forward, +j (b - d) inverse.
+    IQSample jbmd = Inverse ? IQSample(-bmd.imag(), bmd.real())
+                            : IQSample(bmd.imag(), -bmd.real());
+
+    // Spelled out: std::complex multiplication checks for NaN and
+    // infinity unless built with -ffast-math.
+    IQSample y1 = amc + jbmd, y2 = apc - bpd, y3 = amc - jbmd;
+    y[0]           = apc + bpd;
+    y[ystride]     = IQSample(y1.real() * w1.real() - y1.imag() * w1.imag(),
+                              y1.real() * w1.imag() + y1.imag() * w1.real());
+    y[2 * ystride] = IQSample(y2.real() * w2.real() - y2.imag() * w2.imag(),
+                              y2.real() * w2.imag() + y2.imag() * w2.real());
+    y[3 * ystride] = IQSample(y3.real() * w3.real() - y3.imag() * w3.imag(),
+                              y3.real() * w3.imag() + y3.imag() * w3.real());
+}
+
+
+// Transforms q0 .. s-1 at p of a radix-4 stage.
+template <bool Inverse>
+static void fft_radix4_scalar_range(const IQSample *samples_in,
+                                    unsigned int m, unsigned int s,
+                                    unsigned int p, unsigned int q0,
+                                    IQSample w1, IQSample w2, IQSample w3,
+                                    IQSample *samples_out)
+{
+    const IQSample *x = samples_in + s * p;
+    IQSample *y = samples_out + s * 4 * p;
+    for (unsigned int q = q0; q < s; q++)
+        fft_butterfly4<Inverse>(x + q, s * m, y + q, s, w1, w2, w3);
+}
+
+
+template <bool Inverse>
+static void fft_radix4_scalar_t(const IQSample *samples_in,
+                                unsigned int m, unsigned int s,
+                                const IQSample *twiddle,
+                                IQSample *samples_out)
+{
+    for (unsigned int p = 0; p < m; p++) {
+        IQSample w1 = twiddle[p * s];
+        IQSample w2 = twiddle[2 * p * s];
+        IQSample w3 = twiddle[3 * p * s];
+        if (Inverse) {
+            w1 = conj(w1);
+            w2 = conj(w2);
+            w3 = conj(w3);
+        }
+        fft_radix4_scalar_range<Inverse>(samples_in, m, s, p, 0,
+                                         w1, w2, w3, samples_out);
+    }
+}
+
+
+static void fft_radix4_scalar(const IQSample *samples_in,
+                              unsigned int m, unsigned int s,
+                              const IQSample *twiddle, bool inverse,
+                              IQSample *samples_out)
+{
+    if (inverse)
+        fft_radix4_scalar_t<true>(samples_in, m, s, twiddle, samples_out);
+    else
+        fft_radix4_scalar_t<false>(samples_in, m, s, twiddle, samples_out);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// Four transforms (q .. q+3) per register; stages with s < 4 (the
+// first one) run scalar.
+SOFTFM_TARGET("avx2,fma")
+static void fft_radix4_avx2(const IQSample *samples_in,
+                            unsigned int m, unsigned int s,
+                            const IQSample *twiddle, bool inverse,
+                            IQSample *samples_out)
+{
+    if (s < 4) {
+        fft_radix4_scalar(samples_in, m, s, twiddle, inverse, samples_out);
+        return;
+    }
+
+    // Sign flip that turns the swapped (im, re) pairs of (b - d) into
+    // -j (b - d) forward or +j (b - d) inverse. Integer constants, since
+    // -ffast-math may drop the sign of -0.0f.
+    const int sr = inverse ? INT32_MIN : 0, si = inverse ? 0 : INT32_MIN;
+    const __m256 jsign = _mm256_castsi256_ps(
+        _mm256_setr_epi32(sr, si, sr, si, sr, si, sr, si));
+    const unsigned int s4 = s & ~3u;
+
+    for (unsigned int p = 0; p < m; p++) {
+        IQSample w1 = twiddle[p * s];
+        IQSample w2 = twiddle[2 * p * s];
+        IQSample w3 = twiddle[3 * p * s];
+        if (inverse) {
+            w1 = conj(w1);
+            w2 = conj(w2);
+            w3 = conj(w3);
+        }
+        __m256 vw1 = _mm256_setr_ps(w1.real(), w1.imag(), w1.real(), w1.imag(),
+                                    w1.real(), w1.imag(), w1.real(), w1.imag());
+        __m256 vw2 = _mm256_setr_ps(w2.real(), w2.imag(), w2.real(), w2.imag(),
+                                    w2.real(), w2.imag(), w2.real(), w2.imag());
+        __m256 vw3 = _mm256_setr_ps(w3.real(), w3.imag(), w3.real(), w3.imag(),
+                                    w3.real(), w3.imag(), w3.real(), w3.imag());
+
+        const float *x = reinterpret_cast<const float*>(samples_in + s * p);
+        float *y = reinterpret_cast<float*>(samples_out + s * 4 * p);
+        unsigned int xs = 2 * s * m, ys = 2 * s;
+
+        for (unsigned int q = 0; q < s4; q += 4) {
+            __m256 a = _mm256_loadu_ps(x + 2 * q);
+            __m256 b = _mm256_loadu_ps(x + 2 * q + xs);
+            __m256 c = _mm256_loadu_ps(x + 2 * q + 2 * xs);
+            __m256 d = _mm256_loadu_ps(x + 2 * q + 3 * xs);
+            __m256 apc = _mm256_add_ps(a, c);
+            __m256 amc = _mm256_sub_ps(a, c);
+            __m256 bpd = _mm256_add_ps(b, d);
+            __m256 bmd = _mm256_sub_ps(b, d);
+            __m256 jbmd = _mm256_xor_ps(_mm256_permute_ps(bmd, 0xb1), jsign);
+            _mm256_storeu_ps(y + 2 * q, _mm256_add_ps(apc, bpd));
+            _mm256_storeu_ps(y + 2 * q + ys,
+                             cmul_avx2(_mm256_add_ps(amc, jbmd), vw1));
+            _mm256_storeu_ps(y + 2 * q + 2 * ys,
+                             cmul_avx2(_mm256_sub_ps(apc, bpd), vw2));
+            _mm256_storeu_ps(y + 2 * q + 3 * ys,
+                             cmul_avx2(_mm256_sub_ps(amc, jbmd), vw3));
+        }
+
+        if (s4 < s) {
+            if (inverse)
+                fft_radix4_scalar_range<true>(samples_in, m, s, p, s4,
+                                              w1, w2, w3, samples_out);
+            else
+                fft_radix4_scalar_range<false>(samples_in, m, s, p, s4,
+                                               w1, w2, w3, samples_out);
+        }
+    }
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+// Return the radix-4 FFT stage kernel for the specified level.
+FftRadix4Kernel select_fft_radix4_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return fft_radix4_avx2;
+#endif
+        default:                return fft_radix4_scalar;
+    }
+}
+
+
+/* ****************  pilot mixer  **************** */
+
+// Same rotator as the NCO, but the lanes are kept in planar form
+// (8 real parts, 8 imaginary parts), since the input is real.
+
+static IQSample pilot_mix_scalar(const Sample *samples_in, unsigned int n,
+                                 IQSample *phasors, IQSample step,
+                                 Sample *samples_out)
+{
+    float pr[nco_lanes], pi[nco_lanes];
+    float acc_s[nco_lanes], acc_c[nco_lanes];
+    for (unsigned int k = 0; k < nco_lanes; k++) {
+        pr[k] = phasors[k].real();
+        pi[k] = phasors[k].imag();
+        acc_s[k] = 0;
+        acc_c[k] = 0;
+    }
+
+    const float sr = step.real(), si = step.imag();
+
+    for (unsigned int i = 0; i < n; i += nco_lanes) {
+        for (unsigned int k = 0; k < nco_lanes; k++) {
+            float x = samples_in[i+k];
+            samples_out[i+k] = 2 * pr[k] * pi[k];
+            acc_s[k] += x * pi[k];
+            acc_c[k] += x * pr[k];
+            float tr = pr[k] * sr - pi[k] * si;
+            pi[k]    = pr[k] * si + pi[k] * sr;
+            pr[k]    = tr;
+        }
+    }
+
+    float sum_s = 0, sum_c = 0;
+    for (unsigned int k = 0; k < nco_lanes; k++) {
+        phasors[k] = IQSample(pr[k], pi[k]);
+        sum_s += acc_s[k];
+        sum_c += acc_c[k];
+    }
+    return IQSample(sum_s, sum_c);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+static inline float hsum_sse2(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(v);
+}
+
+// 8 lanes in 2 registers of real parts and 2 of imaginary parts.
+SOFTFM_TARGET("sse2")
+static IQSample pilot_mix_sse2(const Sample *samples_in, unsigned int n,
+                               IQSample *phasors, IQSample step,
+                               Sample *samples_out)
+{
+    float *ph = reinterpret_cast<float*>(phasors);
+    __m128 a = _mm_loadu_ps(ph),     b = _mm_loadu_ps(ph + 4);
+    __m128 c = _mm_loadu_ps(ph + 8), d = _mm_loadu_ps(ph + 12);
+    __m128 pr[2] = { _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                     _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0)) };
+    __m128 pi[2] = { _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)),
+                     _mm_shuffle_ps(c, d, _MM_SHUFFLE(3, 1, 3, 1)) };
+    const __m128 sr = _mm_set1_ps(step.real());
+    const __m128 si = _mm_set1_ps(step.imag());
+    __m128 acc_s = _mm_setzero_ps(), acc_c = _mm_setzero_ps();
+
+    for (unsigned int i = 0; i < n; i += nco_lanes) {
+        for (int j = 0; j < 2; j++) {
+            __m128 x = _mm_loadu_ps(samples_in + i + 4 * j);
+            __m128 y = _mm_mul_ps(pr[j], pi[j]);
+            _mm_storeu_ps(samples_out + i + 4 * j, _mm_add_ps(y, y));
+            acc_s = _mm_add_ps(acc_s, _mm_mul_ps(x, pi[j]));
+            acc_c = _mm_add_ps(acc_c, _mm_mul_ps(x, pr[j]));
+            __m128 tr = _mm_sub_ps(_mm_mul_ps(pr[j], sr), _mm_mul_ps(pi[j], si));
+            pi[j] = _mm_add_ps(_mm_mul_ps(pr[j], si), _mm_mul_ps(pi[j], sr));
+            pr[j] = tr;
+        }
+    }
+
+    for (int j = 0; j < 2; j++) {
+        _mm_storeu_ps(ph + 8 * j,     _mm_unpacklo_ps(pr[j], pi[j]));
+        _mm_storeu_ps(ph + 8 * j + 4, _mm_unpackhi_ps(pr[j], pi[j]));
+    }
+    return IQSample(hsum_sse2(acc_s), hsum_sse2(acc_c));
+}
+
+// All 8 lanes in one register of real parts and one of imaginary parts.
+SOFTFM_TARGET("avx2,fma")
+static IQSample pilot_mix_avx2(const Sample *samples_in, unsigned int n,
+                               IQSample *phasors, IQSample step,
+                               Sample *samples_out)
+{
+    float *ph = reinterpret_cast<float*>(phasors);
+    __m256 a = _mm256_loadu_ps(ph), b = _mm256_loadu_ps(ph + 8);
+    // Within each 128-bit half: (r0 r1 r4 r5) and (i0 i1 i4 i5) order,
+    // fixed up by a cross-lane permute.
+    const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256 pr = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), order);
+    __m256 pi = _mm256_permutevar8x32_ps(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), order);
+    const __m256 sr = _mm256_set1_ps(step.real());
+    const __m256 si = _mm256_set1_ps(step.imag());
+    __m256 acc_s = _mm256_setzero_ps(), acc_c = _mm256_setzero_ps();
+
+    for (unsigned int i = 0; i < n; i += nco_lanes) {
+        __m256 x = _mm256_loadu_ps(samples_in + i);
+        __m256 y = _mm256_mul_ps(pr, pi);
+        _mm256_storeu_ps(samples_out + i, _mm256_add_ps(y, y));
+        acc_s = _mm256_fmadd_ps(x, pi, acc_s);
+        acc_c = _mm256_fmadd_ps(x, pr, acc_c);
+        __m256 tr = _mm256_fmsub_ps(pr, sr, _mm256_mul_ps(pi, si));
+        pi = _mm256_fmadd_ps(pr, si, _mm256_mul_ps(pi, sr));
+        pr = tr;
+    }
+
+    __m256 lo = _mm256_unpacklo_ps(pr, pi);     // r0 i0 r1 i1 | r4 i4 r5 i5
+    __m256 hi = _mm256_unpackhi_ps(pr, pi);     // r2 i2 r3 i3 | r6 i6 r7 i7
+    _mm256_storeu_ps(ph,     _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(ph + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc_s), _mm256_extractf128_ps(acc_s, 1));
+    __m128 c = _mm_add_ps(_mm256_castps256_ps128(acc_c), _mm256_extractf128_ps(acc_c, 1));
+    return IQSample(hsum_sse2(s), hsum_sse2(c));
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+// Return the pilot mixer kernel for the specified level.
+PilotMixKernel select_pilot_mix_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return pilot_mix_avx2;
+        case SimdLevel::SSE2:   return pilot_mix_sse2;
+#endif
+        default:                return pilot_mix_scalar;
+    }
+}
+
+
+/* ****************  phase discriminator  **************** */
+
+// All variants use the same branchless atan2:
+//   z = min(|x|,|y|) / max(|x|,|y|),  r = atan(z) by polynomial,
+//   r = pi/2 - r   if |y| > |x|
+//   r = pi - r     if x < 0
+//   r = -r         if y < 0
+// The polynomials approximate atan(z) on 0 <= z <= 1.
+// Fast:     the 3rd order polynomial of fastatan2.h.
+// Accurate: 9th order polynomial, Abramowitz & Stegun 4.4.49; its error
+//           of 1.15e-5 is close to the best for this order (1.14e-5).
+
+static const float atan_pi   = 3.14159265f;
+static const float atan_pi_2 = 1.57079633f;
+static const float atan_f1   =  0.97239411f;
+static const float atan_f3   = -0.19194795f;
+static const float atan_a1   =  0.9998660f;
+static const float atan_a3   = -0.3302995f;
+static const float atan_a5   =  0.1801410f;
+static const float atan_a7   = -0.0851330f;
+static const float atan_a9   =  0.0208351f;
+
+// Return (mask ? a : b) for mask either all ones or all zeros.
+static inline float select_mask(uint32_t mask, float a, float b)
+{
+    uint32_t ua, ub;
+    memcpy(&ua, &a, sizeof(ua));
+    memcpy(&ub, &b, sizeof(ub));
+    ua = (ua & mask) | (ub & ~mask);
+    memcpy(&a, &ua, sizeof(a));
+    return a;
+}
+
+
+template <bool Accurate>
+static inline float atan2_poly(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float mx = (ax > ay) ? ax : ay;
+    float mn = (ay < ax) ? ay : ax;
+    float z = mn / ((mx > FLT_MIN) ? mx : FLT_MIN);
+    float z2 = z * z;
+    float r;
+    if (Accurate) {
+        r = z * (atan_a1 + z2 * (atan_a3 + z2 * (atan_a5 +
+                 z2 * (atan_a7 + z2 * atan_a9))));
+    } else {
+        r = z * (atan_f1 + z2 * atan_f3);
+    }
+    // Select with bit masks rather than branches; the conditions are
+    // unpredictable for noisy input.
+    r = select_mask(-uint32_t(ay > ax), atan_pi_2 - r, r);
+    r = select_mask(-uint32_t(x < 0), atan_pi - r, r);
+    return copysignf(r, y);
+}
+
+
+// Compute output samples [i, n) one sample at a time.
+template <bool Accurate>
+static void phase_disc_scalar_range(const IQSample *samples_in,
+                                    unsigned int i, unsigned int n,
+                                    IQSample last, Sample scale,
+                                    Sample *samples_out)
+{
+    for (; i < n; i++) {
+        IQSample s0 = (i == 0) ? last : samples_in[i-1];
+        IQSample s1 = samples_in[i];
+        float re = s0.real() * s1.real() + s0.imag() * s1.imag();
+        float im = s0.real() * s1.imag() - s0.imag() * s1.real();
+        samples_out[i] = atan2_poly<Accurate>(im, re) * scale;
+    }
+}
+
+
+template <bool Accurate>
+static void phase_disc_scalar(const IQSample *samples_in, unsigned int n,
+                              IQSample last, Sample scale,
+                              Sample *samples_out)
+{
+    phase_disc_scalar_range<Accurate>(samples_in, 0, n, last, scale,
+                                      samples_out);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+template <bool Accurate>
+static inline __m128 atan2_poly_sse2(__m128 y, __m128 x)
+{
+    const __m128 signmask = _mm_set1_ps(-0.0f);
+    __m128 ax = _mm_andnot_ps(signmask, x);
+    __m128 ay = _mm_andnot_ps(signmask, y);
+    __m128 mx = _mm_max_ps(ax, ay);
+    __m128 mn = _mm_min_ps(ax, ay);
+    __m128 z = _mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(FLT_MIN)));
+    __m128 z2 = _mm_mul_ps(z, z);
+    __m128 r;
+    if (Accurate) {
+        r = _mm_set1_ps(atan_a9);
+        r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(atan_a7));
+        r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(atan_a5));
+        r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(atan_a3));
+        r = _mm_add_ps(_mm_mul_ps(r, z2), _mm_set1_ps(atan_a1));
+    } else {
+        r = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(atan_f3), z2),
+                       _mm_set1_ps(atan_f1));
+    }
+    r = _mm_mul_ps(r, z);
+    __m128 m = _mm_cmpgt_ps(ay, ax);
+    r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(atan_pi_2), r)),
+                  _mm_andnot_ps(m, r));
+    m = _mm_cmplt_ps(x, _mm_setzero_ps());
+    r = _mm_or_ps(_mm_and_ps(m, _mm_sub_ps(_mm_set1_ps(atan_pi), r)),
+                  _mm_andnot_ps(m, r));
+    return _mm_or_ps(r, _mm_and_ps(signmask, y));
+}
+
+
+template <bool Accurate>
+static void phase_disc_sse2(const IQSample *samples_in, unsigned int n,
+                            IQSample last, Sample scale,
+                            Sample *samples_out)
+{
+    if (n == 0)
+        return;
+
+    // The first sample needs the last sample of the previous block.
+    phase_disc_scalar_range<Accurate>(samples_in, 0, 1, last, scale,
+                                      samples_out);
+
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    const __m128 vscale = _mm_set1_ps(scale);
+
+    // 4 samples per iteration.
+    unsigned int i = 1;
+    for (; i + 4 <= n; i += 4) {
+        const float *p = x + 2 * i;
+        __m128 s1a = _mm_loadu_ps(p);
+        __m128 s1b = _mm_loadu_ps(p + 4);
+        __m128 s0a = _mm_loadu_ps(p - 2);
+        __m128 s0b = _mm_loadu_ps(p + 2);
+
+        // Deinterleave.
+        __m128 c = _mm_shuffle_ps(s1a, s1b, 0x88);
+        __m128 d = _mm_shuffle_ps(s1a, s1b, 0xdd);
+        __m128 a = _mm_shuffle_ps(s0a, s0b, 0x88);
+        __m128 b = _mm_shuffle_ps(s0a, s0b, 0xdd);
+
+        // conj(a + jb) * (c + jd)
+        __m128 re = _mm_add_ps(_mm_mul_ps(a, c), _mm_mul_ps(b, d));
+        __m128 im = _mm_sub_ps(_mm_mul_ps(a, d), _mm_mul_ps(b, c));
+
+        __m128 w = _mm_mul_ps(atan2_poly_sse2<Accurate>(im, re), vscale);
+        _mm_storeu_ps(samples_out + i, w);
+    }
+
+    phase_disc_scalar_range<Accurate>(samples_in, i, n, last, scale,
+                                      samples_out);
+}
+
+
+template <bool Accurate>
+SOFTFM_TARGET("avx2,fma")
+static inline __m256 atan2_poly_avx2(__m256 y, __m256 x)
+{
+    const __m256 signmask = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(signmask, x);
+    __m256 ay = _mm256_andnot_ps(signmask, y);
+    __m256 mx = _mm256_max_ps(ax, ay);
+    __m256 mn = _mm256_min_ps(ax, ay);
+    __m256 z = _mm256_div_ps(mn, _mm256_max_ps(mx, _mm256_set1_ps(FLT_MIN)));
+    __m256 z2 = _mm256_mul_ps(z, z);
+    __m256 r;
+    if (Accurate) {
+        r = _mm256_set1_ps(atan_a9);
+        r = _mm256_fmadd_ps(r, z2, _mm256_set1_ps(atan_a7));
+        r = _mm256_fmadd_ps(r, z2, _mm256_set1_ps(atan_a5));
+        r = _mm256_fmadd_ps(r, z2, _mm256_set1_ps(atan_a3));
+        r = _mm256_fmadd_ps(r, z2, _mm256_set1_ps(atan_a1));
+    } else {
+        r = _mm256_fmadd_ps(_mm256_set1_ps(atan_f3), z2,
+                            _mm256_set1_ps(atan_f1));
+    }
+    r = _mm256_mul_ps(r, z);
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(atan_pi_2), r),
+                         _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+    // Compare rather than blend on the sign bit, so that x = -0 is not
+    // negative here either.
+    r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(atan_pi), r),
+                         _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    return _mm256_or_ps(r, _mm256_and_ps(signmask, y));
+}
+
+
+template <bool Accurate>
+SOFTFM_TARGET("avx2,fma")
+static void phase_disc_avx2(const IQSample *samples_in, unsigned int n,
+                            IQSample last, Sample scale,
+                            Sample *samples_out)
+{
+    if (n == 0)
+        return;
+
+    // The first sample needs the last sample of the previous block.
+    phase_disc_scalar_range<Accurate>(samples_in, 0, 1, last, scale,
+                                      samples_out);
+
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    const __m256 vscale = _mm256_set1_ps(scale);
+
+    // 8 samples per iteration.
+    unsigned int i = 1;
+    for (; i + 8 <= n; i += 8) {
+        const float *p = x + 2 * i;
+        __m256 s1a = _mm256_loadu_ps(p);
+        __m256 s1b = _mm256_loadu_ps(p + 8);
+        __m256 s0a = _mm256_loadu_ps(p - 2);
+        __m256 s0b = _mm256_loadu_ps(p + 6);
+
+        // Deinterleave. Lane order becomes (0 1 4 5 2 3 6 7).
+        __m256 c = _mm256_shuffle_ps(s1a, s1b, 0x88);
+        __m256 d = _mm256_shuffle_ps(s1a, s1b, 0xdd);
+        __m256 a = _mm256_shuffle_ps(s0a, s0b, 0x88);
+        __m256 b = _mm256_shuffle_ps(s0a, s0b, 0xdd);
+
+        // conj(a + jb) * (c + jd)
+        __m256 re = _mm256_fmadd_ps(a, c, _mm256_mul_ps(b, d));
+        __m256 im = _mm256_fmsub_ps(a, d, _mm256_mul_ps(b, c));
+
+        __m256 w = _mm256_mul_ps(atan2_poly_avx2<Accurate>(im, re), vscale);
+
+        // Restore lane order (0 1 2 3 4 5 6 7).
+        w = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(w), 0xd8));
+        _mm256_storeu_ps(samples_out + i, w);
+    }
+
+    phase_disc_scalar_range<Accurate>(samples_in, i, n, last, scale,
+                                      samples_out);
+}
+
+
+SOFTFM_AVX512_WARNINGS_OFF
+
+template <bool Accurate>
+SOFTFM_TARGET("avx512f")
+static inline __m512 atan2_poly_avx512(__m512 y, __m512 x)
+{
+    const __m512i signmask = _mm512_set1_epi32(0x80000000);
+    __m512 ax = _mm512_castsi512_ps(
+                    _mm512_andnot_si512(signmask, _mm512_castps_si512(x)));
+    __m512 ay = _mm512_castsi512_ps(
+                    _mm512_andnot_si512(signmask, _mm512_castps_si512(y)));
+    __m512 mx = _mm512_max_ps(ax, ay);
+    __m512 mn = _mm512_min_ps(ax, ay);
+    __m512 z = _mm512_div_ps(mn, _mm512_max_ps(mx, _mm512_set1_ps(FLT_MIN)));
+    __m512 z2 = _mm512_mul_ps(z, z);
+    __m512 r;
+    if (Accurate) {
+        r = _mm512_set1_ps(atan_a9);
+        r = _mm512_fmadd_ps(r, z2, _mm512_set1_ps(atan_a7));
+        r = _mm512_fmadd_ps(r, z2, _mm512_set1_ps(atan_a5));
+        r = _mm512_fmadd_ps(r, z2, _mm512_set1_ps(atan_a3));
+        r = _mm512_fmadd_ps(r, z2, _mm512_set1_ps(atan_a1));
+    } else {
+        r = _mm512_fmadd_ps(_mm512_set1_ps(atan_f3), z2,
+                            _mm512_set1_ps(atan_f1));
+    }
+    r = _mm512_mul_ps(r, z);
+    r = _mm512_mask_sub_ps(r, _mm512_cmp_ps_mask(ay, ax, _CMP_GT_OQ),
+                           _mm512_set1_ps(atan_pi_2), r);
+    r = _mm512_mask_sub_ps(r, _mm512_cmp_ps_mask(x, _mm512_setzero_ps(),
+                                                 _CMP_LT_OQ),
+                           _mm512_set1_ps(atan_pi), r);
+    return _mm512_castsi512_ps(
+               _mm512_or_si512(_mm512_castps_si512(r),
+                   _mm512_and_si512(signmask, _mm512_castps_si512(y))));
+}
+
+
+template <bool Accurate>
+SOFTFM_TARGET("avx512f")
+static void phase_disc_avx512(const IQSample *samples_in, unsigned int n,
+                              IQSample last, Sample scale,
+                              Sample *samples_out)
+{
+    if (n == 0)
+        return;
+
+    // The first sample needs the last sample of the previous block.
+    phase_disc_scalar_range<Accurate>(samples_in, 0, 1, last, scale,
+                                      samples_out);
+
+    const float *x = reinterpret_cast<const float*>(samples_in);
+    const __m512 vscale = _mm512_set1_ps(scale);
+
+    // Deinterleaving leaves lane k of each 128-bit block holding samples
+    // (2q, 2q+1, 2q+8, 2q+9) for block q. This index restores the order.
+    const __m512i order = _mm512_setr_epi32(0, 1, 4, 5, 8, 9, 12, 13,
+                                            2, 3, 6, 7, 10, 11, 14, 15);
+
+    // 16 samples per iteration.
+    unsigned int i = 1;
+    for (; i + 16 <= n; i += 16) {
+        const float *p = x + 2 * i;
+        __m512 s1a = _mm512_loadu_ps(p);
+        __m512 s1b = _mm512_loadu_ps(p + 16);
+        __m512 s0a = _mm512_loadu_ps(p - 2);
+        __m512 s0b = _mm512_loadu_ps(p + 14);
+
+        __m512 c = _mm512_shuffle_ps(s1a, s1b, 0x88);
+        __m512 d = _mm512_shuffle_ps(s1a, s1b, 0xdd);
+        __m512 a = _mm512_shuffle_ps(s0a, s0b, 0x88);
+        __m512 b = _mm512_shuffle_ps(s0a, s0b, 0xdd);
+
+        // conj(a + jb) * (c + jd)
+        __m512 re = _mm512_fmadd_ps(a, c, _mm512_mul_ps(b, d));
+        __m512 im = _mm512_fmsub_ps(a, d, _mm512_mul_ps(b, c));
+
+        __m512 w = _mm512_mul_ps(atan2_poly_avx512<Accurate>(im, re), vscale);
+        _mm512_storeu_ps(samples_out + i, _mm512_permutexvar_ps(order, w));
+    }
+
+    phase_disc_scalar_range<Accurate>(samples_in, i, n, last, scale,
+                                      samples_out);
+}
+
+SOFTFM_AVX512_WARNINGS_ON
+
+#endif // SOFTFM_SIMD_X86
+
+
+#if defined(SOFTFM_SIMD_NEON)
+
+template <bool Accurate>
+static inline float32x4_t atan2_poly_neon(float32x4_t y, float32x4_t x)
+{
+    float32x4_t ax = vabsq_f32(x);
+    float32x4_t ay = vabsq_f32(y);
+    float32x4_t mx = vmaxq_f32(vmaxq_f32(ax, ay), vdupq_n_f32(FLT_MIN));
+    float32x4_t mn = vminq_f32(ax, ay);
+
+    // Reciprocal estimate refined by two Newton-Raphson steps
+    // (32-bit NEON has no division).
+    float32x4_t inv = vrecpeq_f32(mx);
+    inv = vmulq_f32(inv, vrecpsq_f32(mx, inv));
+    inv = vmulq_f32(inv, vrecpsq_f32(mx, inv));
+    float32x4_t z = vmulq_f32(mn, inv);
+    float32x4_t z2 = vmulq_f32(z, z);
+
+    float32x4_t r;
+    if (Accurate) {
+        r = vdupq_n_f32(atan_a9);
+        r = vmlaq_f32(vdupq_n_f32(atan_a7), r, z2);
+        r = vmlaq_f32(vdupq_n_f32(atan_a5), r, z2);
+        r = vmlaq_f32(vdupq_n_f32(atan_a3), r, z2);
+        r = vmlaq_f32(vdupq_n_f32(atan_a1), r, z2);
+    } else {
+        r = vmlaq_f32(vdupq_n_f32(atan_f1), vdupq_n_f32(atan_f3), z2);
+    }
+    r = vmulq_f32(r, z);
+    r = vbslq_f32(vcgtq_f32(ay, ax),
+                  vsubq_f32(vdupq_n_f32(atan_pi_2), r), r);
+    r = vbslq_f32(vcltq_f32(x, vdupq_n_f32(0.0f)),
+                  vsubq_f32(vdupq_n_f32(atan_pi), r), r);
+    uint32x4_t signmask = vdupq_n_u32(0x80000000);
+    return vreinterpretq_f32_u32(
+               vorrq_u32(vreinterpretq_u32_f32(r),
+                         vandq_u32(signmask, vreinterpretq_u32_f32(y))));
+}
+
+
+template <bool Accurate>
+static void phase_disc_neon(const IQSample *samples_in, unsigned int n,
+                            IQSample last, Sample scale,
+                            Sample *samples_out)
+{
+    if (n == 0)
+        return;
+
+    // The first sample needs the last sample of the previous block.
+    phase_disc_scalar_range<Accurate>(samples_in, 0, 1, last, scale,
+                                      samples_out);
+
+    const float *x = reinterpret_cast<const float*>(samples_in);
+
+    // 4 samples per iteration.
+    unsigned int i = 1;
+    for (; i + 4 <= n; i += 4) {
+        float32x4x2_t s1 = vld2q_f32(x + 2 * i);
+        float32x4x2_t s0 = vld2q_f32(x + 2 * i - 2);
+
+        // conj(a + jb) * (c + jd)
+        float32x4_t re = vmlaq_f32(vmulq_f32(s0.val[0], s1.val[0]),
+                                   s0.val[1], s1.val[1]);
+        float32x4_t im = vmlsq_f32(vmulq_f32(s0.val[0], s1.val[1]),
+                                   s0.val[1], s1.val[0]);
+
+        float32x4_t w = vmulq_n_f32(atan2_poly_neon<Accurate>(im, re), scale);
+        vst1q_f32(samples_out + i, w);
+    }
+
+    phase_disc_scalar_range<Accurate>(samples_in, i, n, last, scale,
+                                      samples_out);
+}
+
+#endif // SOFTFM_SIMD_NEON
+
+
+// Return the phase discriminator kernel for the specified level.
+PhaseDiscKernel select_phase_disc_kernel(SimdLevel level,
+                                         Atan2Accuracy accuracy)
+{
+    bool accurate = (accuracy == Atan2Accuracy::Accurate);
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+            return accurate ? phase_disc_avx512<true>
+                            : phase_disc_avx512<false>;
+        case SimdLevel::AVX2:
+            return accurate ? phase_disc_avx2<true>
+                            : phase_disc_avx2<false>;
+        case SimdLevel::SSE2:
+            return accurate ? phase_disc_sse2<true>
+                            : phase_disc_sse2<false>;
+#endif
+#if defined(SOFTFM_SIMD_NEON)
+        case SimdLevel::NEON:
+            return accurate ? phase_disc_neon<true>
+                            : phase_disc_neon<false>;
+#endif
+        default:
+            return accurate ? phase_disc_scalar<true>
+                            : phase_disc_scalar<false>;
+    }
+}
+
+
+/* ****************  u8 to IQ conversion  **************** */
+
+// The conversion and the correction fold into one multiply-add per lane
+//   x = byte * scale + offset
+// with scale and offset chosen per lane (I or Q), followed by the phase
+// term q += i * phase. Without correction every step is exact, so the
+// result equals (byte - 128) / 128 at all levels.
+
+struct U8Coeffs
+{
+    float scale_i, offset_i;
+    float scale_q, offset_q;
+    float phase;
+
+    explicit U8Coeffs(const IQCorrection& c)
+        : scale_i(1.0f / 128)
+        , offset_i(-1.0f - c.dc_i)
+        , scale_q(c.gain / 128)
+        , offset_q((-1.0f - c.dc_q) * c.gain)
+        , phase(c.phase)
+    { }
+};
+
+static void u8_to_iq_scalar_range(const uint8_t *samples_in,
+                                  unsigned int i, unsigned int n,
+                                  const U8Coeffs& k, IQSample *samples_out)
+{
+    for (; i < n; i++) {
+        float re = samples_in[2*i]   * k.scale_i + k.offset_i;
+        float im = samples_in[2*i+1] * k.scale_q + k.offset_q + re * k.phase;
+        samples_out[i] = IQSample(re, im);
+    }
+}
+
+static void u8_to_iq_scalar(const uint8_t *samples_in, unsigned int n,
+                            const IQCorrection& correction,
+                            IQSample *samples_out)
+{
+    u8_to_iq_scalar_range(samples_in, 0, n, U8Coeffs(correction),
+                          samples_out);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// Widen with unpack (SSE2 has no pmovzx); 8 samples per iteration.
+SOFTFM_TARGET("sse2")
+static void u8_to_iq_sse2(const uint8_t *samples_in, unsigned int n,
+                          const IQCorrection& correction,
+                          IQSample *samples_out)
+{
+    U8Coeffs k(correction);
+    float *y = reinterpret_cast<float*>(samples_out);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale  = _mm_setr_ps(k.scale_i, k.scale_q, k.scale_i, k.scale_q);
+    const __m128 offset = _mm_setr_ps(k.offset_i, k.offset_q, k.offset_i, k.offset_q);
+    const __m128 phase  = _mm_setr_ps(0, k.phase, 0, k.phase);
+
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples_in + 2 * i));
+        __m128i lo = _mm_unpacklo_epi8(b, zero);
+        __m128i hi = _mm_unpackhi_epi8(b, zero);
+        __m128i w[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                         _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+        for (int j = 0; j < 4; j++) {
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(w[j]), scale), offset);
+            __m128 re = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 0, 0));
+            v = _mm_add_ps(v, _mm_mul_ps(re, phase));
+            _mm_storeu_ps(y + 2 * i + 4 * j, v);
+        }
+    }
+
+    u8_to_iq_scalar_range(samples_in, i, n, k, samples_out);
+}
+
+// pmovzxbd + cvtdq2ps; 16 samples per iteration.
+SOFTFM_TARGET("avx2,fma")
+static void u8_to_iq_avx2(const uint8_t *samples_in, unsigned int n,
+                          const IQCorrection& correction,
+                          IQSample *samples_out)
+{
+    U8Coeffs k(correction);
+    float *y = reinterpret_cast<float*>(samples_out);
+    const __m256 scale  = _mm256_setr_ps(k.scale_i, k.scale_q, k.scale_i, k.scale_q,
+                                         k.scale_i, k.scale_q, k.scale_i, k.scale_q);
+    const __m256 offset = _mm256_setr_ps(k.offset_i, k.offset_q, k.offset_i, k.offset_q,
+                                         k.offset_i, k.offset_q, k.offset_i, k.offset_q);
+    const __m256 phase  = _mm256_setr_ps(0, k.phase, 0, k.phase, 0, k.phase, 0, k.phase);
+
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t *p = samples_in + 2 * i;
+        for (int j = 0; j < 4; j++) {
+            __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 8 * j));
+            __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+            v = _mm256_fmadd_ps(v, scale, offset);
+            v = _mm256_fmadd_ps(_mm256_moveldup_ps(v), phase, v);
+            _mm256_storeu_ps(y + 2 * i + 8 * j, v);
+        }
+    }
+
+    u8_to_iq_scalar_range(samples_in, i, n, k, samples_out);
+}
+
+SOFTFM_AVX512_WARNINGS_OFF
+
+// Same as AVX2 with 16 lanes; 16 samples per iteration.
+SOFTFM_TARGET("avx512f")
+static void u8_to_iq_avx512(const uint8_t *samples_in, unsigned int n,
+                            const IQCorrection& correction,
+                            IQSample *samples_out)
+{
+    U8Coeffs k(correction);
+    float *y = reinterpret_cast<float*>(samples_out);
+    const __m512 scale  = _mm512_broadcast_f32x4(
+                              _mm_setr_ps(k.scale_i, k.scale_q, k.scale_i, k.scale_q));
+    const __m512 offset = _mm512_broadcast_f32x4(
+                              _mm_setr_ps(k.offset_i, k.offset_q, k.offset_i, k.offset_q));
+    const __m512 phase  = _mm512_broadcast_f32x4(_mm_setr_ps(0, k.phase, 0, k.phase));
+
+    unsigned int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t *p = samples_in + 2 * i;
+        for (int j = 0; j < 2; j++) {
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * j));
+            __m512 v = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(b));
+            v = _mm512_fmadd_ps(v, scale, offset);
+            v = _mm512_fmadd_ps(_mm512_moveldup_ps(v), phase, v);
+            _mm512_storeu_ps(y + 2 * i + 16 * j, v);
+        }
+    }
+
+    u8_to_iq_scalar_range(samples_in, i, n, k, samples_out);
+}
+
+SOFTFM_AVX512_WARNINGS_ON
+
+#endif // SOFTFM_SIMD_X86
+
+
+#if defined(SOFTFM_SIMD_NEON)
+
+static void u8_to_iq_neon(const uint8_t *samples_in, unsigned int n,
+                          const IQCorrection& correction,
+                          IQSample *samples_out)
+{
+    U8Coeffs k(correction);
+    float *y = reinterpret_cast<float*>(samples_out);
+    const float scale_v[4]  = { k.scale_i, k.scale_q, k.scale_i, k.scale_q };
+    const float offset_v[4] = { k.offset_i, k.offset_q, k.offset_i, k.offset_q };
+    const float phase_v[4]  = { 0, k.phase, 0, k.phase };
+    const float32x4_t scale  = vld1q_f32(scale_v);
+    const float32x4_t offset = vld1q_f32(offset_v);
+    const float32x4_t phase  = vld1q_f32(phase_v);
+
+    // 8 samples per iteration.
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint8x16_t b = vld1q_u8(samples_in + 2 * i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(b));
+        uint16x8_t hi = vmovl_u8(vget_high_u8(b));
+        uint32x4_t w[4] = { vmovl_u16(vget_low_u16(lo)), vmovl_u16(vget_high_u16(lo)),
+                            vmovl_u16(vget_low_u16(hi)), vmovl_u16(vget_high_u16(hi)) };
+        for (int j = 0; j < 4; j++) {
+            float32x4_t v = vmlaq_f32(offset, vcvtq_f32_u32(w[j]), scale);
+            float32x4_t re = vtrnq_f32(v, v).val[0];
+            v = vmlaq_f32(v, re, phase);
+            vst1q_f32(y + 2 * i + 4 * j, v);
+        }
+    }
+
+    u8_to_iq_scalar_range(samples_in, i, n, k, samples_out);
+}
+
+#endif // SOFTFM_SIMD_NEON
+
+
+// Return the u8 to IQ conversion kernel for the specified level.
+U8ToIQKernel select_u8_to_iq_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512: return u8_to_iq_avx512;
+        case SimdLevel::AVX2:   return u8_to_iq_avx2;
+        case SimdLevel::SSE2:   return u8_to_iq_sse2;
+#endif
+#if defined(SOFTFM_SIMD_NEON)
+        case SimdLevel::NEON:   return u8_to_iq_neon;
+#endif
+        default:                return u8_to_iq_scalar;
+    }
+}
+
+
+/* ****************  16-bit fixed-point front end  **************** */
+
+// The tuner multiplies (I + jQ) by (cos + j sin) with two pmaddwd:
+//   [I, Q] . [cos, -sin] = I',   [I, Q] . [sin, cos] = Q'
+// Inputs are (x - 128) and the oscillator is Q14, so the products are
+// Q21 for a full scale input; rounding and shifting by 7 gives Q14.
+//
+// The FIR kernels also use pmaddwd, which multiplies pairs of int16 and
+// adds each pair into one int32. The plain FIR first rewrites the input
+// as (I[k], I[k+1], Q[k], Q[k+1]), so two adjacent taps of one output are
+// one pmaddwd; the decimating FIR computes few outputs and pairs adjacent
+// taps by shuffling I and Q apart instead.
+// Q14 input times Q14 coefficients fits easily in 32 bits.
+
+static const int tuner_u8_shift = 7;
+
+static inline int16_t saturate_s16(int32_t v)
+{
+    return int16_t(v < -32768 ? -32768 : (v > 32767 ? 32767 : v));
+}
+
+static void tuner_u8_scalar_range(const uint8_t *samples_in, unsigned int i,
+                                  unsigned int n, const int16_t *table_a,
+                                  const int16_t *table_b, int16_t *samples_out)
+{
+    const int32_t round = 1 << (tuner_u8_shift - 1);
+    for (; i < n; i++) {
+        int32_t re = int32_t(samples_in[2*i]) - 128;
+        int32_t im = int32_t(samples_in[2*i+1]) - 128;
+        int32_t a = re * table_a[2*i] + im * table_a[2*i+1];
+        int32_t b = re * table_b[2*i] + im * table_b[2*i+1];
+        samples_out[2*i]   = saturate_s16((a + round) >> tuner_u8_shift);
+        samples_out[2*i+1] = saturate_s16((b + round) >> tuner_u8_shift);
+    }
+}
+
+static void tuner_u8_scalar(const uint8_t *samples_in, unsigned int n,
+                            const int16_t *table_a, const int16_t *table_b,
+                            int16_t *samples_out)
+{
+    tuner_u8_scalar_range(samples_in, 0, n, table_a, table_b, samples_out);
+}
+
+static void fir_s16_scalar_range(const int16_t *x, const int16_t *coeff,
+                                 unsigned int ntaps, unsigned int i,
+                                 unsigned int n, Sample scale,
+                                 IQSample *samples_out)
+{
+    for (; i < n; i++) {
+        const int16_t *p = x + 2 * i;
+        int32_t acc_re = 0, acc_im = 0;
+        for (unsigned int j = 0; j < ntaps; j++) {
+            acc_re += int32_t(p[2*j])   * coeff[j];
+            acc_im += int32_t(p[2*j+1]) * coeff[j];
+        }
+        samples_out[i] = IQSample(float(acc_re) * scale, float(acc_im) * scale);
+    }
+}
+
+static void fir_s16_scalar(const int16_t *samples_in, const int16_t *coeff,
+                           unsigned int ntaps, unsigned int n, Sample scale,
+                           int16_t *, IQSample *samples_out)
+{
+    fir_s16_scalar_range(samples_in, coeff, ntaps, 0, n, scale, samples_out);
+}
+
+static void fir_s16_decim_scalar(const int16_t *samples_in,
+                                 const int16_t *coeff4, unsigned int ntaps,
+                                 unsigned int n, unsigned int stride,
+                                 Sample scale, IQSample *samples_out)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        const int16_t *p = samples_in + 2 * i * stride;
+        int32_t acc_re = 0, acc_im = 0;
+        for (unsigned int j = 0; j < ntaps; j += 4) {
+            const int16_t *c = coeff4 + 2 * j;
+            acc_re += int32_t(p[2*j])   * c[0] + int32_t(p[2*j+2]) * c[1]
+                    + int32_t(p[2*j+4]) * c[4] + int32_t(p[2*j+6]) * c[5];
+            acc_im += int32_t(p[2*j+1]) * c[0] + int32_t(p[2*j+3]) * c[1]
+                    + int32_t(p[2*j+5]) * c[4] + int32_t(p[2*j+7]) * c[5];
+        }
+        samples_out[i] = IQSample(float(acc_re) * scale, float(acc_im) * scale);
+    }
+}
+
+// Load two adjacent int16 coefficients as one int32 lane value.
+static inline int32_t coeff_pair(const int16_t *c)
+{
+    int32_t v;
+    memcpy(&v, c, sizeof(v));
+    return v;
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// 4 samples per iteration.
+SOFTFM_TARGET("sse2")
+static void tuner_u8_sse2(const uint8_t *samples_in, unsigned int n,
+                          const int16_t *table_a, const int16_t *table_b,
+                          int16_t *samples_out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(1 << (tuner_u8_shift - 1));
+
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(samples_in + 2 * i));
+        __m128i x = _mm_sub_epi16(_mm_unpacklo_epi8(b, zero), bias);
+        __m128i ta = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table_a + 2 * i));
+        __m128i tb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table_b + 2 * i));
+        __m128i re = _mm_madd_epi16(x, ta);
+        __m128i im = _mm_madd_epi16(x, tb);
+        __m128i lo = _mm_unpacklo_epi32(re, im);
+        __m128i hi = _mm_unpackhi_epi32(re, im);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), tuner_u8_shift);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), tuner_u8_shift);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(samples_out + 2 * i),
+                         _mm_packs_epi32(lo, hi));
+    }
+
+    tuner_u8_scalar_range(samples_in, i, n, table_a, table_b, samples_out);
+}
+
+// 8 samples per iteration. Unpack and pack work per 128-bit lane,
+// which keeps the samples in order.
+SOFTFM_TARGET("avx2")
+static void tuner_u8_avx2(const uint8_t *samples_in, unsigned int n,
+                          const int16_t *table_a, const int16_t *table_b,
+                          int16_t *samples_out)
+{
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i round = _mm256_set1_epi32(1 << (tuner_u8_shift - 1));
+
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples_in + 2 * i));
+        __m256i x = _mm256_sub_epi16(_mm256_cvtepu8_epi16(b), bias);
+        __m256i ta = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table_a + 2 * i));
+        __m256i tb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(table_b + 2 * i));
+        __m256i re = _mm256_madd_epi16(x, ta);
+        __m256i im = _mm256_madd_epi16(x, tb);
+        __m256i lo = _mm256_unpacklo_epi32(re, im);
+        __m256i hi = _mm256_unpackhi_epi32(re, im);
+        lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), tuner_u8_shift);
+        hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), tuner_u8_shift);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(samples_out + 2 * i),
+                            _mm256_packs_epi32(lo, hi));
+    }
+
+    tuner_u8_scalar_range(samples_in, i, n, table_a, table_b, samples_out);
+}
+
+// Build m sample pairs (I[k], I[k+1], Q[k], Q[k+1]) from m + 1 samples.
+// Each pair feeds one pmaddwd with two adjacent taps, so the filter loop
+// below needs no shuffles.
+SOFTFM_TARGET("sse2")
+static void pair_s16_sse2(const int16_t *x, unsigned int m, int16_t *pairs)
+{
+    unsigned int k = 0;
+    for (; k + 4 <= m; k += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 2 * k));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + 2 * k + 2));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pairs + 4 * k),
+                         _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pairs + 4 * k + 8),
+                         _mm_unpackhi_epi16(a, b));
+    }
+    for (; k < m; k++) {
+        pairs[4*k]   = x[2*k];
+        pairs[4*k+1] = x[2*k+2];
+        pairs[4*k+2] = x[2*k+1];
+        pairs[4*k+3] = x[2*k+3];
+    }
+}
+
+// 8 output samples per iteration, 2 taps per pmaddwd.
+SOFTFM_TARGET("sse2")
+static void fir_s16_sse2(const int16_t *samples_in, const int16_t *coeff,
+                         unsigned int ntaps, unsigned int n, Sample scale,
+                         int16_t *scratch, IQSample *samples_out)
+{
+    float *y = reinterpret_cast<float*>(samples_out);
+    const __m128 vscale = _mm_set1_ps(scale);
+
+    unsigned int nv = n - n % 8;
+    if (nv > 0)
+        pair_s16_sse2(samples_in, nv + ntaps - 2, scratch);
+
+    for (unsigned int i = 0; i < nv; i += 8) {
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        __m128i acc2 = _mm_setzero_si128();
+        __m128i acc3 = _mm_setzero_si128();
+        for (unsigned int j = 0; j < ntaps; j += 2) {
+            __m128i c = _mm_set1_epi32(coeff_pair(coeff + j));
+            const __m128i *q = reinterpret_cast<const __m128i*>(scratch + 4 * (i + j));
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_loadu_si128(q), c));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_loadu_si128(q + 1), c));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_loadu_si128(q + 2), c));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_loadu_si128(q + 3), c));
+        }
+        _mm_storeu_ps(y + 2 * i,      _mm_mul_ps(_mm_cvtepi32_ps(acc0), vscale));
+        _mm_storeu_ps(y + 2 * i + 4,  _mm_mul_ps(_mm_cvtepi32_ps(acc1), vscale));
+        _mm_storeu_ps(y + 2 * i + 8,  _mm_mul_ps(_mm_cvtepi32_ps(acc2), vscale));
+        _mm_storeu_ps(y + 2 * i + 12, _mm_mul_ps(_mm_cvtepi32_ps(acc3), vscale));
+    }
+
+    fir_s16_scalar_range(samples_in, coeff, ntaps, nv, n, scale, samples_out);
+}
+
+// Same as pair_s16_sse2. The in-lane unpack produces pairs (0,1 | 4,5)
+// and (2,3 | 6,7), which are put in order before storing.
+SOFTFM_TARGET("avx2")
+static void pair_s16_avx2(const int16_t *x, unsigned int m, int16_t *pairs)
+{
+    unsigned int k = 0;
+    for (; k + 8 <= m; k += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + 2 * k));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + 2 * k + 2));
+        __m256i lo = _mm256_unpacklo_epi16(a, b);
+        __m256i hi = _mm256_unpackhi_epi16(a, b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pairs + 4 * k),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pairs + 4 * k + 16),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    for (; k < m; k++) {
+        pairs[4*k]   = x[2*k];
+        pairs[4*k+1] = x[2*k+2];
+        pairs[4*k+2] = x[2*k+1];
+        pairs[4*k+3] = x[2*k+3];
+    }
+}
+
+// 16 output samples per iteration, 2 taps per pmaddwd.
+SOFTFM_TARGET("avx2")
+static void fir_s16_avx2(const int16_t *samples_in, const int16_t *coeff,
+                         unsigned int ntaps, unsigned int n, Sample scale,
+                         int16_t *scratch, IQSample *samples_out)
+{
+    float *y = reinterpret_cast<float*>(samples_out);
+    const __m256 vscale = _mm256_set1_ps(scale);
+
+    unsigned int nv = n - n % 16;
+    if (nv > 0)
+        pair_s16_avx2(samples_in, nv + ntaps - 2, scratch);
+
+    for (unsigned int i = 0; i < nv; i += 16) {
+        __m256i acc0 = _mm256_setzero_si256();
+        __m256i acc1 = _mm256_setzero_si256();
+        __m256i acc2 = _mm256_setzero_si256();
+        __m256i acc3 = _mm256_setzero_si256();
+        for (unsigned int j = 0; j < ntaps; j += 2) {
+            __m256i c = _mm256_set1_epi32(coeff_pair(coeff + j));
+            const __m256i *q = reinterpret_cast<const __m256i*>(scratch + 4 * (i + j));
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_loadu_si256(q), c));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_loadu_si256(q + 1), c));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_loadu_si256(q + 2), c));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_loadu_si256(q + 3), c));
+        }
+        _mm256_storeu_ps(y + 2 * i,      _mm256_mul_ps(_mm256_cvtepi32_ps(acc0), vscale));
+        _mm256_storeu_ps(y + 2 * i + 8,  _mm256_mul_ps(_mm256_cvtepi32_ps(acc1), vscale));
+        _mm256_storeu_ps(y + 2 * i + 16, _mm256_mul_ps(_mm256_cvtepi32_ps(acc2), vscale));
+        _mm256_storeu_ps(y + 2 * i + 24, _mm256_mul_ps(_mm256_cvtepi32_ps(acc3), vscale));
+    }
+
+    fir_s16_scalar_range(samples_in, coeff, ntaps, nv, n, scale, samples_out);
+}
+
+// 4 taps per pmaddwd: (I0 Q0 I1 Q1) -> (I0 I1 Q0 Q1) in each half.
+SOFTFM_TARGET("sse2")
+static void fir_s16_decim_sse2(const int16_t *samples_in,
+                               const int16_t *coeff4, unsigned int ntaps,
+                               unsigned int n, unsigned int stride,
+                               Sample scale, IQSample *samples_out)
+{
+    for (unsigned int i = 0; i < n; i++) {
+        const int16_t *p = samples_in + 2 * i * stride;
+        __m128i acc = _mm_setzero_si128();
+        for (unsigned int j = 0; j < ntaps; j += 4) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * j));
+            x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+            x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coeff4 + 2 * j));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(x, c));
+        }
+        // (re01, im01, re23, im23) -> (re, im)
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(acc), _mm_set1_ps(scale));
+        _mm_storel_pi(reinterpret_cast<__m64*>(samples_out + i), v);
+    }
+}
+
+// 8 taps per pmaddwd.
+SOFTFM_TARGET("avx2")
+static void fir_s16_decim_avx2(const int16_t *samples_in,
+                               const int16_t *coeff4, unsigned int ntaps,
+                               unsigned int n, unsigned int stride,
+                               Sample scale, IQSample *samples_out)
+{
+    const __m256i order = _mm256_setr_epi8(0, 1, 4, 5, 2, 3, 6, 7,
+                                           8, 9, 12, 13, 10, 11, 14, 15,
+                                           0, 1, 4, 5, 2, 3, 6, 7,
+                                           8, 9, 12, 13, 10, 11, 14, 15);
+    for (unsigned int i = 0; i < n; i++) {
+        const int16_t *p = samples_in + 2 * i * stride;
+        __m256i acc = _mm256_setzero_si256();
+        for (unsigned int j = 0; j < ntaps; j += 8) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2 * j));
+            x = _mm256_shuffle_epi8(x, order);
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coeff4 + 2 * j));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, c));
+        }
+        __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                  _mm256_extracti128_si256(acc, 1));
+        s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+        __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(s), _mm_set1_ps(scale));
+        _mm_storel_pi(reinterpret_cast<__m64*>(samples_out + i), v);
+    }
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+// Return the u8 fine tuner kernel for the specified level.
+TunerU8Kernel select_tuner_u8_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return tuner_u8_avx2;
+        case SimdLevel::SSE2:   return tuner_u8_sse2;
+#endif
+        default:                return tuner_u8_scalar;
+    }
+}
+
+// Return the 16-bit FIR kernel for the specified level.
+FirS16Kernel select_fir_s16_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return fir_s16_avx2;
+        case SimdLevel::SSE2:   return fir_s16_sse2;
+#endif
+        default:                return fir_s16_scalar;
+    }
+}
+
+// Return the decimating 16-bit FIR kernel for the specified level.
+FirS16DecimKernel select_fir_s16_decim_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:   return fir_s16_decim_avx2;
+        case SimdLevel::SSE2:   return fir_s16_decim_sse2;
+#endif
+        default:                return fir_s16_decim_scalar;
+    }
+}
+
+
+/* ****************  audio to S16 conversion  **************** */
+
+// Clip, scale by 32767 and round to nearest even; lrintf in the scalar
+// code and cvtps2dq in the vector code both use the current rounding
+// mode. packssdw saturates what the dither pushes past the 16-bit range.
+//
+// The dither is the difference of the two 16-bit halves of a xorshift32
+// output. It has a triangular distribution over -1 .. +1 LSB and is exact
+// in float. Sample i of each call uses generator i % 4.
+
+static inline uint32_t xorshift32(uint32_t x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static void s16_out_scalar_range(const Sample *samples_in,
+                                 unsigned int i, unsigned int n,
+                                 DitherState *dither, uint8_t *bytes_out)
+{
+    for (; i < n; i++) {
+        float v = max(-1.0f, min(1.0f, samples_in[i])) * 32767.0f;
+        if (dither) {
+            uint32_t& r = dither->lane[i % 4];
+            r = xorshift32(r);
+            v += float(int32_t(r >> 16) - int32_t(r & 0xffff)) * (1.0f / 65536);
+        }
+        long k = max(-32768L, min(32767L, lrintf(v)));
+        bytes_out[2*i]   = k & 0xff;
+        bytes_out[2*i+1] = (k >> 8) & 0xff;
+    }
+}
+
+static void s16_out_scalar(const Sample *samples_in, unsigned int n,
+                           DitherState *dither, uint8_t *bytes_out)
+{
+    s16_out_scalar_range(samples_in, 0, n, dither, bytes_out);
+}
+
+
+#if defined(SOFTFM_SIMD_X86)
+
+// 8 samples per iteration, one packssdw and one 16-byte store.
+// The min/max order gives +1 for NaN, as in the scalar code.
+SOFTFM_TARGET("sse2")
+static void s16_out_sse2(const Sample *samples_in, unsigned int n,
+                         DitherState *dither, uint8_t *bytes_out)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 minus_one = _mm_set1_ps(-1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    const __m128 lsb = _mm_set1_ps(1.0f / 65536);
+    const __m128i low16 = _mm_set1_epi32(0xffff);
+    __m128i r = dither ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(dither->lane))
+                       : _mm_setzero_si128();
+
+    unsigned int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i w[2];
+        for (int j = 0; j < 2; j++) {
+            __m128 x = _mm_loadu_ps(samples_in + i + 4 * j);
+            __m128 v = _mm_mul_ps(_mm_max_ps(_mm_min_ps(x, one), minus_one), scale);
+            if (dither) {
+                r = _mm_xor_si128(r, _mm_slli_epi32(r, 13));
+                r = _mm_xor_si128(r, _mm_srli_epi32(r, 17));
+                r = _mm_xor_si128(r, _mm_slli_epi32(r, 5));
+                __m128i d = _mm_sub_epi32(_mm_srli_epi32(r, 16), _mm_and_si128(r, low16));
+                v = _mm_add_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(d), lsb));
+            }
+            w[j] = _mm_cvtps_epi32(v);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes_out + 2 * i),
+                         _mm_packs_epi32(w[0], w[1]));
+    }
+
+    if (dither)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dither->lane), r);
+    s16_out_scalar_range(samples_in, i, n, dither, bytes_out);
+}
+
+#endif // SOFTFM_SIMD_X86
+
+
+// Return the audio to S16 conversion kernel for the specified level.
+// The kernel is bound by memory bandwidth, so wider vectors gain nothing.
+S16OutKernel select_s16_out_kernel(SimdLevel level)
+{
+    switch (level) {
+#if defined(SOFTFM_SIMD_X86)
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2:
+        case SimdLevel::SSE2:   return s16_out_sse2;
+#endif
+        default:                return s16_out_scalar;
+    }
+}
+
+/* end */
@@ -0,0 +1,298 @@
+#ifndef SOFTFM_SIMDKERNELS_H
+#define SOFTFM_SIMDKERNELS_H
+
+#include <cstdint>
+
+#include "SoftFM.h"
+
+/** Instruction set level used by the vectorized DSP kernels. */
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    AVX2,
+    AVX512,
+    NEON
+};
+
+/** Detect the best instruction set supported by the running CPU. */
+SimdLevel simd_detect();
+
+/** Return a printable name for an instruction set level. */
+const char * simd_level_name(SimdLevel level);
+
+
+/**
+ * FIR kernel for IQ samples with real-valued, symmetric coefficients.
+ *
+ * samples_in   :: (n + order) input samples; the first "order" samples
+ *                 are history from the previous block.
+ * coeff        :: (order + 1) symmetric filter coefficients.
+ * samples_out  :: n output samples.
+ *
+ * samples_out[i] = sum(samples_in[i+j] * coeff[j], j = 0 .. order)
+ */
+typedef void (*FirIQKernel)(const IQSample *samples_in,
+                            const Sample *coeff,
+                            unsigned int order,
+                            unsigned int n,
+                            IQSample *samples_out);
+
+/**
+ * Decimating FIR kernel for IQ samples with real-valued coefficients.
+ *
+ * samples_in   :: ((n-1) * stride + order + 1) input samples.
+ * coeff2       :: 2 * (order + 1) filter coefficients, each coefficient
+ *                 repeated twice (for the I and Q component).
+ * stride       :: Input step between successive output samples.
+ * samples_out  :: n output samples.
+ *
+ * samples_out[i] = sum(samples_in[i*stride+j] * coeff2[2*j], j = 0 .. order)
+ */
+typedef void (*FirIQDecimKernel)(const IQSample *samples_in,
+                                 const Sample *coeff2,
+                                 unsigned int order,
+                                 unsigned int n,
+                                 unsigned int stride,
+                                 IQSample *samples_out);
+
+/**
+ * Return the FIR IQ kernel for the specified instruction set level.
+ * Falls back to the nearest supported kernel if the level is not
+ * available in this build.
+ */
+FirIQKernel select_fir_iq_kernel(SimdLevel level);
+
+/** Return the decimating FIR IQ kernel for the specified level. */
+FirIQDecimKernel select_fir_iq_decim_kernel(SimdLevel level);
+
+
+/** Number of oscillator lanes used by the NCO rotation kernel. */
+static const unsigned int nco_lanes = 8;
+
+/**
+ * NCO rotation kernel.
+ *
+ * Multiply each input sample by a recursively generated oscillator.
+ * The oscillator runs as nco_lanes parallel phasors, where phasor k holds
+ * the oscillator value for sample k of the next group of nco_lanes
+ * samples. After each group, all phasors are multiplied by step.
+ *
+ * samples_in   :: n input samples, n must be a multiple of nco_lanes.
+ * phasors      :: nco_lanes phasors, updated in place.
+ * step         :: Oscillator rotation over nco_lanes samples.
+ * samples_out  :: n output samples.
+ */
+typedef void (*NcoKernel)(const IQSample *samples_in,
+                          unsigned int n,
+                          IQSample *phasors,
+                          IQSample step,
+                          IQSample *samples_out);
+
+/** Return the NCO rotation kernel for the specified level. */
+NcoKernel select_nco_kernel(SimdLevel level);
+
+
+/**
+ * Radix-4 stage of a self-sorting (Stockham) FFT, see Fft.
+ *
+ * samples_in   :: 4 * m * s samples, s interleaved transforms of 4 * m
+ *                 points (point t of transform q at q + s * t).
+ * twiddle      :: exp(-2 pi j t / (4 * m * s)) for t < 4 * m * s.
+ * inverse      :: Rotate the other way (conjugate twiddles, +j).
+ * samples_out  :: 4 * m * s samples, 4 * s interleaved transforms of m
+ *                 points.
+ *
+ * With x_l = samples_in[q + s * (p + l * m)] and W = twiddle[p * s],
+ *   samples_out[q + s * (4 * p + k)] = W^k * sum(x_l * (-j)^(k * l), l = 0 .. 3)
+ * for p < m, q < s, k < 4 (W and j conjugated for the inverse).
+ */
+typedef void (*FftRadix4Kernel)(const IQSample *samples_in,
+                                unsigned int m,
+                                unsigned int s,
+                                const IQSample *twiddle,
+                                bool inverse,
+                                IQSample *samples_out);
+
+/** Return the radix-4 FFT stage kernel for the specified level. */
+FftRadix4Kernel select_fft_radix4_kernel(SimdLevel level);
+
+/**
+ * Pilot mixer kernel for the phase-locked loop.
+ *
+ * Runs the oscillator as NcoKernel does. For phasor value (c + j s) at
+ * sample i, write the double-frequency tone
+ *   samples_out[i] = 2 * s * c
+ * and return sum(samples_in[i] * s) + j * sum(samples_in[i] * c).
+ *
+ * samples_in   :: n input samples, n must be a multiple of nco_lanes.
+ * phasors      :: nco_lanes phasors, updated in place.
+ * step         :: Oscillator rotation over nco_lanes samples.
+ * samples_out  :: n output samples.
+ */
+typedef IQSample (*PilotMixKernel)(const Sample *samples_in,
+                                   unsigned int n,
+                                   IQSample *phasors,
+                                   IQSample step,
+                                   Sample *samples_out);
+
+/** Return the pilot mixer kernel for the specified level. */
+PilotMixKernel select_pilot_mix_kernel(SimdLevel level);
+
+
+/** Accuracy tier of the polynomial atan2 used by the phase discriminator. */
+enum class Atan2Accuracy
+{
+    Fast,       // 3rd order polynomial (as fastatan2.h), max error 5e-3 rad
+    Accurate    // 9th order polynomial, max error 1.2e-5 rad
+};
+
+/**
+ * Phase discriminator kernel.
+ *
+ * Compute the phase difference between successive IQ samples,
+ *   samples_out[i] = scale * arg(conj(samples_in[i-1]) * samples_in[i])
+ * where samples_in[-1] is taken from "last".
+ */
+typedef void (*PhaseDiscKernel)(const IQSample *samples_in,
+                                unsigned int n,
+                                IQSample last,
+                                Sample scale,
+                                Sample *samples_out);
+
+/** Return the phase discriminator kernel for the specified level. */
+PhaseDiscKernel select_phase_disc_kernel(SimdLevel level,
+                                         Atan2Accuracy accuracy);
+
+
+
+/**
+ * DC offset and I/Q imbalance correction, applied while converting raw
+ * receiver samples to IQSample:
+ *   i = x_i - dc_i
+ *   q = (x_q - dc_q) * gain + i * phase
+ * where x_i, x_q are the raw samples scaled to -1 .. 1.
+ */
+struct IQCorrection
+{
+    Sample dc_i = 0;    // DC offset of I
+    Sample dc_q = 0;    // DC offset of Q
+    Sample gain = 1;    // gain of Q relative to I
+    Sample phase = 0;   // sine of the I/Q phase error
+};
+
+/**
+ * Conversion kernel for unsigned 8-bit I/Q pairs (RTL-SDR format).
+ *
+ * samples_in   :: 2 * n bytes, alternating I and Q, 128 is zero.
+ * correction   :: DC and I/Q imbalance correction.
+ * samples_out  :: n output samples.
+ *
+ * Without correction, samples_out[i] = (samples_in[2*i] - 128) / 128
+ *                                    + j * (samples_in[2*i+1] - 128) / 128
+ */
+typedef void (*U8ToIQKernel)(const std::uint8_t *samples_in,
+                             unsigned int n,
+                             const IQCorrection& correction,
+                             IQSample *samples_out);
+
+/** Return the u8 to IQ conversion kernel for the specified level. */
+U8ToIQKernel select_u8_to_iq_kernel(SimdLevel level);
+
+
+/**
+ * Fine tuner kernel for unsigned 8-bit I/Q pairs with 16-bit fixed-point
+ * output (pmaddwd on x86).
+ *
+ * samples_in   :: 2 * n bytes, alternating I and Q, 128 is zero.
+ * table_a      :: 2 * n oscillator values (cos, -sin) per sample in Q14.
+ * table_b      :: 2 * n oscillator values (sin, cos) per sample in Q14.
+ * samples_out  :: 2 * n int16 values, alternating I and Q, in Q14
+ *                 (a full scale input sample maps to 1 << 14).
+ *
+ * samples_out = round((x - 128) * (cos + j sin) / 128 * (1 << 14)), exact
+ * and identical at every level.
+ */
+typedef void (*TunerU8Kernel)(const std::uint8_t *samples_in,
+                              unsigned int n,
+                              const std::int16_t *table_a,
+                              const std::int16_t *table_b,
+                              std::int16_t *samples_out);
+
+/** Return the u8 fine tuner kernel for the specified level. */
+TunerU8Kernel select_tuner_u8_kernel(SimdLevel level);
+
+/**
+ * FIR kernel for 16-bit fixed-point IQ samples with float output.
+ *
+ * samples_in   :: 2 * (n + ntaps - 1) int16 values, alternating I and Q.
+ * coeff        :: ntaps Q14 coefficients; ntaps must be even.
+ * scale        :: Factor from the integer sum to the output value.
+ * scratch      :: Working space of 4 * (n + ntaps) int16 values.
+ * samples_out  :: n output samples.
+ *
+ * samples_out[i] = scale * sum(samples_in[i+j] * coeff[j], j = 0 .. ntaps-1)
+ * The sum is exact in 32 bits, so all levels give identical results.
+ */
+typedef void (*FirS16Kernel)(const std::int16_t *samples_in,
+                             const std::int16_t *coeff,
+                             unsigned int ntaps,
+                             unsigned int n,
+                             Sample scale,
+                             std::int16_t *scratch,
+                             IQSample *samples_out);
+
+/**
+ * Decimating FIR kernel for 16-bit fixed-point IQ samples.
+ *
+ * samples_in   :: 2 * ((n-1) * stride + ntaps) int16 values.
+ * coeff4       :: 2 * ntaps Q14 coefficients, ntaps a multiple of 8,
+ *                 arranged per group of 4 taps as
+ *                 (c0, c1, c0, c1, c2, c3, c2, c3).
+ * stride       :: Input step between successive output samples.
+ * samples_out  :: n output samples.
+ */
+typedef void (*FirS16DecimKernel)(const std::int16_t *samples_in,
+                                  const std::int16_t *coeff4,
+                                  unsigned int ntaps,
+                                  unsigned int n,
+                                  unsigned int stride,
+                                  Sample scale,
+                                  IQSample *samples_out);
+
+/** Return the 16-bit FIR kernel for the specified level. */
+FirS16Kernel select_fir_s16_kernel(SimdLevel level);
+
+/** Return the decimating 16-bit FIR kernel for the specified level. */
+FirS16DecimKernel select_fir_s16_decim_kernel(SimdLevel level);
+
+
+/**
+ * State of the TPDF dither generator: one xorshift32 generator per lane
+ * of 4 consecutive samples, so that all levels give identical results.
+ */
+struct DitherState
+{
+    std::uint32_t lane[4] = { 0x9e3779b9, 0x7f4a7c15, 0x85ebca6b, 0xc2b2ae35 };
+};
+
+/**
+ * Conversion kernel from audio samples to signed 16-bit little-endian.
+ *
+ * samples_in   :: n samples; values outside -1 .. 1 are clipped.
+ * dither       :: Dither generator state, or NULL for no dither.
+ * bytes_out    :: 2 * n bytes.
+ *
+ * Without dither, sample i is lrint(samples_in[i] * 32767). With dither,
+ * triangular noise of -1 .. +1 LSB is added before rounding and the sum
+ * saturates at the 16-bit range. Results are identical at every level.
+ */
+typedef void (*S16OutKernel)(const Sample *samples_in,
+                             unsigned int n,
+                             DitherState *dither,
+                             std::uint8_t *bytes_out);
+
+/** Return the audio to S16 conversion kernel for the specified level. */
+S16OutKernel select_s16_out_kernel(SimdLevel level);
+
+#endif
@@ -1,7 +1,9 @@
 #ifndef SOFTFM_H
 #define SOFTFM_H
 
+#include <chrono>
 #include <complex>
+#include <cstdint>
 #include <vector>
 
 //typedef double Sample;
@@ -11,6 +13,37 @@ typedef std::vector<Sample> SampleVector;
 typedef std::complex<Sample> IQSample;
 typedef std::vector<IQSample> IQSampleVector;
 
+/** Time at which samples were received, on the monotonic and the wall clock. */
+struct CaptureTime
+{
+    std::int64_t monotonic_ns = 0;  // steady clock, for latency measurements
+    std::int64_t realtime_ns = 0;   // Unix time, for aligning recordings
+
+    /** Return the current time on both clocks. */
+    static CaptureTime now()
+    {
+        using namespace std::chrono;
+        CaptureTime t;
+        t.monotonic_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        t.realtime_ns = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+        return t;
+    }
+
+    /** Return true if the time was set. */
+    bool valid() const
+    {
+        return monotonic_ns != 0;
+    }
+};
+
+/** Span of the IQ sample stream and when its last sample was received. */
+struct StreamTime
+{
+    std::uint64_t sample_index = 0; // stream index of the first IQ sample
+    std::uint64_t num_samples = 0;  // number of IQ samples
+    CaptureTime capture;
+};
+
 /** Compute mean and RMS over a sample vector. */
 inline void samples_mean_rms(const SampleVector& samples,
                              double& mean, double& rms)
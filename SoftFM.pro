@@ -3,23 +3,47 @@ CONFIG += console c++11
 CONFIG -= app_bundle
 CONFIG -= qt
 #QMAKE_CXXFLAGS += -ffast-math -O3
+# Count heap allocations in the decoder threads (shown in the status line).
+#DEFINES += SOFTFM_COUNT_ALLOCS
 
 INCLUDEPATH += ../Common/System ../Common/Multimedia
 
 SOURCES += \
+        AllocCounter.cpp \
         AudioOutput.cpp \
+        Channelizer.cpp \
+        DecoderPool.cpp \
+        FileIQSource.cpp \
+        Fft.cpp \
         Filter.cpp \
+        FilterDesign.cpp \
         FmDecode.cpp \
         RtlSdrSource.cpp \
+        SampleRing.cpp \
+        SimdKernels.cpp \
+        WakeupEvent.cpp \
         mian.cpp \
         oldmain.cpp
 
 HEADERS += \
+    AllocCounter.h \
     AudioOutput.h \
+    Channelizer.h \
+    DecoderPool.h \
+    FileIQSource.h \
+    Fft.h \
     Filter.h \
+    FilterDesign.h \
     FmDecode.h \
+    IQSampleSource.h \
     RtlSdrSource.h \
+    SampleRing.h \
+    SimdKernels.h \
     SoftFM.h \
+    SpscFifo.h \
+    SpscRing.h \
+    ThreadAffinity.h \
+    WakeupEvent.h \
     fastatan2.h
 
 win32 {
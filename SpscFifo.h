@@ -0,0 +1,86 @@
+#ifndef SOFTFM_SPSCFIFO_H
+#define SOFTFM_SPSCFIFO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ *  Lock-free FIFO of single elements for one writer and one reader.
+ *
+ *  Unlike SpscRing, which passes whole blocks, Write() and Read() copy
+ *  any number of elements, so writer and reader can work in chunks of
+ *  different sizes. The capacity is fixed; Write() stores only what
+ *  fits and Read() returns only what is there.
+ */
+template <class T>
+class SpscFifo
+{
+public:
+    /** Create a FIFO with room for "capacity" elements. */
+    explicit SpscFifo(std::size_t capacity) :
+        mItems(capacity + 1)
+    { }
+
+    /** Append up to n elements; return the number stored. */
+    std::size_t Write(const T* items, std::size_t n)
+    {
+        std::size_t head = mHead.load(std::memory_order_relaxed);
+        std::size_t tail = mTail.load(std::memory_order_acquire);
+        n = std::min(n, Free(head, tail));
+        std::size_t first = std::min(n, mItems.size() - head);
+        std::copy(items, items + first, mItems.begin() + head);
+        std::copy(items + first, items + n, mItems.begin());
+        mHead.store((head + n) % mItems.size(), std::memory_order_release);
+        return n;
+    }
+
+    /** Remove up to n elements into "items"; return the number read. */
+    std::size_t Read(T* items, std::size_t n)
+    {
+        std::size_t tail = mTail.load(std::memory_order_relaxed);
+        std::size_t head = mHead.load(std::memory_order_acquire);
+        n = std::min(n, Used(head, tail));
+        std::size_t first = std::min(n, mItems.size() - tail);
+        std::copy(mItems.begin() + tail, mItems.begin() + tail + first, items);
+        std::copy(mItems.begin(), mItems.begin() + (n - first), items + first);
+        mTail.store((tail + n) % mItems.size(), std::memory_order_release);
+        return n;
+    }
+
+    /** Return the number of stored elements (approximate while in use). */
+    std::size_t Size() const
+    {
+        return Used(mHead.load(std::memory_order_acquire),
+                    mTail.load(std::memory_order_acquire));
+    }
+
+    std::size_t Capacity() const
+    {
+        return mItems.size() - 1;
+    }
+
+private:
+    std::size_t Used(std::size_t head, std::size_t tail) const
+    {
+        return (head + mItems.size() - tail) % mItems.size();
+    }
+
+    std::size_t Free(std::size_t head, std::size_t tail) const
+    {
+        return Capacity() - Used(head, tail);
+    }
+
+    // One element stays empty to tell a full FIFO from an empty one.
+    std::vector<T> mItems;
+
+    // Writer and reader indices on separate cache lines.
+    char mPad0[64];
+    std::atomic<std::size_t> mHead { 0 };
+    char mPad1[64];
+    std::atomic<std::size_t> mTail { 0 };
+    char mPad2[64];
+};
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef SOFTFM_SPSCRING_H
+#define SOFTFM_SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ *  Lock-free ring of pre-allocated blocks for one writer and one reader.
+ *
+ *  Same usage as LF::utils::SWSRLFList: the writer fills the block
+ *  returned by GetBlockToWrite() and publishes it with UpdateWriteState();
+ *  the reader consumes the block returned by GetBlockToRead() and
+ *  releases it with UpdateReadState(). Blocks are reused, so buffers
+ *  inside them keep their capacity.
+ *
+ *  The reader claims a block in GetBlockToRead(), which lets the writer
+ *  discard the oldest published block with DropOldest() as long as the
+ *  reader has not claimed it yet.
+ */
+template <class T>
+class SpscRing
+{
+public:
+    /** Create a ring with room for "capacity" blocks. */
+    explicit SpscRing(std::size_t capacity) :
+        mBlocks(capacity + 1)
+    { }
+
+    /** Return the next free block, or nullptr if the ring is full. */
+    T* GetBlockToWrite()
+    {
+        std::size_t head = mHead.load(std::memory_order_relaxed);
+        if (Next(head) == (mTail.load(std::memory_order_acquire) >> 1))
+        {
+            return nullptr;
+        }
+        return &mBlocks[head];
+    }
+
+    /** Publish the block returned by GetBlockToWrite(). */
+    void UpdateWriteState()
+    {
+        std::size_t head = mHead.load(std::memory_order_relaxed);
+        mHead.store(Next(head), std::memory_order_release);
+    }
+
+    /**
+     * Claim and return the oldest published block, or nullptr if the ring
+     * is empty. Until UpdateReadState() the same block is returned again.
+     */
+    T* GetBlockToRead()
+    {
+        std::size_t tail = mTail.load(std::memory_order_acquire);
+        for (;;)
+        {
+            if (tail & claimed)
+            {
+                return &mBlocks[tail >> 1];
+            }
+            if ((tail >> 1) == mHead.load(std::memory_order_acquire))
+            {
+                return nullptr;
+            }
+            // Fails only if the writer dropped the block in the meantime.
+            if (mTail.compare_exchange_weak(tail, tail | claimed,
+                                            std::memory_order_acquire))
+            {
+                return &mBlocks[tail >> 1];
+            }
+        }
+    }
+
+    /** Release the block returned by GetBlockToRead(). */
+    void UpdateReadState()
+    {
+        std::size_t tail = mTail.load(std::memory_order_relaxed);
+        mTail.store(Next(tail >> 1) << 1, std::memory_order_release);
+    }
+
+    /**
+     * Writer side: discard the oldest published block to make room.
+     * Return the discarded block, which stays valid until the next
+     * GetBlockToWrite(), or nullptr if the ring is empty or the reader
+     * has already claimed the oldest block.
+     */
+    T* DropOldest()
+    {
+        std::size_t head = mHead.load(std::memory_order_relaxed);
+        std::size_t tail = mTail.load(std::memory_order_acquire);
+        if ((tail & claimed) || (tail >> 1) == head)
+        {
+            return nullptr;
+        }
+        if (!mTail.compare_exchange_strong(tail, Next(tail >> 1) << 1,
+                                           std::memory_order_acq_rel))
+        {
+            return nullptr;
+        }
+        return &mBlocks[tail >> 1];
+    }
+
+    /** Return the number of published blocks (approximate while in use). */
+    std::size_t Size() const
+    {
+        std::size_t head = mHead.load(std::memory_order_acquire);
+        std::size_t tail = mTail.load(std::memory_order_acquire) >> 1;
+        return (head + mBlocks.size() - tail) % mBlocks.size();
+    }
+
+    std::size_t Capacity() const
+    {
+        return mBlocks.size() - 1;
+    }
+
+protected:
+    /** Return the storage of all blocks, for rings that set them up. */
+    std::vector<T>& Blocks()
+    {
+        return mBlocks;
+    }
+
+private:
+    // Low bit of mTail: the reader holds the block at mTail >> 1.
+    static const std::size_t claimed = 1;
+
+    std::size_t Next(std::size_t index) const
+    {
+        return (index + 1 == mBlocks.size()) ? 0 : index + 1;
+    }
+
+    // One block stays empty to tell a full ring from an empty one.
+    std::vector<T> mBlocks;
+
+    // Writer and reader indices on separate cache lines.
+    char mPad0[64];
+    std::atomic<std::size_t> mHead { 0 };
+    char mPad1[64];
+    std::atomic<std::size_t> mTail { 0 };   // index << 1 | claimed
+    char mPad2[64];
+};
+
+#endif
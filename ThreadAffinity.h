@@ -0,0 +1,91 @@
+#ifndef SOFTFM_THREADAFFINITY_H
+#define SOFTFM_THREADAFFINITY_H
+
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Return the CPU cores decoder threads may be pinned to: the cores in the
+ * affinity mask of the process (as set with taskset or a cgroup), except
+ * core 0, which is left to the USB thread of the dongle and the OS. If
+ * core 0 is the only allowed core, it is returned. Empty if the platform
+ * does not support pinning.
+ */
+inline std::vector<unsigned int> pinnable_cpus()
+{
+    std::vector<unsigned int> cpus;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    // The mask of the main thread, which is never pinned.
+    if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) != 0)
+    {
+        return cpus;
+    }
+    for (unsigned int cpu = 1; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    if (cpus.empty() && CPU_ISSET(0, &allowed))
+    {
+        cpus.push_back(0);
+    }
+#endif
+    return cpus;
+}
+
+/**
+ * Pin a thread to one CPU core, picked as the index-th entry (modulo
+ * their number) of pinnable_cpus(). Store the core in "cpu", if given.
+ * Return false if pinning failed or is not supported on this platform.
+ */
+inline bool pin_thread_to_cpu(std::thread::native_handle_type thread,
+                              unsigned int index,
+                              unsigned int* cpu = nullptr)
+{
+#ifdef __linux__
+    static const std::vector<unsigned int> cpus = pinnable_cpus();
+    if (cpus.empty())
+    {
+        return false;
+    }
+    unsigned int core = cpus[index % cpus.size()];
+    if (cpu)
+    {
+        *cpu = core;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+    (void)thread;
+    (void)index;
+    (void)cpu;
+    return false;
+#endif
+}
+
+/** Pin the calling thread to one CPU core; see pin_thread_to_cpu(). */
+inline bool pin_current_thread_to_cpu(unsigned int index,
+                                      unsigned int* cpu = nullptr)
+{
+#ifdef __linux__
+    return pin_thread_to_cpu(pthread_self(), index, cpu);
+#else
+    (void)index;
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include "WakeupEvent.h"
+
+using namespace std;
+
+WakeupEvent::WakeupEvent()
+{
+#ifdef __linux__
+    mFd = eventfd(0, EFD_CLOEXEC);
+#endif
+}
+
+WakeupEvent::~WakeupEvent()
+{
+#ifdef __linux__
+    if (mFd >= 0)
+    {
+        close(mFd);
+    }
+#endif
+}
+
+void WakeupEvent::Signal()
+{
+#ifdef __linux__
+    if (mFd >= 0)
+    {
+        // Only fails if the counter would overflow, which still wakes the waiter.
+        uint64_t one = 1;
+        while (write(mFd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+        return;
+    }
+#endif
+    {
+        lock_guard<mutex> lock(mMutex);
+        ++mCount;
+    }
+    mCond.notify_one();
+}
+
+uint64_t WakeupEvent::Wait()
+{
+#ifdef __linux__
+    if (mFd >= 0)
+    {
+        uint64_t count = 0;
+        while (read(mFd, &count, sizeof(count)) < 0 && errno == EINTR)
+        {
+        }
+        return count;
+    }
+#endif
+    unique_lock<mutex> lock(mMutex);
+    mCond.wait(lock, [this] { return mCount != 0; });
+    uint64_t count = mCount;
+    mCount = 0;
+    return count;
+}
+
+/* end */
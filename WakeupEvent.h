@@ -0,0 +1,40 @@
+#ifndef SOFTFM_WAKEUPEVENT_H
+#define SOFTFM_WAKEUPEVENT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ *  Counting wakeup of one waiting thread.
+ *
+ *  Signal() may be called from any thread and never blocks; all signals
+ *  that arrive before the waiter runs are folded into one wakeup. On
+ *  Linux this is an eventfd, so the signalling thread does a single
+ *  write() and takes no lock. Elsewhere, or if no eventfd can be
+ *  created, a mutex and condition variable are used.
+ */
+class WakeupEvent
+{
+public:
+    WakeupEvent();
+    ~WakeupEvent();
+
+    WakeupEvent(const WakeupEvent&) = delete;
+    WakeupEvent& operator=(const WakeupEvent&) = delete;
+
+    /** Wake up the waiting thread. */
+    void Signal();
+
+    /** Wait for Signal(); return the number of signals since the last Wait(). */
+    std::uint64_t Wait();
+
+private:
+    int mFd { -1 };
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::uint64_t mCount { 0 };
+};
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * softfm_bench - throughput benchmark for the SoftFM decode chain.
+ *
+ * Generates synthetic FM multiplex IQ signals and measures the speed of
+ * each DSP stage and of the complete FmDecoder over a sweep of IF sample
+ * rates and block sizes. Results are written as JSON.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+#include "SoftFM.h"
+#include "Filter.h"
+#include "FmDecode.h"
+#include "SelfTest.h"
+#include "SimdKernels.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+/** Kind of synthetic test signal. */
+enum SignalType { SIGNAL_MONO, SIGNAL_STEREO, SIGNAL_NOISE };
+
+static const char * signal_name(SignalType type)
+{
+    switch (type)
+    {
+        case SIGNAL_MONO:   return "mono";
+        case SIGNAL_STEREO: return "stereo";
+        default:            return "noise";
+    }
+}
+
+/** Small deterministic noise source, so every run sees the same samples. */
+class NoiseSource
+{
+public:
+    explicit NoiseSource(uint32_t seed) : m_state(seed) { }
+
+    /** Return uniform noise in the range -0.5 .. 0.5. */
+    double next()
+    {
+        m_state = m_state * 1664525u + 1013904223u;
+        return (m_state >> 8) * (1.0 / 16777216.0) - 0.5;
+    }
+
+private:
+    uint32_t m_state;
+};
+
+/**
+ * Generate n IQ samples of a broadcast FM signal at tuning_offset Hz.
+ *
+ * Mono carries a 1 kHz tone. Stereo carries 1 kHz left, 3 kHz right and
+ * the 19 kHz pilot. Noise is complex white noise without a carrier.
+ */
+static IQSampleVector generate_signal(SignalType type, double sample_rate,
+                                      double tuning_offset, unsigned int n)
+{
+    IQSampleVector samples(n);
+    NoiseSource noise(12345);
+    double phase = 0;
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (type == SIGNAL_NOISE)
+        {
+            samples[i] = IQSample(noise.next(), noise.next());
+            continue;
+        }
+
+        double t = i / sample_rate;
+        double left  = 0.9 * sin(2 * M_PI * 1000 * t);
+        double right = (type == SIGNAL_STEREO) ? 0.9 * sin(2 * M_PI * 3000 * t) : left;
+        double pilot = 2 * M_PI * FmDecoder::pilot_freq * t;
+        double mpx = 0.45 * (left + right);
+        if (type == SIGNAL_STEREO)
+        {
+            mpx += 0.45 * (left - right) * cos(2 * pilot) + 0.1 * sin(pilot);
+        }
+
+        phase += 2 * M_PI * (FmDecoder::default_freq_dev * 0.9 * mpx + tuning_offset) / sample_rate;
+        phase = remainder(phase, 2 * M_PI);
+        samples[i] = IQSample(0.5 * cos(phase) + 0.01 * noise.next(),
+                              0.5 * sin(phase) + 0.01 * noise.next());
+    }
+
+    return samples;
+}
+
+/** One benchmark result. */
+struct Result
+{
+    string          stage;
+    string          signal;
+    double          if_rate;
+    unsigned int    block_size;
+    double          sample_rate;    // input sample rate of the stage
+    uint64_t        samples;        // input samples processed
+    double          seconds;
+};
+
+/**
+ * Call process(offset, n) on consecutive blocks of an input of
+ * total_samples until at least min_seconds have passed.
+ * Return the number of processed samples and the elapsed time.
+ */
+static void run_timed(const function<void(unsigned int, unsigned int)>& process,
+                      unsigned int total_samples, unsigned int block_size,
+                      double min_seconds, uint64_t& samples, double& seconds)
+{
+    block_size = min(block_size, total_samples);
+    unsigned int num_blocks = total_samples / block_size;
+
+    // Warm up caches and let the filters size their buffers.
+    process(0, block_size);
+
+    samples = 0;
+    Clock::time_point start = Clock::now();
+    unsigned int b = 0;
+    do
+    {
+        process((b % num_blocks) * block_size, block_size);
+        samples += block_size;
+        b++;
+        seconds = chrono::duration<double>(Clock::now() - start).count();
+    } while (seconds < min_seconds);
+}
+
+static void print_result(FILE *f, const Result& r, bool last)
+{
+    double msps = r.samples / r.seconds * 1.0e-6;
+    fprintf(f, "    { \"stage\": \"%s\", \"signal\": \"%s\", \"if_rate\": %.0f, "
+               "\"block_size\": %u, \"sample_rate\": %.1f, \"samples\": %llu, "
+               "\"seconds\": %.6f, \"msps\": %.3f, \"ns_per_sample\": %.3f, "
+               "\"realtime_factor\": %.2f }%s\n",
+            r.stage.c_str(), r.signal.c_str(), r.if_rate,
+            r.block_size, r.sample_rate, (unsigned long long)r.samples,
+            r.seconds, msps, r.seconds / r.samples * 1.0e9,
+            r.samples / r.sample_rate / r.seconds,
+            last ? "" : ",");
+}
+
+/** Benchmark every decoder stage on the stereo signal at one IF rate and block size. */
+static void bench_stages(double if_rate, unsigned int block_size,
+                         const IQSampleVector& iq, double min_seconds,
+                         vector<Result>& results)
+{
+    // Same configuration as softfm: tuner 1/4 IF rate above the station.
+    const double tuning_offset = -0.25 * if_rate;
+    const unsigned int downsample = max(1, int(if_rate / 215.0e3));
+    const double baseband_rate = if_rate / downsample;
+    const double pcm_rate = 48000;
+    const unsigned int n = iq.size();
+
+    // Intermediate signals of the chain, so every stage gets realistic input.
+    IQSampleVector tuned(n), filtered(n + 1);
+    SampleVector demod(n), baseband, pilot, audio;
+    {
+        NcoTuner tuner(tuning_offset / if_rate);
+        LowPassFilterFirIQ iffilter(10, FmDecoder::default_bandwidth_if / if_rate);
+        PhaseDiscriminator phasedisc(FmDecoder::default_freq_dev / if_rate);
+        DownsampleFilter resample(8 * downsample, 0.4 / downsample, downsample, true);
+        tuner.process(iq.data(), n, tuned.data());
+        iffilter.process(tuned.data(), n, filtered.data());
+        phasedisc.process(filtered.data(), n, demod.data());
+        resample.process(demod, baseband);
+    }
+    const unsigned int nb = baseband.size();
+    const unsigned int block_baseband = max(1u, block_size / downsample);
+
+    auto add = [&](const char *stage, double rate, unsigned int bs, uint64_t samples, double seconds)
+    {
+        results.push_back(Result { stage, "stereo", if_rate, bs, rate, samples, seconds });
+        fprintf(stderr, "%-20s if_rate=%8.0f block=%7u  %8.2f MS/s\n",
+                stage, if_rate, bs, samples / seconds * 1.0e-6);
+    };
+
+    uint64_t samples;
+    double seconds;
+    IQSampleVector iq_out(block_size + 1);
+    SampleVector real_out(block_size + 1);
+
+    // Raw RTL-SDR bytes of the same signal.
+    vector<uint8_t> raw(2 * n);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        raw[2*i]   = max(0L, min(255L, lrint(iq[i].real() * 128 + 128)));
+        raw[2*i+1] = max(0L, min(255L, lrint(iq[i].imag() * 128 + 128)));
+    }
+
+    {
+        U8ToIQKernel convert = select_u8_to_iq_kernel(simd_detect());
+        IQCorrection correction;
+        run_timed([&](unsigned int off, unsigned int k) {
+                      convert(raw.data() + 2 * off, k, correction, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("U8ToIQ", if_rate, block_size, samples, seconds);
+    }
+    {
+        int table_size = 64;
+        FineTuner tuner(table_size, -lrint(tuning_offset / if_rate * table_size));
+        run_timed([&](unsigned int off, unsigned int k) {
+                      tuner.process(iq.data() + off, k, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("FineTuner", if_rate, block_size, samples, seconds);
+    }
+    {
+        NcoTuner tuner(tuning_offset / if_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      tuner.process(iq.data() + off, k, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("NcoTuner", if_rate, block_size, samples, seconds);
+    }
+    {
+        LowPassFilterFirIQ filter(10, FmDecoder::default_bandwidth_if / if_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      filter.process(tuned.data() + off, k, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("LowPassFilterFirIQ", if_rate, block_size, samples, seconds);
+    }
+    {
+        // Long IF filter in overlap-save form, to recheck fft_filter_crossover().
+        FftFilterIQ filter(254, FmDecoder::default_bandwidth_if / if_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      filter.process(tuned.data() + off, k, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("FftFilterIQ", if_rate, block_size, samples, seconds);
+    }
+    {
+        int table_size = 1024;
+        FineTunerU8 tuner(table_size, -lrint(tuning_offset / if_rate * table_size));
+        vector<int16_t> out(2 * block_size);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      tuner.process(raw.data() + 2 * off, k, out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("FineTunerU8", if_rate, block_size, samples, seconds);
+    }
+    {
+        // Q14 samples of the tuned signal.
+        vector<int16_t> tuned16(2 * n);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            tuned16[2*i]   = lrint(tuned[i].real() * (1 << 14));
+            tuned16[2*i+1] = lrint(tuned[i].imag() * (1 << 14));
+        }
+        LowPassFilterFirS16 filter(10, FmDecoder::default_bandwidth_if / if_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      filter.process(tuned16.data() + 2 * off, k, iq_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("LowPassFilterFirS16", if_rate, block_size, samples, seconds);
+    }
+    {
+        PhaseDiscriminator phasedisc(FmDecoder::default_freq_dev / if_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      phasedisc.process(filtered.data() + off, k, real_out.data());
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("PhaseDiscriminator", if_rate, block_size, samples, seconds);
+    }
+    {
+        DownsampleFilter resample(8 * downsample, 0.4 / downsample, downsample, true);
+        SampleVector in, out;
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(demod.begin() + off, demod.begin() + off + k);
+                      resample.process(in, out);
+                  }, n, block_size, min_seconds, samples, seconds);
+        add("DownsampleFilter", if_rate, block_size, samples, seconds);
+    }
+
+    // Back end stages run at the baseband rate.
+    SampleVector in, out;
+    {
+        PilotPhaseLock pll(FmDecoder::pilot_freq / baseband_rate, 50 / baseband_rate, 0.01);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(baseband.begin() + off, baseband.begin() + off + k);
+                      pll.process(in, out);
+                  }, nb, block_baseband, min_seconds, samples, seconds);
+        add("PilotPhaseLock", baseband_rate, block_baseband, samples, seconds);
+    }
+    {
+        PilotPhaseLock pll(FmDecoder::pilot_freq / baseband_rate, 50 / baseband_rate, 0.01,
+                           FmDecoderOptions().pilot_subblock);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(baseband.begin() + off, baseband.begin() + off + k);
+                      pll.process(in, out);
+                  }, nb, block_baseband, min_seconds, samples, seconds);
+        add("PilotPhaseLockSub", baseband_rate, block_baseband, samples, seconds);
+    }
+    {
+        DownsampleFilter resample(int(baseband_rate / 1000.0),
+                                  FmDecoder::default_bandwidth_pcm / baseband_rate,
+                                  baseband_rate / pcm_rate, false);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(baseband.begin() + off, baseband.begin() + off + k);
+                      resample.process(in, out);
+                  }, nb, block_baseband, min_seconds, samples, seconds);
+        add("DownsampleFilterPcm", baseband_rate, block_baseband, samples, seconds);
+    }
+    {
+        // Mono and stereo audio through one two-channel resampler, with
+        // the 4 kHz transition band FmDecoder gives it.
+        MultistageDownsampleFilter resample(int(baseband_rate / 1000.0),
+                                            FmDecoder::default_bandwidth_pcm / baseband_rate,
+                                            baseband_rate / pcm_rate, 256, 8, 2,
+                                            FirDesign(FirDesignMethod::Lanczos,
+                                                      4000 / baseband_rate));
+        SampleVector out1;
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(baseband.begin() + off, baseband.begin() + off + k);
+                      resample.process(in, in, out, out1);
+                  }, nb, block_baseband, min_seconds, samples, seconds);
+        add("MultistageDownsampleFilterPcm2", baseband_rate, block_baseband, samples, seconds);
+    }
+
+    // Audio stages run at the PCM rate on the mono signal.
+    audio.resize(max(1u, unsigned(nb * pcm_rate / baseband_rate)));
+    for (unsigned int i = 0; i < audio.size(); i++)
+        audio[i] = baseband[min(nb - 1, unsigned(i * baseband_rate / pcm_rate))];
+    const unsigned int na = audio.size();
+    const unsigned int block_pcm = max(1u, unsigned(block_baseband * pcm_rate / baseband_rate));
+    {
+        HighPassFilterIir dcblock(30.0 / pcm_rate);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(audio.begin() + off, audio.begin() + off + k);
+                      dcblock.process_inplace(in);
+                  }, na, block_pcm, min_seconds, samples, seconds);
+        add("HighPassFilterIir", pcm_rate, block_pcm, samples, seconds);
+    }
+    {
+        LowPassFilterRC deemph(FmDecoder::default_deemphasis * pcm_rate * 1.0e-6);
+        run_timed([&](unsigned int off, unsigned int k) {
+                      in.assign(audio.begin() + off, audio.begin() + off + k);
+                      deemph.process_inplace(in);
+                  }, na, block_pcm, min_seconds, samples, seconds);
+        add("LowPassFilterRC", pcm_rate, block_pcm, samples, seconds);
+    }
+}
+
+/** Benchmark the complete decoder on one signal at one IF rate and block size. */
+static void bench_decoder(double if_rate, unsigned int block_size,
+                          SignalType type, const IQSampleVector& iq,
+                          const FmDecoderOptions& options, const char *stage,
+                          double min_seconds, vector<Result>& results)
+{
+    const unsigned int downsample = max(1, int(if_rate / 215.0e3));
+    FmDecoder decoder(if_rate,                          // sample_rate_if
+                      -0.25 * if_rate,                  // tuning_offset
+                      48000,                            // sample_rate_pcm
+                      type != SIGNAL_MONO,              // stereo
+                      FmDecoder::default_deemphasis,    // deemphasis
+                      FmDecoder::default_bandwidth_if,  // bandwidth_if
+                      FmDecoder::default_freq_dev,      // freq_dev
+                      FmDecoder::default_bandwidth_pcm, // bandwidth_pcm
+                      downsample,                       // downsample
+                      options);                         // options
+
+    // Same as FmDecoder::process(), without copying the input block.
+    SampleVector baseband, audio;
+    uint64_t samples;
+    double seconds;
+    run_timed([&](unsigned int off, unsigned int k) {
+                  decoder.process_frontend(iq.data() + off, k, baseband);
+                  decoder.process_backend(baseband, audio);
+              }, iq.size(), block_size, min_seconds, samples, seconds);
+
+    results.push_back(Result { stage, signal_name(type), if_rate, block_size,
+                               if_rate, samples, seconds });
+    fprintf(stderr, "%-20s if_rate=%8.0f block=%7u  %-6s %8.2f MS/s\n",
+            stage, if_rate, block_size, signal_name(type), samples / seconds * 1.0e-6);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+    "Usage: softfm_bench [options]\n"
+            "  -s rates      Comma separated IF sample rates in Hz\n"
+            "                (default 240000,960000,1200000,2400000,3200000)\n"
+            "  -n sizes      Comma separated block sizes in IQ samples\n"
+            "                (default 16384,65536,262144)\n"
+            "  -t seconds    Minimum measurement time per case (default 0.5)\n"
+            "  -o filename   Write JSON results to file (default stdout)\n"
+            "  -S            Only benchmark the individual stages\n"
+            "  -F            Only benchmark the complete decoder\n"
+            "  -T            Run the self tests and exit\n"
+            "\n");
+}
+
+/** Run all self tests; return true if they pass. */
+static bool run_selftests()
+{
+    bool ok = true;
+    ok &= selftest_filter_design();
+    ok &= selftest_audio_resampler();
+    ok &= selftest_fir_iq_kernels();
+    ok &= selftest_phase_disc_kernels();
+    fprintf(stderr, "%s\n", ok ? "All self tests passed." : "Self tests FAILED.");
+    return ok;
+}
+
+static bool parse_list(const char *s, vector<double>& values)
+{
+    values.clear();
+    while (*s)
+    {
+        char *end;
+        double v = strtod(s, &end);
+        if (end == s || v <= 0)
+            return false;
+        values.push_back(v);
+        s = end;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return false;
+    }
+    return !values.empty();
+}
+
+int main(int argc, char **argv)
+{
+    vector<double> if_rates { 240000, 960000, 1200000, 2400000, 3200000 };
+    vector<double> block_sizes { 16384, 65536, 262144 };
+    double min_seconds = 0.5;
+    string filename;
+    bool run_stages = true;
+    bool run_decoder = true;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:n:t:o:SFT")) >= 0)
+    {
+        switch (c)
+        {
+            case 's':
+                if (!parse_list(optarg, if_rates))
+                {
+                    fprintf(stderr, "ERROR: Invalid argument for -s\n");
+                    exit(1);
+                }
+                break;
+            case 'n':
+                if (!parse_list(optarg, block_sizes))
+                {
+                    fprintf(stderr, "ERROR: Invalid argument for -n\n");
+                    exit(1);
+                }
+                break;
+            case 't':
+                min_seconds = atof(optarg);
+                break;
+            case 'o':
+                filename = optarg;
+                break;
+            case 'S':
+                run_decoder = false;
+                break;
+            case 'F':
+                run_stages = false;
+                break;
+            case 'T':
+                exit(run_selftests() ? 0 : 1);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+
+    FILE *out = stdout;
+    if (!filename.empty())
+    {
+        out = fopen(filename.c_str(), "w");
+        if (out == nullptr)
+        {
+            fprintf(stderr, "ERROR: can not open '%s' (%s)\n", filename.c_str(), strerror(errno));
+            exit(1);
+        }
+    }
+
+    const SimdLevel simd = simd_detect();
+    fprintf(stderr, "SIMD level: %s\n", simd_level_name(simd));
+
+    vector<Result> results;
+    const SignalType signals[] = { SIGNAL_MONO, SIGNAL_STEREO, SIGNAL_NOISE };
+
+    for (double if_rate : if_rates)
+    {
+        // Half a second of signal, at least one block of the largest size.
+        unsigned int max_block = unsigned(*max_element(block_sizes.begin(), block_sizes.end()));
+        unsigned int n = max(max_block, unsigned(0.5 * if_rate));
+
+        for (SignalType type : signals)
+        {
+            IQSampleVector iq = generate_signal(type, if_rate, -0.25 * if_rate, n);
+            for (double bs : block_sizes)
+            {
+                if (run_stages && type == SIGNAL_STEREO)
+                {
+                    bench_stages(if_rate, bs, iq, min_seconds, results);
+                }
+                if (run_decoder)
+                {
+                    FmDecoderOptions options;
+                    bench_decoder(if_rate, bs, type, iq, options,
+                                  "FmDecoder", min_seconds, results);
+                    options.if_decimation = true;
+                    bench_decoder(if_rate, bs, type, iq, options,
+                                  "FmDecoderIfDecim", min_seconds, results);
+                    options = FmDecoderOptions();
+                    options.filter.method = FirDesignMethod::Kaiser;
+                    bench_decoder(if_rate, bs, type, iq, options,
+                                  "FmDecoderKaiser", min_seconds, results);
+                    options.filter.method = FirDesignMethod::Equiripple;
+                    bench_decoder(if_rate, bs, type, iq, options,
+                                  "FmDecoderEquiripple", min_seconds, results);
+                }
+            }
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"simd\": \"%s\",\n", simd_level_name(simd));
+    fprintf(out, "  \"min_seconds\": %.3f,\n", min_seconds);
+    fprintf(out, "  \"results\": [\n");
+    for (unsigned int i = 0; i < results.size(); i++)
+    {
+        print_result(out, results[i], i + 1 == results.size());
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
+
+/* end */
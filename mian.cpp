@@ -5,10 +5,13 @@
 #include <cmath>
 #include <vector>
 #include <algorithm>
+#include <thread>
 
 #include "AudioOutput.h"
 #include "RtlSdrSource.h"
+#include "FileIQSource.h"
 #include "FmDecode.h"
+#include "Channelizer.h"
 
 #include "threads/threadutils.h"
 #include "utils/profiler.h"
@@ -28,25 +31,110 @@ extern void badarg(const char *label);
 extern bool parse_int(const char *s, int& v, bool allow_unit=false);
 extern bool parse_dbl(const char *s, double& v);
 
+// Choose the tuner frequency for multi-station mode: all stations must
+// lie inside the IF band, and DC should be as far as possible from any
+// station. Return -1 if the stations do not fit.
+static double center_frequency(const std::vector<double>& freqs, double ifrate)
+{
+    double fmin = *std::min_element(freqs.begin(), freqs.end());
+    double fmax = *std::max_element(freqs.begin(), freqs.end());
+    double mid = 0.5 * (fmin + fmax);
+    double margin = 0.5 * ifrate - FmDecoder::default_bandwidth_if - 0.5 * (fmax - fmin);
+    if (margin < 0)
+    {
+        return -1;
+    }
+
+    double best = mid;
+    double best_dist = -1;
+    for (double f = mid - margin; f <= mid + margin; f += 10.0e3)
+    {
+        double dist = HUGE_VAL;
+        for (double station: freqs)
+        {
+            dist = std::min(dist, fabs(station - f));
+        }
+        if (dist > best_dist)
+        {
+            best = f;
+            best_dist = dist;
+        }
+    }
+    return best;
+}
+
+// Insert the station frequency before the file name extension,
+// e.g. "out.wav" -> "out-96.300.wav".
+static std::string station_filename(const std::string& filename, double freq)
+{
+    char tag[32];
+    snprintf(tag, sizeof(tag), "-%.3f", freq * 1.0e-6);
+    size_t slash = filename.find_last_of('/');
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return filename + tag;
+    }
+    return filename.substr(0, dot) + tag + filename.substr(dot);
+}
+
 static void usage()
 {
     fprintf(stderr,
     "Usage: softfm -f freq [options]\n"
             "  -f freq       Frequency of radio station in Hz\n"
+            "                repeat to decode several stations at once (needs -R or -W,\n"
+            "                the station frequency is appended to each file name)\n"
             "  -d devidx     RTL-SDR device index, 'list' to show device list (default 0)\n"
+            "  -F filename   Read IQ samples from a recording instead of RTL-SDR\n"
+            "                (-s gives its sample rate)\n"
+            "  -i format     Recording format: u8, cs16, cf32\n"
+            "                (default from the extension, otherwise u8 as written by rtl_sdr)\n"
+            "  -c freq       Center frequency of the recording in Hz\n"
+            "                (default: the station frequency, or the middle of all stations)\n"
+            "  -t            Replay the recording in real time (default when playing\n"
+            "                audio, otherwise as fast as possible)\n"
             "  -g gain       Set LNA gain in dB, or 'auto' (default auto)\n"
             "  -a            Enable RTL AGC mode (default disabled)\n"
+            "  -C dci,dcq,gain,phase\n"
+            "                Correct DC offset of I and Q (full scale 1.0), gain of Q\n"
+            "                relative to I and I/Q phase error in degrees\n"
+            "  -L samples    IQ samples per block (RTL-SDR default 65536,\n"
+            "                recording default 16384); small blocks lower the latency\n"
+            "  -N blocks     Number of blocks in the sample ring (default 16)\n"
+            "  -U buffers    Number of RTL-SDR USB transfer buffers (default librtlsdr)\n"
+            "  -H            Do not use huge pages for the sample ring\n"
+            "  -O policy     What to do when the sample ring is full:\n"
+            "                drop-newest (default), drop-oldest or block\n"
+            "  -8            Keep raw 8-bit samples and run fine tuner and IF filter\n"
+            "                in 16-bit fixed point (single station, u8 input, no -C)\n"
             "  -s ifrate     IF sample rate in Hz (default 1200000)\n"
             "                (valid ranges: [225001, 300000], [900001, 3200000]))\n"
             "  -r pcmrate    Audio sample rate in Hz (default 48000 Hz)\n"
             "  -M            Disable stereo decoding\n"
+            "  -X            Add TPDF dither when converting audio to 16 bits\n"
+            "  -D            Decimate in the IF filter (less CPU at high IF rates)\n"
+            "  -Q design[,atten[,ripple]]\n"
+            "                Filter design: lanczos (default, fixed orders), kaiser or\n"
+            "                equiripple, sized for the stopband attenuation in dB\n"
+            "                (default 60) and passband ripple in dB (default 0.1)\n"
+            "  -p            Pipelined decoder: run IF/demodulator and audio stages\n"
+            "                on two separate cores\n"
+            "  -E [samples]  Decode all waiting blocks per wakeup of the decoder thread,\n"
+            "                feeding up to this many IQ samples to the audio stages at\n"
+            "                once (default 65536)\n"
             "  -R filename   Write audio data as raw S16_LE samples\n"
             "                use filename '-' to write to stdout\n"
             "  -W filename   Write audio data to .WAV file\n"
             "  -P [device]   Play audio via RTAudio device (default 'default')\n"
             "  -T filename   Write pulse-per-second timestamps\n"
             "                use filename '-' to write to stdout\n"
-            "  -b seconds    Set audio buffer size in seconds\n"
+            "  -b seconds    Play through a bounded low-latency buffer of this size\n"
+            "                (e.g. 0.04; use small blocks with -L for low latency)\n"
+            "  -A            With -b, resample by up to 0.1 %% to follow the sound card\n"
+            "                clock and keep the buffer half full\n"
+            "  -j workers    Decode stations on a pool of worker threads pinned to\n"
+            "                CPU cores (multi-station mode, 0 = one per core)\n"
             "\n");
 }
 
@@ -57,54 +145,109 @@ int main(int argc, char **argv)
 #else
     LF::utils::Profiler::SetEnabled(false);
 
-    double  freq    = -1;
+    std::vector<double> freqs;
     int     devidx  = 0;
     int     lnagain = INT_MIN;
     bool    agcmode = false;
     double  ifrate  = 1.2e6;
     int     pcmrate = 48000;
     bool    stereo  = true;
+    bool    dither  = false;
     enum OutputMode { MODE_RAW, MODE_WAV, MODE_RTAUDIO };
     OutputMode outmode = MODE_RTAUDIO;
     std::string  filename;
     std::string  ppsfilename;
     FILE*  ppsfile = nullptr;
     double  bufsecs = -1;
+    bool    adaptive = false;
+    int     workers = -1;
+    FmDecoderOptions decoder_options;
+    bool    pipelined = false;
+    bool    drain = false;
+    int     batch_samples = 65536;
+    std::string  iqfilename;
+    FileIQSource::Format iqformat = FileIQSource::FORMAT_AUTO;
+    double  iqcenter = -1;
+    bool    realtime = false;
+    IQCorrection iqcorrection;
+    bool    rawiq = false;
+    SampleRingConfig ring;
+    int     usbbufs = 0;
 
     SDEB("SoftFM - Software decoder for FM broadcast radio with RTL-SDR");
 
     const struct option longopts[] = {
         { "freq",       1, nullptr, 'f' },
         { "dev",        1, nullptr, 'd' },
+        { "file",       1, nullptr, 'F' },
+        { "format",     1, nullptr, 'i' },
+        { "center",     1, nullptr, 'c' },
+        { "realtime",   0, nullptr, 't' },
         { "gain",       1, nullptr, 'g' },
         { "ifrate",     1, nullptr, 's' },
         { "pcmrate",    1, nullptr, 'r' },
         { "agc",        0, nullptr, 'a' },
+        { "iqcorr",     1, nullptr, 'C' },
+        { "int16",      0, nullptr, '8' },
+        { "blocklen",   1, nullptr, 'L' },
+        { "ringblocks", 1, nullptr, 'N' },
+        { "usbbufs",    1, nullptr, 'U' },
+        { "nohugepages", 0, nullptr, 'H' },
+        { "overrun",    1, nullptr, 'O' },
         { "mono",       0, nullptr, 'M' },
+        { "dither",     0, nullptr, 'X' },
+        { "ifdecim",    0, nullptr, 'D' },
+        { "filter",     1, nullptr, 'Q' },
+        { "pipeline",   0, nullptr, 'p' },
+        { "drain",      2, nullptr, 'E' },
         { "raw",        1, nullptr, 'R' },
         { "wav",        1, nullptr, 'W' },
         { "play",       2, nullptr, 'P' },
         { "pps",        1, nullptr, 'T' },
         { "buffer",     1, nullptr, 'b' },
+        { "adaptive",   0, nullptr, 'A' },
+        { "workers",    1, nullptr, 'j' },
         { nullptr,      0, nullptr, 0 } };
 
     int c, longindex;
-    while ((c = getopt_long(argc, argv, "f:d:g:s:r:MR:W:P::T:b:a", longopts, &longindex)) >= 0)
+    while ((c = getopt_long(argc, argv, "f:d:F:i:c:tg:s:r:MXDQ:pE::R:W:P::T:b:Aj:aC:8L:N:U:HO:", longopts, &longindex)) >= 0)
     {
         switch (c)
         {
             case 'f':
+            {
+                double freq;
                 if (!parse_dbl(optarg, freq) || freq <= 0)
                 {
                     badarg("-f");
                 }
+                freqs.push_back(freq);
                 break;
+            }
             case 'd':
                 if (!parse_int(optarg, devidx))
                 {
                     devidx = -1;
                 }
                 break;
+            case 'F':
+                iqfilename = optarg;
+                break;
+            case 'i':
+                if (!FileIQSource::parse_format(optarg, iqformat))
+                {
+                    badarg("-i");
+                }
+                break;
+            case 'c':
+                if (!parse_dbl(optarg, iqcenter) || iqcenter <= 0)
+                {
+                    badarg("-c");
+                }
+                break;
+            case 't':
+                realtime = true;
+                break;
             case 'g':
                 if (strcasecmp(optarg, "auto") == 0)
                 {
@@ -132,11 +275,7 @@ int main(int argc, char **argv)
             case 's':
                 // NOTE: RTL does not support some sample rates below 900 kS/s
                 // Also, max sampling rate is 3.2 MS/s
-                if (!parse_dbl(optarg, ifrate))
-                {
-                    badarg("-s");
-                }
-                if ((ifrate < 225001) || (ifrate > 3200000) || ((ifrate > 300000) && (ifrate < 900001)))
+                if (!parse_dbl(optarg, ifrate) || ifrate <= 0)
                 {
                     badarg("-s");
                 }
@@ -150,6 +289,37 @@ int main(int argc, char **argv)
             case 'M':
                 stereo = false;
                 break;
+            case 'X':
+                dither = true;
+                break;
+            case 'D':
+                decoder_options.if_decimation = true;
+                break;
+            case 'Q':
+            {
+                char name[16];
+                double atten = decoder_options.filter.atten;
+                double ripple = decoder_options.filter.ripple;
+                if (sscanf(optarg, "%15[^,],%lf,%lf", name, &atten, &ripple) < 1 ||
+                    !parse_fir_design(name, decoder_options.filter.method) ||
+                    atten <= 0 || ripple <= 0)
+                {
+                    badarg("-Q");
+                }
+                decoder_options.filter.atten = atten;
+                decoder_options.filter.ripple = ripple;
+                break;
+            }
+            case 'p':
+                pipelined = true;
+                break;
+            case 'E':
+                drain = true;
+                if (optarg != nullptr && (!parse_int(optarg, batch_samples) || batch_samples < 0))
+                {
+                    badarg("-E");
+                }
+                break;
             case 'R':
                 outmode = MODE_RAW;
                 filename = optarg;
@@ -172,9 +342,81 @@ int main(int argc, char **argv)
                     badarg("-b");
                 }
                 break;
+            case 'A':
+                adaptive = true;
+                break;
+            case 'j':
+                if (!parse_int(optarg, workers) || workers < 0)
+                {
+                    badarg("-j");
+                }
+                break;
             case 'a':
                 agcmode = true;
                 break;
+            case 'C':
+            {
+                double dci, dcq, gain, phase;
+                if (sscanf(optarg, "%lf,%lf,%lf,%lf", &dci, &dcq, &gain, &phase) != 4 || gain <= 0)
+                {
+                    badarg("-C");
+                }
+                iqcorrection.dc_i = dci;
+                iqcorrection.dc_q = dcq;
+                iqcorrection.gain = gain;
+                iqcorrection.phase = sin(phase * M_PI / 180);
+                break;
+            }
+            case '8':
+                rawiq = true;
+                break;
+            case 'L':
+            {
+                int len;
+                if (!parse_int(optarg, len) || len < 256)
+                {
+                    badarg("-L");
+                }
+                ring.block_length = len;
+                break;
+            }
+            case 'N':
+            {
+                int num;
+                if (!parse_int(optarg, num) || num < 2)
+                {
+                    badarg("-N");
+                }
+                ring.num_blocks = num;
+                break;
+            }
+            case 'U':
+                if (!parse_int(optarg, usbbufs) || usbbufs < 0)
+                {
+                    badarg("-U");
+                }
+                break;
+            case 'H':
+                ring.hugepages = false;
+                break;
+            case 'O':
+                if (strcasecmp(optarg, "drop-newest") == 0)
+                {
+                    ring.policy = OverrunPolicy::DropNewest;
+                }
+                else if (strcasecmp(optarg, "drop-oldest") == 0)
+                {
+                    ring.policy = OverrunPolicy::DropOldest;
+                }
+                else if (strcasecmp(optarg, "block") == 0)
+                {
+                    ring.policy = OverrunPolicy::Block;
+                }
+                else
+                {
+                    badarg("-O");
+                }
+                break;
             default:
                 usage();
                 SERR("Invalid command line options");
@@ -189,89 +431,202 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    std::vector<std::string> devnames = RtlSdrSource::get_device_names();
-    if (devidx < 0 || (unsigned int)devidx >= devnames.size())
+    if (freqs.empty())
     {
-        if (devidx != -1)
-        {
-            SERR("invalid device index %d", devidx);
-        }
-        SDEB("Found %u devices: ", (unsigned int)devnames.size());
-        for (unsigned int i = 0; i < devnames.size(); i++)
-        {
-            SDEB("%2u: %s", i, devnames[i].c_str());
-        }
+        usage();
+        SERR("ERROR: Specify a tuning frequency");
         exit(1);
     }
-    SDEB("using device %d: %s", devidx, devnames[devidx].c_str());
 
-    if (freq <= 0)
+    const double freq = freqs.front();
+    const bool multi_station = (freqs.size() > 1);
+    if (multi_station && (outmode == MODE_RTAUDIO || filename == "-"))
     {
-        usage();
-        SERR("ERROR: Specify a tuning frequency");
+        SERR("ERROR: Multiple stations need file output (-R or -W)");
         exit(1);
     }
-
-    // Intentionally tune at a higher frequency to avoid DC offset.
-    double tuner_freq = freq + 0.25 * ifrate;
-
-    // Open RTL-SDR device.
-    RtlSdrSource rtlsdr(devidx, true);
-    if (!rtlsdr)
+    if (multi_station && rawiq)
     {
-        SERR("RtlSdr: %s", rtlsdr.error().c_str());
+        SERR("ERROR: 16-bit front end (-8) supports a single station only");
         exit(1);
     }
+    if (outmode != MODE_RTAUDIO && (bufsecs >= 0 || adaptive))
+    {
+        SWAR("-b and -A only apply to audio playback (-P)");
+    }
+    else if (adaptive && bufsecs <= 0)
+    {
+        SWAR("-A needs a low-latency buffer (-b)");
+    }
+    if (multi_station && !ppsfilename.empty())
+    {
+        SWAR("PPS markers (-T) are only written for a single station");
+        ppsfilename.clear();
+    }
 
-    // Check LNA gain.
-    if (lnagain != INT_MIN)
+    std::unique_ptr<IQSampleSource> source;
+    FileIQSource* iqfile = nullptr;
+    double tuner_freq;
+
+    if (!iqfilename.empty())
     {
-        std::vector<int> gains = rtlsdr.get_tuner_gains();
-        if (std::find(gains.begin(), gains.end(), lnagain) == gains.end())
+        // The recording was made at a fixed center frequency.
+        tuner_freq = iqcenter;
+        if (tuner_freq < 0)
+        {
+            tuner_freq = 0.5 * (*std::min_element(freqs.begin(), freqs.end()) +
+                                *std::max_element(freqs.begin(), freqs.end()));
+        }
+
+        // Audio devices play at the sample rate; do not flood them.
+        if (outmode == MODE_RTAUDIO)
+        {
+            realtime = true;
+        }
+
+        iqfile = new FileIQSource(iqfilename, iqformat, lrint(ifrate), lrint(tuner_freq), realtime, rawiq);
+        source.reset(iqfile);
+        if (!(*iqfile))
         {
-            if (lnagain != INT_MIN + 1)
+            SERR("FileIQSource: %s", iqfile->error().c_str());
+            exit(1);
+        }
+        SDEB("reading %llu IQ samples from '%s'%s",
+             (unsigned long long)iqfile->get_num_samples(), iqfilename.c_str(),
+             realtime ? " in real time" : "");
+        SDEB("recording center frequency: %.6f MHz", tuner_freq * 1.0e-6);
+        SDEB("IF sample rate: %.0f Hz", ifrate);
+    }
+    else
+    {
+        // NOTE: RTL does not support some sample rates below 900 kS/s
+        // Also, max sampling rate is 3.2 MS/s
+        if ((ifrate < 225001) || (ifrate > 3200000) || ((ifrate > 300000) && (ifrate < 900001)))
+        {
+            badarg("-s");
+        }
+
+        std::vector<std::string> devnames = RtlSdrSource::get_device_names();
+        if (devidx < 0 || (unsigned int)devidx >= devnames.size())
+        {
+            if (devidx != -1)
             {
-                SERR("LNA gain %.1f dB not supported by tuner", lnagain * 0.1);
+                SERR("invalid device index %d", devidx);
             }
-            SDEB("Supported LNA gains: ");
-            for (int g: gains)
+            SDEB("Found %u devices: ", (unsigned int)devnames.size());
+            for (unsigned int i = 0; i < devnames.size(); i++)
             {
-                SDEB("\t%.1f dB ", 0.1 * g);
+                SDEB("%2u: %s", i, devnames[i].c_str());
             }
             exit(1);
         }
-    }
+        SDEB("using device %d: %s", devidx, devnames[devidx].c_str());
 
-    // Configure RTL-SDR device and start streaming.
-    rtlsdr.configure(ifrate, tuner_freq, lnagain, RtlSdrSource::default_block_length, agcmode);
-    if (!rtlsdr)
-    {
-        SERR("RtlSdr: %s", rtlsdr.error().c_str());
-        exit(1);
+        // Intentionally tune at a higher frequency to avoid DC offset.
+        tuner_freq = freq + 0.25 * ifrate;
+        if (multi_station)
+        {
+            tuner_freq = center_frequency(freqs, ifrate);
+            if (tuner_freq < 0)
+            {
+                SERR("ERROR: Stations do not fit in IF sample rate %.0f Hz", ifrate);
+                exit(1);
+            }
+        }
+
+        // Open RTL-SDR device.
+        RtlSdrSource* rtlsdr = new RtlSdrSource(devidx, true, rawiq);
+        source.reset(rtlsdr);
+        if (!(*rtlsdr))
+        {
+            SERR("RtlSdr: %s", rtlsdr->error().c_str());
+            exit(1);
+        }
+
+        // Check LNA gain.
+        if (lnagain != INT_MIN)
+        {
+            std::vector<int> gains = rtlsdr->get_tuner_gains();
+            if (std::find(gains.begin(), gains.end(), lnagain) == gains.end())
+            {
+                if (lnagain != INT_MIN + 1)
+                {
+                    SERR("LNA gain %.1f dB not supported by tuner", lnagain * 0.1);
+                }
+                SDEB("Supported LNA gains: ");
+                for (int g: gains)
+                {
+                    SDEB("\t%.1f dB ", 0.1 * g);
+                }
+                exit(1);
+            }
+        }
+
+        // Configure RTL-SDR device and start streaming.
+        rtlsdr->configure(ifrate, tuner_freq, lnagain,
+                          ring.block_length ? ring.block_length : RtlSdrSource::default_block_length,
+                          agcmode, usbbufs);
+        if (!(*rtlsdr))
+        {
+            SERR("RtlSdr: %s", rtlsdr->error().c_str());
+            exit(1);
+        }
+
+        tuner_freq = rtlsdr->get_frequency();
+        SDEB("device tuned for: %.6f MHz", tuner_freq * 1.0e-6);
+
+        if (lnagain == INT_MIN)
+        {
+            SDEB("LNA gain: auto");
+        }
+        else
+        {
+            SDEB("LNA gain: %.1f dB", 0.1 * rtlsdr->get_tuner_gain());
+        }
+
+        ifrate = rtlsdr->get_sample_rate();
+        SDEB("IF sample rate: %.0f Hz", ifrate);
+
+        SDEB("RTL AGC mode: %s", agcmode ? "enabled" : "disabled");
     }
 
-    tuner_freq = rtlsdr.get_frequency();
-    SDEB("device tuned for: %.6f MHz", tuner_freq * 1.0e-6);
+    source->set_ring_config(ring);
+    SDEB("sample ring: %u blocks%s", ring.num_blocks,
+         ring.hugepages ? ", huge pages if available" : "");
 
-    if (lnagain == INT_MIN)
+    if (rawiq)
     {
-        SDEB("LNA gain: auto");
+        SDEB("front end: 16-bit fixed point from raw 8-bit samples");
+        if (iqcorrection.dc_i != 0 || iqcorrection.dc_q != 0 ||
+            iqcorrection.gain != 1 || iqcorrection.phase != 0)
+        {
+            SWAR("I/Q correction is not applied to raw samples");
+        }
     }
     else
     {
-        SDEB("LNA gain: %.1f dB", 0.1 * rtlsdr.get_tuner_gain());
+        source->set_iq_correction(iqcorrection);
+        SDEB("I/Q correction: DC %+.4f %+.4f, gain %.4f, phase %+.3f deg",
+             iqcorrection.dc_i, iqcorrection.dc_q, iqcorrection.gain,
+             asin(iqcorrection.phase) * 180 / M_PI);
     }
 
-    ifrate = rtlsdr.get_sample_rate();
-    SDEB("IF sample rate: %.0f Hz", ifrate);
-
-    SDEB("RTL AGC mode: %s", agcmode ? "enabled" : "disabled");
-
     // The baseband signal is empty above 100 kHz, so we can
     // downsample to ~ 200 kS/s without loss of information.
     // This will speed up later processing stages.
     unsigned int downsample = std::max(1, int(ifrate / 215.0e3));
-    SDEB("baseband downsampling factor %u", downsample);
+    SDEB("baseband downsampling factor %u%s", downsample,
+         decoder_options.if_decimation ? " (in IF filter)" : "");
+    if (decoder_options.filter.method == FirDesignMethod::Lanczos)
+    {
+        SDEB("filter design: lanczos");
+    }
+    else
+    {
+        SDEB("filter design: %s, %.1f dB attenuation, %.3f dB ripple",
+             fir_design_name(decoder_options.filter.method),
+             decoder_options.filter.atten, decoder_options.filter.ripple);
+    }
 
     // Prevent aliasing at very low output sample rates.
     double bandwidth_pcm = std::min(FmDecoder::default_bandwidth_pcm, 0.45 * pcmrate);
@@ -300,6 +655,70 @@ int main(int argc, char **argv)
         fflush(ppsfile);
     }
 
+    if (multi_station)
+    {
+        // One audio output per station, all fed from one channelizer.
+        std::vector<std::unique_ptr<AudioOutput>> station_outputs;
+        // Without -j, all stations are decoded on the channelizer thread.
+        if (workers == 0)
+        {
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        ChannelizerThread chan(source.get(), ifrate, downsample, std::max(0, workers));
+        SDEB("channel sample rate: %.0f Hz", ifrate / downsample);
+        if (workers > 0)
+        {
+            SDEB("decoding on %d worker threads", workers);
+        }
+
+        for (double station: freqs)
+        {
+            std::string station_file = station_filename(filename, station);
+            if (outmode == MODE_RAW)
+            {
+                SDEB("%.4f MHz: writing raw 16-bit audio samples to '%s'",
+                     station * 1.0e-6, station_file.c_str());
+                station_outputs.emplace_back(new RawAudioOutput(station_file));
+            }
+            else
+            {
+                SDEB("%.4f MHz: writing audio samples to '%s'",
+                     station * 1.0e-6, station_file.c_str());
+                station_outputs.emplace_back(new WavAudioOutput(station_file, pcmrate, stereo));
+            }
+            station_outputs.back()->set_dither(dither);
+            if (!(*station_outputs.back()))
+            {
+                SERR("AudioOutput: %s", station_outputs.back()->error().c_str());
+                exit(1);
+            }
+
+            chan.AddStation(station - tuner_freq,                   // tuning_offset
+                            station_outputs.back().get(),           // output
+                            pcmrate,                                // sample_rate_pcm
+                            stereo,                                 // stereo
+                            FmDecoder::default_deemphasis,          // deemphasis
+                            bandwidth_pcm,                          // bandwidth_pcm
+                            decoder_options);                       // options
+        }
+        if (!source->StartAsync())
+        {
+            SERR("ERROR: Can not start the sample source");
+            exit(1);
+        }
+
+        if (iqfile)
+        {
+            iqfile->WaitFinished();
+            chan.WaitIdle();
+            PRINT("\n");
+            SDEB("end of recording");
+            return 0;
+        }
+        LF::threads::SleepSec(10000);
+        return 0;
+    }
+
     // Prepare output writer.
     std::unique_ptr<AudioOutput> audio_output;
     switch (outmode)
@@ -314,17 +733,20 @@ int main(int argc, char **argv)
             break;
         case MODE_RTAUDIO:
             SDEB("playing audio to RTAudio default device");
-            audio_output.reset(new RtAudioOutput(pcmrate, stereo));
+            audio_output.reset(new RtAudioOutput(pcmrate, stereo,
+                                                 std::max(0.0, bufsecs), adaptive));
             break;
     }
 
+    audio_output->set_dither(dither);
     if (!(*audio_output))
     {
         SERR("AudioOutput: %s", audio_output->error().c_str());
         exit(1);
     }
 
-    FmDecoderThread dec(&rtlsdr, audio_output.get());
+    FmDecoderThread dec(source.get(), audio_output.get(), pipelined, drain, batch_samples);
+    dec.SetPpsFile(ppsfile);
     dec.CreateDecoder(ifrate,                            // sample_rate_if
                       freq - tuner_freq,                 // tuning_offset
                       pcmrate,                           // sample_rate_pcm
@@ -333,9 +755,34 @@ int main(int argc, char **argv)
                       FmDecoder::default_bandwidth_if,   // bandwidth_if
                       FmDecoder::default_freq_dev,       // freq_dev
                       bandwidth_pcm,                     // bandwidth_pcm
-                      downsample);
-    rtlsdr.StartAsync();
+                      downsample,                        // downsample
+                      decoder_options);                  // options
+    if (!source->StartAsync())
+    {
+        SERR("ERROR: Can not start the sample source");
+        exit(1);
+    }
 
+    if (iqfile)
+    {
+        iqfile->WaitFinished();
+        dec.WaitIdle();
+        PRINT("\n");
+        AudioOutput::LatencyStats lat = audio_output->get_latency_stats();
+        SDEB("capture to output latency: mean %.1f ms, max %.1f ms",
+             lat.mean * 1.0e3, lat.max * 1.0e3);
+        if (drain)
+        {
+            FmDecoderThread::WakeupStats w = dec.GetWakeupStats();
+            PRINT("wakeups=%llu  blocks/wakeup=%.2f  blocks/batch=%.2f  wakeup latency mean=%.3fms max=%.3fms\n",
+                  (unsigned long long)w.wakeups,
+                  w.wakeups ? double(w.blocks) / w.wakeups : 0.0,
+                  w.batches ? double(w.blocks) / w.batches : 0.0,
+                  w.mean * 1.0e3, w.max * 1.0e3);
+        }
+        SDEB("end of recording");
+        return 0;
+    }
     LF::threads::SleepSec(10000);
 #endif
 }
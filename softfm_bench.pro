@@ -0,0 +1,48 @@
+TEMPLATE = app
+TARGET = softfm_bench
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+QMAKE_CXXFLAGS += -O2
+
+INCLUDEPATH += ../Common/System ../Common/Multimedia
+
+SOURCES += \
+        AllocCounter.cpp \
+        AudioOutput.cpp \
+        Fft.cpp \
+        Filter.cpp \
+        FilterDesign.cpp \
+        FmDecode.cpp \
+        SelfTest.cpp \
+        SimdKernels.cpp \
+        WakeupEvent.cpp \
+        bench.cpp
+
+HEADERS += \
+    AllocCounter.h \
+    AudioOutput.h \
+    Fft.h \
+    Filter.h \
+    FilterDesign.h \
+    FmDecode.h \
+    IQSampleSource.h \
+    SelfTest.h \
+    SimdKernels.h \
+    SoftFM.h \
+    SpscFifo.h \
+    SpscRing.h \
+    ThreadAffinity.h \
+    WakeupEvent.h
+
+win32 {
+    INCLUDEPATH += $$PWD/../LFFM/_win/include
+    LIBS += -L$$PWD/../LFFM/_win/lib
+}
+
+unix {
+    LIBS += -lpulse-simple -lpulse -lasound
+}
+
+LIBS += -L../CommonLibs/debug
+LIBS += -lpthread -lMultimedia -lSystem